@@ -25,6 +25,14 @@
 #define NVME_REG_ASQ        0x0028  /* Admin Submission Queue Base Address (8 bytes) */
 #define NVME_REG_ACQ        0x0030  /* Admin Completion Queue Base Address (8 bytes) */
 
+/*
+ * Version Register values (MJR 31:16, MNR 15:8, TER 7:0)
+ */
+#define NVME_VS_1_1         0x00010100
+#define NVME_VS_1_2         0x00010200
+#define NVME_VS_1_3         0x00010300
+#define NVME_VS_2_0         0x00020000
+
 /*
  * Controller Capabilities Register bits
  */
@@ -68,6 +76,8 @@
 #define NVME_ADMIN_ABORT        0x08
 #define NVME_ADMIN_SET_FEATURES 0x09
 #define NVME_ADMIN_GET_FEATURES 0x0A
+#define NVME_ADMIN_ASYNC_EVENT  0x0C
+#define NVME_ADMIN_FORMAT_NVM   0x80
 
 /*
  * NVMe I/O Command Opcodes
@@ -80,11 +90,46 @@
 #define NVME_CMD_DSM            0x09  /* Dataset Management (TRIM/UNMAP) */
 #define NVME_CMD_VERIFY         0x0C
 
+/*
+ * Read/Write Command Dword 12 fields
+ * NLB (15:0) is 0-based, upper bits are per-command flags
+ */
+#define NVME_RW_NLB_MASK        0x0000FFFF  /* Number of Logical Blocks (0-based) */
+#define NVME_RW_DEAC            0x02000000  /* Bit 25: Deallocate (Write Zeroes only, NVMe 1.3+) */
+#define NVME_RW_FUA             0x40000000  /* Bit 30: Force Unit Access */
+#define NVME_RW_LR              0x80000000  /* Bit 31: Limited Retry */
+
+/*
+ * Dataset Management (DSM) command fields
+ * CDW10: NR (7:0) = number of ranges, 0-based
+ * CDW11: attributes (IDR, IDW, AD)
+ */
+#define NVME_DSM_ATTR_INTEGRAL_READ   0x00000001  /* Bit 0: IDR */
+#define NVME_DSM_ATTR_INTEGRAL_WRITE  0x00000002  /* Bit 1: IDW */
+#define NVME_DSM_ATTR_DEALLOCATE      0x00000004  /* Bit 2: AD (deallocate / TRIM) */
+#define NVME_DSM_MAX_RANGES           256         /* Ranges per DSM command (4KB of range data) */
+
+/*
+ * DSM Range Definition (16 bytes), little-endian on the wire
+ */
+typedef struct _nvme_dsm_range {
+    __uint32_t cattr;       /* Context Attributes */
+    __uint32_t nlb;         /* Length in logical blocks (1-based) */
+    __uint32_t slba_lo;     /* Starting LBA low 32 bits */
+    __uint32_t slba_hi;     /* Starting LBA high 32 bits */
+} nvme_dsm_range_t;
+
 /*
  * NVMe Identify CNS values
  */
 #define NVME_CNS_NAMESPACE    0x00
 #define NVME_CNS_CONTROLLER   0x01
+#define NVME_CNS_ACTIVE_NS    0x02  /* Active Namespace ID list (NVMe 1.1+) */
+#define NVME_CNS_CTRL_CSI     0x06  /* I/O Command Set specific Identify Controller (NVMe 2.0) */
+
+/* NVM Command Set Identify Controller (CNS 06h) byte offsets */
+#define NVME_ID_NVM_VSL       0     /* Verify Size Limit, 2^n CAP.MPSMIN pages, 0 = none */
+#define NVME_ID_NVM_WZSL      1     /* Write Zeroes Size Limit, 2^n CAP.MPSMIN pages, 0 = none */
 
 /*
  * NVMe Log Page Identifiers
@@ -92,6 +137,35 @@
 #define NVME_LOG_PAGE_ERROR_INFO        0x01
 #define NVME_LOG_PAGE_SMART_HEALTH      0x02
 #define NVME_LOG_PAGE_FW_SLOT_INFO      0x03
+#define NVME_LOG_PAGE_CHANGED_NS        0x04    /* Changed Namespace List (NVMe 1.2+) */
+#define NVME_CHANGED_NS_OVERFLOW        0xFFFFFFFF  /* First entry: more than 1024 changed */
+
+/*
+ * SMART / Health Information log page (02h): 512 bytes, little-endian and
+ * not naturally aligned, so fields are byte offsets. The 128-bit counters
+ * are kept to their low 64 bits.
+ */
+#define NVME_SMART_LOG_SIZE             512
+#define NVME_SMART_CRIT_WARNING         0       /* 1 byte: critical warning bits */
+#define NVME_SMART_TEMPERATURE          1       /* 2 bytes: composite temperature, Kelvin */
+#define NVME_SMART_AVAIL_SPARE          3       /* 1 byte: available spare, percent */
+#define NVME_SMART_SPARE_THRESH         4       /* 1 byte: available spare threshold, percent */
+#define NVME_SMART_PERCENT_USED         5       /* 1 byte: percentage used, may exceed 100 */
+#define NVME_SMART_DATA_UNITS_READ      32      /* 16 bytes: thousands of 512-byte units */
+#define NVME_SMART_DATA_UNITS_WRITTEN   48      /* 16 bytes: thousands of 512-byte units */
+#define NVME_SMART_POWER_ON_HOURS       128     /* 16 bytes */
+#define NVME_SMART_UNSAFE_SHUTDOWNS     144     /* 16 bytes */
+#define NVME_SMART_MEDIA_ERRORS         160     /* 16 bytes: unrecovered data integrity errors */
+#define NVME_SMART_ERROR_LOG_ENTRIES    176     /* 16 bytes */
+#define NVME_SMART_TMT1_COUNT           216     /* 4 bytes: light thermal throttle entries (1.2+) */
+#define NVME_SMART_TMT2_COUNT           220     /* 4 bytes: heavy thermal throttle entries (1.2+) */
+
+/* SMART Critical Warning bits */
+#define NVME_SMART_CW_SPARE             0x01    /* Available spare below threshold */
+#define NVME_SMART_CW_TEMPERATURE       0x02    /* Temperature outside a threshold */
+#define NVME_SMART_CW_RELIABILITY       0x04    /* Media or internal errors degrade reliability */
+#define NVME_SMART_CW_READ_ONLY         0x08    /* Media placed in read only mode */
+#define NVME_SMART_CW_VOLATILE_BACKUP   0x10    /* Volatile memory backup device failed */
 
 /*
  * NVMe Feature Identifiers (FID)
@@ -107,6 +181,7 @@
 #define NVME_FEAT_INTERRUPT_VECTOR_CONFIG 0x09
 #define NVME_FEAT_WRITE_ATOMICITY       0x0A
 #define NVME_FEAT_ASYNC_EVENT_CONFIG    0x0B
+#define NVME_FEAT_HOST_MEM_BUF          0x0D    /* NVMe 1.2+ */
 
 /*
  * NVMe Get Features SEL (Select) values
@@ -181,6 +256,8 @@ typedef struct _nvme_error_log_entry {
 /*
  * Command Dword 0 fields
  */
+#define NVME_CMD_FUSE_FIRST     0x0100  /* Bits 9:8 = 01: first command of a fused operation */
+#define NVME_CMD_FUSE_SECOND    0x0200  /* Bits 9:8 = 10: second command of a fused operation */
 #define NVME_CMD_PRP            0x00
 #define NVME_CMD_SGL            0x40
 
@@ -245,26 +322,108 @@ typedef struct _nvme_identify_controller {
     uchar_t ieee_oui[3];                /* Offset 73-75: IEEE OUI Identifier */
     uchar_t cmic;                       /* Offset 76: Controller Multi-Path I/O and Namespace Sharing Capabilities */
     uchar_t mdts;                       /* Offset 77: MDTS - Maximum Data Transfer Size (2^n pages, 0=unlimited) */
-    uchar_t reserved1[438];             /* Offset 78-515 */
+    uchar_t reserved1[14];              /* Offset 78-91: CNTLID, VER, RTD3R, RTD3E */
+    __uint32_t oaes;                    /* Offset 92: OAES - Optional Asynchronous Events Supported (1.2+) */
+    uchar_t reserved1a[160];            /* Offset 96-255 */
+    __uint32_t oacs_acl_aerl;           /* Offset 256: OACS (15:0), ACL (23:16), AERL (31:24) */
+    __uint32_t frmw_lpa_elpe_npss;      /* Offset 260: FRMW (7:0), LPA (15:8), ELPE (23:16), NPSS (31:24) */
+    __uint32_t avscc_apsta_wctemp;      /* Offset 264: AVSCC (7:0), APSTA (15:8), WCTEMP (31:16) */
+    __uint32_t cctemp_mtfa;             /* Offset 268: CCTEMP (15:0), MTFA (31:16) */
+    __uint32_t hmpre;                   /* Offset 272: HMPRE - preferred Host Memory Buffer size, 4 KiB units */
+    __uint32_t hmmin;                   /* Offset 276: HMMIN - minimum Host Memory Buffer size, 4 KiB units */
+    uchar_t reserved1b[52];             /* Offset 280-331 */
+    __uint32_t hmminds;                 /* Offset 332: HMMINDS - minimum HMB descriptor size, 4 KiB units */
+    __uint32_t hmmaxd_nsetidmax;        /* Offset 336: HMMAXD (15:0) - maximum HMB descriptors, NSETIDMAX (31:16) */
+    uchar_t reserved1c[176];            /* Offset 340-515 */
     __uint32_t number_of_namespaces;    /* Offset 516 (NN field) */
     __uint32_t oncs;                    /* Offset 520: Optional NVM Command Support (in LE bottom) */
-    uchar_t reserved2[3572];            /* Offset 524-4095 (rest of 4096 byte structure) */
+    __uint32_t fna_vwc_awun;            /* Offset 524: FNA (7:0), VWC (15:8), AWUN (31:16) */
+    uchar_t reserved2[3568];            /* Offset 528-4095 (rest of 4096 byte structure) */
 } nvme_identify_controller_t;
 
+/* OACS (Optional Admin Command Support) bit definitions - offset 256 */
+#define NVME_OACS_FORMAT        0x0002  /* Bit 1: Format NVM command supported */
+
 /* ONCS (Optional NVM Command Support) bit definitions - offset 520 */
 #define NVME_ONCS_COMPARE       0x0001  /* Bit 0: Compare command supported */
 #define NVME_ONCS_WRITE_UNCORR  0x0002  /* Bit 1: Write Uncorrectable command supported */
 #define NVME_ONCS_DSM           0x0004  /* Bit 2: Dataset Management (TRIM/UNMAP) supported */
+#define NVME_ONCS_WRITE_ZEROES  0x0008  /* Bit 3: Write Zeroes command supported */
 #define NVME_ONCS_VERIFY        0x0020  /* Bit 5: Verify command supported */
 
+/* FUSES (Fused Operation Support) - offset 522, upper half of the dword read at 520 */
+#define NVME_FUSES_COMPARE_WRITE 0x00010000  /* FUSES bit 0: Compare and Write fused operation */
+
+/* VWC (Volatile Write Cache) - offset 525, second byte of the dword read at 524 */
+#define NVME_VWC_PRESENT        0x00000100  /* VWC bit 0: volatile write cache present */
+
+/* OAES (Optional Asynchronous Events Supported) - offset 92 */
+#define NVME_OAES_NS_ATTR       0x00000100  /* Bit 8: Namespace Attribute Notices */
+
+/* Asynchronous Event Configuration feature (FID 0Bh) CDW11 */
+#define NVME_FEAT_AEC_SMART     0x000000FF  /* Bits 7:0: report these SMART critical warnings */
+#define NVME_FEAT_AEC_NS_ATTR   0x00000100  /* Bit 8: report Namespace Attribute Notices */
+
+/*
+ * Asynchronous Event Request completion Dword 0
+ */
+#define NVME_AER_TYPE(dw0)      ((dw0) & 0x7)           /* Bits 2:0: Asynchronous Event Type */
+#define NVME_AER_INFO(dw0)      (((dw0) >> 8) & 0xFF)   /* Bits 15:8: Asynchronous Event Information */
+#define NVME_AER_LID(dw0)       (((dw0) >> 16) & 0xFF)  /* Bits 23:16: log page that clears the event */
+
+#define NVME_AER_TYPE_ERROR     0       /* Error status */
+#define NVME_AER_TYPE_SMART     1       /* SMART / Health status */
+#define NVME_AER_TYPE_NOTICE    2       /* Notice */
+#define NVME_AER_TYPE_IO        6       /* I/O command set specific */
+#define NVME_AER_TYPE_VENDOR    7       /* Vendor specific */
+
+#define NVME_AER_NOTICE_NS_ATTR 0x00    /* Notice: Namespace Attribute Changed */
+
+/* Command Specific Status (SCT 1) of Asynchronous Event Request */
+#define NVME_SC_AER_LIMIT       0x05    /* Asynchronous Event Request Limit Exceeded */
+
+/* Temperature Threshold feature (FID 04h) CDW11 */
+#define NVME_FEAT_TMPTH_MASK    0x0000FFFF  /* Bits 15:0: threshold, Kelvin */
+#define NVME_FEAT_THSEL_OVER    0x00000000  /* Bits 21:20: over temperature threshold */
+
+/* Volatile Write Cache feature (FID 06h) CDW11 / completion DW0 */
+#define NVME_FEAT_VWC_WCE       0x00000001  /* Bit 0: volatile write cache enabled */
+
+/* Host Memory Buffer feature (FID 0Dh) CDW11; CDW12 HSIZE, CDW13/14 list address, CDW15 entries */
+#define NVME_FEAT_HMB_EHM       0x00000001  /* Bit 0: enable host memory */
+#define NVME_FEAT_HMB_MR        0x00000002  /* Bit 1: memory return, same buffer as last time */
+
+/*
+ * Host Memory Buffer Descriptor Entry (16 bytes, list 16 byte aligned)
+ */
+typedef struct _nvme_hmb_desc {
+    __uint32_t badd_lo;     /* Buffer address, memory page size aligned */
+    __uint32_t badd_hi;
+    __uint32_t bsize;       /* Buffer size in memory pages (CC.MPS) */
+    __uint32_t reserved;
+} nvme_hmb_desc_t;
+
 /*
  * NVMe LBA Format Structure (used in Identify Namespace)
- * 32-bit field: MS (15:0), LBADS (23:16), RP (31:24)
+ * 32-bit field: MS (15:0), LBADS (23:16), RP (25:24)
  */
 typedef struct _nvme_lba_format {
-    __uint32_t dw0;     /* MS (15:0), LBADS (23:16), RP (31:24) */
+    __uint32_t dw0;     /* MS (15:0), LBADS (23:16), RP (25:24) */
 } nvme_lba_format_t;
 
+#define NVME_LBAF_MS(dw0)       ((dw0) & 0xFFFF)        /* Metadata bytes per block */
+#define NVME_LBAF_LBADS(dw0)    (((dw0) >> 16) & 0xFF)  /* log2 of data size */
+#define NVME_LBAF_RP(dw0)       (((dw0) >> 24) & 0x3)   /* Relative performance, 0 = best */
+
+/* Format NVM CDW10 fields */
+#define NVME_FORMAT_LBAF_MASK   0x0F    /* Bits 3:0: LBA format index */
+#define NVME_FORMAT_SES_NONE    0x000   /* Bits 11:9: no secure erase */
+
+/* NSFEAT (Namespace Features) bit definitions - offset 24 */
+#define NVME_NSFEAT_THINP       0x01    /* Bit 0: Thin provisioning */
+#define NVME_NSFEAT_NSABP       0x02    /* Bit 1: NAWUN/NAWUPF/NACWU valid */
+#define NVME_NSFEAT_OPTPERF     0x10    /* Bit 4: NPWG/NPWA/NPDG/NPDA/NOWS valid (NVMe 1.4+) */
+
 /*
  * NVMe Identify Namespace Structure (partial)
  * 64-bit values split into low/high 32-bit fields
@@ -278,7 +437,16 @@ typedef struct _nvme_identify_namespace {
     __uint32_t nuse_lo;                 /* Offset 16: NUSE low - Namespace Utilization */
     __uint32_t nuse_hi;                 /* Offset 20: NUSE high */
     __uint32_t features_nlbaf_flbas_mc; /* Offset 24: NSFEAT (7:0), NLBAF (15:8), FLBAS (23:16), MC (31:24) */
-    uchar_t reserved1[76];              /* Offset 28-103 */
+    __uint32_t dpc_dps_nmic_rescap;     /* Offset 28: DPC, DPS, NMIC, RESCAP */
+    __uint32_t fpi_dlfeat_nawun;        /* Offset 32: FPI (7:0), DLFEAT (15:8), NAWUN (31:16) */
+    __uint32_t nawupf_nacwu;            /* Offset 36: NAWUPF (15:0), NACWU (31:16) */
+    __uint32_t nabsn_nabo;              /* Offset 40: NABSN (15:0), NABO (31:16) */
+    __uint32_t nabspf_noiob;            /* Offset 44: NABSPF (15:0), NOIOB (31:16) (NVMe 1.3+) */
+    uchar_t nvmcap[16];                 /* Offset 48-63: NVMCAP */
+    __uint32_t npwg_npwa;               /* Offset 64: NPWG (15:0), NPWA (31:16) (NVMe 1.4+) */
+    __uint32_t npdg_npda;               /* Offset 68: NPDG (15:0), NPDA (31:16) (NVMe 1.4+) */
+    __uint32_t nows;                    /* Offset 72: NOWS (15:0) (NVMe 1.4+) */
+    uchar_t reserved1[28];              /* Offset 76-103 */
     uchar_t nguid[16];                  /* Offset 104-119: NGUID */
     uchar_t eui64[8];                   /* Offset 120-127: EUI64 */
     nvme_lba_format_t lba_formats[16];  /* Offset 128-191: LBAF0-LBAF15 (16 x 4 bytes = 64 bytes) */
@@ -15,62 +15,113 @@
  */
 int
 nvme_submit_cmd(nvme_soft_t *soft, nvme_queue_t *q, nvme_command_t *cmd)
+{
+    return nvme_submit_cmds(soft, q, cmd, 1);
+}
+
+/*
+ * nvme_submit_cmds: Submit several commands to a queue in consecutive slots
+ *
+ * All commands are written under one queue lock and published with a single
+ * doorbell write, so no other submitter can slip a command in between. Fused
+ * operations (Compare + Write) rely on this.
+ *
+ * Arguments:
+ *   soft  - Controller state
+ *   q     - Submission queue
+ *   cmds  - Array of commands (CIDs already set)
+ *   count - Number of commands in cmds
+ *
+ * Returns:
+ *   0 on success
+ *   -1 if the queue doesn't have room for all of them (nothing submitted)
+ */
+int
+nvme_submit_cmds(nvme_soft_t *soft, nvme_queue_t *q, nvme_command_t *cmds, uint_t count)
 {
     uint_t next_tail;
+    uint_t free_slots;
+    uint_t i;
+    uint_t cid;
+    nvme_command_t *cmd;
     nvme_command_t *sq_entry;
+    nvme_cmd_info_t *ci;
 
     mutex_lock(&q->lock, PZERO);
 
-    /* Calculate next tail position */
-    next_tail = (q->sq_tail + 1) & q->size_mask;
-
-    /* Check if queue is full - we can't let tail catch up to head */
-    if (next_tail == q->sq_head) {
+    /* Check if queue has room - we can't let tail catch up to head */
+    free_slots = (q->sq_head - q->sq_tail - 1) & q->size_mask;
+    if (free_slots < count) {
 #ifdef NVME_DBG
-        cmn_err(CE_WARN, "nvme_submit_cmd: queue %d is full (head=%d, tail=%d)",
-                q->qid, q->sq_head, q->sq_tail);
+        cmn_err(CE_WARN, "nvme_submit_cmds: queue %d is full (head=%d, tail=%d, need=%u)",
+                q->qid, q->sq_head, q->sq_tail, count);
 #endif
         mutex_unlock(&q->lock);
+        if (q == &soft->io_queue)
+            NVME_STAT_INC(soft, sq_full);
         return -1;
     }
 
-    sq_entry = &q->sq[q->sq_tail];
+    for (i = 0; i < count; i++) {
+        cmd = &cmds[i];
+        /* Calculate next tail position */
+        next_tail = (q->sq_tail + 1) & q->size_mask;
+
+        sq_entry = &q->sq[q->sq_tail];
 #ifdef NVME_DBG_CMD
-    cmn_err(CE_NOTE, "nvme_submit_cmd: Writing to SQ[%u] at %p", q->sq_tail, sq_entry);
-#endif
-    /* Write command to submission queue entry */
-    NVME_MEMWR(&sq_entry->cdw0, cmd->cdw0);
-    NVME_MEMWR(&sq_entry->nsid, cmd->nsid);
-    NVME_MEMWR(&sq_entry->cdw2, cmd->cdw2);
-    NVME_MEMWR(&sq_entry->cdw3, cmd->cdw3);
-    NVME_MEMWR(&sq_entry->mptr_lo, cmd->mptr_lo);
-    NVME_MEMWR(&sq_entry->mptr_hi, cmd->mptr_hi);
-    NVME_MEMWR(&sq_entry->prp1_lo, cmd->prp1_lo);
-    NVME_MEMWR(&sq_entry->prp1_hi, cmd->prp1_hi);
-    NVME_MEMWR(&sq_entry->prp2_lo, cmd->prp2_lo);
-    NVME_MEMWR(&sq_entry->prp2_hi, cmd->prp2_hi);
-    NVME_MEMWR(&sq_entry->cdw10, cmd->cdw10);
-    NVME_MEMWR(&sq_entry->cdw11, cmd->cdw11);
-    NVME_MEMWR(&sq_entry->cdw12, cmd->cdw12);
-    NVME_MEMWR(&sq_entry->cdw13, cmd->cdw13);
-    NVME_MEMWR(&sq_entry->cdw14, cmd->cdw14);
-    NVME_MEMWR(&sq_entry->cdw15, cmd->cdw15);
+        cmn_err(CE_NOTE, "nvme_submit_cmds: Writing to SQ[%u] at %p", q->sq_tail, sq_entry);
+#endif
+        /* Write command to submission queue entry */
+        NVME_MEMWR(&sq_entry->cdw0, cmd->cdw0);
+        NVME_MEMWR(&sq_entry->nsid, cmd->nsid);
+        NVME_MEMWR(&sq_entry->cdw2, cmd->cdw2);
+        NVME_MEMWR(&sq_entry->cdw3, cmd->cdw3);
+        NVME_MEMWR(&sq_entry->mptr_lo, cmd->mptr_lo);
+        NVME_MEMWR(&sq_entry->mptr_hi, cmd->mptr_hi);
+        NVME_MEMWR(&sq_entry->prp1_lo, cmd->prp1_lo);
+        NVME_MEMWR(&sq_entry->prp1_hi, cmd->prp1_hi);
+        NVME_MEMWR(&sq_entry->prp2_lo, cmd->prp2_lo);
+        NVME_MEMWR(&sq_entry->prp2_hi, cmd->prp2_hi);
+        NVME_MEMWR(&sq_entry->cdw10, cmd->cdw10);
+        NVME_MEMWR(&sq_entry->cdw11, cmd->cdw11);
+        NVME_MEMWR(&sq_entry->cdw12, cmd->cdw12);
+        NVME_MEMWR(&sq_entry->cdw13, cmd->cdw13);
+        NVME_MEMWR(&sq_entry->cdw14, cmd->cdw14);
+        NVME_MEMWR(&sq_entry->cdw15, cmd->cdw15);
 #ifdef IP30
-    heart_dcache_wb_inval((caddr_t)sq_entry, sizeof(nvme_command_t));
+        heart_dcache_wb_inval((caddr_t)sq_entry, sizeof(nvme_command_t));
 #endif
 
 #ifdef NVME_DBG_CMD
-    /* Dump what we just wrote to the SQ */
-    nvme_dump_sq_entry(sq_entry, "After writing to SQ");
+        /* Dump what we just wrote to the SQ */
+        nvme_dump_sq_entry(sq_entry, "After writing to SQ");
 #endif /* NVME_DBG_CMD */
-    /* Advance tail */
-    q->sq_tail = next_tail;
+        /* Keep I/O commands for the replay after a controller reset */
+        cid = cmd->cdw0 >> 16;
+        if (q == &soft->io_queue && cid < NVME_IO_QUEUE_SIZE) {
+            ci = &soft->io_requests[cid];
+            ci->cmd = *cmd;
+            ci->seq = q->sq_seq;
+            ci->submitted = 1;
+        }
+        q->sq_seq++;
+
+        /* Advance tail */
+        q->sq_tail = next_tail;
+    }
 
     /* Increment outstanding command counter */
-    atomicAddInt(&q->outstanding, 1);
+    atomicAddInt(&q->outstanding, count);
+    if (q == &soft->io_queue) {
+        /* Depth statistics, the queue lock orders these */
+        soft->stats.submits += count;
+        soft->stats.depth_sum += q->outstanding;
+        if (q->outstanding > soft->stats.depth_max)
+            soft->stats.depth_max = q->outstanding;
+    }
 
 #ifdef NVME_DBG_EXTRA
-    cmn_err(CE_NOTE, "nvme_submit_cmd: Ringing doorbell at offset 0x%x with value %u (outstanding=%d)",
+    cmn_err(CE_NOTE, "nvme_submit_cmds: Ringing doorbell at offset 0x%x with value %u (outstanding=%d)",
             q->sq_doorbell, q->sq_tail, q->outstanding);
 #endif
     /* Ring doorbell to notify controller */
@@ -79,7 +130,7 @@ nvme_submit_cmd(nvme_soft_t *soft, nvme_queue_t *q, nvme_command_t *cmd)
 
 #ifdef NVME_DBG_EXTRA
     /* Verify the doorbell was written */
-    cmn_err(CE_NOTE, "nvme_submit_cmd: Doorbell readback = 0x%08x",
+    cmn_err(CE_NOTE, "nvme_submit_cmds: Doorbell readback = 0x%08x",
             NVME_RD(soft, q->sq_doorbell));
 #endif
     mutex_unlock(&q->lock);
@@ -113,7 +164,7 @@ nvme_submit_cmd(nvme_soft_t *soft, nvme_queue_t *q, nvme_command_t *cmd)
                 us_delay(1000); /* 1 millisecond */
         }
 
-        cmn_err(CE_WARN, "nvme_submit_cmd: after 1ms delay, manually processed %d completions (cq_head %d->%d)  int count=%d",
+        cmn_err(CE_WARN, "nvme_submit_cmds: after 1ms delay, manually processed %d completions (cq_head %d->%d)  int count=%d",
                 num_processed, old_head, q->cq_head, nvme_intcount);
     }
 #endif
@@ -121,41 +172,226 @@ nvme_submit_cmd(nvme_soft_t *soft, nvme_queue_t *q, nvme_command_t *cmd)
     return 0;
 }
 
+/*
+ * nvme_admin_pool_init: Allocate the admin command buffer pool
+ *
+ * NVME_ADMIN_BUFS physically contiguous pages, handed out one per admin
+ * command that transfers data (Identify, Get Log Page).
+ *
+ * Returns:
+ *   0 on success
+ *   -1 on failure
+ */
+int
+nvme_admin_pool_init(nvme_soft_t *soft)
+{
+    soft->admin_bufs = kvpalloc(NVME_ADMIN_BUFS, VM_UNCACHED | VM_PHYSCONTIG | VM_DIRECT | VM_NOSLEEP, 0);
+    if (!soft->admin_bufs) {
+#ifdef NVME_DBG
+        cmn_err(CE_WARN, "nvme_admin_pool_init: failed to allocate admin buffers");
+#endif
+        return -1;
+    }
+#ifdef NVME_UTILBUF_USEDMAP
+    soft->admin_bufs_dmamap = pciio_dmamap_alloc(soft->pci_vhdl, NULL,
+                                                 NVME_ADMIN_BUFS * NBPP,
+                                                 UTILBUF_DMA_TYPE);
+    soft->admin_bufs_phys = pciio_dmamap_addr(soft->admin_bufs_dmamap,
+                                              kvtophys(soft->admin_bufs),
+                                              NVME_ADMIN_BUFS * NBPP);
+#else
+    soft->admin_bufs_phys = pciio_dmatrans_addr(soft->pci_vhdl, 0,
+                                                kvtophys(soft->admin_bufs),
+                                                NVME_ADMIN_BUFS * NBPP,
+                                                UTILBUF_DMA_TYPE | DMATRANS64);
+#endif
+    if (!soft->admin_bufs_phys) {
+#ifdef NVME_DBG
+        cmn_err(CE_WARN, "nvme_admin_pool_init: DMA translation failed");
+#endif
+#ifdef NVME_UTILBUF_USEDMAP
+        pciio_dmamap_free(soft->admin_bufs_dmamap);
+#endif
+        kvpfree(soft->admin_bufs, NVME_ADMIN_BUFS);
+        soft->admin_bufs = NULL;
+        return -1;
+    }
+
+    soft->admin_slot_bitmap = 0;
+    soft->admin_busy = 0;
+    soft->admin_buf_bitmap = 0;
+    soft->admin_waiters = NULL;
+    init_mutex(&soft->admin_lock, MUTEX_DEFAULT, "nvme_admin", 0);
+    return 0;
+}
+
+/*
+ * nvme_admin_pool_done: Free the admin command buffer pool
+ *
+ * Only after the controller is disabled, a command still in flight would
+ * otherwise DMA into freed memory.
+ */
+void
+nvme_admin_pool_done(nvme_soft_t *soft)
+{
+    if (!soft->admin_bufs)
+        return;  /* Pool was never initialized */
+
+    mutex_destroy(&soft->admin_lock);
+#ifdef NVME_UTILBUF_USEDMAP
+    pciio_dmamap_free(soft->admin_bufs_dmamap);
+#endif
+    kvpfree(soft->admin_bufs, NVME_ADMIN_BUFS);
+    soft->admin_bufs = NULL;
+    soft->admin_bufs_phys = 0;
+}
+
+/*
+ * nvme_admin_alloc: Reserve a slot (and CID) for an admin command
+ *
+ * Arguments:
+ *   soft     - Controller state
+ *   want_buf - Nonzero to also reserve a zeroed page from the admin buffer pool
+ *   done     - Called from the admin completion handler, no locks held; may be NULL
+ *   arg      - Caller context, kept in ac->arg (ac->argv is cleared for the caller)
+ *
+ * Never waits for a slot to free up, but takes admin_lock, a mutex that may
+ * block briefly. Completion and timeout handlers run as threads on IRIX and
+ * may call it; code that cannot block may not.
+ *
+ * Returns:
+ *   The slot, or NULL if all slots or all buffers are in use
+ */
+nvme_admin_cmd_t *
+nvme_admin_alloc(nvme_soft_t *soft, int want_buf, nvme_admin_done_t done, void *arg)
+{
+    nvme_admin_cmd_t *ac;
+    int slot, bufidx = -1;
+
+    mutex_lock(&soft->admin_lock, PZERO);
+
+    for (slot = 0; slot < NVME_ADMIN_SLOTS; slot++) {
+        if (!(soft->admin_slot_bitmap & (1u << slot)))
+            break;
+    }
+    if (slot == NVME_ADMIN_SLOTS) {
+        mutex_unlock(&soft->admin_lock);
+        cmn_err(CE_WARN, "nvme_admin_alloc: all %d admin slots in use", NVME_ADMIN_SLOTS);
+        return NULL;
+    }
+
+    if (want_buf) {
+        for (bufidx = 0; bufidx < NVME_ADMIN_BUFS; bufidx++) {
+            if (!(soft->admin_buf_bitmap & (1u << bufidx)))
+                break;
+        }
+        if (bufidx == NVME_ADMIN_BUFS) {
+            mutex_unlock(&soft->admin_lock);
+            cmn_err(CE_WARN, "nvme_admin_alloc: all %d admin buffers in use", NVME_ADMIN_BUFS);
+            return NULL;
+        }
+        soft->admin_buf_bitmap |= 1u << bufidx;
+    }
+    soft->admin_slot_bitmap |= 1u << slot;
+    soft->admin_busy++;
+
+    mutex_unlock(&soft->admin_lock);
+
+    ac = &soft->admin_cmds[slot];
+    ac->cid = NVME_ADMIN_CID(slot);
+    ac->opcode = 0;
+    ac->bufidx = bufidx;
+    ac->done = done;
+    ac->arg = arg;
+    ac->argv = 0;
+    if (bufidx >= 0) {
+        ac->buf = (caddr_t)soft->admin_bufs + bufidx * NBPP;
+        ac->buf_phys = soft->admin_bufs_phys + bufidx * NBPP;
+        bzero(ac->buf, NBPP);
+#ifdef IP30
+        heart_dcache_wb_inval((caddr_t)ac->buf, NBPP);
+#else
+        dki_dcache_wbinval((caddr_t)ac->buf, NBPP);
+#endif
+    } else {
+        ac->buf = NULL;
+        ac->buf_phys = 0;
+    }
+    return ac;
+}
+
+/*
+ * nvme_admin_free: Release an admin slot and its buffer
+ *
+ * Called by nvme_admin_submit() when the command never made it to the
+ * controller, and by the admin completion handler after the done callback.
+ */
+void
+nvme_admin_free(nvme_soft_t *soft, nvme_admin_cmd_t *ac)
+{
+    int slot = ac->cid - NVME_ADMIN_CID_BASE;
+
+    mutex_lock(&soft->admin_lock, PZERO);
+    if (ac->bufidx >= 0)
+        soft->admin_buf_bitmap &= ~(1u << ac->bufidx);
+    soft->admin_slot_bitmap &= ~(1u << slot);
+    soft->admin_busy--;
+    mutex_unlock(&soft->admin_lock);
+}
+
+/*
+ * nvme_admin_submit: Put an admin command built for slot ac on the admin queue
+ *
+ * Fills in the CID (CDW0 31:16) from the slot; the caller sets up everything
+ * else, including PRP1 from ac->buf_phys when it asked for a buffer.
+ *
+ * Returns: 1 on success (command submitted), 0 on failure (slot released)
+ */
+int
+nvme_admin_submit(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_command_t *cmd)
+{
+    cmd->cdw0 = (cmd->cdw0 & 0xFFFF) | ((uint_t)ac->cid << 16);
+    ac->opcode = cmd->cdw0 & 0xFF;
+
+    if (nvme_submit_cmd(soft, &soft->admin_queue, cmd) != 0) {
+        nvme_admin_free(soft, ac);
+        return 0;
+    }
+    return 1;
+}
+
 /*
  * nvme_admin_identify_controller: Send Identify Controller command
  *
- * Uses utility buffer to retrieve controller identification data.
- * Stores serial, model, firmware, and number of namespaces in soft state.
+ * Retrieves the controller identification data into an admin buffer.
+ * nvme_identify_controller_done() stores serial, model, firmware, and number
+ * of namespaces in soft state.
  */
 int
 nvme_admin_identify_controller(nvme_soft_t *soft)
 {
     nvme_command_t cmd;
-    nvme_identify_controller_t *id_ctrl;
+    nvme_admin_cmd_t *ac;
 
 #ifdef NVME_DBG_CMD
     cmn_err(CE_NOTE, "nvme_admin_identify_controller: sending command");
 #endif
-    /* Clear utility buffer */
-    bzero(soft->utility_buffer, NBPP);
-#ifdef IP30
-    heart_dcache_wb_inval((caddr_t)soft->utility_buffer, sizeof(NBPP));
-#else
-    dki_dcache_wbinval((caddr_t)soft->utility_buffer, sizeof(NBPP));
-#endif
+    ac = nvme_admin_alloc(soft, 1, nvme_identify_controller_done, NULL);
+    if (ac == NULL)
+        return 0;
 
     /* Build Identify Controller command */
     bzero(&cmd, sizeof(cmd));
 
-    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) */
-    cmd.cdw0 = NVME_ADMIN_IDENTIFY | (NVME_ADMIN_CID_IDENTIFY_CONTROLLER << 16);
+    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) filled in by nvme_admin_submit() */
+    cmd.cdw0 = NVME_ADMIN_IDENTIFY;
 
     /* NSID: not used for controller identify */
     cmd.nsid = 0;
 
-    /* PRP1: physical address of utility buffer (controller data destination) */
-    cmd.prp1_lo = PHYS64_LO(soft->utility_buffer_phys);
-    cmd.prp1_hi = PHYS64_HI(soft->utility_buffer_phys);
+    /* PRP1: the admin buffer (controller data destination) */
+    cmd.prp1_lo = PHYS64_LO(ac->buf_phys);
+    cmd.prp1_hi = PHYS64_HI(ac->buf_phys);
 
     /* PRP2: not needed (data is only 4KB) */
     cmd.prp2_lo = 0;
@@ -171,11 +407,11 @@ nvme_admin_identify_controller(nvme_soft_t *soft)
     cmn_err(CE_NOTE, "  nsid=0x%08x", cmd.nsid);
     cmn_err(CE_NOTE, "  prp1=0x%08x%08x (virt=%p, phys=0x%llx)",
             cmd.prp1_hi, cmd.prp1_lo,
-            soft->utility_buffer, soft->utility_buffer_phys);
+            ac->buf, ac->buf_phys);
     cmn_err(CE_NOTE, "  cdw10=0x%08x (CNS)", cmd.cdw10);
 #endif
     /* Submit command */
-    if (nvme_submit_cmd(soft, &soft->admin_queue, &cmd) != 0) {
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
 #ifdef NVME_DBG
         cmn_err(CE_WARN, "nvme_admin_identify_controller: failed to submit command (queue full?)");
 #endif
@@ -190,36 +426,35 @@ nvme_admin_identify_controller(nvme_soft_t *soft)
 /*
  * nvme_admin_identify_namespace: Send Identify Namespace command
  *
- * Uses utility buffer to retrieve namespace identification data for namespace 1.
- * Stores namespace size and block size in soft state for later use by SCSI emulation.
+ * Retrieves namespace identification data for ns->nsid into an admin buffer.
+ * done is nvme_identify_namespace_done(), which stores namespace size and
+ * block size in ns for later use by SCSI emulation, or a wrapper around it
+ * such as nvme_ns_rescan_done().
  */
 int
-nvme_admin_identify_namespace(nvme_soft_t *soft)
+nvme_admin_identify_namespace(nvme_soft_t *soft, nvme_ns_t *ns, nvme_admin_done_t done)
 {
     nvme_command_t cmd;
+    nvme_admin_cmd_t *ac;
 
 #ifdef NVME_DBG_CMD
-    cmn_err(CE_NOTE, "nvme_admin_identify_namespace: sending command for NSID 1");
-#endif
-    /* Clear utility buffer */
-    bzero(soft->utility_buffer, NBPP);
-#ifdef IP30
-    heart_dcache_wb_inval((caddr_t)soft->utility_buffer, sizeof(NBPP));
-#else
-    dki_dcache_wbinval((caddr_t)soft->utility_buffer, sizeof(NBPP));
+    cmn_err(CE_NOTE, "nvme_admin_identify_namespace: sending command for NSID %u", ns->nsid);
 #endif
+    ac = nvme_admin_alloc(soft, 1, done, ns);
+    if (ac == NULL)
+        return 0;
 
     /* Build Identify Namespace command */
     bzero(&cmd, sizeof(cmd));
 
-    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) */
-    cmd.cdw0 = NVME_ADMIN_IDENTIFY | (NVME_ADMIN_CID_IDENTIFY_NAMESPACE << 16);
+    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) filled in by nvme_admin_submit() */
+    cmd.cdw0 = NVME_ADMIN_IDENTIFY;
 
-    cmd.nsid = 1;
+    cmd.nsid = ns->nsid;
 
-    /* PRP1: physical address of utility buffer (namespace data destination) */
-    cmd.prp1_lo = PHYS64_LO(soft->utility_buffer_phys);
-    cmd.prp1_hi = PHYS64_HI(soft->utility_buffer_phys);
+    /* PRP1: the admin buffer (namespace data destination) */
+    cmd.prp1_lo = PHYS64_LO(ac->buf_phys);
+    cmd.prp1_hi = PHYS64_HI(ac->buf_phys);
 
     /* PRP2: not needed (data is only 4KB) */
     cmd.prp2_lo = 0;
@@ -229,7 +464,7 @@ nvme_admin_identify_namespace(nvme_soft_t *soft)
     cmd.cdw10 = NVME_CNS_NAMESPACE;
 
     /* Submit command */
-    if (nvme_submit_cmd(soft, &soft->admin_queue, &cmd) != 0) {
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
 #ifdef NVME_DBG
         cmn_err(CE_WARN, "nvme_admin_identify_namespace: failed to submit command (queue full?)");
 #endif
@@ -242,40 +477,124 @@ nvme_admin_identify_namespace(nvme_soft_t *soft)
     return 1;  /* Success - command submitted */
 }
 
+/*
+ * nvme_admin_identify_ns_list: Send Identify for the Active Namespace ID list
+ *
+ * NVMe 1.1+. The controller returns up to 1024 active NSIDs in ascending
+ * order, zero terminated. nvme_identify_ns_list_done() fills in
+ * soft->ns[].nsid and soft->ns_count.
+ */
+int
+nvme_admin_identify_ns_list(nvme_soft_t *soft)
+{
+    nvme_command_t cmd;
+    nvme_admin_cmd_t *ac;
+
+#ifdef NVME_DBG_CMD
+    cmn_err(CE_NOTE, "nvme_admin_identify_ns_list: sending command");
+#endif
+    ac = nvme_admin_alloc(soft, 1, nvme_identify_ns_list_done, NULL);
+    if (ac == NULL)
+        return 0;
+
+    bzero(&cmd, sizeof(cmd));
+
+    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) filled in by nvme_admin_submit() */
+    cmd.cdw0 = NVME_ADMIN_IDENTIFY;
+
+    /* NSID: list starts after this ID */
+    cmd.nsid = 0;
+
+    /* PRP1: the admin buffer (list destination) */
+    cmd.prp1_lo = PHYS64_LO(ac->buf_phys);
+    cmd.prp1_hi = PHYS64_HI(ac->buf_phys);
+
+    /* CDW10: CNS = 0x02 for Active Namespace ID list */
+    cmd.cdw10 = NVME_CNS_ACTIVE_NS;
+
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
+#ifdef NVME_DBG
+        cmn_err(CE_WARN, "nvme_admin_identify_ns_list: failed to submit command (queue full?)");
+#endif
+        return 0;  /* Failure */
+    }
+
+    return 1;  /* Success - command submitted */
+}
+
+/*
+ * nvme_admin_identify_ctrl_nvm: Send Identify for the NVM Command Set controller data
+ *
+ * NVMe 2.0. Carries the per-command size limits that outgrew Identify
+ * Controller; nvme_identify_ctrl_nvm_done() keeps VSL and WZSL in soft.
+ */
+int
+nvme_admin_identify_ctrl_nvm(nvme_soft_t *soft)
+{
+    nvme_command_t cmd;
+    nvme_admin_cmd_t *ac;
+
+#ifdef NVME_DBG_CMD
+    cmn_err(CE_NOTE, "nvme_admin_identify_ctrl_nvm: sending command");
+#endif
+    ac = nvme_admin_alloc(soft, 1, nvme_identify_ctrl_nvm_done, NULL);
+    if (ac == NULL)
+        return 0;
+
+    bzero(&cmd, sizeof(cmd));
+
+    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) filled in by nvme_admin_submit() */
+    cmd.cdw0 = NVME_ADMIN_IDENTIFY;
+
+    /* PRP1: the admin buffer (controller data destination) */
+    cmd.prp1_lo = PHYS64_LO(ac->buf_phys);
+    cmd.prp1_hi = PHYS64_HI(ac->buf_phys);
+
+    /* CDW10: CNS = 0x06; CDW11 CSI (31:24) stays 0, the NVM Command Set */
+    cmd.cdw10 = NVME_CNS_CTRL_CSI;
+
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
+#ifdef NVME_DBG
+        cmn_err(CE_WARN, "nvme_admin_identify_ctrl_nvm: failed to submit command (queue full?)");
+#endif
+        return 0;  /* Failure */
+    }
+
+    return 1;  /* Success - command submitted */
+}
+
 /*
  * nvme_admin_get_log_page_error: Send Get Log Page command for Error Information
  *
- * Uses utility buffer to retrieve error log entries.
- * The completion handler will decode and dump the first entry.
+ * Retrieves error log entries into an admin buffer.
+ * nvme_error_log_done() decodes and dumps the first entry. Safe to call from
+ * the I/O completion path.
  */
 int
 nvme_admin_get_log_page_error(nvme_soft_t *soft)
 {
     nvme_command_t cmd;
+    nvme_admin_cmd_t *ac;
 
 #ifdef NVME_DBG_CMD
     cmn_err(CE_NOTE, "nvme_admin_get_log_page_error: sending command");
 #endif
-    /* Clear utility buffer */
-    bzero(soft->utility_buffer, NBPP);
-#ifdef IP30
-    heart_dcache_wb_inval((caddr_t)soft->utility_buffer, sizeof(NBPP));
-#else
-    dki_dcache_wbinval((caddr_t)soft->utility_buffer, sizeof(NBPP));
-#endif
+    ac = nvme_admin_alloc(soft, 1, nvme_error_log_done, NULL);
+    if (ac == NULL)
+        return 0;
 
     /* Build Get Log Page command */
     bzero(&cmd, sizeof(cmd));
 
-    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) */
-    cmd.cdw0 = NVME_ADMIN_GET_LOG_PAGE | (NVME_ADMIN_CID_GET_LOG_PAGE_ERROR << 16);
+    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) filled in by nvme_admin_submit() */
+    cmd.cdw0 = NVME_ADMIN_GET_LOG_PAGE;
 
     /* NSID: 0xFFFFFFFF for global log pages */
     cmd.nsid = 0xFFFFFFFF;
 
-    /* PRP1: physical address of utility buffer (log data destination) */
-    cmd.prp1_lo = PHYS64_LO(soft->utility_buffer_phys);
-    cmd.prp1_hi = PHYS64_HI(soft->utility_buffer_phys);
+    /* PRP1: the admin buffer (log data destination) */
+    cmd.prp1_lo = PHYS64_LO(ac->buf_phys);
+    cmd.prp1_hi = PHYS64_HI(ac->buf_phys);
 
     /* PRP2: not needed (requesting only 4KB) */
     cmd.prp2_lo = 0;
@@ -293,7 +612,7 @@ nvme_admin_get_log_page_error(nvme_soft_t *soft)
     cmd.cdw11 = 0;
 
     /* Submit command */
-    if (nvme_submit_cmd(soft, &soft->admin_queue, &cmd) != 0) {
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
 #ifdef NVME_DBG
         cmn_err(CE_WARN, "nvme_admin_get_log_page_error: failed to submit command (queue full?)");
 #endif
@@ -306,11 +625,129 @@ nvme_admin_get_log_page_error(nvme_soft_t *soft)
     return 1;  /* Success - command submitted */
 }
 
+/*
+ * nvme_admin_get_log_page_smart: Fetch the SMART / Health Information log
+ *
+ * Reads the controller-wide log into an admin buffer of its own, so a
+ * refresh can run alongside Identify or Format. nvme_smart_log_done()
+ * decodes it into soft->smart (nvme_smart_update).
+ *
+ * Returns: 1 on success (command submitted), 0 on failure
+ */
+int
+nvme_admin_get_log_page_smart(nvme_soft_t *soft)
+{
+    nvme_command_t cmd;
+    nvme_admin_cmd_t *ac;
+
+    ac = nvme_admin_alloc(soft, 1, nvme_smart_log_done, NULL);
+    if (ac == NULL)
+        return 0;
+
+    bzero(&cmd, sizeof(cmd));
+
+    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) filled in by nvme_admin_submit() */
+    cmd.cdw0 = NVME_ADMIN_GET_LOG_PAGE;
+
+    /* NSID: 0xFFFFFFFF for the controller-wide log */
+    cmd.nsid = 0xFFFFFFFF;
+
+    cmd.prp1_lo = PHYS64_LO(ac->buf_phys);
+    cmd.prp1_hi = PHYS64_HI(ac->buf_phys);
+
+    /* CDW10: Log Page Identifier (7:0) and NUMDL (31:16), 512 bytes = 128 dwords */
+    cmd.cdw10 = NVME_LOG_PAGE_SMART_HEALTH | (((NVME_SMART_LOG_SIZE / 4) - 1) << 16);
+
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
+#ifdef NVME_DBG
+        cmn_err(CE_WARN, "nvme_admin_get_log_page_smart: failed to submit command (queue full?)");
+#endif
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * nvme_admin_get_log_page: Read the first 4KB of a controller-wide log page
+ *
+ * For the log pages named by asynchronous events; reading one is what lets
+ * the controller report that event type again. done may be NULL when the
+ * read only serves that purpose.
+ *
+ * Returns: 1 on success (command submitted), 0 on failure
+ */
+int
+nvme_admin_get_log_page(nvme_soft_t *soft, uchar_t lid, nvme_admin_done_t done)
+{
+    nvme_command_t cmd;
+    nvme_admin_cmd_t *ac;
+
+    ac = nvme_admin_alloc(soft, 1, done, NULL);
+    if (ac == NULL)
+        return 0;
+    ac->argv = lid;
+
+    bzero(&cmd, sizeof(cmd));
+
+    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) filled in by nvme_admin_submit() */
+    cmd.cdw0 = NVME_ADMIN_GET_LOG_PAGE;
+    cmd.nsid = 0xFFFFFFFF;
+
+    cmd.prp1_lo = PHYS64_LO(ac->buf_phys);
+    cmd.prp1_hi = PHYS64_HI(ac->buf_phys);
+
+    /* CDW10: Log Page Identifier (7:0) and NUMDL (31:16), 4KB = 1024 dwords */
+    cmd.cdw10 = lid | (0x3FF << 16);
+
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
+#ifdef NVME_DBG
+        cmn_err(CE_WARN, "nvme_admin_get_log_page: failed to submit command for log 0x%02x", lid);
+#endif
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * nvme_admin_async_event: Post one Asynchronous Event Request
+ *
+ * The command has no data and no timeout; the controller completes it when
+ * it has an event to report. It is counted as parked on the admin queue so
+ * nvme_wait_for_queue_idle() does not wait for it.
+ *
+ * Returns: 1 on success (command submitted), 0 on failure
+ */
+int
+nvme_admin_async_event(nvme_soft_t *soft)
+{
+    nvme_command_t cmd;
+    nvme_admin_cmd_t *ac;
+
+    ac = nvme_admin_alloc(soft, 0, nvme_aer_done, NULL);
+    if (ac == NULL)
+        return 0;
+
+    bzero(&cmd, sizeof(cmd));
+
+    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) filled in by nvme_admin_submit() */
+    cmd.cdw0 = NVME_ADMIN_ASYNC_EVENT;
+
+    /* Parked before the doorbell, an event may already be pending */
+    atomicAddInt(&soft->admin_queue.parked, 1);
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
+        atomicAddInt(&soft->admin_queue.parked, -1);
+        cmn_err(CE_WARN, "nvme_admin_async_event: failed to submit command");
+        return 0;
+    }
+    return 1;
+}
+
 /*
  * nvme_admin_get_features: Send Get Features command
  *
  * Retrieves the specified feature from the controller.
- * The feature value is returned in DW0 of the completion queue entry.
+ * The feature value is returned in DW0 of the completion queue entry;
+ * nvme_feature_query_done() files it in soft->features[fid].
  *
  * Arguments:
  *   soft - Controller soft state
@@ -323,25 +760,30 @@ int
 nvme_admin_get_features(nvme_soft_t *soft, uchar_t fid, uchar_t sel)
 {
     nvme_command_t cmd;
+    nvme_admin_cmd_t *ac;
 
 #ifdef NVME_DBG_CMD
     cmn_err(CE_NOTE, "nvme_admin_get_features: FID=0x%02x SEL=0x%02x", fid, sel);
 #endif
+    ac = nvme_admin_alloc(soft, 0, nvme_feature_query_done, NULL);
+    if (ac == NULL)
+        return 0;
+    ac->argv = fid;
 
     /* Build Get Features command */
     bzero(&cmd, sizeof(cmd));
 
-    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16)
-     * Encode FID in CID so completion handler can identify which feature */
-    cmd.cdw0 = NVME_ADMIN_GET_FEATURES | (NVME_ADMIN_CID_GET_FEATURES(fid) << 16);
+    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) filled in by nvme_admin_submit() */
+    cmd.cdw0 = NVME_ADMIN_GET_FEATURES;
 
-    /* NSID: Some features are namespace-specific and require NSID=1
+    /* NSID: Some features are namespace-specific and require a valid NSID
      * Per NVMe 1.0e spec:
      *   - Error Recovery (0x05): namespace-specific
      *   - LBA Range Type (0x03): namespace-specific
-     *   - All others: controller-level (use NSID=0) */
+     *   - All others: controller-level (use NSID=0)
+     * The capability query asks the first namespace (LUN 0) */
     if (fid == NVME_FEAT_ERROR_RECOVERY || fid == NVME_FEAT_LBA_RANGE_TYPE) {
-        cmd.nsid = 1;  /* Namespace 1 */
+        cmd.nsid = soft->ns[0].nsid;
     } else {
         cmd.nsid = 0;  /* Controller-level feature */
     }
@@ -363,7 +805,7 @@ nvme_admin_get_features(nvme_soft_t *soft, uchar_t fid, uchar_t sel)
     cmd.prp2_hi = 0;
 
     /* Submit command */
-    if (nvme_submit_cmd(soft, &soft->admin_queue, &cmd) != 0) {
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
 #ifdef NVME_DBG
         cmn_err(CE_WARN, "nvme_admin_get_features: failed to submit command (queue full?)");
 #endif
@@ -392,16 +834,21 @@ int
 nvme_admin_set_features(nvme_soft_t *soft, uchar_t fid, uint_t value)
 {
     nvme_command_t cmd;
+    nvme_admin_cmd_t *ac;
 
 #ifdef NVME_DBG_CMD
     cmn_err(CE_NOTE, "nvme_admin_set_features: FID=0x%02x value=0x%08x", fid, value);
 #endif
+    ac = nvme_admin_alloc(soft, 0, nvme_set_features_done, NULL);
+    if (ac == NULL)
+        return 0;
+    ac->argv = fid;
 
     /* Build Set Features command */
     bzero(&cmd, sizeof(cmd));
 
-    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) */
-    cmd.cdw0 = NVME_ADMIN_SET_FEATURES | (NVME_ADMIN_CID_SET_FEATURES << 16);
+    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) filled in by nvme_admin_submit() */
+    cmd.cdw0 = NVME_ADMIN_SET_FEATURES;
 
     /* NSID: not used for most features */
     cmd.nsid = 0;
@@ -425,7 +872,7 @@ nvme_admin_set_features(nvme_soft_t *soft, uchar_t fid, uint_t value)
     cmd.prp2_hi = 0;
 
     /* Submit command */
-    if (nvme_submit_cmd(soft, &soft->admin_queue, &cmd) != 0) {
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
 #ifdef NVME_DBG
         cmn_err(CE_WARN, "nvme_admin_set_features: failed to submit command (queue full?)");
 #endif
@@ -438,6 +885,87 @@ nvme_admin_set_features(nvme_soft_t *soft, uchar_t fid, uint_t value)
     return 1;  /* Success - command submitted */
 }
 
+/*
+ * nvme_admin_get_vwc: Read the current Volatile Write Cache setting
+ *
+ * Completes through nvme_get_vwc_done(), which stores the current value in
+ * soft->vwc_enabled rather than with the SEL=SUPPORTED capability masks
+ * kept in soft->features[].
+ *
+ * Returns: 1 on success (command submitted), 0 on failure
+ */
+int
+nvme_admin_get_vwc(nvme_soft_t *soft)
+{
+    nvme_command_t cmd;
+    nvme_admin_cmd_t *ac;
+
+    ac = nvme_admin_alloc(soft, 0, nvme_get_vwc_done, NULL);
+    if (ac == NULL)
+        return 0;
+
+    bzero(&cmd, sizeof(cmd));
+
+    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) filled in by nvme_admin_submit() */
+    cmd.cdw0 = NVME_ADMIN_GET_FEATURES;
+    cmd.nsid = 0;  /* Controller-level feature */
+
+    /* CDW10: FID (7:0), SEL (9:8) */
+    cmd.cdw10 = NVME_FEAT_VOLATILE_WRITE_CACHE | ((uint_t)NVME_FEAT_SEL_CURRENT << 8);
+
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
+#ifdef NVME_DBG
+        cmn_err(CE_WARN, "nvme_admin_get_vwc: failed to submit command (queue full?)");
+#endif
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * nvme_admin_set_vwc: Enable or disable the Volatile Write Cache
+ *
+ * Completes through nvme_set_vwc_done() and nvme_scsi_mode_select_done(),
+ * which updates soft->vwc_enabled and finishes the MODE SELECT in
+ * soft->vwc_req.
+ *
+ * Arguments:
+ *   soft   - Controller soft state
+ *   enable - Nonzero to turn write-back caching on
+ *
+ * Returns: 1 on success (command submitted), 0 on failure
+ */
+int
+nvme_admin_set_vwc(nvme_soft_t *soft, int enable)
+{
+    nvme_command_t cmd;
+    nvme_admin_cmd_t *ac;
+
+    ac = nvme_admin_alloc(soft, 0, nvme_set_vwc_done, NULL);
+    if (ac == NULL)
+        return 0;
+
+    bzero(&cmd, sizeof(cmd));
+
+    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) filled in by nvme_admin_submit() */
+    cmd.cdw0 = NVME_ADMIN_SET_FEATURES;
+    cmd.nsid = 0;  /* Controller-level feature */
+
+    /* CDW10: FID (7:0), SV (31) clear, the setting does not persist across power cycles */
+    cmd.cdw10 = NVME_FEAT_VOLATILE_WRITE_CACHE;
+
+    /* CDW11: WCE (0) */
+    cmd.cdw11 = enable ? NVME_FEAT_VWC_WCE : 0;
+
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
+#ifdef NVME_DBG
+        cmn_err(CE_WARN, "nvme_admin_set_vwc: failed to submit command (queue full?)");
+#endif
+        return 0;
+    }
+    return 1;
+}
+
 /*
  * nvme_admin_query_features: Query common controller features
  *
@@ -503,8 +1031,8 @@ nvme_admin_query_features(nvme_soft_t *soft)
         nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000);
 #endif
 
-        /* Feature value is stored in soft state by the completion handler
-         * based on the FID encoded in the CID */
+        /* nvme_feature_query_done(), the slot's done callback, files the
+         * value in soft->features[] by the FID kept in ac->argv */
 
 #ifdef NVME_DBG
         cmn_err(CE_NOTE, "nvme_admin_query_features: %s (FID 0x%02x) queried",
@@ -516,19 +1044,124 @@ nvme_admin_query_features(nvme_soft_t *soft)
     return 1;
 }
 
+/*
+ * nvme_admin_format_nvm: Send Format NVM command
+ *
+ * Low level formats a namespace to the given LBA format, without metadata,
+ * protection information or secure erase. Only ever issued on request of
+ * the NVME_SOP_FORMAT ioctl; nvme_format_done() posts the outcome in
+ * soft->format_status.
+ *
+ * Arguments:
+ *   soft - Controller soft state
+ *   ns   - Namespace to format
+ *   lbaf - LBA format index (0-15)
+ *
+ * Returns: 1 on success (command submitted), 0 on failure
+ */
+int
+nvme_admin_format_nvm(nvme_soft_t *soft, nvme_ns_t *ns, uint_t lbaf)
+{
+    nvme_command_t cmd;
+    nvme_admin_cmd_t *ac;
+
+#ifdef NVME_DBG_CMD
+    cmn_err(CE_NOTE, "nvme_admin_format_nvm: NSID=%u LBAF=%u", ns->nsid, lbaf);
+#endif
+    ac = nvme_admin_alloc(soft, 0, nvme_format_done, NULL);
+    if (ac == NULL)
+        return 0;
+
+    bzero(&cmd, sizeof(cmd));
+
+    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) filled in by nvme_admin_submit() */
+    cmd.cdw0 = NVME_ADMIN_FORMAT_NVM;
+
+    cmd.nsid = ns->nsid;
+
+    /* CDW10: LBAF (3:0), MSET (4) = 0, PI (7:5) = 0, PIL (8) = 0, SES (11:9) */
+    cmd.cdw10 = (lbaf & NVME_FORMAT_LBAF_MASK) | NVME_FORMAT_SES_NONE;
+
+    soft->format_status = -1;
+
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
+#ifdef NVME_DBG
+        cmn_err(CE_WARN, "nvme_admin_format_nvm: failed to submit command (queue full?)");
+#endif
+        return 0;  /* Failure */
+    }
+
+    return 1;  /* Success - command submitted */
+}
+
+/*
+ * nvme_admin_set_hmb: Hand the Host Memory Buffer to the controller, or take it back
+ *
+ * Enabling describes the buffer built by nvme_hmb_setup(): size in memory
+ * pages, descriptor list address and entry count. Disabling clears EHM; the
+ * controller stops using the memory before the command completes.
+ * nvme_set_hmb_done() updates soft->hmb_enabled.
+ *
+ * Returns: 1 on success (command submitted), 0 on failure
+ */
+int
+nvme_admin_set_hmb(nvme_soft_t *soft, int enable)
+{
+    nvme_command_t cmd;
+    nvme_admin_cmd_t *ac;
+
+    ac = nvme_admin_alloc(soft, 0, nvme_set_hmb_done, NULL);
+    if (ac == NULL)
+        return 0;
+    ac->argv = enable;
+
+    bzero(&cmd, sizeof(cmd));
+
+    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) filled in by nvme_admin_submit() */
+    cmd.cdw0 = NVME_ADMIN_SET_FEATURES;
+    cmd.nsid = 0;  /* Controller-level feature */
+
+    /* CDW10: FID (7:0), SV (31) clear */
+    cmd.cdw10 = NVME_FEAT_HOST_MEM_BUF;
+
+    if (enable) {
+        /* CDW11: EHM; CDW12: HSIZE; CDW13-14: HMDLLA/HMDLUA; CDW15: HMDLEC */
+        cmd.cdw11 = NVME_FEAT_HMB_EHM;
+        cmd.cdw12 = soft->hmb_bytes / soft->nvme_page_size;
+        cmd.cdw13 = PHYS64_LO(soft->hmb_desc_phys);
+        cmd.cdw14 = PHYS64_HI(soft->hmb_desc_phys);
+        cmd.cdw15 = soft->hmb_nchunks;
+    }
+
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
+#ifdef NVME_DBG
+        cmn_err(CE_WARN, "nvme_admin_set_hmb: failed to submit command (queue full?)");
+#endif
+        return 0;
+    }
+    return 1;
+}
+
 /*
  * nvme_admin_create_cq: Create I/O Completion Queue
+ *
+ * nvme_queue_cmd_done() leaves the status in soft->queue_status.
  */
 int
 nvme_admin_create_cq(nvme_soft_t *soft, ushort_t qid, ushort_t qsize,
                      alenaddr_t phys_addr, ushort_t vector)
 {
     nvme_command_t cmd;
+    nvme_admin_cmd_t *ac;
+
+    ac = nvme_admin_alloc(soft, 0, nvme_queue_cmd_done, NULL);
+    if (ac == NULL)
+        return 0;
+    soft->queue_status = -1;
 
     bzero(&cmd, sizeof(cmd));
 
     cmd.cdw0 = NVME_ADMIN_CREATE_CQ;
-    cmd.cdw0 |= NVME_ADMIN_CID_CREATE_CQ << 16;
 
     cmd.prp1_lo = PHYS64_LO(phys_addr);
     cmd.prp1_hi = PHYS64_HI(phys_addr);
@@ -539,7 +1172,7 @@ nvme_admin_create_cq(nvme_soft_t *soft, ushort_t qid, ushort_t qsize,
 #endif
             ;
 
-    if (nvme_submit_cmd(soft, &soft->admin_queue, &cmd) != 0) {
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
 #ifdef NVME_DBG
         cmn_err(CE_WARN, "nvme_admin_create_cq: failed to submit command");
 #endif
@@ -550,24 +1183,31 @@ nvme_admin_create_cq(nvme_soft_t *soft, ushort_t qid, ushort_t qsize,
 
 /*
  * nvme_admin_create_sq: Create I/O Submission Queue
+ *
+ * nvme_queue_cmd_done() leaves the status in soft->queue_status.
  */
 int
 nvme_admin_create_sq(nvme_soft_t *soft, ushort_t qid, ushort_t qsize,
                      alenaddr_t phys_addr, ushort_t cqid)
 {
     nvme_command_t cmd;
+    nvme_admin_cmd_t *ac;
+
+    ac = nvme_admin_alloc(soft, 0, nvme_queue_cmd_done, NULL);
+    if (ac == NULL)
+        return 0;
+    soft->queue_status = -1;
 
     bzero(&cmd, sizeof(cmd));
 
     cmd.cdw0 = NVME_ADMIN_CREATE_SQ;
-    cmd.cdw0 |= NVME_ADMIN_CID_CREATE_SQ << 16;
 
     cmd.prp1_lo = PHYS64_LO(phys_addr);
     cmd.prp1_hi = PHYS64_HI(phys_addr);
     cmd.cdw10 = ((qsize - 1) << 16) | qid;
     cmd.cdw11 = NVME_QUEUE_PHYS_CONTIG | (cqid << 16);
 
-    if (nvme_submit_cmd(soft, &soft->admin_queue, &cmd) != 0) {
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
 #ifdef NVME_DBG
         cmn_err(CE_WARN, "nvme_admin_create_sq: failed to submit command");
 #endif
@@ -578,19 +1218,26 @@ nvme_admin_create_sq(nvme_soft_t *soft, ushort_t qid, ushort_t qsize,
 
 /*
  * nvme_admin_delete_sq: Delete I/O Submission Queue
+ *
+ * nvme_queue_cmd_done() leaves the status in soft->queue_status.
  */
 int
 nvme_admin_delete_sq(nvme_soft_t *soft, ushort_t qid)
 {
     nvme_command_t cmd;
+    nvme_admin_cmd_t *ac;
+
+    ac = nvme_admin_alloc(soft, 0, nvme_queue_cmd_done, NULL);
+    if (ac == NULL)
+        return 0;
+    soft->queue_status = -1;
 
     bzero(&cmd, sizeof(cmd));
 
     cmd.cdw0 = NVME_ADMIN_DELETE_SQ;
-    cmd.cdw0 |= NVME_ADMIN_CID_DELETE_SQ << 16;
     cmd.cdw10 = qid;
 
-    if (nvme_submit_cmd(soft, &soft->admin_queue, &cmd) != 0) {
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
 #ifdef NVME_DBG
         cmn_err(CE_WARN, "nvme_admin_delete_sq: failed to submit command");
 #endif
@@ -601,19 +1248,26 @@ nvme_admin_delete_sq(nvme_soft_t *soft, ushort_t qid)
 
 /*
  * nvme_admin_delete_cq: Delete I/O Completion Queue
+ *
+ * nvme_queue_cmd_done() leaves the status in soft->queue_status.
  */
 int
 nvme_admin_delete_cq(nvme_soft_t *soft, ushort_t qid)
 {
     nvme_command_t cmd;
+    nvme_admin_cmd_t *ac;
+
+    ac = nvme_admin_alloc(soft, 0, nvme_queue_cmd_done, NULL);
+    if (ac == NULL)
+        return 0;
+    soft->queue_status = -1;
 
     bzero(&cmd, sizeof(cmd));
 
     cmd.cdw0 = NVME_ADMIN_DELETE_CQ;
-    cmd.cdw0 |= NVME_ADMIN_CID_DELETE_CQ << 16;
     cmd.cdw10 = qid;
 
-    if (nvme_submit_cmd(soft, &soft->admin_queue, &cmd) != 0) {
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
 #ifdef NVME_DBG
         cmn_err(CE_WARN, "nvme_admin_delete_cq: failed to submit command");
 #endif
@@ -626,8 +1280,7 @@ nvme_admin_delete_cq(nvme_soft_t *soft, ushort_t qid)
  * nvme_admin_abort_command: Abort a command
  *
  * Issues an Abort command to the admin queue to abort a specific command.
- * The CID encoding uses bit 15 set to indicate abort, with the lower 8 bits
- * containing the CID being aborted.
+ * nvme_abort_done() reports the outcome for the aborted CID kept in argv.
  *
  * Per NVMe spec, CDW10 contains:
  *   Bits 31:16: Command ID of command to abort
@@ -635,7 +1288,7 @@ nvme_admin_delete_cq(nvme_soft_t *soft, ushort_t qid)
  *
  * Arguments:
  *   soft - Controller state
- *   cid  - Command ID to abort (from I/O queue, 0-255)
+ *   cid  - Command ID to abort (from I/O queue, 0 to NVME_IO_QUEUE_SIZE-1)
  *
  * Returns:
  *   1 on success (abort command submitted)
@@ -645,26 +1298,29 @@ int
 nvme_admin_abort_command(nvme_soft_t *soft, ushort_t cid)
 {
     nvme_command_t cmd;
-    ushort_t abort_cid;
+    nvme_admin_cmd_t *ac;
 
-    bzero(&cmd, sizeof(cmd));
+    ac = nvme_admin_alloc(soft, 0, nvme_abort_done, NULL);
+    if (ac == NULL) {
+        cmn_err(CE_WARN, "nvme_admin_abort_command: no admin slot to abort CID %d", cid);
+        return 0;
+    }
+    ac->argv = cid;
 
-    /* Encode CID for abort: bit 15 set, lower 8 bits = original CID */
-    abort_cid = NVME_ADMIN_CID_MAKE_ABORT(cid);
+    bzero(&cmd, sizeof(cmd));
 
     /* Build Abort command */
     cmd.cdw0 = NVME_ADMIN_ABORT;
-    cmd.cdw0 |= abort_cid << 16;
 
     /* CDW10: SQID (15:0) = 1 (I/O queue), CID (31:16) = command to abort */
     cmd.cdw10 = 1 | (cid << 16);
 
 #ifdef NVME_DBG
-    cmn_err(CE_NOTE, "nvme_admin_abort_command: aborting CID %d (abort_cid=0x%x)",
-            cid, abort_cid);
+    cmn_err(CE_NOTE, "nvme_admin_abort_command: aborting CID %d (admin CID 0x%x)",
+            cid, ac->cid);
 #endif
 
-    if (nvme_submit_cmd(soft, &soft->admin_queue, &cmd) != 0) {
+    if (!nvme_admin_submit(soft, ac, &cmd)) {
         cmn_err(CE_WARN, "nvme_admin_abort_command: failed to submit abort for CID %d", cid);
         return 0;
     }
@@ -672,6 +1328,76 @@ nvme_admin_abort_command(nvme_soft_t *soft, ushort_t cid)
     return 1;
 }
 
+/*
+ * nvme_io_next_chunk: Size the next command of a split transfer
+ *
+ * Returns how many blocks the command starting 'done' blocks into the request
+ * should carry. The chunk is capped at max_transfer_blocks and never crosses
+ * the namespace's optimal I/O boundary (NOIOB). When the transfer is split
+ * anyway, the chunk end is pulled back to a multiple of the preferred write
+ * granularity (NPWG), then to an nvme_page_size boundary of the host buffer
+ * if that keeps the NPWG alignment, so the next command starts page aligned
+ * and needs the fewest PRP entries. Adjustments that would leave an empty
+ * chunk are skipped.
+ *
+ * Depends only on ps and done, so callers can count commands up front and
+ * get the same chunks again while building them.
+ *
+ * Arguments:
+ *   soft      - Controller state
+ *   ps        - rw command builder state (ns, lba, num_blocks, max_transfer_blocks)
+ *   done      - Blocks already covered by earlier commands
+ *
+ * Returns:
+ *   Number of blocks for the next command (at least 1 while done < num_blocks)
+ */
+uint_t
+nvme_io_next_chunk(nvme_soft_t *soft, nvme_rwcmd_state_t *ps, uint_t done)
+{
+    scsi_request_t *req = ps->req;
+    nvme_ns_t *ns = ps->ns;
+    __uint64_t lba = ps->lba + done;
+    uint_t remaining = ps->num_blocks - done;
+    uint_t gran = ns->pref_write_gran;
+    uint_t chunk;
+    uint_t trim;
+
+    chunk = (remaining > ps->max_transfer_blocks) ? ps->max_transfer_blocks : remaining;
+
+    /* Don't straddle the controller's optimal I/O boundary */
+    if (ns->noiob) {
+        trim = ns->noiob - (uint_t)(lba % ns->noiob);
+        if (chunk > trim)
+            chunk = trim;
+    }
+
+    if (chunk == remaining)
+        return chunk;
+
+    /* Splitting anyway: end on a preferred write granularity multiple */
+    if (gran > 1) {
+        trim = (uint_t)((lba + chunk) % gran);
+        if (trim < chunk)
+            chunk -= trim;
+    }
+
+    /* ... and on a page boundary of the host buffer (virtual offset within a
+     * page matches the physical one, unmapped buf_t buffers are skipped) */
+    if (req->sr_buffer != NULL && !(req->sr_flags & SRF_MAPBP)) {
+        __psunsigned_t end = (__psunsigned_t)req->sr_buffer +
+                             (__psunsigned_t)(done + chunk) * ns->block_size;
+
+        trim = (uint_t)(end & (soft->nvme_page_size - 1));
+        if ((trim % ns->block_size) == 0) {
+            trim /= ns->block_size;
+            if (trim < chunk && (gran <= 1 || (trim % gran) == 0))
+                chunk -= trim;
+        }
+    }
+
+    return chunk;
+}
+
 /*
  * nvme_io_build_rw_command: Build NVMe Read/Write command from SCSI request
  *
@@ -679,14 +1405,15 @@ nvme_admin_abort_command(nvme_soft_t *soft, ushort_t cid)
  * into NVMe Read/Write commands. Parses the SCSI CDB and fills in the NVMe command
  * structure with opcode, namespace ID, LBA, and block count.
  *
- * For multi-command transfers (cmd_index > 0), the LBA and block count are adjusted
- * based on the command index and max_transfer_blocks.
+ * For multi-command transfers the command covers ps->chunk_blocks blocks
+ * starting ps->done_blocks into the request, as sized by nvme_io_next_chunk().
  *
  * PRP entries are NOT set by this function - they must be filled in separately
  * by calling nvme_build_prps_from_alenlist().
  *
  * Arguments:
  *   soft      - Controller state
+ *   ps        - rw command builder state (ns, lba, cids, chunk position)
  *
  * Returns:
  *   1 on success
@@ -698,17 +1425,13 @@ nvme_io_build_rw_command(nvme_soft_t *soft, nvme_rwcmd_state_t *ps)
 {
     nvme_command_t *cmd = &(ps->cmd);
 
-    /* Adjust LBA and block count based on command index for multi-command transfers */
-    __uint64_t lba = ps->lba + ps->cidx * ps->max_transfer_blocks;
-    uint_t num_blocks = ps->num_blocks - ps->cidx * ps->max_transfer_blocks;
+    /* Position of this chunk within a multi-command transfer */
+    __uint64_t lba = ps->lba + ps->done_blocks;
+    uint_t num_blocks = ps->chunk_blocks;
 
     /* Clear command structure */
     bzero(cmd, sizeof(*cmd));
 
-    if (num_blocks > ps->max_transfer_blocks) {
-        num_blocks = ps->max_transfer_blocks;
-    }
-
     /* Build NVMe command header - CID will be set by caller */
     if (ps->flags & NF_WRITE) {
         cmd->cdw0 = NVME_CMD_WRITE;
@@ -718,8 +1441,8 @@ nvme_io_build_rw_command(nvme_soft_t *soft, nvme_rwcmd_state_t *ps)
 
     cmd->cdw0 |= (ps->cids[ps->cidx] << 16);
 
-    /* Set namespace ID (hardcoded to 1) */
-    cmd->nsid = 1;
+    /* Namespace of the request's LUN */
+    cmd->nsid = ps->ns->nsid;
 
     /* Set LBA (CDW10 = lower 32 bits, CDW11 = upper 32 bits) */
     cmd->cdw10 = (__uint32_t)(lba & 0xFFFFFFFF);
@@ -728,6 +1451,11 @@ nvme_io_build_rw_command(nvme_soft_t *soft, nvme_rwcmd_state_t *ps)
     /* Set number of logical blocks (0-based, so subtract 1) */
     cmd->cdw12 = (num_blocks > 0) ? (num_blocks - 1) : 0;
 
+    /* Force Unit Access: data must reach non-volatile media before completion */
+    if (ps->flags & NF_FUA) {
+        cmd->cdw12 |= NVME_RW_FUA;
+    }
+
     /* Remaining fields already zeroed by bzero() above */
 
 #ifdef NVME_DBG_CMD
@@ -737,6 +1465,57 @@ nvme_io_build_rw_command(nvme_soft_t *soft, nvme_rwcmd_state_t *ps)
     return 1;
 }
 
+/*
+ * nvme_io_build_compare_write_command: Build one half of a fused Compare + Write
+ *
+ * COMPARE AND WRITE carries 2 * num_blocks of data-out: the verify data
+ * followed by the write data. Command index 0 becomes the Compare (fused
+ * first), index 1 the Write (fused second), both against the same LBA range.
+ * With chunk_blocks set to num_blocks the alenlist cursor hands each half
+ * its own PRPs via nvme_build_prps_from_alenlist().
+ *
+ * Arguments:
+ *   soft      - Controller state
+ *   ps        - rw command builder state (cidx selects the half)
+ *
+ * Returns:
+ *   1 on success
+ */
+int
+nvme_io_build_compare_write_command(nvme_soft_t *soft, nvme_rwcmd_state_t *ps)
+{
+    nvme_command_t *cmd = &(ps->cmd);
+
+    bzero(cmd, sizeof(*cmd));
+
+    /* CDW0: Opcode (7:0), Fuse (9:8), CID (31:16) */
+    if (ps->cidx == 0) {
+        cmd->cdw0 = NVME_CMD_COMPARE | NVME_CMD_FUSE_FIRST;
+    } else {
+        cmd->cdw0 = NVME_CMD_WRITE | NVME_CMD_FUSE_SECOND;
+    }
+    cmd->cdw0 |= (ps->cids[ps->cidx] << 16);
+
+    /* Namespace of the request's LUN */
+    cmd->nsid = ps->ns->nsid;
+
+    /* CDW10/11: Starting LBA, same range for both halves */
+    cmd->cdw10 = (__uint32_t)(ps->lba & 0xFFFFFFFF);
+    cmd->cdw11 = (__uint32_t)(ps->lba >> 32);
+
+    /* CDW12: NLB (0-based), FUA only matters for the Write */
+    cmd->cdw12 = (ps->num_blocks - 1) & NVME_RW_NLB_MASK;
+    if (ps->cidx != 0 && (ps->flags & NF_FUA)) {
+        cmd->cdw12 |= NVME_RW_FUA;
+    }
+
+#ifdef NVME_DBG_CMD
+    cmn_err(CE_NOTE, "nvme_io_build_compare_write_command: %s LBA=%llu blocks=%u",
+            (ps->cidx == 0) ? "COMPARE" : "WRITE", ps->lba, ps->num_blocks);
+#endif
+    return 1;
+}
+
 /*
  * nvme_get_translated_addr: Get and translate next page from alenlist
  *
@@ -1050,9 +1829,9 @@ nvme_build_prps_from_alenlist(nvme_soft_t *soft, nvme_rwcmd_state_t *ps)
     }
 
     /* Calculate chunk size for this command */
-    chunk_size = req->sr_buflen - (ps->cidx * ps->max_transfer_blocks * soft->block_size);
-    if (chunk_size > ps->max_transfer_blocks * soft->block_size) {
-        chunk_size = ps->max_transfer_blocks * soft->block_size;
+    chunk_size = req->sr_buflen - (ps->done_blocks * ps->ns->block_size);
+    if (chunk_size > ps->chunk_blocks * ps->ns->block_size) {
+        chunk_size = ps->chunk_blocks * ps->ns->block_size;
     }
 
 #ifdef NVME_DBG_CMD
@@ -1136,7 +1915,7 @@ nvme_build_prps_from_alenlist(nvme_soft_t *soft, nvme_rwcmd_state_t *ps)
                             num_prp_pages);
 #endif
                     /* Resource exhaustion - set BUSY and return -1 for retry */
-                    nvme_set_adapter_status(req, SC_REQUEST, ST_BUSY);
+                    nvme_set_busy(soft, req);
                     return -1;
                 }
 
@@ -1315,6 +2094,7 @@ nvme_prp_pool_alloc(nvme_soft_t *soft)
 
     /* No pages available */
     mutex_unlock(&soft->prp_pool_lock);
+    NVME_STAT_INC(soft, prp_exhausted);
     return -1;
 }
 
@@ -1387,6 +2167,7 @@ nvme_io_cid_alloc(nvme_soft_t *soft, scsi_request_t *req, unsigned int commands,
     /* Early rejection: check if we have enough free CIDs */
     if (soft->io_cid_free_count < commands) {
         mutex_unlock(&soft->io_requests_lock);
+        NVME_STAT_INC(soft, cid_exhausted);
 #ifdef NVME_DBG
         cmn_err(CE_WARN, "nvme_io_cid_alloc: insufficient free CIDs (requested %u, available %u)",
                 commands, soft->io_cid_free_count);
@@ -1394,6 +2175,14 @@ nvme_io_cid_alloc(nvme_soft_t *soft, scsi_request_t *req, unsigned int commands,
         return -1;
     }
 
+    /* Thermal pacing: hold the queue depth down, but never starve a request */
+    if (soft->thermal_level && soft->io_cid_free_count < NVME_IO_QUEUE_SIZE &&
+        NVME_IO_QUEUE_SIZE - soft->io_cid_free_count + commands > soft->io_depth_limit) {
+        mutex_unlock(&soft->io_requests_lock);
+        NVME_STAT_INC(soft, cid_paced);
+        return -1;
+    }
+
     /* Search for free bits in the bitmap */
     for (word_idx = 0; word_idx < (NVME_IO_QUEUE_SIZE/32) && allocated < commands; word_idx++) {
         word = soft->io_cid_bitmap[word_idx];
@@ -1450,6 +2239,8 @@ nvme_io_cid_alloc(nvme_soft_t *soft, scsi_request_t *req, unsigned int commands,
         cid = cids[i];
         soft->io_requests[cid].req = req;
         soft->io_requests[cid].start_time = lbolt;  /* Record start time for timeout tracking */
+        soft->io_requests[cid].submitted = 0;
+        soft->io_requests[cid].recov = NVME_RECOV_NONE;
         for (word_idx = 0; word_idx < NVME_CMD_MAX_PRPS; word_idx++) {
             soft->io_requests[cid].prpidx[word_idx] = -1;
         }
@@ -1508,6 +2299,7 @@ nvme_io_cid_done(nvme_soft_t *soft, unsigned int cid, int *last)
     mutex_lock(&soft->io_requests_lock, PZERO);
     /* Clear the scsi_request pointer (must be inside lock to avoid races with timeout check) */
     soft->io_requests[cid].req = NULL;
+    soft->io_requests[cid].submitted = 0;
     /* Clear the bit to mark as free */
     soft->io_cid_bitmap[word_idx] &= ~mask;
     /* Increment free count */
@@ -1552,14 +2344,18 @@ nvme_io_cid_store_prp(nvme_soft_t *soft, unsigned int cid, int prpidx)
  *
  * This is used for ordering guarantees when processing ordered or head-of-queue
  * commands. The flush uses a special CID (NVME_IO_CID_FLUSH) that won't conflict
- * with normal I/O CIDs (0-255).
+ * with normal I/O CIDs (0 to NVME_IO_QUEUE_SIZE-1).
+ *
+ * Arguments:
+ *   soft - Controller state
+ *   ns   - Namespace of the ordered command
  *
  * Returns:
  *   0 on success (command submitted)
  *   -1 on failure
  */
 int
-nvme_cmd_special_flush(nvme_soft_t *soft)
+nvme_cmd_special_flush(nvme_soft_t *soft, nvme_ns_t *ns)
 {
     nvme_command_t cmd;
     int rc;
@@ -1570,8 +2366,7 @@ nvme_cmd_special_flush(nvme_soft_t *soft)
     /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) */
     cmd.cdw0 = NVME_CMD_FLUSH | (NVME_IO_CID_FLUSH << 16);
 
-    /* Set namespace ID to 1 (we always use namespace 1) */
-    cmd.nsid = 1;
+    cmd.nsid = ns->nsid;
 
     /* Submit the command to the I/O queue */
     rc = nvme_submit_cmd(soft, &soft->io_queue, &cmd);
@@ -1589,6 +2384,204 @@ nvme_cmd_special_flush(nvme_soft_t *soft)
     return 0;
 }
 
+/*
+ * nvme_io_build_write_zeroes_command: Build an NVMe Write Zeroes command
+ *
+ * No data is transferred, so no PRPs are set. The caller guarantees
+ * num_blocks is between 1 and ns->write_zeroes_max_blocks. WRITE SAME has
+ * no FUA bit, so neither does the command.
+ *
+ * Arguments:
+ *   soft       - Controller state
+ *   ns         - Target namespace
+ *   cid        - I/O CID already allocated for this command
+ *   lba        - Starting LBA
+ *   num_blocks - Number of blocks to zero
+ *   flags      - NF_DEALLOC
+ *   cmd        - Output: NVMe command
+ *
+ * Returns:
+ *   1 on success
+ */
+int
+nvme_io_build_write_zeroes_command(nvme_soft_t *soft, nvme_ns_t *ns, unsigned int cid,
+                                   __uint64_t lba, uint_t num_blocks, uint_t flags,
+                                   nvme_command_t *cmd)
+{
+    bzero(cmd, sizeof(*cmd));
+
+    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) */
+    cmd->cdw0 = NVME_CMD_ZERO | (cid << 16);
+    cmd->nsid = ns->nsid;
+
+    /* CDW10/11: Starting LBA */
+    cmd->cdw10 = (__uint32_t)(lba & 0xFFFFFFFF);
+    cmd->cdw11 = (__uint32_t)(lba >> 32);
+
+    /* CDW12: NLB (0-based) plus flags */
+    cmd->cdw12 = (num_blocks - 1) & NVME_RW_NLB_MASK;
+    /* DEAC is reserved before NVMe 1.3, only set it when the controller knows it */
+    if ((flags & NF_DEALLOC) && soft->vs >= NVME_VS_1_3)
+        cmd->cdw12 |= NVME_RW_DEAC;
+
+#ifdef NVME_DBG_CMD
+    cmn_err(CE_NOTE, "nvme_io_build_write_zeroes_command: CID %u LBA=%llu blocks=%u cdw12=0x%x",
+            cid, lba, num_blocks, cmd->cdw12);
+#endif
+    return 1;
+}
+
+/*
+ * nvme_io_build_verify_command: Build an NVMe Verify command
+ *
+ * The controller reads and checks the range internally, no data is returned
+ * to the host so no PRPs are set. The caller guarantees num_blocks is between
+ * 1 and NVME_RW_NLB_MASK + 1.
+ *
+ * Arguments:
+ *   soft       - Controller state
+ *   ns         - Target namespace
+ *   cid        - I/O CID already allocated for this command
+ *   lba        - Starting LBA
+ *   num_blocks - Number of blocks to verify
+ *   cmd        - Output: NVMe command
+ *
+ * Returns:
+ *   1 on success
+ */
+int
+nvme_io_build_verify_command(nvme_soft_t *soft, nvme_ns_t *ns, unsigned int cid,
+                             __uint64_t lba, uint_t num_blocks, nvme_command_t *cmd)
+{
+    bzero(cmd, sizeof(*cmd));
+
+    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) */
+    cmd->cdw0 = NVME_CMD_VERIFY | (cid << 16);
+    cmd->nsid = ns->nsid;
+
+    /* CDW10/11: Starting LBA */
+    cmd->cdw10 = (__uint32_t)(lba & 0xFFFFFFFF);
+    cmd->cdw11 = (__uint32_t)(lba >> 32);
+
+    /* CDW12: NLB (0-based), LR/FUA/PRINFO = 0 */
+    cmd->cdw12 = (num_blocks - 1) & NVME_RW_NLB_MASK;
+
+#ifdef NVME_DBG_CMD
+    cmn_err(CE_NOTE, "nvme_io_build_verify_command: CID %u LBA=%llu blocks=%u",
+            cid, lba, num_blocks);
+#endif
+    return 1;
+}
+
+/*
+ * nvme_io_build_dsm_command: Build an NVMe Dataset Management (deallocate) command
+ *
+ * Packs SCSI UNMAP block descriptors into a DSM range list held in a PRP pool
+ * page. The page is attached to the CID so nvme_io_cid_done() returns it to
+ * the pool on completion. Zero-length descriptors are skipped.
+ *
+ * Arguments:
+ *   soft      - Controller state
+ *   ns        - Target namespace
+ *   cid       - I/O CID already allocated for this command
+ *   desc      - First UNMAP block descriptor (16 bytes each, big-endian)
+ *   num_desc  - Number of descriptors available at desc
+ *   consumed  - Output: number of descriptors consumed into this command
+ *   cmd       - Output: NVMe command (CID set, PRP1 points to range list)
+ *
+ * Returns:
+ *   1 on success
+ *   0 on failure (no non-empty descriptors, CID/PRP bookkeeping failed)
+ *  -1 on resource exhaustion (no PRP pool page, caller should return BUSY)
+ */
+int
+nvme_io_build_dsm_command(nvme_soft_t *soft, nvme_ns_t *ns, unsigned int cid, uchar_t *desc,
+                          uint_t num_desc, uint_t *consumed, nvme_command_t *cmd)
+{
+    nvme_dsm_range_t *range;
+    alenaddr_t range_phys;
+    __uint64_t lba;
+    uint_t nlb;
+    uint_t nr = 0;
+    uint_t i;
+    int pool_index;
+
+    *consumed = 0;
+
+    /* The range list lives in a PRP pool page (4KB holds 256 ranges) */
+    pool_index = nvme_prp_pool_alloc(soft);
+    if (pool_index < 0) {
+#ifdef NVME_DBG
+        cmn_err(CE_WARN, "nvme_io_build_dsm_command: no PRP pool pages available");
+#endif
+        return -1;
+    }
+    if (nvme_io_cid_store_prp(soft, cid, pool_index) != 0) {
+        cmn_err(CE_WARN, "nvme_io_build_dsm_command: failed to store range page %d with CID %u",
+                pool_index, cid);
+        nvme_prp_pool_free(soft, pool_index);
+        return 0;
+    }
+
+    range = (nvme_dsm_range_t *)((caddr_t)soft->prp_pool + (pool_index * soft->nvme_page_size));
+    range_phys = soft->prp_pool_phys + (pool_index * soft->nvme_page_size);
+
+    for (i = 0; i < num_desc && nr < NVME_DSM_MAX_RANGES; i++, desc += NVME_UNMAP_DESC_SIZE) {
+        lba = ((__uint64_t)desc[0] << 56) | ((__uint64_t)desc[1] << 48) |
+              ((__uint64_t)desc[2] << 40) | ((__uint64_t)desc[3] << 32) |
+              ((__uint64_t)desc[4] << 24) | ((__uint64_t)desc[5] << 16) |
+              ((__uint64_t)desc[6] << 8)  | ((__uint64_t)desc[7]);
+        nlb = ((uint_t)desc[8] << 24) | ((uint_t)desc[9] << 16) |
+              ((uint_t)desc[10] << 8) | ((uint_t)desc[11]);
+        if (nlb == 0)
+            continue;
+
+        /* 512-byte emulation: deallocate only whole namespace blocks inside the range */
+        if (ns->emul_shift) {
+            __uint64_t end = (lba + nlb) >> ns->emul_shift;
+
+            lba = (lba + (1u << ns->emul_shift) - 1) >> ns->emul_shift;
+            if (end <= lba)
+                continue;
+            nlb = (uint_t)(end - lba);
+        }
+
+        NVME_MEMWR(&range[nr].cattr, 0);
+        NVME_MEMWR(&range[nr].nlb, nlb);
+        NVME_MEMWR(&range[nr].slba_lo, PHYS64_LO(lba));
+        NVME_MEMWR(&range[nr].slba_hi, PHYS64_HI(lba));
+        nr++;
+    }
+    *consumed = i;
+
+    if (nr == 0) {
+        return 0;
+    }
+#ifdef IP30
+    heart_dcache_wb_inval(range, nr * sizeof(nvme_dsm_range_t));
+#endif
+
+    bzero(cmd, sizeof(*cmd));
+
+    /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) */
+    cmd->cdw0 = NVME_CMD_DSM | (cid << 16);
+    cmd->nsid = ns->nsid;
+
+    /* Range list fits in one page - PRP1 only */
+    cmd->prp1_lo = PHYS64_LO(range_phys);
+    cmd->prp1_hi = PHYS64_HI(range_phys);
+
+    /* CDW10: Number of Ranges (0-based), CDW11: deallocate */
+    cmd->cdw10 = nr - 1;
+    cmd->cdw11 = NVME_DSM_ATTR_DEALLOCATE;
+
+#ifdef NVME_DBG_CMD
+    cmn_err(CE_NOTE, "nvme_io_build_dsm_command: CID %u, %u ranges from %u descriptors",
+            cid, nr, i);
+#endif
+    return 1;
+}
+
 #ifdef NVME_TEST
 void
 nvme_cmd_admin_test(nvme_soft_t *soft, unsigned int i)
@@ -1597,8 +2590,8 @@ nvme_cmd_admin_test(nvme_soft_t *soft, unsigned int i)
 
     cmn_err(CE_NOTE, "nvme_admin_identify_controller: sending command");
 
-    /* Clear utility buffer */
-    bzero(soft->utility_buffer, NBPP);
+    /* Clear the first admin buffer, the test handler owns the admin queue */
+    bzero(soft->admin_bufs, NBPP);
 
     /* Build Identify Controller command */
     bzero(&cmd, sizeof(cmd));
@@ -1609,9 +2602,9 @@ nvme_cmd_admin_test(nvme_soft_t *soft, unsigned int i)
     /* NSID: not used for controller identify */
     cmd.nsid = 0;
 
-    /* PRP1: physical address of utility buffer (controller data destination) */
-    cmd.prp1_lo = PHYS64_LO(soft->utility_buffer_phys);
-    cmd.prp1_hi = PHYS64_HI(soft->utility_buffer_phys);
+    /* PRP1: physical address of the first admin buffer (controller data destination) */
+    cmd.prp1_lo = PHYS64_LO(soft->admin_bufs_phys);
+    cmd.prp1_hi = PHYS64_HI(soft->admin_bufs_phys);
 
     /* PRP2: not needed (data is only 4KB) */
     cmd.prp2_lo = 0;
@@ -1634,8 +2627,8 @@ nvme_cmd_io_test(nvme_soft_t *soft, unsigned int i)
 
     cmn_err(CE_NOTE, "nvme_admin_identify_controller: sending command");
 
-    /* Clear utility buffer */
-    bzero(soft->utility_buffer, NBPP);
+    /* Clear the first admin buffer, used as the read destination */
+    bzero(soft->admin_bufs, NBPP);
 
     /* Build Identify Controller command */
     bzero(&cmd, sizeof(cmd));
@@ -1648,8 +2641,8 @@ nvme_cmd_io_test(nvme_soft_t *soft, unsigned int i)
     cmd.cdw10 = 0; // lba low
     cmd.cdw11 = 0; // lba hi
     cmd.cdw12 = 0; // blocks
-    cmd.prp1_lo = PHYS64_LO(soft->utility_buffer_phys);
-    cmd.prp1_hi = PHYS64_HI(soft->utility_buffer_phys);
+    cmd.prp1_lo = PHYS64_LO(soft->admin_bufs_phys);
+    cmd.prp1_hi = PHYS64_HI(soft->admin_bufs_phys);
 #endif
 
 #if 0
@@ -39,11 +39,22 @@ nvme_set_success(scsi_request_t *req)
     req->sr_sensegotten = 0;
 }
 
+/*
+ * Helper: Answer busy, the disk driver retries the request later
+ */
+void
+nvme_set_busy(nvme_soft_t *soft, scsi_request_t *req)
+{
+    NVME_STAT_INC(soft, busy);
+    nvme_set_adapter_status(req, SC_REQUEST, ST_BUSY);
+}
+
 /*
  * nvme_complete_request: Complete a SCSI request and call sr_notify callback
  *
  * This function handles the final step of request completion, including:
  * - Cache invalidation for R10K+ speculative execution workaround (reads only)
+ * - Counting the request in soft->stats
  * - Setting sr_ha to NULL (required before sr_notify per SCSI driver protocol)
  * - Calling the sr_notify callback to notify upper layers
  *
@@ -54,11 +65,14 @@ nvme_set_success(scsi_request_t *req)
  * layer accesses the data.
  *
  * Arguments:
- *   req - SCSI request to complete
+ *   soft - Controller state
+ *   req  - SCSI request to complete
  */
 void
-nvme_complete_request(scsi_request_t *req)
+nvme_complete_request(nvme_soft_t *soft, scsi_request_t *req)
 {
+    nvme_stats_complete(soft, req);
+
     /* If this IO resulted in a DMA from device to memory (disk read),
      * then invalidate cache copies of the data.
      * This only applies to read operations (SRF_DIR_IN).
@@ -80,6 +94,64 @@ nvme_complete_request(scsi_request_t *req)
     }
 }
 
+/*
+ * nvme_smart_le: Little-endian SMART log field of up to 8 bytes
+ */
+static __uint64_t
+nvme_smart_le(uchar_t *log, uint_t offset, uint_t len)
+{
+    __uint64_t value = 0;
+
+    while (len-- > 0)
+        value = (value << 8) | log[offset + len];
+    return value;
+}
+
+/*
+ * nvme_smart_update: Decode a freshly read SMART / Health log into soft->smart
+ *
+ * Called from the Get Log Page completion with the log in its admin buffer.
+ * A new critical warning is logged once, when it first shows up.
+ */
+void
+nvme_smart_update(nvme_soft_t *soft, uchar_t *log)
+{
+    nvme_smart_t smart;
+    uchar_t old_warning;
+
+#ifdef HEART_INVALIDATE_WAR
+    heart_invalidate_war((caddr_t)log, NVME_SMART_LOG_SIZE);
+#endif
+    smart.valid = 1;
+    smart.updated = lbolt;
+    smart.crit_warning = log[NVME_SMART_CRIT_WARNING];
+    smart.temperature = (ushort_t)nvme_smart_le(log, NVME_SMART_TEMPERATURE, 2);
+    smart.avail_spare = log[NVME_SMART_AVAIL_SPARE];
+    smart.spare_thresh = log[NVME_SMART_SPARE_THRESH];
+    smart.percent_used = log[NVME_SMART_PERCENT_USED];
+    smart.data_units_read = nvme_smart_le(log, NVME_SMART_DATA_UNITS_READ, 8);
+    smart.data_units_written = nvme_smart_le(log, NVME_SMART_DATA_UNITS_WRITTEN, 8);
+    smart.power_on_hours = nvme_smart_le(log, NVME_SMART_POWER_ON_HOURS, 8);
+    smart.unsafe_shutdowns = nvme_smart_le(log, NVME_SMART_UNSAFE_SHUTDOWNS, 8);
+    smart.media_errors = nvme_smart_le(log, NVME_SMART_MEDIA_ERRORS, 8);
+    smart.error_log_entries = nvme_smart_le(log, NVME_SMART_ERROR_LOG_ENTRIES, 8);
+    smart.throttle_count = (uint_t)(nvme_smart_le(log, NVME_SMART_TMT1_COUNT, 4) +
+                                    nvme_smart_le(log, NVME_SMART_TMT2_COUNT, 4));
+
+    mutex_lock(&soft->smart_lock, PZERO);
+    old_warning = soft->smart.valid ? soft->smart.crit_warning : 0;
+    soft->smart = smart;
+    mutex_unlock(&soft->smart_lock);
+
+    if (smart.crit_warning & ~old_warning) {
+        cmn_err(CE_WARN, "nvme: SMART critical warning 0x%02x (spare %u%%, used %u%%, %d C)",
+                smart.crit_warning, smart.avail_spare, smart.percent_used,
+                (int)smart.temperature - 273);
+    }
+
+    nvme_thermal_update(soft, smart.temperature);
+}
+
 void
 nvme_read_completion(nvme_completion_t *cpl, nvme_queue_t *q)
 {
@@ -165,229 +237,683 @@ nvme_process_completions(nvme_soft_t *soft, nvme_queue_t *q)
     return count;
 }
 
+/*
+ * nvme_handle_admin_completion: Admin queue completion handler
+ *
+ * Every admin command owns a slot of soft->admin_cmds[] (nvme_admin_alloc);
+ * the CID leads to it, its done callback interprets the result, then the
+ * slot and its buffer go back to the pool and sleeping admin waiters are
+ * posted.
+ */
 void
 nvme_handle_admin_completion(nvme_soft_t *soft, nvme_queue_t *q, nvme_completion_t *cpl)
 {
     ushort_t status_code = (cpl->dw3 >> 17) & 0x7F;
     ushort_t status_type = (cpl->dw3 >> 25) & 0x7;
     ushort_t cid = cpl->dw3 & 0xFFFF;
-    nvme_identify_controller_t *id_ctrl;
-    nvme_identify_namespace_t *id_ns;
-    __uint64_t nsze;
-    uint_t lbads;
-    int i;
+    nvme_admin_cmd_t *ac;
+
+    if (!NVME_ADMIN_CID_IS_SLOT(cid) ||
+        !(soft->admin_slot_bitmap & (1u << (cid - NVME_ADMIN_CID_BASE)))) {
+        cmn_err(CE_WARN, "nvme_handle_admin_completion: completion for unknown CID %d", cid);
+        return;
+    }
+    ac = &soft->admin_cmds[cid - NVME_ADMIN_CID_BASE];
 
     if (status_code != NVME_SC_SUCCESS) {
         cmn_err(CE_WARN, "nvme_handle_admin_completion: command failed, "
-                "CID %d, status type %d, code %d",
-                cid, status_type, status_code);
-        return;
+                "CID %d, opcode 0x%02x, status type %d, code %d",
+                cid, ac->opcode, status_type, status_code);
+    }
+#ifdef NVME_DBG
+    else {
+        cmn_err(CE_NOTE, "nvme_handle_admin_completion: command CID %d completed", cid);
     }
+#endif
+
+    if (ac->done)
+        ac->done(soft, ac, cpl);
+    nvme_admin_free(soft, ac);
+    nvme_admin_wakeup(soft);
+}
+
+/*
+ * nvme_identify_controller_done: Decode Identify Controller data
+ */
+void
+nvme_identify_controller_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl)
+{
+    nvme_identify_controller_t *id_ctrl;
+
+    if (NVME_CPL_STATUS(cpl))
+        return;
 
-    /* Handle specific commands based on CID */
-    switch (cid) {
-    case NVME_ADMIN_CID_IDENTIFY_CONTROLLER:
 #ifdef NVME_DBG
-        cmn_err(CE_NOTE, "nvme_handle_admin_completion: processing Identify Controller");
+    cmn_err(CE_NOTE, "nvme_handle_admin_completion: processing Identify Controller");
 #endif
 #ifdef HEART_INVALIDATE_WAR
-        heart_invalidate_war((caddr_t)soft->utility_buffer, sizeof(NBPP));
+    heart_invalidate_war((caddr_t)ac->buf, NBPP);
 #endif
-        id_ctrl = (nvme_identify_controller_t *)soft->utility_buffer;
+    id_ctrl = (nvme_identify_controller_t *)ac->buf;
 
-        /* Copy serial number (20 bytes, space-padded ASCII) and null-terminate */
-        bcopy(id_ctrl->serial_number, soft->serial, 20);
-        soft->serial[20] = '\0';
+    /* Copy serial number (20 bytes, space-padded ASCII) and null-terminate */
+    bcopy(id_ctrl->serial_number, soft->serial, 20);
+    soft->serial[20] = '\0';
 
-        /* Copy model number (40 bytes, space-padded ASCII) and null-terminate */
-        bcopy(id_ctrl->model_number, soft->model, 40);
-        soft->model[40] = '\0';
+    /* Copy model number (40 bytes, space-padded ASCII) and null-terminate */
+    bcopy(id_ctrl->model_number, soft->model, 40);
+    soft->model[40] = '\0';
 
-        /* Copy firmware revision (8 bytes, space-padded ASCII) and null-terminate */
-        bcopy(id_ctrl->firmware_revision, soft->firmware_rev, 8);
-        soft->firmware_rev[8] = '\0';
+    /* Copy firmware revision (8 bytes, space-padded ASCII) and null-terminate */
+    bcopy(id_ctrl->firmware_revision, soft->firmware_rev, 8);
+    soft->firmware_rev[8] = '\0';
 
-        soft->num_namespaces = NVME_MEMRDBS(&id_ctrl->number_of_namespaces);
+    soft->num_namespaces = NVME_MEMRDBS(&id_ctrl->number_of_namespaces);
 
-        /* Get MDTS (Maximum Data Transfer Size) */
-        soft->mdts = id_ctrl->mdts;
+    /* Get MDTS (Maximum Data Transfer Size), turned into block limits by
+     * nvme_compute_transfer_geometry() once the LBA format is known */
+    soft->mdts = id_ctrl->mdts;
 
-        /* Calculate maximum transfer size in blocks */
-        if (soft->mdts == 0) {
-            /* 0 means no limit - cap at something reasonable */
-            soft->max_transfer_blocks = 0xFFFF;  /* 32MB with 512-byte blocks */
-        } else {
-            /* MDTS is 2^n pages, convert to blocks */
-            uint_t max_pages = (1 << soft->mdts);
-            soft->max_transfer_blocks = (max_pages * (1u << (soft->min_page_size + 12))) / 512;
-        }
+    soft->oacs_format = (NVME_MEMRDBS(&id_ctrl->oacs_acl_aerl) & NVME_OACS_FORMAT) ? 1 : 0;
 
-        /* Decode ONCS (Optional NVM Command Support) */
-        {
-            __uint32_t oncs = NVME_MEMRDBS(&id_ctrl->oncs);
-            soft->oncs_compare = (oncs & NVME_ONCS_COMPARE) ? 1 : 0;
-            soft->oncs_dataset_mgmt = (oncs & NVME_ONCS_DSM) ? 1 : 0;
-            soft->oncs_verify = (oncs & NVME_ONCS_VERIFY) ? 1 : 0;
-        }
+    /* Asynchronous events: AERL is 0's based, OAES is 0 before NVMe 1.2 */
+    soft->aer_limit = ((NVME_MEMRDBS(&id_ctrl->oacs_acl_aerl) >> 24) & 0xFF) + 1;
+    soft->oaes = NVME_MEMRDBS(&id_ctrl->oaes);
+
+    /* Decode ONCS (Optional NVM Command Support) */
+    {
+        __uint32_t oncs = NVME_MEMRDBS(&id_ctrl->oncs);
+        soft->oncs_compare = (oncs & NVME_ONCS_COMPARE) ? 1 : 0;
+        soft->oncs_dataset_mgmt = (oncs & NVME_ONCS_DSM) ? 1 : 0;
+        soft->oncs_write_zeroes = (oncs & NVME_ONCS_WRITE_ZEROES) ? 1 : 0;
+        soft->oncs_verify = (oncs & NVME_ONCS_VERIFY) ? 1 : 0;
+        /* Fused Compare and Write needs both FUSES bit 0 and the Compare command */
+        soft->fuses_compare_write = ((oncs & NVME_FUSES_COMPARE_WRITE) && soft->oncs_compare) ? 1 : 0;
+    }
+
+    soft->vwc_present = (NVME_MEMRDBS(&id_ctrl->fna_vwc_awun) & NVME_VWC_PRESENT) ? 1 : 0;
+
+    /* Warning temperature threshold, the LOG SENSE reference temperature (0 = not reported) */
+    soft->wctemp = (NVME_MEMRDBS(&id_ctrl->avscc_apsta_wctemp) >> 16) & 0xFFFF;
+
+    /* Host Memory Buffer sizes (NVMe 1.2+), 0 = the drive does not want one */
+    soft->hmpre = NVME_MEMRDBS(&id_ctrl->hmpre);
+    soft->hmmin = NVME_MEMRDBS(&id_ctrl->hmmin);
+    soft->hmminds = NVME_MEMRDBS(&id_ctrl->hmminds);
+    soft->hmmaxd = NVME_MEMRDBS(&id_ctrl->hmmaxd_nsetidmax) & 0xFFFF;
 
 //#ifdef NVME_DBG
-        cmn_err(CE_NOTE, "nvme: Controller - SN=%s, Model=%s, FW=%s, NS=%d",
-                soft->serial, soft->model, soft->firmware_rev, soft->num_namespaces);
-        cmn_err(CE_NOTE, "nvme: MDTS=%d (max transfer = %d blocks = %d KB)",
-                soft->mdts, soft->max_transfer_blocks,
-                (soft->max_transfer_blocks * 512) / 1024);
-        cmn_err(CE_NOTE, "nvme: ONCS - Compare:%d DSM(TRIM):%d Verify:%d",
-                soft->oncs_compare, soft->oncs_dataset_mgmt, soft->oncs_verify);
+    cmn_err(CE_NOTE, "nvme: Controller - SN=%s, Model=%s, FW=%s, NS=%d",
+            soft->serial, soft->model, soft->firmware_rev, soft->num_namespaces);
+    cmn_err(CE_NOTE, "nvme: ONCS - Compare:%d DSM(TRIM):%d WriteZeroes:%d Verify:%d FusedCW:%d VWC:%d",
+            soft->oncs_compare, soft->oncs_dataset_mgmt, soft->oncs_write_zeroes,
+            soft->oncs_verify, soft->fuses_compare_write, soft->vwc_present);
 //#endif
-        break;
+}
+
+/*
+ * nvme_identify_ctrl_nvm_done: Decode the NVM Command Set controller data
+ *
+ * Keeps VSL and WZSL. A controller that rejects CNS 06h has no limits.
+ */
+void
+nvme_identify_ctrl_nvm_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl)
+{
+    if (NVME_CPL_STATUS(cpl))
+        return;
 
-    case NVME_ADMIN_CID_IDENTIFY_NAMESPACE: {
-        uint_t flbas;
+#ifdef HEART_INVALIDATE_WAR
+    heart_invalidate_war((caddr_t)ac->buf, NBPP);
+#endif
+    soft->vsl = ((uchar_t *)ac->buf)[NVME_ID_NVM_VSL];
+    soft->wzsl = ((uchar_t *)ac->buf)[NVME_ID_NVM_WZSL];
+    if (soft->vsl || soft->wzsl)
+        cmn_err(CE_NOTE, "nvme: VSL=%d WZSL=%d", soft->vsl, soft->wzsl);
+}
+
+/*
+ * nvme_identify_ns_list_done: Take the LUNs from the Active Namespace ID list
+ */
+void
+nvme_identify_ns_list_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl)
+{
+    __uint32_t *list;
+    __uint32_t nsid;
+    int i;
+
+    if (NVME_CPL_STATUS(cpl))
+        return;
 
 #ifdef NVME_DBG
-        cmn_err(CE_NOTE, "nvme_handle_admin_completion: processing Identify Namespace");
+    cmn_err(CE_NOTE, "nvme_handle_admin_completion: processing Active Namespace list");
 #endif
-#ifdef IP30
-        //heart_dcache_inval((caddr_t)soft->utility_buffer, sizeof(NBPP));
-        heart_invalidate_war((caddr_t)soft->utility_buffer, sizeof(NBPP));
+#ifdef HEART_INVALIDATE_WAR
+    heart_invalidate_war((caddr_t)ac->buf, NBPP);
 #endif
-        id_ns = (nvme_identify_namespace_t *)soft->utility_buffer;
-
-        /* Get namespace size (NSZE) - 64-bit value, little-endian */
-        nsze = (__uint64_t)NVME_MEMRDBS(&id_ns->nsze_lo) |
-               (((__uint64_t)NVME_MEMRDBS(&id_ns->nsze_hi)) << 32);
+    list = (__uint32_t *)ac->buf;
 
-        /* Get formatted LBA size (FLBAS) - bits 23:16 of features_nlbaf_flbas_mc */
-        flbas = (NVME_MEMRDBS(&id_ns->features_nlbaf_flbas_mc) >> 16) & 0xF;
+    /* Ascending NSIDs, zero terminated; LUN n gets the n-th one */
+    soft->ns_count = 0;
+    for (i = 0; i < 1024 && soft->ns_count < NVME_MAX_NAMESPACES; i++) {
+        nsid = NVME_MEMRDBS(&list[i]);
+        if (nsid == 0)
+            break;
+        soft->ns[soft->ns_count++].nsid = nsid;
+    }
+}
 
-        /* Get LBA data size (LBADS) from LBA format - bits 23:16 of lba_formats[flbas].dw0 */
-        lbads = (NVME_MEMRDBS(&id_ns->lba_formats[flbas].dw0) >> 16) & 0xFF;
+/*
+ * nvme_identify_namespace_done: Decode Identify Namespace data into ac->arg
+ */
+void
+nvme_identify_namespace_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl)
+{
+    nvme_ns_t *ns = (nvme_ns_t *)ac->arg;
+    nvme_identify_namespace_t *id_ns;
+    __uint64_t nsze;
+    uint_t lbads;
+    uint_t flbas;
+    int i;
 
-        soft->num_blocks = nsze;
-        soft->block_size = 1u << lbads;  /* 2^LBADS */
-        soft->lba_shift = lbads;
-        soft->nsid = 1;  /* We always use namespace 1 */
+    if (NVME_CPL_STATUS(cpl))
+        return;
 
 #ifdef NVME_DBG
-        cmn_err(CE_NOTE, "nvme: Namespace 1 - Size=%llu blocks, Block size=%u bytes (2^%u)",
-                soft->num_blocks,
-                soft->block_size,
-                soft->lba_shift);
+    cmn_err(CE_NOTE, "nvme_handle_admin_completion: processing Identify Namespace");
 #endif
-        break;
+#ifdef IP30
+    //heart_dcache_inval((caddr_t)ac->buf, NBPP);
+    heart_invalidate_war((caddr_t)ac->buf, NBPP);
+#endif
+    id_ns = (nvme_identify_namespace_t *)ac->buf;
+
+    /* Get namespace size (NSZE) - 64-bit value, little-endian */
+    nsze = (__uint64_t)NVME_MEMRDBS(&id_ns->nsze_lo) |
+           (((__uint64_t)NVME_MEMRDBS(&id_ns->nsze_hi)) << 32);
+
+    /* Get formatted LBA size (FLBAS) - bits 23:16 of features_nlbaf_flbas_mc */
+    flbas = (NVME_MEMRDBS(&id_ns->features_nlbaf_flbas_mc) >> 16) & 0xF;
+
+    /* Get LBA data size (LBADS) from LBA format - bits 23:16 of lba_formats[flbas].dw0 */
+    lbads = (NVME_MEMRDBS(&id_ns->lba_formats[flbas].dw0) >> 16) & 0xFF;
+
+    ns->num_blocks = nsze;
+    ns->block_size = 1u << lbads;  /* 2^LBADS */
+    ns->lba_shift = lbads;
+
+    /* Keep every LBA format for the format ioctl */
+    ns->flbas = flbas;
+    ns->nlbaf = ((NVME_MEMRDBS(&id_ns->features_nlbaf_flbas_mc) >> 8) & 0xFF) + 1;
+    if (ns->nlbaf > NVME_MAX_LBAF)
+        ns->nlbaf = NVME_MAX_LBAF;
+    for (i = 0; i < ns->nlbaf; i++)
+        ns->lbaf[i] = NVME_MEMRDBS(&id_ns->lba_formats[i].dw0);
+
+    /* Preferred write granularity and optimal write size (NVMe 1.4+).
+     * NPWG gives the physical block size, only usable as an exponent
+     * when it is a power of two */
+    ns->phys_block_exp = 0;
+    ns->pref_write_gran = 0;
+    ns->opt_write_size = 0;
+
+    /* Optimal I/O boundary (NVMe 1.3+), 0 means not reported */
+    ns->noiob = (NVME_MEMRDBS(&id_ns->nabspf_noiob) >> 16) & 0xFFFF;
+    if (NVME_MEMRDBS(&id_ns->features_nlbaf_flbas_mc) & NVME_NSFEAT_OPTPERF) {
+        uint_t npwg = (NVME_MEMRDBS(&id_ns->npwg_npwa) & 0xFFFF) + 1;
+
+        ns->pref_write_gran = npwg;
+        ns->opt_write_size = (NVME_MEMRDBS(&id_ns->nows) & 0xFFFF) + 1;
+        if ((npwg & (npwg - 1)) == 0) {
+            while ((1u << ns->phys_block_exp) < npwg && ns->phys_block_exp < 15)
+                ns->phys_block_exp++;
+        }
     }
 
-    case NVME_ADMIN_CID_CREATE_CQ:
 #ifdef NVME_DBG
-        cmn_err(CE_NOTE, "nvme_handle_admin_completion: I/O Completion Queue created");
+    cmn_err(CE_NOTE, "nvme: Namespace %u - Size=%llu blocks, Block size=%u bytes (2^%u), physical 2^%u blocks",
+            ns->nsid,
+            ns->num_blocks,
+            ns->block_size,
+            ns->lba_shift,
+            ns->phys_block_exp);
+    cmn_err(CE_NOTE, "nvme: Namespace %u - NOIOB=%u NPWG=%u NOWS=%u blocks",
+            ns->nsid, ns->noiob, ns->pref_write_gran, ns->opt_write_size);
+    for (i = 0; i < ns->nlbaf; i++) {
+        cmn_err(CE_NOTE, "nvme: LBAF%d%s - %u bytes, MS=%u, RP=%u",
+                i, (i == ns->flbas) ? "*" : "",
+                1u << NVME_LBAF_LBADS(ns->lbaf[i]),
+                NVME_LBAF_MS(ns->lbaf[i]), NVME_LBAF_RP(ns->lbaf[i]));
+    }
 #endif
-        break;
+}
 
-    case NVME_ADMIN_CID_CREATE_SQ:
-#ifdef NVME_DBG
-        cmn_err(CE_NOTE, "nvme_handle_admin_completion: I/O Submission Queue created");
-#endif
-        break;
+/*
+ * nvme_error_log_done: Dump the first Error Information log entry
+ */
+void
+nvme_error_log_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl)
+{
+    nvme_error_log_entry_t *error_log;
+    __uint64_t error_count;
+    ushort_t sqid, error_cid;
+    ushort_t status_code, status_type;
+    __uint64_t lba;
 
-    case NVME_ADMIN_CID_GET_LOG_PAGE_ERROR: {
-        nvme_error_log_entry_t *error_log;
-        __uint64_t error_count;
-        ushort_t sqid, error_cid;
-        ushort_t status_code, status_type;
-        __uint64_t lba;
+    if (NVME_CPL_STATUS(cpl))
+        return;
 
 #ifdef NVME_DBG
-        cmn_err(CE_NOTE, "nvme_handle_admin_completion: processing Get Log Page (Error Info)");
+    cmn_err(CE_NOTE, "nvme_handle_admin_completion: processing Get Log Page (Error Info)");
 #endif
 #ifdef HEART_INVALIDATE_WAR
-        heart_invalidate_war((caddr_t)soft->utility_buffer, sizeof(NBPP));
+    heart_invalidate_war((caddr_t)ac->buf, NBPP);
 #endif
-        error_log = (nvme_error_log_entry_t *)soft->utility_buffer;
+    error_log = (nvme_error_log_entry_t *)ac->buf;
 
-        /* Decode first error log entry */
-        error_count = (__uint64_t)NVME_MEMRDBS(&error_log->error_count_lo) |
-                     (((__uint64_t)NVME_MEMRDBS(&error_log->error_count_hi)) << 32);
+    /* Decode first error log entry */
+    error_count = (__uint64_t)NVME_MEMRDBS(&error_log->error_count_lo) |
+                 (((__uint64_t)NVME_MEMRDBS(&error_log->error_count_hi)) << 32);
 
-        /* Only decode if error_count is non-zero (valid entry) */
-        if (error_count != 0) {
-            sqid = NVME_MEMRDBS(&error_log->sqid_cid) & 0xFFFF;
-            error_cid = (NVME_MEMRDBS(&error_log->sqid_cid) >> 16) & 0xFFFF;
+    /* Only decode if error_count is non-zero (valid entry) */
+    if (error_count != 0) {
+        sqid = NVME_MEMRDBS(&error_log->sqid_cid) & 0xFFFF;
+        error_cid = (NVME_MEMRDBS(&error_log->sqid_cid) >> 16) & 0xFFFF;
 
-            status_code = (NVME_MEMRDBS(&error_log->status_pstat_loc) >> 1) & 0x7F;
-            status_type = (NVME_MEMRDBS(&error_log->status_pstat_loc) >> 9) & 0x7;
+        status_code = (NVME_MEMRDBS(&error_log->status_pstat_loc) >> 1) & 0x7F;
+        status_type = (NVME_MEMRDBS(&error_log->status_pstat_loc) >> 9) & 0x7;
 
-            lba = (__uint64_t)NVME_MEMRDBS(&error_log->lba_lo) |
-                 (((__uint64_t)NVME_MEMRDBS(&error_log->lba_hi)) << 32);
+        lba = (__uint64_t)NVME_MEMRDBS(&error_log->lba_lo) |
+             (((__uint64_t)NVME_MEMRDBS(&error_log->lba_hi)) << 32);
 
-            cmn_err(CE_WARN, "nvme: Error Log Entry #1:");
-            cmn_err(CE_WARN, "  Error Count: %llu", error_count);
-            cmn_err(CE_WARN, "  SQID: %u, CID: %u", sqid, error_cid);
-            cmn_err(CE_WARN, "  Status: Type=%u Code=%u", status_type, status_code);
-            cmn_err(CE_WARN, "  LBA: %llu", lba);
-            cmn_err(CE_WARN, "  NSID: %u", NVME_MEMRDBS(&error_log->nsid));
-        } else {
-            cmn_err(CE_NOTE, "nvme: Error log is empty (no errors recorded)");
+        cmn_err(CE_WARN, "nvme: Error Log Entry #1:");
+        cmn_err(CE_WARN, "  Error Count: %llu", error_count);
+        cmn_err(CE_WARN, "  SQID: %u, CID: %u", sqid, error_cid);
+        cmn_err(CE_WARN, "  Status: Type=%u Code=%u", status_type, status_code);
+        cmn_err(CE_WARN, "  LBA: %llu", lba);
+        cmn_err(CE_WARN, "  NSID: %u", NVME_MEMRDBS(&error_log->nsid));
+    } else {
+        cmn_err(CE_NOTE, "nvme: Error log is empty (no errors recorded)");
+    }
+}
+
+/*
+ * nvme_smart_log_done: Refresh the SMART cache from a Get Log Page
+ *
+ * On failure the old SMART data stays, the next refresh tries again.
+ */
+void
+nvme_smart_log_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl)
+{
+    if (NVME_CPL_STATUS(cpl) == 0)
+        nvme_smart_update(soft, (uchar_t *)ac->buf);
+    soft->smart_busy = 0;
+}
+
+/*
+ * nvme_feature_query_done: File a SEL=SUPPORTED capability mask for FID ac->argv
+ */
+void
+nvme_feature_query_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl)
+{
+    uint_t feature_value = cpl->dw0;
+    uchar_t fid = (uchar_t)ac->argv;
+
+    if (NVME_CPL_STATUS(cpl))
+        return;
+
+    /* Store feature capability bitmask (from SEL=SUPPORTED query) in array indexed by FID */
+    if (fid < 16) {
+        soft->features[fid] = feature_value;
+
+        /* Log which features are supported (non-zero means changeable bits exist) */
+        if (feature_value) {
+            const char *feature_name;
+            switch (fid) {
+            case NVME_FEAT_ARBITRATION:           feature_name = "Arbitration"; break;
+            case NVME_FEAT_POWER_MANAGEMENT:      feature_name = "Power Management"; break;
+            case NVME_FEAT_LBA_RANGE_TYPE:        feature_name = "LBA Range Type"; break;
+            case NVME_FEAT_TEMPERATURE_THRESHOLD: feature_name = "Temperature Threshold"; break;
+            case NVME_FEAT_ERROR_RECOVERY:        feature_name = "Error Recovery"; break;
+            case NVME_FEAT_VOLATILE_WRITE_CACHE:  feature_name = "Volatile Write Cache"; break;
+            case NVME_FEAT_NUMBER_OF_QUEUES:      feature_name = "Number of Queues"; break;
+            case NVME_FEAT_INTERRUPT_COALESCING:  feature_name = "Interrupt Coalescing"; break;
+            case NVME_FEAT_INTERRUPT_VECTOR_CONFIG: feature_name = "Interrupt Vector Config"; break;
+            case NVME_FEAT_WRITE_ATOMICITY:       feature_name = "Write Atomicity"; break;
+            case NVME_FEAT_ASYNC_EVENT_CONFIG:    feature_name = "Async Event Config"; break;
+            default:                              feature_name = "Unknown"; break;
+            }
+            cmn_err(CE_NOTE, "nvme: Feature 0x%02x (%s) supported (capability mask=0x%08x)",
+                    fid, feature_name, feature_value);
         }
-        break;
+    } else {
+        cmn_err(CE_WARN, "nvme: Get Features FID=0x%02x out of range", fid);
     }
+}
+
+/*
+ * nvme_set_features_done: Report a Set Features for FID ac->argv
+ */
+void
+nvme_set_features_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl)
+{
+    if (NVME_CPL_STATUS(cpl))
+        return;
 
-    case NVME_ADMIN_CID_SET_FEATURES:
 #ifdef NVME_DBG
-        cmn_err(CE_NOTE, "nvme_handle_admin_completion: processing Set Features");
+    cmn_err(CE_NOTE, "nvme_handle_admin_completion: processing Set Features");
 #endif
-        /* Set Features completion - DW0 may contain previous feature value */
-        cmn_err(CE_NOTE, "nvme: Set Features completed (previous value=0x%08x)", cpl->dw0);
-        break;
+    /* Set Features completion - DW0 may contain previous feature value */
+    cmn_err(CE_NOTE, "nvme: Set Features 0x%02x completed (previous value=0x%08x)",
+            ac->argv, cpl->dw0);
+}
+
+/*
+ * nvme_get_vwc_done: Store the current Volatile Write Cache setting
+ */
+void
+nvme_get_vwc_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl)
+{
+    if (NVME_CPL_STATUS(cpl))
+        return;
+
+    soft->vwc_enabled = (cpl->dw0 & NVME_FEAT_VWC_WCE) ? 1 : 0;
+#ifdef NVME_DBG
+    cmn_err(CE_NOTE, "nvme_handle_admin_completion: volatile write cache %s",
+            soft->vwc_enabled ? "enabled" : "disabled");
+#endif
+}
+
+/*
+ * nvme_set_vwc_done: Finish the MODE SELECT waiting on Set Features VWC
+ */
+void
+nvme_set_vwc_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl)
+{
+    nvme_scsi_mode_select_done(soft, NVME_CPL_STATUS(cpl) == 0);
+}
+
+/*
+ * nvme_format_done: Post the Format NVM outcome for the polling ioctl
+ *
+ * When the ioctl already timed out, the namespaces are identified again from
+ * here and the last rescan Identify drops format_active (nvme_ns_rescan_next()).
+ */
+void
+nvme_format_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl)
+{
+    uint_t j;
 
-    default:
-        /* Check if this is a Get Features completion (CID in range 16-31) */
-        if (NVME_ADMIN_CID_IS_GET_FEATURES(cid)) {
-            uint_t feature_value = cpl->dw0;
-            uchar_t fid = NVME_ADMIN_CID_EXTRACT_FID(cid);
-
-            /* Store feature capability bitmask (from SEL=SUPPORTED query) in array indexed by FID */
-            if (fid < 16) {
-                soft->features[fid] = feature_value;
-
-                /* Log which features are supported (non-zero means changeable bits exist) */
-                if (feature_value) {
-                    const char *feature_name;
-                    switch (fid) {
-                    case NVME_FEAT_ARBITRATION:           feature_name = "Arbitration"; break;
-                    case NVME_FEAT_POWER_MANAGEMENT:      feature_name = "Power Management"; break;
-                    case NVME_FEAT_LBA_RANGE_TYPE:        feature_name = "LBA Range Type"; break;
-                    case NVME_FEAT_TEMPERATURE_THRESHOLD: feature_name = "Temperature Threshold"; break;
-                    case NVME_FEAT_ERROR_RECOVERY:        feature_name = "Error Recovery"; break;
-                    case NVME_FEAT_VOLATILE_WRITE_CACHE:  feature_name = "Volatile Write Cache"; break;
-                    case NVME_FEAT_NUMBER_OF_QUEUES:      feature_name = "Number of Queues"; break;
-                    case NVME_FEAT_INTERRUPT_COALESCING:  feature_name = "Interrupt Coalescing"; break;
-                    case NVME_FEAT_INTERRUPT_VECTOR_CONFIG: feature_name = "Interrupt Vector Config"; break;
-                    case NVME_FEAT_WRITE_ATOMICITY:       feature_name = "Write Atomicity"; break;
-                    case NVME_FEAT_ASYNC_EVENT_CONFIG:    feature_name = "Async Event Config"; break;
-                    default:                              feature_name = "Unknown"; break;
-                    }
-                    cmn_err(CE_NOTE, "nvme: Feature 0x%02x (%s) supported (capability mask=0x%08x)",
-                            fid, feature_name, feature_value);
-                }
-            } else {
-                cmn_err(CE_WARN, "nvme: Get Features FID=0x%02x out of range", fid);
-            }
-        } else if (NVME_ADMIN_CID_IS_ABORT(cid)) {
-            ushort_t aborted_cid = NVME_ADMIN_CID_GET_ABORTED_CID(cid);
-
-            if (status_code == NVME_SC_SUCCESS) {
-                cmn_err(CE_NOTE, "nvme: abort command succeeded for CID %d", aborted_cid);
-            } else {
-                /* Abort failed - command may have already completed or CID invalid */
-                cmn_err(CE_NOTE, "nvme: abort command failed for CID %d (status type=%d, code=%d)",
-                        aborted_cid, status_type, status_code);
-            }
-        } else {
 #ifdef NVME_DBG
-            cmn_err(CE_NOTE, "nvme_handle_admin_completion: command CID %d completed", cid);
+    cmn_err(CE_NOTE, "nvme_handle_admin_completion: Format NVM completed");
+#endif
+    soft->format_status = NVME_CPL_STATUS(cpl);
+
+    if (!compare_and_swap_int((int *)&soft->format_orphaned, 1, 0))
+        return;
+
+    cmn_err(CE_NOTE, "nvme: late Format NVM completed, status 0x%x", soft->format_status);
+    for (j = 0; j < soft->ns_count; j++)
+        soft->ns[j].rescan_pending = 1;
+    soft->format_rescan = 1;
+    nvme_ns_rescan_start(soft);
+}
+
+/*
+ * nvme_set_hmb_done: Record whether the controller took (or gave back) the HMB
+ */
+void
+nvme_set_hmb_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl)
+{
+    if (NVME_CPL_STATUS(cpl) == 0)
+        soft->hmb_enabled = ac->argv ? 1 : 0;
+}
+
+/*
+ * nvme_aer_done: Handle an asynchronous event, then post the request again
+ *
+ * The controller masks an event type until the log page it names is read,
+ * so every event ends in a Get Log Page:
+ *   - error:  Error Information, dumped by nvme_error_log_done()
+ *   - SMART:  SMART / Health, which refreshes the LOG SENSE cache and moves
+ *             thermal pacing (nvme_smart_update)
+ *   - namespace attribute notice: Changed Namespace List, which re-identifies
+ *             the namespaces behind our LUNs (nvme_changed_ns_done)
+ *   - others: the named page, read only to re-arm the event
+ * A failed request (aborted, or over the controller's limit) is not posted
+ * again.
+ */
+void
+nvme_aer_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl)
+{
+    uint_t type, info, lid;
+    int ok = 1;
+
+    atomicAddInt(&soft->admin_queue.parked, -1);
+
+    if (NVME_CPL_STATUS(cpl)) {
+        atomicAddInt(&soft->aer_active, -1);
+        return;
+    }
+
+    type = NVME_AER_TYPE(cpl->dw0);
+    info = NVME_AER_INFO(cpl->dw0);
+    lid = NVME_AER_LID(cpl->dw0);
+    soft->aer_events++;
+
+    switch (type) {
+    case NVME_AER_TYPE_ERROR:
+        cmn_err(CE_WARN, "nvme: asynchronous error event, info 0x%02x", info);
+        ok = nvme_admin_get_log_page_error(soft);
+        break;
+    case NVME_AER_TYPE_SMART:
+        cmn_err(CE_NOTE, "nvme: SMART / Health event, info 0x%02x", info);
+        ok = nvme_admin_get_log_page_smart(soft);
+        break;
+    case NVME_AER_TYPE_NOTICE:
+        if (info == NVME_AER_NOTICE_NS_ATTR) {
+            ok = nvme_admin_get_log_page(soft, NVME_LOG_PAGE_CHANGED_NS, nvme_changed_ns_done);
+            break;
+        }
+        /* FALLTHROUGH */
+    default:
+        cmn_err(CE_NOTE, "nvme: asynchronous event type %u, info 0x%02x, log 0x%02x",
+                type, info, lid);
+        ok = nvme_admin_get_log_page(soft, lid, NULL);
+        break;
+    }
+    if (!ok)
+        cmn_err(CE_WARN, "nvme: could not read log 0x%02x, its events stay masked", lid);
+
+    if (soft->aer_stop || !nvme_admin_async_event(soft))
+        atomicAddInt(&soft->aer_active, -1);
+}
+
+/*
+ * nvme_changed_ns_done: Re-identify the namespaces of the Changed Namespace List
+ *
+ * Namespaces behind a LUN are marked and identified again one at a time
+ * (nvme_ns_rescan_start()), this callback still holds an admin buffer and
+ * a long list would run out of them. A namespace that turns up without a
+ * LUN is only reported: LUNs are handed out at attach, and renumbering them
+ * under a running system is worse than asking for a re-attach.
+ */
+void
+nvme_changed_ns_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl)
+{
+    __uint32_t *list;
+    __uint32_t nsid;
+    uint_t i, j;
+    int all;
+
+    if (NVME_CPL_STATUS(cpl))
+        return;
+
+#ifdef HEART_INVALIDATE_WAR
+    heart_invalidate_war((caddr_t)ac->buf, NBPP);
 #endif
+    list = (__uint32_t *)ac->buf;
+
+    /* More than 1024 changes: the list only holds the overflow marker */
+    all = NVME_MEMRDBS(&list[0]) == NVME_CHANGED_NS_OVERFLOW;
+    if (all) {
+        for (j = 0; j < soft->ns_count; j++)
+            soft->ns[j].rescan_pending = 1;
+        nvme_ns_rescan_start(soft);
+        return;
+    }
+
+    for (i = 0; i < 1024; i++) {
+        nsid = NVME_MEMRDBS(&list[i]);
+        if (nsid == 0)
+            break;
+        for (j = 0; j < soft->ns_count; j++) {
+            if (soft->ns[j].nsid == nsid)
+                break;
         }
+        if (j < soft->ns_count)
+            soft->ns[j].rescan_pending = 1;
+        else
+            cmn_err(CE_NOTE, "nvme: namespace %u changed, it has no LUN until the next attach", nsid);
     }
+    nvme_ns_rescan_start(soft);
+}
+
+/*
+ * nvme_ns_rescan_start: Start identifying the namespaces marked rescan_pending
+ *
+ * Does nothing while a rescan Identify is in flight, its completion moves
+ * on to the newly marked namespaces. rescan_wanted stays set until a start
+ * gets through, the timeout watchdog retries from there.
+ */
+void
+nvme_ns_rescan_start(nvme_soft_t *soft)
+{
+    soft->rescan_wanted = 1;
+    if (!compare_and_swap_int((int *)&soft->rescan_busy, 0, 1))
+        return;
+    soft->rescan_wanted = 0;
+    nvme_ns_rescan_next(soft);
+}
+
+/*
+ * nvme_ns_rescan_next: Identify the next namespace marked rescan_pending
+ *
+ * Called with rescan_busy held, from nvme_ns_rescan_start() and at the end
+ * of every nvme_ns_rescan_done(). Releases rescan_busy once nothing is left
+ * or no admin buffer is free; in the latter case the namespace stays marked
+ * for the watchdog's next try. A rescan after a late Format NVM lets I/O in
+ * again once every namespace is through.
+ */
+void
+nvme_ns_rescan_next(nvme_soft_t *soft)
+{
+    uint_t j;
+
+    for (j = 0; j < soft->ns_count; j++) {
+        if (!soft->ns[j].rescan_pending)
+            continue;
+        soft->ns[j].rescan_pending = 0;
+        if (nvme_admin_identify_namespace(soft, &soft->ns[j], nvme_ns_rescan_done))
+            return;
+        soft->ns[j].rescan_pending = 1;
+        soft->rescan_wanted = 1;
+        soft->rescan_busy = 0;
+        return;
+    }
+
+    if (soft->format_rescan) {
+        soft->format_rescan = 0;
+        nvme_compute_transfer_geometry(soft);
+        atomicAddInt((int *)&soft->format_active, -1);
+        cmn_err(CE_NOTE, "nvme: namespaces identified again after the Format NVM");
+    }
+    soft->rescan_busy = 0;
+}
+
+/*
+ * nvme_ns_rescan_done: Pick up a namespace change reported by an event
+ *
+ * Like nvme_identify_namespace_done(), but the LUN stays online: a new size
+ * or block format raises CAPACITY DATA HAS CHANGED on its next command, and
+ * a namespace that is gone keeps its block format and reports no blocks.
+ * Moves on to the next marked namespace when done.
+ */
+void
+nvme_ns_rescan_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl)
+{
+    nvme_ns_t *ns = (nvme_ns_t *)ac->arg;
+    __uint64_t old_blocks = ns->num_blocks;
+    uint_t old_flbas = ns->flbas;
+    uint_t old_size = ns->block_size;
+    uint_t old_shift = ns->lba_shift;
+    uint_t status = NVME_CPL_STATUS(cpl);
+
+    if (status == NVME_SC_INVALID_NS) {
+        ns->num_blocks = 0;     /* Detached or deleted */
+    } else if (status) {
+        goto next;
+    } else {
+        nvme_identify_namespace_done(soft, ac, cpl);
+        if (ns->num_blocks == 0) {
+            ns->flbas = old_flbas;
+            ns->block_size = old_size;
+            ns->lba_shift = old_shift;
+        }
+    }
+
+    if (ns->num_blocks == old_blocks && ns->flbas == old_flbas)
+        goto next;
+
+    if (ns->flbas != old_flbas)
+        nvme_compute_transfer_geometry(soft);
+    ns->capacity_changed = 1;
+
+    if (ns->num_blocks == 0)
+        cmn_err(CE_WARN, "nvme: namespace %u (LUN %u) is no longer attached", ns->nsid, ns->lun);
+    else
+        cmn_err(CE_NOTE, "nvme: namespace %u (LUN %u) now %llu blocks of %u bytes",
+                ns->nsid, ns->lun, ns->num_blocks, ns->block_size);
+
+next:
+    nvme_ns_rescan_next(soft);
+}
+
+/*
+ * nvme_abort_done: Record the outcome of an Abort for I/O CID ac->argv
+ *
+ * Either way nvme_check_timeouts() now gives the command NVME_ABORT_WAIT_MS
+ * to come back before it escalates. DW0 bit 0 set means the controller did
+ * not abort it.
+ */
+void
+nvme_abort_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl)
+{
+    nvme_cmd_info_t *ci = &soft->io_requests[ac->argv];
+
+    if (NVME_CPL_STATUS(cpl) == 0 && !(cpl->dw0 & 1)) {
+        cmn_err(CE_NOTE, "nvme: abort command succeeded for CID %d", ac->argv);
+    } else {
+        /* Abort failed - command may have already completed or CID invalid */
+        cmn_err(CE_NOTE, "nvme: abort command failed for CID %d (status 0x%x%s)",
+                ac->argv, NVME_CPL_STATUS(cpl),
+                NVME_CPL_STATUS(cpl) == 0 ? ", not aborted" : "");
+    }
+
+    mutex_lock(&soft->io_requests_lock, PZERO);
+    if (ci->recov == NVME_RECOV_ABORT_SENT) {
+        ci->recov = NVME_RECOV_ABORT_DONE;
+        ci->recov_time = lbolt;
+    }
+    mutex_unlock(&soft->io_requests_lock);
+}
+
+/*
+ * nvme_queue_cmd_done: Keep the status of a Create / Delete I/O queue command
+ */
+void
+nvme_queue_cmd_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl)
+{
+    soft->queue_status = NVME_CPL_STATUS(cpl);
 }
 
 /*
@@ -466,6 +992,46 @@ nvme_map_status_to_sense(scsi_request_t *req, ushort_t status_type, ushort_t sta
     }
 }
 
+/*
+ * nvme_stats_complete: Count a host request as it is handed back
+ *
+ * Called on every way a request goes back to the SCSI layer once the
+ * controller is known: nvme_complete_request(), nvme_emul_notify() and the
+ * synchronous answers of nvme_scsi_dispatch(). Only READ and WRITE count as
+ * reads and writes; UNMAP, WRITE SAME and MODE SELECT carry data out too
+ * but move no user data. The 512-byte emulation's internal namespace I/O
+ * is not a host request and is left out.
+ */
+void
+nvme_stats_complete(nvme_soft_t *soft, scsi_request_t *req)
+{
+    uint_t bytes = req->sr_buflen - req->sr_resid;
+
+    if (req == &soft->emul_ireq)
+        return;
+
+    if (req->sr_status != SC_GOOD || req->sr_scsi_status != ST_GOOD)
+        NVME_STAT_INC(soft, errors);
+
+    switch (req->sr_command[0]) {
+    case SCSIOP_READ_6:
+    case SCSIOP_READ_10:
+    case SCSIOP_READ_16:
+        NVME_STAT_INC(soft, reads);
+        atomicAddUint64(&soft->stats.read_bytes, bytes);
+        break;
+    case SCSIOP_WRITE_6:
+    case SCSIOP_WRITE_10:
+    case SCSIOP_WRITE_16:
+        NVME_STAT_INC(soft, writes);
+        atomicAddUint64(&soft->stats.write_bytes, bytes);
+        break;
+    default:
+        NVME_STAT_INC(soft, others);
+        break;
+    }
+}
+
 /*
  * nvme_handle_io_completion: Handle I/O command completion
  *
@@ -497,6 +1063,13 @@ nvme_handle_io_completion(nvme_soft_t *soft, nvme_queue_t *q, nvme_completion_t
         return;
     }
 
+    /* Aborted by the queue deletion or controller reset in progress: the CID
+     * stays allocated and nvme_reset_capture() picks it up for the replay */
+    if (soft->reset_active && !soft->ctlr_failed &&
+        status_type == 0 && status_code == NVME_SC_ABORT_QUEUE) {
+        return;
+    }
+
     /* Look up the SCSI request for this CID, this also frees the slot and PRPs.
      * nvme_io_cid_done() returns non-NULL only if this was the last CID (refcount hit 0).
      */
@@ -517,6 +1090,14 @@ nvme_handle_io_completion(nvme_soft_t *soft, nvme_queue_t *q, nvme_completion_t
         }
 #ifdef NVME_DBG
         cmn_err(CE_NOTE, "nvme_handle_io_completion: CID %d completed successfully", cid);
+#endif
+    } else if (status_type == 2 && status_code == NVME_SC_COMPARE_FAILED) {
+        /* COMPARE AND WRITE miscompare, the fused Write was not executed */
+        nvme_scsi_set_error(req, SCSI_SENSE_MISCOMPARE, SCSI_ADSENSE_MISCOMPARE, 0);
+    } else if (status_type == 0 && status_code == NVME_SC_FUSED_FAIL && req->sr_scsi_status != 0) {
+        /* Aborted because the other half of the fused pair failed, keep that error */
+#ifdef NVME_DBG
+        cmn_err(CE_NOTE, "nvme_handle_io_completion: CID %d aborted by failed fused command", cid);
 #endif
     } else {
         /* Always set error status - errors take priority */
@@ -536,9 +1117,8 @@ nvme_handle_io_completion(nvme_soft_t *soft, nvme_queue_t *q, nvme_completion_t
      * sr_ha is already 0 from the atomic decrement, no need to set it again
      * nvme_complete_request() handles cache invalidation for R10K+ CPUs
      */
-    if (last) {
-        nvme_complete_request(req);
-    }
+    if (last)
+        nvme_complete_request(soft, req);
 }
 
 #ifdef NVME_TEST
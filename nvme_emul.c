@@ -0,0 +1,611 @@
+/*
+ * nvme_emul.c - 512-byte Logical Block Emulation
+ *
+ * Presents 512-byte SCSI logical blocks on a namespace formatted with larger
+ * blocks (512e over 4Kn), for tools and volume headers that assume 512-byte
+ * sectors. Requests aligned to namespace blocks are translated in
+ * nvme_scsi_read_write() and go straight to the controller. Everything else
+ * is queued here and handled by a kernel thread that reads the namespace
+ * blocks into a bounce buffer, merges the initiator data and writes them back.
+ *
+ * The thread works through its queue in order, so overlapping partial writes
+ * are serialized. Queued writes that overlap or abut the one at the head of
+ * the queue are merged into a single read-modify-write cycle, and aligned
+ * writes that overlap queued or active work are queued behind it.
+ */
+
+#include "nvmedrv.h"
+
+/*
+ * nvme_emul_notify: Hand a finished initiator request back to the SCSI layer
+ *
+ * The data was moved by the CPU, so nvme_complete_request()'s DMA cache
+ * invalidation must not run on it.
+ */
+static void
+nvme_emul_notify(nvme_soft_t *soft, scsi_request_t *req)
+{
+    nvme_stats_complete(soft, req);
+    req->sr_ha = NULL;
+    if (req->sr_notify) {
+        (*req->sr_notify)(req);
+    }
+}
+
+/*
+ * nvme_emul_io_done: sr_notify for the internal namespace request
+ */
+static void
+nvme_emul_io_done(scsi_request_t *ireq)
+{
+    nvme_soft_t *soft = (nvme_soft_t *)ireq->sr_dev;
+
+    vsema(&soft->emul_io_sema);
+}
+
+/*
+ * nvme_emul_dev_io: Synchronous namespace read or write for the RMW thread
+ *
+ * Runs the regular read/write engine on an internal request in namespace
+ * block units and sleeps until it completes. Busy conditions (no free CIDs,
+ * PRP pool exhausted, queue full) are retried.
+ *
+ * Arguments:
+ *   soft       - Controller soft state
+ *   ns         - Namespace to transfer to or from
+ *   lba        - First namespace block
+ *   num_blocks - Namespace blocks to transfer
+ *   buf        - Kernel buffer, num_blocks << lba_shift bytes
+ *   flags      - NF_WRITE, NF_FUA
+ *
+ * Returns:
+ *   1 on success, 0 on failure (status and sense left in soft->emul_ireq)
+ */
+static int
+nvme_emul_dev_io(nvme_soft_t *soft, nvme_ns_t *ns, __uint64_t lba,
+                 uint_t num_blocks, caddr_t buf, uint_t flags)
+{
+    scsi_request_t *ireq = &soft->emul_ireq;
+    nvme_rwcmd_state_t *ps = soft->emul_ps;
+    u_char *cdb = soft->emul_cdb;
+    int tries;
+    int i;
+
+    /* READ(16)/WRITE(16) for anyone looking at the request */
+    bzero(cdb, sizeof(soft->emul_cdb));
+    cdb[0] = (flags & NF_WRITE) ? SCSIOP_WRITE_16 : SCSIOP_READ_16;
+    if (flags & NF_FUA)
+        cdb[1] = 0x08;
+    for (i = 0; i < 8; i++)
+        cdb[2 + i] = (lba >> (56 - 8 * i)) & 0xFF;
+    cdb[10] = (num_blocks >> 24) & 0xFF;
+    cdb[11] = (num_blocks >> 16) & 0xFF;
+    cdb[12] = (num_blocks >> 8) & 0xFF;
+    cdb[13] = num_blocks & 0xFF;
+
+    for (tries = 0; tries < 100; tries++) {
+        bzero(ireq, sizeof(*ireq));
+        ireq->sr_command = cdb;
+        ireq->sr_cmdlen = 16;
+        ireq->sr_buffer = (u_char *)buf;
+        ireq->sr_lun = ns->lun;
+        ireq->sr_buflen = num_blocks << ns->lba_shift;
+        ireq->sr_flags = SRF_MAP | SRF_FLUSH | ((flags & NF_WRITE) ? 0 : SRF_DIR_IN);
+        ireq->sr_sense = soft->emul_sense;
+        ireq->sr_senselen = sizeof(soft->emul_sense);
+        ireq->sr_notify = nvme_emul_io_done;
+        ireq->sr_dev = (void *)soft;
+
+        ps->req = ireq;
+        ps->ns = ns;
+        ps->lba = lba;
+        ps->num_blocks = num_blocks;
+        ps->buflen = ireq->sr_buflen;
+        ps->flags = flags;
+        nvme_scsi_rw_start(soft, ps);
+        psema(&soft->emul_io_sema, PZERO);
+
+        if (ireq->sr_status != SC_REQUEST || ireq->sr_scsi_status != ST_BUSY)
+            break;
+        delay(1);
+    }
+
+    return (ireq->sr_status == SC_GOOD && ireq->sr_scsi_status == ST_GOOD);
+}
+
+/*
+ * nvme_emul_fail: Copy the internal request's failure to an initiator request
+ */
+static void
+nvme_emul_fail(nvme_soft_t *soft, scsi_request_t *req)
+{
+    scsi_request_t *ireq = &soft->emul_ireq;
+
+    req->sr_status = ireq->sr_status;
+    req->sr_scsi_status = ireq->sr_scsi_status;
+    req->sr_resid = req->sr_buflen;
+    req->sr_sensegotten = 0;
+    if (ireq->sr_sensegotten && req->sr_sense &&
+        req->sr_senselen >= ireq->sr_sensegotten) {
+        bcopy(ireq->sr_sense, req->sr_sense, ireq->sr_sensegotten);
+        req->sr_sensegotten = ireq->sr_sensegotten;
+    }
+}
+
+/*
+ * nvme_emul_map: Kernel address of a job's data
+ *
+ * User addresses were staged by nvme_emul_queue(); unmapped buffers are
+ * mapped here, in thread context.
+ */
+static caddr_t
+nvme_emul_map(nvme_emul_job_t *job)
+{
+    scsi_request_t *req = job->req;
+    buf_t *bp;
+
+    if (job->kaddr)
+        return job->kaddr;
+
+    if (req->sr_flags & SRF_MAPBP) {
+        bp = (buf_t *)req->sr_bp;
+        if (BP_ISMAPPED(bp)) {
+            job->kaddr = bp->b_un.b_addr;
+        } else {
+            job->kaddr = bp_mapin(bp);
+            job->mapped = 1;
+        }
+    } else {
+        job->kaddr = (caddr_t)req->sr_buffer;
+    }
+    return job->kaddr;
+}
+
+/*
+ * nvme_emul_finish: Complete a job, successful or not
+ */
+static void
+nvme_emul_finish(nvme_soft_t *soft, nvme_emul_job_t *job, int ok)
+{
+    scsi_request_t *req = job->req;
+
+    if (ok) {
+        nvme_set_success(req);
+    } else {
+        nvme_emul_fail(soft, req);
+    }
+
+    /* Write back what the CPU copied in before the initiator looks at it */
+    if (ok && !(job->flags & NF_WRITE) && !job->wait && job->kaddr)
+        dki_dcache_wbinval(job->kaddr, job->num_blocks << NVME_EMUL_HOST_SHIFT);
+    if (job->mapped)
+        bp_mapout((buf_t *)req->sr_bp);
+
+    /* The issuing thread copies out, completes and frees staged jobs */
+    if (job->wait) {
+        vsema(&job->done);
+        return;
+    }
+
+    kmem_free(job, sizeof(*job));
+    nvme_emul_notify(soft, req);
+}
+
+/*
+ * nvme_emul_read: Serve an unaligned read through the bounce buffer
+ */
+static int
+nvme_emul_read(nvme_soft_t *soft, nvme_emul_job_t *job)
+{
+    nvme_ns_t *ns = job->ns;
+    uint_t shift = ns->emul_shift;
+    uint_t window = NVME_EMUL_BOUNCE_BYTES >> ns->lba_shift;
+    __uint64_t dlo, dcount, hlo, hhi;
+    caddr_t data = nvme_emul_map(job);
+
+    for (dlo = job->dev_lo; dlo < job->dev_hi; dlo += dcount) {
+        dcount = job->dev_hi - dlo;
+        if (dcount > window)
+            dcount = window;
+
+        if (!nvme_emul_dev_io(soft, ns, dlo, (uint_t)dcount, soft->emul_bounce, 0))
+            return 0;
+
+        /* Host blocks of this job inside the window */
+        hlo = dlo << shift;
+        hhi = (dlo + dcount) << shift;
+        if (hlo < job->lba)
+            hlo = job->lba;
+        if (hhi > job->lba + job->num_blocks)
+            hhi = job->lba + job->num_blocks;
+
+        bcopy(soft->emul_bounce + ((hlo - (dlo << shift)) << NVME_EMUL_HOST_SHIFT),
+              data + ((hlo - job->lba) << NVME_EMUL_HOST_SHIFT),
+              (hhi - hlo) << NVME_EMUL_HOST_SHIFT);
+    }
+    return 1;
+}
+
+/*
+ * nvme_emul_write: Read-modify-write a batch of merged writes
+ *
+ * The batch covers host blocks [lo, hi) of one namespace without holes. Only the partial
+ * namespace blocks at either end of each bounce window are read; everything
+ * in between is overwritten by initiator data, applied in queue order.
+ */
+static int
+nvme_emul_write(nvme_soft_t *soft, nvme_emul_job_t *batch,
+                __uint64_t lo, __uint64_t hi, uint_t flags)
+{
+    nvme_ns_t *ns = batch->ns;
+    uint_t shift = ns->emul_shift;
+    uint_t mask = (1u << shift) - 1;
+    uint_t window = NVME_EMUL_BOUNCE_BYTES >> ns->lba_shift;
+    __uint64_t dlo, dhi, dcount, hlo, hhi, jlo, jhi;
+    nvme_emul_job_t *job;
+    caddr_t tail;
+
+    for (job = batch; job; job = job->next)
+        (void)nvme_emul_map(job);
+
+    dhi = (hi + mask) >> shift;
+    for (dlo = lo >> shift; dlo < dhi; dlo += dcount) {
+        dcount = dhi - dlo;
+        if (dcount > window)
+            dcount = window;
+
+        hlo = dlo << shift;
+        hhi = (dlo + dcount) << shift;
+        if (hlo < lo)
+            hlo = lo;
+        if (hhi > hi)
+            hhi = hi;
+
+        /* Fetch the namespace blocks only partly covered */
+        if ((hlo & mask) &&
+            !nvme_emul_dev_io(soft, ns, dlo, 1, soft->emul_bounce, 0))
+            return 0;
+        if ((hhi & mask) && (dcount > 1 || !(hlo & mask))) {
+            tail = soft->emul_bounce + ((dcount - 1) << ns->lba_shift);
+            if (!nvme_emul_dev_io(soft, ns, dlo + dcount - 1, 1, tail, 0))
+                return 0;
+        }
+
+        /* Merge */
+        for (job = batch; job; job = job->next) {
+            jlo = (job->lba > hlo) ? job->lba : hlo;
+            jhi = job->lba + job->num_blocks;
+            if (jhi > hhi)
+                jhi = hhi;
+            if (jlo >= jhi)
+                continue;
+            bcopy(job->kaddr + ((jlo - job->lba) << NVME_EMUL_HOST_SHIFT),
+                  soft->emul_bounce + ((jlo - (dlo << shift)) << NVME_EMUL_HOST_SHIFT),
+                  (jhi - jlo) << NVME_EMUL_HOST_SHIFT);
+        }
+
+        if (!nvme_emul_dev_io(soft, ns, dlo, (uint_t)dcount, soft->emul_bounce,
+                              NF_WRITE | (flags & NF_FUA)))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * nvme_emul_run: Take the next batch off the queue and process it
+ *
+ * Returns:
+ *   1 if a batch was processed, 0 if the queue was empty
+ */
+static int
+nvme_emul_run(nvme_soft_t *soft)
+{
+    uint_t window;
+    nvme_emul_job_t *batch, *last, *next, *job;
+    __uint64_t lo, hi, dev_lo, dev_hi;
+    uint_t flags;
+    int ok;
+
+    mutex_lock(&soft->emul_lock, PZERO);
+    batch = soft->emul_head;
+    if (batch == NULL) {
+        mutex_unlock(&soft->emul_lock);
+        return 0;
+    }
+
+    window = NVME_EMUL_BOUNCE_BYTES >> batch->ns->lba_shift;
+    last = batch;
+    lo = batch->lba;
+    hi = batch->lba + batch->num_blocks;
+    dev_lo = batch->dev_lo;
+    dev_hi = batch->dev_hi;
+    flags = batch->flags;
+
+    /* Merge following writes to the same namespace that overlap or abut and fit one window */
+    if (batch->flags & NF_WRITE) {
+        while ((next = last->next) != NULL && (next->flags & NF_WRITE) &&
+               next->ns == batch->ns && next->lba <= hi && next->lba + next->num_blocks >= lo) {
+            __uint64_t nlo = (next->dev_lo < dev_lo) ? next->dev_lo : dev_lo;
+            __uint64_t nhi = (next->dev_hi > dev_hi) ? next->dev_hi : dev_hi;
+
+            if (nhi - nlo > window)
+                break;
+            dev_lo = nlo;
+            dev_hi = nhi;
+            if (next->lba < lo)
+                lo = next->lba;
+            if (next->lba + next->num_blocks > hi)
+                hi = next->lba + next->num_blocks;
+            flags |= next->flags;
+            last = next;
+        }
+    }
+
+    soft->emul_head = last->next;
+    if (soft->emul_head == NULL)
+        soft->emul_tail = NULL;
+    last->next = NULL;
+    soft->emul_active_ns = batch->ns;
+    soft->emul_active_lo = dev_lo;
+    soft->emul_active_hi = dev_hi;
+    mutex_unlock(&soft->emul_lock);
+
+#ifdef NVME_DBG_EXTRA
+    cmn_err(CE_NOTE, "nvme_emul_run: %s host blocks %llu-%llu (%s)",
+            (flags & NF_WRITE) ? "write" : "read", lo, hi - 1,
+            (batch->next) ? "merged" : "single");
+#endif
+
+    if (flags & NF_WRITE) {
+        ok = nvme_emul_write(soft, batch, lo, hi, flags);
+    } else {
+        ok = nvme_emul_read(soft, batch);
+    }
+
+    mutex_lock(&soft->emul_lock, PZERO);
+    soft->emul_active_ns = NULL;
+    soft->emul_active_lo = 0;
+    soft->emul_active_hi = 0;
+    mutex_unlock(&soft->emul_lock);
+
+    for (job = batch; job; job = next) {
+        next = job->next;
+        nvme_emul_finish(soft, job, ok);
+    }
+    return 1;
+}
+
+/*
+ * nvme_emul_thread: Kernel thread running the read-modify-write engine
+ *
+ * Sleeps on emul_sema, which is posted once per queued job.
+ */
+static void
+nvme_emul_thread(void *arg)
+{
+    nvme_soft_t *soft = (nvme_soft_t *)arg;
+
+#ifdef NVME_DBG
+    cmn_err(CE_NOTE, "nvme_emul_thread: started");
+#endif
+    while (!soft->emul_shutdown) {
+        psema(&soft->emul_sema, PZERO);
+        if (soft->emul_shutdown) {
+            break;
+        }
+        (void)nvme_emul_run(soft);
+    }
+
+#ifdef NVME_DBG
+    cmn_err(CE_NOTE, "nvme_emul_thread: exiting");
+#endif
+    soft->emul_running = 0;
+}
+
+/*
+ * nvme_emul_divert: Decide whether a read/write needs the RMW engine
+ *
+ * Arguments:
+ *   soft - Controller soft state
+ *   ps   - Parsed request, LBA and length in 512-byte host blocks
+ *
+ * Returns:
+ *   1 if the request is not aligned to namespace blocks, or is a write
+ *   overlapping queued or active RMW work; 0 if it can go straight through
+ */
+int
+nvme_emul_divert(nvme_soft_t *soft, nvme_rwcmd_state_t *ps)
+{
+    nvme_ns_t *ns = ps->ns;
+    uint_t mask = (1u << ns->emul_shift) - 1;
+    __uint64_t dlo, dhi;
+    nvme_emul_job_t *job;
+    int hit = 0;
+
+    if ((ps->lba & mask) || (ps->num_blocks & mask))
+        return 1;
+    if (!(ps->flags & NF_WRITE))
+        return 0;
+    if (soft->emul_head == NULL && soft->emul_active_hi == 0)
+        return 0;
+
+    dlo = ps->lba >> ns->emul_shift;
+    dhi = (ps->lba + ps->num_blocks) >> ns->emul_shift;
+
+    mutex_lock(&soft->emul_lock, PZERO);
+    if (soft->emul_active_ns == ns &&
+        dlo < soft->emul_active_hi && soft->emul_active_lo < dhi)
+        hit = 1;
+    for (job = soft->emul_head; job && !hit; job = job->next) {
+        if ((job->flags & NF_WRITE) && job->ns == ns &&
+            dlo < job->dev_hi && job->dev_lo < dhi)
+            hit = 1;
+    }
+    mutex_unlock(&soft->emul_lock);
+
+    return hit;
+}
+
+/*
+ * nvme_emul_queue: Hand a read/write to the RMW engine
+ *
+ * Data at a user address can only be reached from the issuing process, so
+ * it is staged through a kernel buffer and the caller sleeps until the
+ * thread is done. Other requests complete asynchronously from the thread.
+ * Always completes the request.
+ *
+ * Arguments:
+ *   soft - Controller soft state
+ *   ps   - Parsed request, LBA and length in 512-byte host blocks
+ */
+void
+nvme_emul_queue(nvme_soft_t *soft, nvme_rwcmd_state_t *ps)
+{
+    scsi_request_t *req = ps->req;
+    uint_t mask = (1u << ps->ns->emul_shift) - 1;
+    uint_t len = ps->num_blocks << NVME_EMUL_HOST_SHIFT;
+    nvme_emul_job_t *job;
+    int user;
+
+    if (req->sr_buflen < len ||
+        (req->sr_buffer == NULL && !(req->sr_flags & SRF_MAPBP))) {
+        nvme_set_adapter_error(req);
+        nvme_emul_notify(soft, req);
+        return;
+    }
+
+    job = kmem_zalloc(sizeof(*job), KM_NOSLEEP);
+    if (job == NULL || !soft->emul_running) {
+        if (job)
+            kmem_free(job, sizeof(*job));
+        nvme_set_busy(soft, req);
+        nvme_emul_notify(soft, req);
+        return;
+    }
+
+    job->req = req;
+    job->ns = ps->ns;
+    job->lba = ps->lba;
+    job->num_blocks = ps->num_blocks;
+    job->flags = ps->flags & (NF_WRITE | NF_FUA);
+    job->dev_lo = ps->lba >> ps->ns->emul_shift;
+    job->dev_hi = (ps->lba + ps->num_blocks + mask) >> ps->ns->emul_shift;
+    nvme_set_success(req);
+
+    user = !(req->sr_flags & SRF_MAPBP) && IS_KUSEG(req->sr_buffer);
+    if (user) {
+        job->wait = 1;
+        job->kaddr = kmem_alloc(len, KM_SLEEP);
+        if ((job->flags & NF_WRITE) && copyin(req->sr_buffer, job->kaddr, len)) {
+            kmem_free(job->kaddr, len);
+            kmem_free(job, sizeof(*job));
+            nvme_set_adapter_error(req);
+            nvme_emul_notify(soft, req);
+            return;
+        }
+        initnsema(&job->done, 0, "nvme_emul_job");
+    }
+
+    mutex_lock(&soft->emul_lock, PZERO);
+    if (soft->emul_tail) {
+        soft->emul_tail->next = job;
+    } else {
+        soft->emul_head = job;
+    }
+    soft->emul_tail = job;
+    mutex_unlock(&soft->emul_lock);
+    vsema(&soft->emul_sema);
+
+    if (!user)
+        return;
+
+    psema(&job->done, PZERO);
+    if (!(job->flags & NF_WRITE) && req->sr_status == SC_GOOD &&
+        req->sr_scsi_status == ST_GOOD &&
+        copyout(job->kaddr, req->sr_buffer, len)) {
+        nvme_set_adapter_error(req);
+    }
+    freesema(&job->done);
+    kmem_free(job->kaddr, len);
+    kmem_free(job, sizeof(*job));
+    nvme_emul_notify(soft, req);
+}
+
+/*
+ * nvme_emul_start: Set up the RMW engine and start its thread
+ *
+ * Called during attach in NVME_EMULATE_512 builds, whether or not the
+ * namespace currently needs emulation, since a format can change that.
+ */
+void
+nvme_emul_start(nvme_soft_t *soft)
+{
+    init_mutex(&soft->emul_lock, MUTEX_DEFAULT, "nvme_emul", 0);
+    initnsema(&soft->emul_sema, 0, "nvme_emul");
+    initnsema(&soft->emul_io_sema, 0, "nvme_emul_io");
+    soft->emul_bounce = kmem_alloc(NVME_EMUL_BOUNCE_BYTES, KM_SLEEP | KM_CACHEALIGN);
+    soft->emul_ps = kmem_zalloc(sizeof(nvme_rwcmd_state_t), KM_SLEEP);
+    soft->emul_head = NULL;
+    soft->emul_tail = NULL;
+    soft->emul_active_lo = 0;
+    soft->emul_active_hi = 0;
+
+    soft->emul_shutdown = 0;
+    soft->emul_running = 1;
+
+    sthread_create("nvme_emul",
+                    NULL, 2 * KTHREAD_DEF_STACKSZ, /* stack/stack size */
+                    0, /* flags */
+                    scsi_intr_pri, /* some priority */
+                    KT_PS, /* scheduling flags PS - priority scheduled */
+                    nvme_emul_thread,
+                    (void *)soft, /* arg0 */
+                    0, 0, 0); /* rest of args */
+
+#ifdef NVME_DBG
+    cmn_err(CE_NOTE, "nvme_emul_start: RMW thread created");
+#endif
+}
+
+/*
+ * nvme_emul_stop: Stop the RMW thread and fail anything still queued
+ *
+ * Called during detach, before the controller is shut down.
+ */
+void
+nvme_emul_stop(nvme_soft_t *soft)
+{
+    nvme_emul_job_t *job;
+    int waited = 0;
+
+    if (!soft->emul_bounce) {
+        return;
+    }
+
+    /* The thread may be asleep in nvme_emul_dev_io() on an internal request.
+     * The controller is still up, so that request completes or times out
+     * through the watchdog; nothing below may be freed before it is back */
+    soft->emul_shutdown = 1;
+    vsema(&soft->emul_sema);
+    while (soft->emul_running) {
+        delay(drv_usectohz(10000));  /* 10ms */
+        if (++waited % 500 == 0)
+            cmn_err(CE_NOTE, "nvme_emul_stop: waiting for the RMW thread to finish its I/O");
+    }
+
+    while ((job = soft->emul_head) != NULL) {
+        soft->emul_head = job->next;
+        job->next = NULL;
+        nvme_set_adapter_error(&soft->emul_ireq);
+        soft->emul_ireq.sr_sensegotten = 0;
+        nvme_emul_finish(soft, job, 0);
+    }
+    soft->emul_tail = NULL;
+
+    kmem_free(soft->emul_ps, sizeof(nvme_rwcmd_state_t));
+    kmem_free(soft->emul_bounce, NVME_EMUL_BOUNCE_BYTES);
+    soft->emul_bounce = NULL;
+    freesema(&soft->emul_io_sema);
+    freesema(&soft->emul_sema);
+    mutex_destroy(&soft->emul_lock);
+}
@@ -93,7 +93,7 @@ void
 nvme_build_inquiry_data(nvme_soft_t *soft, u_char *inq_data)
 {
 #ifdef NVME_DBG    
-    cmn_err(CE_NOTE, "nvme_build_inquiry_data: soft=%p max_transfer_blocks:%d", soft, soft->max_transfer_blocks);
+    cmn_err(CE_NOTE, "nvme_build_inquiry_data: soft=%p", soft);
 #endif
 
     /* Clear the buffer */
@@ -149,11 +149,14 @@ nvme_build_inquiry_data(nvme_soft_t *soft, u_char *inq_data)
 
 /*
  * nvme_scsi_inquiry: Handle INQUIRY command
- * Supports standard INQUIRY and VPD page 0x80 (Unit Serial Number)
+ * Supports standard INQUIRY and VPD pages 0x00, 0x80 (Unit Serial Number),
+ * 0xB0 (Block Limits), 0xB1 (Block Device Characteristics) and
+ * 0xB2 (Logical Block Provisioning, DSM/Write Zeroes only)
  */
 int
 nvme_scsi_inquiry(nvme_soft_t *soft, scsi_request_t *req)
 {
+    nvme_ns_t *ns = NVME_REQ_NS(soft, req);
     uchar_t *cdb = req->sr_command;
     uchar_t *buffer = (uchar_t *)req->sr_buffer;
     uchar_t evpd = cdb[1] & 0x01;  /* Enable Vital Product Data */
@@ -166,36 +169,58 @@ nvme_scsi_inquiry(nvme_soft_t *soft, scsi_request_t *req)
         /* VPD Page requested */
         if (page_code == 0x00) {
             /* Supported VPD Pages */
-            if (req->sr_buflen < 6) {
+            int num_pages = 4;
+
+            /* Logical Block Provisioning page only makes sense with DSM or Write Zeroes */
+            if (soft->oncs_dataset_mgmt || soft->oncs_write_zeroes)
+                num_pages++;
+
+            if (req->sr_buflen < 4 + num_pages) {
                 nvme_set_adapter_error(req);
                 return -1;
             }
             buffer[0] = 0x00;  /* Peripheral Device Type: Direct-access */
             buffer[1] = 0x00;  /* Page Code: Supported VPD Pages */
             buffer[2] = 0x00;  /* Reserved */
-            buffer[3] = 0x03;  /* Page Length: 3 pages */
+            buffer[3] = num_pages;  /* Page Length: number of pages listed */
             buffer[4] = 0x00;  /* Page 0x00 (this page) */
             buffer[5] = 0x80;  /* Page 0x80 (Unit Serial Number) */
             buffer[6] = 0xB0;  /* Page 0xB0 (Block Limits) */
-            copy_len = 7;
+            buffer[7] = 0xB1;  /* Page 0xB1 (Block Device Characteristics) */
+            if (soft->oncs_dataset_mgmt || soft->oncs_write_zeroes)
+                buffer[8] = 0xB2;  /* Page 0xB2 (Logical Block Provisioning) */
+            copy_len = 4 + num_pages;
         } else if (page_code == 0x80) {
             /* Unit Serial Number Page */
+            char ns_suffix[12];
+            int sfx_len = 0;
+
             /* Find actual serial number length (trim trailing spaces) */
             for (sn_len = 20; sn_len > 0 && (soft->serial[sn_len-1] == ' ' || soft->serial[sn_len-1] == '\0'); sn_len--)
                 ;
 
-            if (req->sr_buflen < (4 + sn_len)) {
+            /* LUNs past the first append their NSID so every serial is unique */
+            if (ns->lun != 0)
+                sfx_len = sprintf(ns_suffix, "-%u", ns->nsid);
+
+            if (req->sr_buflen < (4 + sn_len + sfx_len)) {
                 nvme_set_adapter_error(req);
                 return -1;
             }
             buffer[0] = 0x00;  /* Peripheral Device Type */
             buffer[1] = 0x80;  /* Page Code: Unit Serial Number */
             buffer[2] = 0x00;  /* Reserved */
-            buffer[3] = sn_len; /* Page Length */
+            buffer[3] = sn_len + sfx_len; /* Page Length */
             bcopy(soft->serial, &buffer[4], sn_len);
-            copy_len = 4 + sn_len;
+            bcopy(ns_suffix, &buffer[4 + sn_len], sfx_len);
+            copy_len = 4 + sn_len + sfx_len;
         } else if (page_code == 0xB0) {
             /* Block Limits VPD Page (SBC-3) */
+            uint_t opt_gran;
+            uint_t opt_len;
+            uint_t max_len;
+            uint_t ws_len;
+
             if (req->sr_buflen < 64) {
                 nvme_set_adapter_error(req);
                 return -1;
@@ -206,24 +231,110 @@ nvme_scsi_inquiry(nvme_soft_t *soft, scsi_request_t *req)
             buffer[2] = 0x00;  /* Reserved */
             buffer[3] = 0x3C;  /* Page Length: 60 bytes (0x3C) */
 
-            /* Optimal Transfer Length Granularity: not specified */
-            buffer[4] = 0x00;
-            buffer[5] = 0x00;
+            /*
+             * Optimal Transfer Length Granularity: the namespace's preferred
+             * write granularity (NPWG), else one block. Optimal Transfer Length:
+             * the optimal write size (NOWS) when it fits a single command,
+             * else the largest transfer the driver issues without splitting.
+             * All lengths are in SCSI blocks, so with 512-byte emulation
+             * a namespace block counts 1 << emul_shift times.
+             */
+            max_len = ns->max_transfer_blocks << ns->emul_shift;
+            opt_gran = (ns->pref_write_gran ? ns->pref_write_gran : 1) << ns->emul_shift;
+            if (opt_gran > 0xFFFF)
+                opt_gran = 0xFFFF;
+            opt_len = ns->max_transfer_blocks;
+            if (ns->opt_write_size && ns->opt_write_size <= ns->max_transfer_blocks)
+                opt_len = ns->opt_write_size;
+            opt_len <<= ns->emul_shift;
+
+            buffer[6] = (opt_gran >> 8) & 0xFF;
+            buffer[7] = opt_gran & 0xFF;
 
             /* Maximum Transfer Length (blocks): use controller's MDTS limit */
-            buffer[8] = (soft->max_transfer_blocks >> 24) & 0xFF;
-            buffer[9] = (soft->max_transfer_blocks >> 16) & 0xFF;
-            buffer[10] = (soft->max_transfer_blocks >> 8) & 0xFF;
-            buffer[11] = soft->max_transfer_blocks & 0xFF;
+            buffer[8] = (max_len >> 24) & 0xFF;
+            buffer[9] = (max_len >> 16) & 0xFF;
+            buffer[10] = (max_len >> 8) & 0xFF;
+            buffer[11] = max_len & 0xFF;
+
+            /* Optimal Transfer Length */
+            buffer[12] = (opt_len >> 24) & 0xFF;
+            buffer[13] = (opt_len >> 16) & 0xFF;
+            buffer[14] = (opt_len >> 8) & 0xFF;
+            buffer[15] = opt_len & 0xFF;
+
+            if (soft->oncs_dataset_mgmt) {
+                /* Maximum Unmap LBA Count: NVMe ranges are 32-bit, no total limit */
+                buffer[20] = 0xFF;
+                buffer[21] = 0xFF;
+                buffer[22] = 0xFF;
+                buffer[23] = 0xFF;
+
+                /* Maximum Unmap Block Descriptor Count */
+                buffer[24] = (NVME_UNMAP_MAX_DESCRIPTORS >> 24) & 0xFF;
+                buffer[25] = (NVME_UNMAP_MAX_DESCRIPTORS >> 16) & 0xFF;
+                buffer[26] = (NVME_UNMAP_MAX_DESCRIPTORS >> 8) & 0xFF;
+                buffer[27] = NVME_UNMAP_MAX_DESCRIPTORS & 0xFF;
+
+                /* Optimal Unmap Granularity: one namespace block, aligned at 0 */
+                buffer[31] = 1 << ns->emul_shift;
+            }
 
-            /* Optimal Transfer Length: same as maximum */
-            buffer[12] = (soft->max_transfer_blocks >> 24) & 0xFF;
-            buffer[13] = (soft->max_transfer_blocks >> 16) & 0xFF;
-            buffer[14] = (soft->max_transfer_blocks >> 8) & 0xFF;
-            buffer[15] = soft->max_transfer_blocks & 0xFF;
+            if (soft->oncs_write_zeroes) {
+                /* WSNZ=1: WRITE SAME with zero blocks is rejected */
+                buffer[4] |= 0x01;
+
+                /* Maximum Write Same Length (bytes 36-43), fewer blocks under WZSL */
+                ws_len = NVME_WRITE_SAME_MAX_BLOCKS;
+                if (ns->write_zeroes_max_blocks < NVME_WRITE_ZEROES_MAX_BLOCKS)
+                    ws_len = (ns->write_zeroes_max_blocks * NVME_WRITE_SAME_MAX_COMMANDS) << ns->emul_shift;
+                buffer[40] = (ws_len >> 24) & 0xFF;
+                buffer[41] = (ws_len >> 16) & 0xFF;
+                buffer[42] = (ws_len >> 8) & 0xFF;
+                buffer[43] = ws_len & 0xFF;
+            }
+
+            if (soft->fuses_compare_write) {
+                /* Maximum Compare and Write Length: each half must fit one command */
+                buffer[5] = (max_len > 0xFF) ? 0xFF : max_len;
+            }
 
             /* All other fields remain zero (bzero above) */
             copy_len = 64;
+        } else if (page_code == 0xB1) {
+            /* Block Device Characteristics VPD Page (SBC-3) */
+            if (req->sr_buflen < 64) {
+                nvme_set_adapter_error(req);
+                return -1;
+            }
+            bzero(buffer, 64);
+            buffer[0] = 0x00;  /* Peripheral Device Type: Direct-access */
+            buffer[1] = 0xB1;  /* Page Code: Block Device Characteristics */
+            buffer[2] = 0x00;
+            buffer[3] = 0x3C;  /* Page Length: 60 bytes (0x3C) */
+            buffer[4] = 0x00;  /* Medium Rotation Rate: 0x0001 = non-rotating medium */
+            buffer[5] = 0x01;
+            buffer[6] = 0x00;  /* Product Type: not indicated */
+            buffer[7] = 0x00;  /* WABEREQ/WACEREQ = 0, Nominal Form Factor: not reported */
+            copy_len = 64;
+        } else if (page_code == 0xB2 && (soft->oncs_dataset_mgmt || soft->oncs_write_zeroes)) {
+            /* Logical Block Provisioning VPD Page (SBC-3) */
+            if (req->sr_buflen < 8) {
+                nvme_set_adapter_error(req);
+                return -1;
+            }
+            bzero(buffer, 8);
+            buffer[0] = 0x00;  /* Peripheral Device Type: Direct-access */
+            buffer[1] = 0xB2;  /* Page Code: Logical Block Provisioning */
+            buffer[2] = 0x00;
+            buffer[3] = 0x04;  /* Page Length: 4 bytes */
+            buffer[4] = 0x00;  /* Threshold Exponent: thresholds not supported */
+            /* LBPU: UNMAP via DSM, LBPWS/LBPWS10: WRITE SAME(16/10) with UNMAP via Write Zeroes,
+             * LBPRZ=0 since DSM read-back is undefined */
+            buffer[5] = (soft->oncs_dataset_mgmt ? 0x80 : 0) |
+                        (soft->oncs_write_zeroes ? 0x60 : 0);
+            buffer[6] = 0x02;  /* Provisioning Type: thin provisioned */
+            copy_len = 8;
         } else {
             /* Unsupported VPD page */
             cmn_err(CE_WARN, "nvme_scsi_inquiry: unsupported VPD page 0x%x", page_code);
@@ -266,17 +377,24 @@ nvme_scsi_inquiry(nvme_soft_t *soft, scsi_request_t *req)
 
 /*
  * nvme_scsi_read_capacity: Handle READ CAPACITY(10)
+ *
+ * Namespaces whose last LBA doesn't fit in 32 bits report 0xFFFFFFFF so the
+ * initiator switches to READ CAPACITY(16).
  */
 int
 nvme_scsi_read_capacity(nvme_soft_t *soft, scsi_request_t *req)
 {
+    nvme_ns_t *ns = NVME_REQ_NS(soft, req);
     uchar_t *buf;
     uint_t last_lba;
     uint_t block_size;
 
-    /* READ CAPACITY returns last LBA (not size) */
-    last_lba = (uint_t)(soft->num_blocks - 1);
-    block_size = soft->block_size;
+    /* READ CAPACITY returns last LBA (not size), in SCSI blocks */
+    if (NVME_HOST_BLOCKS(ns) - 1 > (__uint64_t)0xFFFFFFFF)
+        last_lba = 0xFFFFFFFF;
+    else
+        last_lba = (uint_t)(NVME_HOST_BLOCKS(ns) - 1);
+    block_size = NVME_HOST_BLOCK_SIZE(ns);
 
     if (req->sr_buflen < 8) {
         nvme_set_adapter_error(req);
@@ -302,12 +420,81 @@ nvme_scsi_read_capacity(nvme_soft_t *soft, scsi_request_t *req)
     return 0;
 }
 
+/*
+ * nvme_scsi_read_capacity_16: Handle SERVICE ACTION IN(16) / READ CAPACITY(16)
+ *
+ * Returns the full 64-bit last LBA, the logical block size, the
+ * physical block exponent derived from NPWG and LBPME when UNMAP is
+ * backed by Dataset Management.
+ */
+int
+nvme_scsi_read_capacity_16(nvme_soft_t *soft, scsi_request_t *req)
+{
+    nvme_ns_t *ns = NVME_REQ_NS(soft, req);
+    uchar_t *cdb = req->sr_command;
+    uchar_t data[32];
+    __uint64_t last_lba;
+    uint_t alloc_len;
+    uint_t copy_len;
+
+    if ((cdb[1] & 0x1F) != SCSI_SAI_READ_CAPACITY_16) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB, 0);
+        return -1;
+    }
+
+    alloc_len = ((uint_t)cdb[10] << 24) | ((uint_t)cdb[11] << 16) |
+                ((uint_t)cdb[12] << 8) | ((uint_t)cdb[13]);
+    copy_len = sizeof(data);
+    if (copy_len > alloc_len)
+        copy_len = alloc_len;
+    if (copy_len > req->sr_buflen)
+        copy_len = req->sr_buflen;
+
+    bzero(data, sizeof(data));
+    last_lba = NVME_HOST_BLOCKS(ns) - 1;
+
+    /* Bytes 0-7: Returned logical block address (last LBA) */
+    data[0] = (last_lba >> 56) & 0xFF;
+    data[1] = (last_lba >> 48) & 0xFF;
+    data[2] = (last_lba >> 40) & 0xFF;
+    data[3] = (last_lba >> 32) & 0xFF;
+    data[4] = (last_lba >> 24) & 0xFF;
+    data[5] = (last_lba >> 16) & 0xFF;
+    data[6] = (last_lba >> 8) & 0xFF;
+    data[7] = last_lba & 0xFF;
+
+    /* Bytes 8-11: Logical block length */
+    data[8] = (NVME_HOST_BLOCK_SIZE(ns) >> 24) & 0xFF;
+    data[9] = (NVME_HOST_BLOCK_SIZE(ns) >> 16) & 0xFF;
+    data[10] = (NVME_HOST_BLOCK_SIZE(ns) >> 8) & 0xFF;
+    data[11] = NVME_HOST_BLOCK_SIZE(ns) & 0xFF;
+
+    /* Byte 12: P_TYPE/PROT_EN = 0, no protection information */
+
+    /* Byte 13: Logical blocks per physical block exponent, an emulated
+     * 512-byte block is a fraction of a namespace block */
+    data[13] = (ns->phys_block_exp + ns->emul_shift) & 0x0F;
+
+    /* Bytes 14-15: LBPME (bit 7 of byte 14), LBPRZ=0, lowest aligned LBA = 0 */
+    if (soft->oncs_dataset_mgmt)
+        data[14] = 0x80;
+
+    if (copy_len > 0)
+        bcopy(data, req->sr_buffer, copy_len);
+
+    nvme_set_success(req);
+    req->sr_resid = req->sr_buflen - copy_len;
+
+    return 0;
+}
+
 /*
  * nvme_scsi_mode_sense: Handle MODE SENSE(6) command
  */
 int
 nvme_scsi_mode_sense(nvme_soft_t *soft, scsi_request_t *req)
 {
+    nvme_ns_t *ns = NVME_REQ_NS(soft, req);
     uchar_t *cdb = req->sr_command;
     uchar_t *buffer = (uchar_t *)req->sr_buffer;
     uchar_t pageCode;
@@ -351,11 +538,15 @@ nvme_scsi_mode_sense(nvme_soft_t *soft, scsi_request_t *req)
     blockDescLength = dbd ? 0 : 8;
     offset = headerSize;
 
-    blockSize = soft->block_size;
-    numBlocks = soft->num_blocks;
+    blockSize = NVME_HOST_BLOCK_SIZE(ns);
+    numBlocks = NVME_HOST_BLOCKS(ns);
 
-    /* Add block descriptor if not disabled */
-    if (!dbd && (offset + blockDescLength) <= req->sr_buflen) {
+    /* Add block descriptor if not disabled; none of its fields can be
+     * changed, so the changeable values leave it zeroed */
+    if (!dbd && (offset + blockDescLength) <= req->sr_buflen &&
+        pageControl == MODE_SENSE_CHANGEABLE_VALUES) {
+        offset += blockDescLength;
+    } else if (!dbd && (offset + blockDescLength) <= req->sr_buflen) {
         uchar_t *blockDesc = buffer + offset;
 
         /* Block descriptor format (8 bytes) */
@@ -383,17 +574,24 @@ nvme_scsi_mode_sense(nvme_soft_t *soft, scsi_request_t *req)
     }
 
     /* Add mode pages based on pageCode */
-    if (pageControl == MODE_SENSE_CHANGEABLE_VALUES) {
-        /* Return all zeros for changeable values (nothing is changeable) */
-        /* Header already zeroed, just set lengths */
-    } else if (pageCode == MODE_SENSE_RETURN_ALL || pageCode == MODE_PAGE_CACHING) {
+    if (pageCode == MODE_SENSE_RETURN_ALL || pageCode == MODE_PAGE_CACHING) {
         /* Page 08h: Caching Parameters Page */
-        if ((offset + 20) <= req->sr_buflen) {
+        if ((offset + 20) <= req->sr_buflen && pageControl == MODE_SENSE_CHANGEABLE_VALUES) {
+            uchar_t *cachePage = buffer + offset;
+
+            cachePage[0] = MODE_PAGE_CACHING;  /* Page code */
+            cachePage[1] = MODE_CACHING_PAGE_LEN;  /* Page length (n-1, total 20 bytes) */
+            /* Only WCE can be changed, and only when there is a volatile write cache */
+            cachePage[2] = soft->vwc_present ? MODE_CACHING_WCE : 0x00;
+
+            offset += 20;
+        } else if ((offset + 20) <= req->sr_buflen) {
             uchar_t *cachePage = buffer + offset;
 
             cachePage[0] = MODE_PAGE_CACHING;  /* Page code */
-            cachePage[1] = 18;  /* Page length (n-1, total 20 bytes) */
-            cachePage[2] = 0x04;  /* WCE=1 (write cache enabled), RCD=0 */
+            cachePage[1] = MODE_CACHING_PAGE_LEN;  /* Page length (n-1, total 20 bytes) */
+            /* WCE follows the NVMe Volatile Write Cache feature, RCD=0 */
+            cachePage[2] = soft->vwc_enabled ? MODE_CACHING_WCE : 0x00;
             cachePage[3] = 0x00;  /* Read/write retention priority */
             cachePage[4] = 0x00;  /* Disable pre-fetch transfer length */
             cachePage[5] = 0x00;
@@ -434,7 +632,9 @@ nvme_scsi_mode_sense(nvme_soft_t *soft, scsi_request_t *req)
     /* Fill in MODE SENSE(6) header */
     buffer[0] = (uchar_t)(totalLength - 1);  /* Mode data length (excludes length field) */
     buffer[1] = 0x00;  /* Medium type (0 = default) */
-    buffer[2] = 0x00;  /* Device-specific parameter */
+    /* Device-specific parameter: DPOFUA=1, FUA in READ/WRITE(10/16) is passed
+     * through to NVMe so upper layers can avoid whole-cache SYNC CACHE */
+    buffer[2] = MODE_DSP_DPOFUA;
     buffer[3] = (uchar_t)blockDescLength;
 
     /* Set residual */
@@ -448,12 +648,301 @@ nvme_scsi_mode_sense(nvme_soft_t *soft, scsi_request_t *req)
     return 0;
 }
 
+/*
+ * nvme_scsi_mode_select: Handle MODE SELECT(6/10)
+ *
+ * The only changeable field is WCE in the caching page, which is applied
+ * with Set Features Volatile Write Cache; the request then completes from
+ * the admin completion in nvme_scsi_mode_select_done(). Other caching page
+ * fields and the control page are accepted and ignored, as is a block
+ * descriptor restating the current block length. Saved pages (SP) are not
+ * supported. Always completes the request.
+ */
+void
+nvme_scsi_mode_select(nvme_soft_t *soft, scsi_request_t *req)
+{
+    nvme_ns_t *ns = NVME_REQ_NS(soft, req);
+    uchar_t *cdb = req->sr_command;
+    uchar_t *data = (uchar_t *)req->sr_buffer;
+    uchar_t *page;
+    uint_t param_len;
+    uint_t header_len;
+    uint_t bd_len;
+    uint_t offset;
+    uint_t block_len;
+    int wce = -1;
+
+    nvme_set_success(req);
+
+    if (cdb[0] == SCSIOP_MODE_SELECT_10) {
+        param_len = ((uint_t)cdb[7] << 8) | cdb[8];
+        header_len = 8;
+    } else {
+        param_len = cdb[4];
+        header_len = 4;
+    }
+
+    if (!(cdb[1] & MODE_SELECT_PF) || (cdb[1] & MODE_SELECT_SP)) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB, 0);
+        goto done;
+    }
+    if (param_len == 0)
+        goto done;
+    if (data == NULL || param_len > req->sr_buflen) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB, 0);
+        goto done;
+    }
+    if (param_len < header_len)
+        goto bad_param;
+
+    bd_len = (header_len == 8) ? (((uint_t)data[6] << 8) | data[7]) : data[3];
+    offset = header_len;
+    if (bd_len > param_len - offset)
+        goto bad_param;
+
+    /* A block descriptor may only restate the current block length */
+    if (bd_len >= 8) {
+        block_len = ((uint_t)data[offset + 5] << 16) | ((uint_t)data[offset + 6] << 8) |
+                    data[offset + 7];
+        if (block_len != 0 && block_len != NVME_HOST_BLOCK_SIZE(ns))
+            goto bad_param;
+    }
+    offset += bd_len;
+
+    while (offset + 2 <= param_len) {
+        page = data + offset;
+        /* No subpages, and the page has to fit in the list */
+        if ((page[0] & 0x40) || page[1] + 2 > param_len - offset)
+            goto bad_param;
+
+        switch (page[0] & 0x3F) {
+        case MODE_PAGE_CACHING:
+            if (page[1] != MODE_CACHING_PAGE_LEN)
+                goto bad_param;
+            wce = (page[2] & MODE_CACHING_WCE) ? 1 : 0;
+            break;
+        case MODE_PAGE_CONTROL:
+            break;
+        default:
+            goto bad_param;
+        }
+        offset += page[1] + 2;
+    }
+
+    if (wce < 0 || wce == soft->vwc_enabled)
+        goto done;
+    if (!soft->vwc_present)
+        goto bad_param;
+
+    /* One Set Features VWC at a time, its request waits in soft->vwc_req */
+    if (atomicAddInt((int *)&soft->vwc_busy, 1) != 1) {
+        atomicAddInt((int *)&soft->vwc_busy, -1);
+        nvme_set_busy(soft, req);
+        goto done;
+    }
+    soft->vwc_req = req;
+    soft->vwc_wanted = wce;
+    if (!nvme_admin_set_vwc(soft, wce)) {
+        soft->vwc_req = NULL;
+        atomicAddInt((int *)&soft->vwc_busy, -1);
+        nvme_set_busy(soft, req);
+        goto done;
+    }
+    return;  /* Completed by nvme_scsi_mode_select_done() */
+
+bad_param:
+    nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_PARAMETER, 0);
+done:
+    nvme_complete_request(soft, req);
+}
+
+/*
+ * nvme_scsi_mode_select_done: Finish the MODE SELECT waiting on Set Features VWC
+ *
+ * Called from the admin completion handler.
+ *
+ * Arguments:
+ *   soft - Controller soft state
+ *   ok   - 1 if the controller took the new setting, 0 if it failed it
+ */
+void
+nvme_scsi_mode_select_done(nvme_soft_t *soft, int ok)
+{
+    scsi_request_t *req = soft->vwc_req;
+
+    if (req == NULL)
+        return;
+    soft->vwc_req = NULL;
+
+    if (ok) {
+        soft->vwc_enabled = soft->vwc_wanted;
+        cmn_err(CE_NOTE, "nvme: volatile write cache %s",
+                soft->vwc_enabled ? "enabled" : "disabled");
+    } else {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_PARAMETER, 0);
+    }
+    atomicAddInt((int *)&soft->vwc_busy, -1);
+
+    nvme_complete_request(soft, req);
+}
+
+/*
+ * nvme_log_param: Append one parameter to a LOG SENSE page
+ *
+ * Parameters below the CDB's parameter pointer are left out. The value is
+ * stored big-endian in len bytes, zero-filled above its low 8 bytes.
+ *
+ * Returns:
+ *   Offset just past the parameter
+ */
+static uint_t
+nvme_log_param(uchar_t *page, uint_t offset, uint_t ptr, uint_t code,
+               uchar_t control, uint_t len, __uint64_t value)
+{
+    uint_t i;
+    uint_t shift;
+
+    if (code < ptr)
+        return offset;
+
+    page[offset] = (code >> 8) & 0xFF;
+    page[offset + 1] = code & 0xFF;
+    page[offset + 2] = control;
+    page[offset + 3] = len;
+    for (i = 0; i < len; i++) {
+        shift = len - 1 - i;
+        page[offset + 4 + i] = (shift < 8) ? (uchar_t)(value >> (8 * shift)) : 0;
+    }
+    return offset + 4 + len;
+}
+
+/*
+ * nvme_scsi_log_sense: Handle LOG SENSE from the SMART / Health cache
+ *
+ * Pages served: Supported Pages (00h), Read Error Counter (03h, total
+ * uncorrected errors = Media and Data Integrity Errors), Temperature (0Dh),
+ * Self-Test Results (10h, always empty, no self-test log is read),
+ * Solid State Media (11h, percentage used) and Informational Exceptions
+ * (2Fh). The data comes from soft->smart, never from the admin queue, so a
+ * poll costs no device round trip; it is at most NVME_SMART_REFRESH_MS old.
+ * Only cumulative values exist, so the page control field is ignored.
+ */
+int
+nvme_scsi_log_sense(nvme_soft_t *soft, scsi_request_t *req)
+{
+    uchar_t *cdb = req->sr_command;
+    uchar_t page[4 + 20 * 20];          /* Largest page: 20 self-test results */
+    uchar_t page_code = cdb[2] & 0x3F;
+    uint_t ptr = ((uint_t)cdb[5] << 8) | cdb[6];
+    uint_t alloc_len = ((uint_t)cdb[7] << 8) | cdb[8];
+    uint_t offset = 4;
+    uint_t copy_len;
+    nvme_smart_t smart;
+    int temp;
+    uint_t i;
+
+    /* No parameter changes (PPC) or saving (SP), no subpages */
+    if ((cdb[1] & 0x03) || cdb[3] != 0) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB, 0);
+        return -1;
+    }
+
+    mutex_lock(&soft->smart_lock, PZERO);
+    smart = soft->smart;
+    mutex_unlock(&soft->smart_lock);
+
+    if (!smart.valid && page_code != LOG_PAGE_SUPPORTED && page_code != LOG_PAGE_SELF_TEST) {
+        /* The first SMART read has not completed */
+        nvme_scsi_set_error(req, SCSI_SENSE_NOT_READY, SCSI_ADSENSE_LUN_NOT_READY, 0x00);
+        return -1;
+    }
+
+    bzero(page, sizeof(page));
+    switch (page_code) {
+    case LOG_PAGE_SUPPORTED:
+        page[offset++] = LOG_PAGE_SUPPORTED;
+        page[offset++] = LOG_PAGE_READ_ERRORS;
+        page[offset++] = LOG_PAGE_TEMPERATURE;
+        page[offset++] = LOG_PAGE_SELF_TEST;
+        page[offset++] = LOG_PAGE_SOLID_STATE_MEDIA;
+        page[offset++] = LOG_PAGE_INFO_EXCEPTIONS;
+        break;
+
+    case LOG_PAGE_READ_ERRORS:
+        /* 0006h: Total uncorrected errors (NVMe does not split reads and writes) */
+        offset = nvme_log_param(page, offset, ptr, 0x0006, 0x02, 8, smart.media_errors);
+        break;
+
+    case LOG_PAGE_TEMPERATURE:
+        /* Degrees Celsius, 0xFF when unknown */
+        temp = smart.temperature ? (int)smart.temperature - 273 : 0xFF;
+        if (temp < 0)
+            temp = 0;
+        offset = nvme_log_param(page, offset, ptr, 0x0000, 0x03, 2, (uchar_t)temp);
+        /* 0001h: Reference temperature from the warning threshold (WCTEMP) */
+        temp = soft->wctemp ? (int)soft->wctemp - 273 : 0xFF;
+        if (temp < 0)
+            temp = 0;
+        offset = nvme_log_param(page, offset, ptr, 0x0001, 0x03, 2, (uchar_t)temp);
+        break;
+
+    case LOG_PAGE_SELF_TEST:
+        /* 0001h-0014h: unused result entries */
+        for (i = 1; i <= 20; i++)
+            offset = nvme_log_param(page, offset, ptr, i, 0x03, 0x10, 0);
+        break;
+
+    case LOG_PAGE_SOLID_STATE_MEDIA:
+        /* 0001h: Percentage used endurance indicator */
+        offset = nvme_log_param(page, offset, ptr, 0x0001, 0x03, 4,
+                                smart.percent_used);
+        break;
+
+    case LOG_PAGE_INFO_EXCEPTIONS:
+        /* 0000h: IE ASC, IE ASCQ, most recent temperature */
+        temp = smart.temperature ? (int)smart.temperature - 273 : 0xFF;
+        if (temp < 0)
+            temp = 0;
+        if (smart.crit_warning) {
+            /* HARDWARE IMPENDING FAILURE GENERAL HARD DRIVE FAILURE */
+            i = (0x5D << 16) | (0x10 << 8);
+        } else if (smart.percent_used >= 100) {
+            /* MEDIA IMPENDING FAILURE ENDURANCE LIMIT MET */
+            i = (0x5D << 16) | (0x73 << 8);
+        } else {
+            i = 0;
+        }
+        offset = nvme_log_param(page, offset, ptr, 0x0000, 0x03, 3, i | (uchar_t)temp);
+        break;
+
+    default:
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB, 0);
+        return -1;
+    }
+
+    page[0] = page_code;
+    page[2] = ((offset - 4) >> 8) & 0xFF;
+    page[3] = (offset - 4) & 0xFF;
+
+    copy_len = offset;
+    if (copy_len > alloc_len)
+        copy_len = alloc_len;
+    if (copy_len > req->sr_buflen)
+        copy_len = req->sr_buflen;
+    bcopy(page, req->sr_buffer, copy_len);
+
+    nvme_set_success(req);
+    req->sr_resid = req->sr_buflen - copy_len;
+    return 0;
+}
+
 /*
  * nvme_scsi_sync_cache: Handle SYNC CACHE command
  */
 int
 nvme_scsi_sync_cache(nvme_soft_t *soft, scsi_request_t *req)
 {
+    nvme_ns_t *ns = NVME_REQ_NS(soft, req);
     nvme_cmd_info_t *cmd_info;
     nvme_command_t cmd;
     unsigned int cid;
@@ -464,7 +953,7 @@ nvme_scsi_sync_cache(nvme_soft_t *soft, scsi_request_t *req)
 #ifdef NVME_DBG
         cmn_err(CE_WARN, "nvme_scsi_sync_cache: no free CID available");
 #endif
-        nvme_set_adapter_status(req, SC_REQUEST, ST_BUSY);
+        nvme_set_busy(soft, req);
         return -1;
     }
 
@@ -474,8 +963,8 @@ nvme_scsi_sync_cache(nvme_soft_t *soft, scsi_request_t *req)
     /* CDW0: Opcode (7:0), Flags (15:8), CID (31:16) */
     cmd.cdw0 = NVME_CMD_FLUSH | (cid << 16);
 
-    /* Set namespace ID to 1 (we always use namespace 1) */
-    cmd.nsid = 1;
+    /* Flush the namespace behind this LUN */
+    cmd.nsid = ns->nsid;
 
     /* Submit the command to the I/O queue */
     rc = nvme_submit_cmd(soft, &soft->io_queue, &cmd);
@@ -484,12 +973,388 @@ nvme_scsi_sync_cache(nvme_soft_t *soft, scsi_request_t *req)
         cmn_err(CE_WARN, "nvme_scsi_sync_cache: failed to submit flush command");
 #endif
         nvme_io_cid_done(soft, cid, NULL);
-        nvme_set_adapter_status(req, SC_REQUEST, ST_BUSY);
+        nvme_set_busy(soft, req);
         return -1;
     }
 
-    /* Command submitted successfully - completion will be handled by interrupt */
-    return 0;
+    /* Command submitted successfully - completion will be handled by interrupt */
+    return 0;
+}
+
+/*
+ * nvme_scsi_unmap: Handle UNMAP by translating to NVMe Dataset Management
+ *
+ * The parameter list is parsed directly from sr_buffer. Non-empty block
+ * descriptors are packed into DSM deallocate commands of up to
+ * NVME_DSM_MAX_RANGES ranges each; every DSM command gets its own CID and
+ * the request is completed when the last one completes (refcount in sr_ha,
+ * same scheme as nvme_scsi_read_write). Always completes the request.
+ */
+void
+nvme_scsi_unmap(nvme_soft_t *soft, scsi_request_t *req)
+{
+    nvme_ns_t *ns = NVME_REQ_NS(soft, req);
+    uchar_t *cdb = req->sr_command;
+    uchar_t *param = (uchar_t *)req->sr_buffer;
+    uchar_t *desc;
+    unsigned int cids[NVME_UNMAP_MAX_COMMANDS];
+    nvme_command_t cmd;
+    uint_t param_len;
+    uint_t desc_len;
+    uint_t num_desc;
+    uint_t num_ranges = 0;
+    uint_t commands;
+    uint_t consumed;
+    uint_t cidx = 0;
+    uint_t i;
+    int rc;
+
+    /* Initialize refcount to 1 (will be incremented by nvme_io_cid_alloc) */
+    *(volatile int *)&(req->sr_ha) = 1;
+    nvme_set_success(req);
+
+    if (!soft->oncs_dataset_mgmt) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_COMMAND, 0);
+        goto done;
+    }
+
+    /* CDB bytes 7-8: parameter list length, 0 means nothing to do */
+    param_len = ((uint_t)cdb[7] << 8) | cdb[8];
+    if (param_len == 0)
+        goto done;
+
+    if (param_len < 8 || param == NULL || req->sr_buflen < param_len) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB, 0);
+        goto done;
+    }
+
+    /* Parameter list header: bytes 2-3 = block descriptor data length */
+    desc_len = ((uint_t)param[2] << 8) | param[3];
+    if (desc_len > param_len - 8)
+        desc_len = param_len - 8;
+    num_desc = desc_len / NVME_UNMAP_DESC_SIZE;
+    desc = param + 8;
+
+    if (num_desc > NVME_UNMAP_MAX_DESCRIPTORS) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_PARAMETER, 0);
+        goto done;
+    }
+
+    /* Validate every descriptor before touching the device */
+    for (i = 0; i < num_desc; i++) {
+        uchar_t *d = desc + i * NVME_UNMAP_DESC_SIZE;
+        __uint64_t lba;
+        uint_t nlb;
+
+        lba = ((__uint64_t)d[0] << 56) | ((__uint64_t)d[1] << 48) |
+              ((__uint64_t)d[2] << 40) | ((__uint64_t)d[3] << 32) |
+              ((__uint64_t)d[4] << 24) | ((__uint64_t)d[5] << 16) |
+              ((__uint64_t)d[6] << 8)  | ((__uint64_t)d[7]);
+        nlb = ((uint_t)d[8] << 24) | ((uint_t)d[9] << 16) |
+              ((uint_t)d[10] << 8) | ((uint_t)d[11]);
+        if (nlb == 0)
+            continue;
+        if (lba >= NVME_HOST_BLOCKS(ns) || nlb > NVME_HOST_BLOCKS(ns) - lba) {
+            nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_LBA_OUT_OF_RANGE, 0);
+            goto done;
+        }
+        /* UNMAP is advisory, ranges holding no whole namespace block are dropped */
+        if (ns->emul_shift &&
+            ((lba + nlb) >> ns->emul_shift) <=
+            ((lba + (1u << ns->emul_shift) - 1) >> ns->emul_shift))
+            continue;
+        num_ranges++;
+    }
+
+    if (num_ranges == 0)
+        goto done;
+
+    commands = (num_ranges + NVME_DSM_MAX_RANGES - 1) / NVME_DSM_MAX_RANGES;
+
+    if (nvme_io_cid_alloc(soft, req, commands, cids) != 0) {
+#ifdef NVME_DBG
+        cmn_err(CE_WARN, "nvme_scsi_unmap: no free CIDs available (requested %u)", commands);
+#endif
+        nvme_set_busy(soft, req);
+        goto done;
+    }
+
+    for (cidx = 0; cidx < commands; cidx++) {
+        rc = nvme_io_build_dsm_command(soft, ns, cids[cidx], desc, num_desc, &consumed, &cmd);
+        if (rc <= 0) {
+            if (rc == 0)
+                nvme_set_adapter_error(req);
+            else
+                nvme_set_busy(soft, req);
+            break;
+        }
+        desc += consumed * NVME_UNMAP_DESC_SIZE;
+        num_desc -= consumed;
+
+        if (nvme_submit_cmd(soft, &soft->io_queue, &cmd) != 0) {
+#ifdef NVME_DBG
+            cmn_err(CE_WARN, "nvme_scsi_unmap: failed to submit DSM command %u", cidx);
+#endif
+            nvme_set_busy(soft, req);
+            break;
+        }
+    }
+
+    /* Release CIDs that were never submitted */
+    for (i = cidx; i < commands; i++) {
+        nvme_io_cid_done(soft, cids[i], NULL);
+    }
+
+done:
+    /* Drop the initial reference, complete now if all DSM commands already finished */
+    if (atomicAddInt((int *)&req->sr_ha, -1) == 0) {
+        nvme_complete_request(soft, req);
+    }
+}
+
+/*
+ * nvme_scsi_write_same: Handle WRITE SAME(10/16) via NVMe Write Zeroes
+ *
+ * Only the all-zero pattern is supported: the single block of payload must be
+ * zero, or NDOB (WRITE SAME(16) only) must be set. The UNMAP bit is passed on
+ * as the Write Zeroes deallocate hint. No host data is transferred to the
+ * device. The range is split into Write Zeroes commands of at most
+ * ns->write_zeroes_max_blocks blocks, each with its own CID. Always
+ * completes the request.
+ */
+void
+nvme_scsi_write_same(nvme_soft_t *soft, scsi_request_t *req)
+{
+    nvme_ns_t *ns = NVME_REQ_NS(soft, req);
+    uchar_t *cdb = req->sr_command;
+    uchar_t *payload = (uchar_t *)req->sr_buffer;
+    unsigned int cids[NVME_WRITE_SAME_MAX_COMMANDS];
+    nvme_command_t cmd;
+    __uint64_t lba;
+    uint_t num_blocks;
+    uint_t chunk;
+    uint_t flags = 0;
+    uint_t commands;
+    uint_t cidx = 0;
+    uint_t i;
+    int ndob = 0;
+
+    /* Initialize refcount to 1 (will be incremented by nvme_io_cid_alloc) */
+    *(volatile int *)&(req->sr_ha) = 1;
+    nvme_set_success(req);
+
+    if (!soft->oncs_write_zeroes) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_COMMAND, 0);
+        goto done;
+    }
+
+    if (cdb[0] == SCSIOP_WRITE_SAME_16) {
+        lba = ((__uint64_t)cdb[2] << 56) | ((__uint64_t)cdb[3] << 48) |
+              ((__uint64_t)cdb[4] << 40) | ((__uint64_t)cdb[5] << 32) |
+              ((__uint64_t)cdb[6] << 24) | ((__uint64_t)cdb[7] << 16) |
+              ((__uint64_t)cdb[8] << 8)  | ((__uint64_t)cdb[9]);
+        num_blocks = ((uint_t)cdb[10] << 24) | ((uint_t)cdb[11] << 16) |
+                     ((uint_t)cdb[12] << 8) | ((uint_t)cdb[13]);
+        ndob = cdb[1] & 0x01;  /* No Data-Out Buffer */
+    } else {
+        lba = ((__uint64_t)cdb[2] << 24) | ((__uint64_t)cdb[3] << 16) |
+              ((__uint64_t)cdb[4] << 8)  | ((__uint64_t)cdb[5]);
+        num_blocks = ((uint_t)cdb[7] << 8) | ((uint_t)cdb[8]);
+    }
+
+    if (cdb[1] & 0x08)  /* UNMAP bit */
+        flags |= NF_DEALLOC;
+
+    /* WSNZ=1 is reported in the Block Limits page, so 0 blocks is invalid */
+    if (num_blocks == 0 || num_blocks > NVME_WRITE_SAME_MAX_BLOCKS) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB, 0);
+        goto done;
+    }
+    if (lba >= NVME_HOST_BLOCKS(ns) || num_blocks > NVME_HOST_BLOCKS(ns) - lba) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_LBA_OUT_OF_RANGE, 0);
+        goto done;
+    }
+
+    /* Only a zero pattern can be expressed as Write Zeroes */
+    if (!ndob) {
+        if (payload == NULL || req->sr_buflen < NVME_HOST_BLOCK_SIZE(ns)) {
+            nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB, 0);
+            goto done;
+        }
+        for (i = 0; i < NVME_HOST_BLOCK_SIZE(ns); i++) {
+            if (payload[i] != 0)
+                break;
+        }
+        if (i != NVME_HOST_BLOCK_SIZE(ns)) {
+#ifdef NVME_DBG
+            cmn_err(CE_NOTE, "nvme_scsi_write_same: non-zero pattern not supported");
+#endif
+            nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB, 0);
+            goto done;
+        }
+    }
+
+    /* 512-byte emulation: Write Zeroes covers whole namespace blocks only */
+    if (ns->emul_shift) {
+        if ((lba | num_blocks) & ((1u << ns->emul_shift) - 1)) {
+            nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB, 0);
+            goto done;
+        }
+        lba >>= ns->emul_shift;
+        num_blocks >>= ns->emul_shift;
+    }
+
+    commands = (num_blocks + ns->write_zeroes_max_blocks - 1) / ns->write_zeroes_max_blocks;
+    if (commands > NVME_WRITE_SAME_MAX_COMMANDS) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB, 0);
+        goto done;
+    }
+
+    if (nvme_io_cid_alloc(soft, req, commands, cids) != 0) {
+#ifdef NVME_DBG
+        cmn_err(CE_WARN, "nvme_scsi_write_same: no free CIDs available (requested %u)", commands);
+#endif
+        nvme_set_busy(soft, req);
+        goto done;
+    }
+
+    for (cidx = 0; cidx < commands; cidx++) {
+        chunk = (num_blocks > ns->write_zeroes_max_blocks) ? ns->write_zeroes_max_blocks : num_blocks;
+
+        nvme_io_build_write_zeroes_command(soft, ns, cids[cidx], lba, chunk, flags, &cmd);
+        if (nvme_submit_cmd(soft, &soft->io_queue, &cmd) != 0) {
+#ifdef NVME_DBG
+            cmn_err(CE_WARN, "nvme_scsi_write_same: failed to submit Write Zeroes %u", cidx);
+#endif
+            nvme_set_busy(soft, req);
+            break;
+        }
+        lba += chunk;
+        num_blocks -= chunk;
+    }
+
+    /* Release CIDs that were never submitted */
+    for (i = cidx; i < commands; i++) {
+        nvme_io_cid_done(soft, cids[i], NULL);
+    }
+
+done:
+    /* Drop the initial reference, complete now if all commands already finished */
+    if (atomicAddInt((int *)&req->sr_ha, -1) == 0) {
+        nvme_complete_request(soft, req);
+    }
+}
+
+/*
+ * nvme_scsi_verify: Handle VERIFY(10/16) via NVMe Verify
+ *
+ * Only BYTCHK=0 (medium verification, no data-out) is supported. The range is
+ * split into NVMe Verify commands of at most ns->verify_max_blocks (the
+ * 16-bit NLB limit, or the controller's VSL), each with its own CID, so the
+ * controller does the reads and no data crosses the bus. A verification
+ * length of zero is a successful no-op. Always completes the request.
+ */
+void
+nvme_scsi_verify(nvme_soft_t *soft, scsi_request_t *req)
+{
+    nvme_ns_t *ns = NVME_REQ_NS(soft, req);
+    uchar_t *cdb = req->sr_command;
+    unsigned int cids[NVME_VERIFY_MAX_COMMANDS];
+    nvme_command_t cmd;
+    __uint64_t lba;
+    uint_t num_blocks;
+    uint_t max_blocks;
+    uint_t chunk;
+    uint_t commands;
+    uint_t cidx = 0;
+    uint_t i;
+
+    /* Initialize refcount to 1 (will be incremented by nvme_io_cid_alloc) */
+    *(volatile int *)&(req->sr_ha) = 1;
+    nvme_set_success(req);
+
+    if (!soft->oncs_verify) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_COMMAND, 0);
+        goto done;
+    }
+
+    if (cdb[0] == SCSIOP_VERIFY_16) {
+        lba = ((__uint64_t)cdb[2] << 56) | ((__uint64_t)cdb[3] << 48) |
+              ((__uint64_t)cdb[4] << 40) | ((__uint64_t)cdb[5] << 32) |
+              ((__uint64_t)cdb[6] << 24) | ((__uint64_t)cdb[7] << 16) |
+              ((__uint64_t)cdb[8] << 8)  | ((__uint64_t)cdb[9]);
+        num_blocks = ((uint_t)cdb[10] << 24) | ((uint_t)cdb[11] << 16) |
+                     ((uint_t)cdb[12] << 8) | ((uint_t)cdb[13]);
+    } else {
+        lba = ((__uint64_t)cdb[2] << 24) | ((__uint64_t)cdb[3] << 16) |
+              ((__uint64_t)cdb[4] << 8)  | ((__uint64_t)cdb[5]);
+        num_blocks = ((uint_t)cdb[7] << 8) | ((uint_t)cdb[8]);
+    }
+
+    /* BYTCHK (bits 2:1) asks for a compare against data-out, NVMe Verify can't do that */
+    if (cdb[1] & 0x06) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB, 0);
+        goto done;
+    }
+
+    if (num_blocks == 0)
+        goto done;
+
+    if (lba >= NVME_HOST_BLOCKS(ns) || num_blocks > NVME_HOST_BLOCKS(ns) - lba) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_LBA_OUT_OF_RANGE, 0);
+        goto done;
+    }
+
+    /* 512-byte emulation: verify every namespace block the range touches */
+    if (ns->emul_shift) {
+        __uint64_t end = (lba + num_blocks + (1u << ns->emul_shift) - 1) >> ns->emul_shift;
+
+        lba >>= ns->emul_shift;
+        num_blocks = (uint_t)(end - lba);
+    }
+
+    /* No data moves, only NLB and VSL limit a command */
+    max_blocks = ns->verify_max_blocks;
+
+    commands = (num_blocks + max_blocks - 1) / max_blocks;
+    if (commands > NVME_VERIFY_MAX_COMMANDS) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB, 0);
+        goto done;
+    }
+
+    if (nvme_io_cid_alloc(soft, req, commands, cids) != 0) {
+#ifdef NVME_DBG
+        cmn_err(CE_WARN, "nvme_scsi_verify: no free CIDs available (requested %u)", commands);
+#endif
+        nvme_set_busy(soft, req);
+        goto done;
+    }
+
+    for (cidx = 0; cidx < commands; cidx++) {
+        chunk = (num_blocks > max_blocks) ? max_blocks : num_blocks;
+
+        nvme_io_build_verify_command(soft, ns, cids[cidx], lba, chunk, &cmd);
+        if (nvme_submit_cmd(soft, &soft->io_queue, &cmd) != 0) {
+#ifdef NVME_DBG
+            cmn_err(CE_WARN, "nvme_scsi_verify: failed to submit Verify %u", cidx);
+#endif
+            nvme_set_busy(soft, req);
+            break;
+        }
+        lba += chunk;
+        num_blocks -= chunk;
+    }
+
+    /* Release CIDs that were never submitted */
+    for (i = cidx; i < commands; i++) {
+        nvme_io_cid_done(soft, cids[i], NULL);
+    }
+
+done:
+    /* Drop the initial reference, complete now if all Verify commands already finished */
+    if (atomicAddInt((int *)&req->sr_ha, -1) == 0) {
+        nvme_complete_request(soft, req);
+    }
 }
 
 int
@@ -523,7 +1388,7 @@ nvme_parse_rw(nvme_soft_t *soft, nvme_rwcmd_state_t *ps)
     case SCSIOP_WRITE_10:
         /* READ(10)/WRITE(10) format:
          * Byte 0: Opcode
-         * Byte 1: Flags
+         * Byte 1: Flags (bit 3 = FUA)
          * Byte 2: LBA bits 31-24
          * Byte 3: LBA bits 23-16
          * Byte 4: LBA bits 15-8
@@ -540,13 +1405,15 @@ nvme_parse_rw(nvme_soft_t *soft, nvme_rwcmd_state_t *ps)
         ps->num_blocks = ((uint_t)cdb[7] << 8) | ((uint_t)cdb[8]);
         if (cdb[0] == SCSIOP_WRITE_10)
             ps->flags |= NF_WRITE;
+        if (cdb[1] & 0x08)  /* FUA bit */
+            ps->flags |= NF_FUA;
         break;
 
     case SCSIOP_READ_16:
     case SCSIOP_WRITE_16:
         /* READ(16)/WRITE(16) format:
          * Byte 0: Opcode
-         * Byte 1: Flags
+         * Byte 1: Flags (bit 3 = FUA)
          * Byte 2: LBA bits 63-56
          * Byte 3: LBA bits 55-48
          * Byte 4: LBA bits 47-40
@@ -576,6 +1443,8 @@ nvme_parse_rw(nvme_soft_t *soft, nvme_rwcmd_state_t *ps)
                          ((uint_t)cdb[13]);
         if (cdb[0] == SCSIOP_WRITE_16)
             ps->flags |= NF_WRITE;
+        if (cdb[1] & 0x08)  /* FUA bit */
+            ps->flags |= NF_FUA;
         break;
 
     default:
@@ -590,12 +1459,17 @@ nvme_parse_rw(nvme_soft_t *soft, nvme_rwcmd_state_t *ps)
 
 /*
  * nvme_scsi_read_write: Handle READ/WRITE commands
+ *
+ * LBA and length come from the CDB in SCSI logical blocks. With 512-byte
+ * emulation active these are converted to namespace blocks when aligned;
+ * anything else goes to the read-modify-write engine in nvme_emul.c.
+ * Always completes the request.
  */
 void
 nvme_scsi_read_write(nvme_soft_t *soft, scsi_request_t *req)
 {
+    nvme_ns_t *ns = NVME_REQ_NS(soft, req);
     nvme_rwcmd_state_t s;
-    int rc;
 
     /* Reject zero-length transfers */
     if (req->sr_buflen == 0) {
@@ -603,35 +1477,80 @@ nvme_scsi_read_write(nvme_soft_t *soft, scsi_request_t *req)
         cmn_err(CE_WARN, "nvme_scsi_read_write: zero-length transfer rejected");
 #endif
         nvme_set_success(req);
-        nvme_complete_request(req);
+        nvme_complete_request(soft, req);
         return;
     }
 
-    /* Initialize refcount atomically to 1 (will be incremented by nvme_io_cid_alloc) */
-    *(volatile int *)&(req->sr_ha) = 1;
-
-    /* Initialize SCSI status to success (errors will override this) */
-    nvme_set_success(req);
-
     s.req = req;
+    s.ns = ns;
     s.buflen = req->sr_buflen;
     s.flags = 0;
-    s.max_transfer_blocks = soft->max_transfer_blocks;
     if (!nvme_parse_rw(soft, &s)) {
         nvme_set_adapter_error(req);
-        goto error;
+        nvme_complete_request(soft, req);
+        return;
+    }
+
+    /* Reject ranges past the end of the namespace (64-bit LBA, no wrap) */
+    if (s.lba >= NVME_HOST_BLOCKS(ns) || s.num_blocks > NVME_HOST_BLOCKS(ns) - s.lba) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_LBA_OUT_OF_RANGE, 0);
+        nvme_complete_request(soft, req);
+        return;
+    }
+
+    /* Commands are built from the CDB's block count, the buffer must hold it all */
+    if (((__uint64_t)s.num_blocks << (ns->lba_shift - ns->emul_shift)) > req->sr_buflen) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB, 0);
+        nvme_complete_request(soft, req);
+        return;
+    }
+
+    if (ns->emul_shift) {
+        if (nvme_emul_divert(soft, &s)) {
+            nvme_emul_queue(soft, &s);
+            return;
+        }
+        s.lba >>= ns->emul_shift;
+        s.num_blocks >>= ns->emul_shift;
     }
 
+    nvme_scsi_rw_start(soft, &s);
+}
+
+/*
+ * nvme_scsi_rw_start: Issue the NVMe commands for a parsed read/write
+ *
+ * Arguments:
+ *   soft - Controller soft state
+ *   ps   - Request with lba, num_blocks, buflen and flags in namespace blocks
+ *
+ * The request completes through the usual sr_ha reference count, whether
+ * the commands are submitted or fail here.
+ */
+void
+nvme_scsi_rw_start(nvme_soft_t *soft, nvme_rwcmd_state_t *ps)
+{
+    scsi_request_t *req = ps->req;
+    int rc;
+
+    /* Initialize refcount atomically to 1 (will be incremented by nvme_io_cid_alloc) */
+    *(volatile int *)&(req->sr_ha) = 1;
+
+    /* Initialize SCSI status to success (errors will override this) */
+    nvme_set_success(req);
+
+    ps->max_transfer_blocks = ps->ns->max_transfer_blocks;
+
     /* Check if this is a retry of an aborted command */
-    if (nvme_aborted_fifo_find_and_remove(soft, &s)) {
-        s.flags |= NF_RETRY;
-        s.max_transfer_blocks = 1;
-        cmn_err(CE_WARN, "nvme_scsi_read_write: RETRY DETECTED buflen=%u buffer=%p bp=%p sr_flags=0x%x nf_flags=0x%x",
-                req->sr_buflen, req->sr_buffer, req->sr_bp, req->sr_flags, s.flags);
+    if (nvme_aborted_fifo_find_and_remove(soft, ps)) {
+        ps->flags |= NF_RETRY;
+        ps->max_transfer_blocks = 1;
+        cmn_err(CE_WARN, "nvme_scsi_rw_start: RETRY DETECTED buflen=%u buffer=%p bp=%p sr_flags=0x%x nf_flags=0x%x",
+                req->sr_buflen, req->sr_buffer, req->sr_bp, req->sr_flags, ps->flags);
     }
 
 #ifdef NVME_DBG
-    cmn_err(CE_NOTE, "nvme_scsi_read_write: ENTRY buflen=%d buffer=%p flags=0x%x tag=%d",
+    cmn_err(CE_NOTE, "nvme_scsi_rw_start: ENTRY buflen=%d buffer=%p flags=0x%x tag=%d",
             req->sr_buflen, req->sr_buffer, req->sr_flags, req->sr_tag);
 #endif
 
@@ -642,71 +1561,76 @@ nvme_scsi_read_write(nvme_soft_t *soft, scsi_request_t *req)
      */
     if (req->sr_tag == SC_TAG_ORDERED || req->sr_tag == SC_TAG_HEAD) {
 #ifdef NVME_DBG
-        cmn_err(CE_NOTE, "nvme_scsi_read_write: issuing special flush before %s command",
+        cmn_err(CE_NOTE, "nvme_scsi_rw_start: issuing special flush before %s command",
                 req->sr_tag == SC_TAG_ORDERED ? "ordered" : "head-of-queue");
 #endif
-        rc = nvme_cmd_special_flush(soft);
+        rc = nvme_cmd_special_flush(soft, ps->ns);
         if (rc != 0) {
-            cmn_err(CE_WARN, "nvme_scsi_read_write: special flush failed");
+            cmn_err(CE_WARN, "nvme_scsi_rw_start: special flush failed");
             /* Continue anyway - best effort */
         }
     }
 
-    if (req->sr_buflen > s.max_transfer_blocks * soft->block_size) {
-        s.commands = (req->sr_buflen + s.max_transfer_blocks * soft->block_size - 1) / (s.max_transfer_blocks * soft->block_size);
-    } else {
-        s.commands = 1;
+    /* Count commands, chunk sizes depend on LBA and buffer alignment */
+    ps->commands = 0;
+    for (ps->done_blocks = 0; ps->done_blocks < ps->num_blocks;
+         ps->done_blocks += nvme_io_next_chunk(soft, ps, ps->done_blocks)) {
+        ps->commands++;
     }
+    ps->done_blocks = 0;
+    if (ps->commands == 0)
+        goto error;  /* Zero-block transfer, nothing to do */
     /* Prepare alenlist before allocating CIDs (initializes cursor at offset 0) */
-    rc = nvme_prepare_alenlist(soft, &s);
+    rc = nvme_prepare_alenlist(soft, ps);
     if (rc <= 0) {
 #ifdef NVME_DBG
-        cmn_err(CE_WARN, "nvme_scsi_read_write: failed to prepare alenlist");
+        cmn_err(CE_WARN, "nvme_scsi_rw_start: failed to prepare alenlist");
 #endif
         if (rc == 0)
             nvme_set_adapter_error(req);
         goto error;
     }
-    if (!s.alenlist)
+    if (!ps->alenlist)
         goto error;
 
     /* Allocate CID(s) for this I/O command */
-    if (nvme_io_cid_alloc(soft, req, s.commands, s.cids) != 0) {
+    if (nvme_io_cid_alloc(soft, req, ps->commands, ps->cids) != 0) {
 #ifdef NVME_DBG
-        cmn_err(CE_WARN, "nvme_scsi_read_write: no free CIDs available (requested %u)", s.commands);
+        cmn_err(CE_WARN, "nvme_scsi_rw_start: no free CIDs available (requested %u)", ps->commands);
 #endif
-        nvme_set_adapter_status(req, SC_REQUEST, ST_BUSY);
+        nvme_set_busy(soft, req);
         goto error_cleanup_alenlist;
     }
 
     /* Process each command/CID */
-    for (s.cidx = 0; s.cidx < s.commands; s.cidx++) {
+    for (ps->cidx = 0; ps->cidx < ps->commands; ps->cidx++) {
 
         /* Build the NVMe READ/WRITE command (sets opcode, nsid, LBA, num_blocks) */
+        ps->chunk_blocks = nvme_io_next_chunk(soft, ps, ps->done_blocks);
 #ifdef NVME_DBG_CMD
-        cmn_err(CE_WARN, "nvme_scsi_read_write: building NVMe command %u/%u (CID %u)...", s.cidx+1, s.commands, s.cids[s.cidx]);
+        cmn_err(CE_WARN, "nvme_scsi_rw_start: building NVMe command %u/%u (CID %u)...", ps->cidx+1, ps->commands, ps->cids[ps->cidx]);
 #endif
-        rc = nvme_io_build_rw_command(soft, &s);
+        rc = nvme_io_build_rw_command(soft, ps);
         if (rc <= 0) {
 #ifdef NVME_DBG
-            cmn_err(CE_WARN, "nvme_scsi_read_write: failed to build NVMe command %u", s.cidx);
+            cmn_err(CE_WARN, "nvme_scsi_rw_start: failed to build NVMe command %u", ps->cidx);
 #endif
             if (rc == 0)
                 nvme_set_adapter_error(req);
             goto error_cleanup_cids;
         }
 #ifdef NVME_DBG_CMD
-        cmn_err(CE_NOTE, "nvme_scsi_read_write: NVMe command %u built successfully", s.cidx);
+        cmn_err(CE_NOTE, "nvme_scsi_rw_start: NVMe command %u built successfully", ps->cidx);
 #endif
 
         /* Build PRP entries for data transfer (sets prp1/prp2, allocates PRP list if needed) */
 #ifdef NVME_DBG_CMD
-        cmn_err(CE_NOTE, "nvme_scsi_read_write: building PRPs for command %u...", s.cidx);
+        cmn_err(CE_NOTE, "nvme_scsi_rw_start: building PRPs for command %u...", ps->cidx);
 #endif
-        rc = nvme_build_prps_from_alenlist(soft, &s);
+        rc = nvme_build_prps_from_alenlist(soft, ps);
         if (rc <= 0) {
 #ifdef NVME_DBG
-            cmn_err(CE_WARN, "nvme_scsi_read_write: failed to build PRPs for command %u (rc=%d)", s.cidx, rc);
+            cmn_err(CE_WARN, "nvme_scsi_rw_start: failed to build PRPs for command %u (rc=%d)", ps->cidx, rc);
 #endif
             if (rc == 0) {
                 /* Hard error - set adapter error */
@@ -716,37 +1640,38 @@ nvme_scsi_read_write(nvme_soft_t *soft, scsi_request_t *req)
             goto error_cleanup_cids;
         }
 #ifdef NVME_DBG_CMD
-        cmn_err(CE_NOTE, "nvme_scsi_read_write: PRPs built successfully for command %u, prp1=0x%x%08x prp2=0x%x%08x blocks=%u",
-                s.cidx, s.cmd.prp1_hi, s.cmd.prp1_lo, s.cmd.prp2_hi, s.cmd.prp2_lo, s.cmd.cdw12+1);
+        cmn_err(CE_NOTE, "nvme_scsi_rw_start: PRPs built successfully for command %u, prp1=0x%x%08x prp2=0x%x%08x blocks=%u",
+                ps->cidx, ps->cmd.prp1_hi, ps->cmd.prp1_lo, ps->cmd.prp2_hi, ps->cmd.prp2_lo, (ps->cmd.cdw12 & NVME_RW_NLB_MASK)+1);
 #endif
         /* Submit the command to the I/O queue */
 #ifdef NVME_DBG_CMD
-        cmn_err(CE_WARN, "nvme_scsi_read_write: submitting NVMe command %u/%u (CID=%d)...", s.cidx+1, s.commands, s.cids[s.cidx]);
+        cmn_err(CE_WARN, "nvme_scsi_rw_start: submitting NVMe command %u/%u (CID=%d)...", ps->cidx+1, ps->commands, ps->cids[ps->cidx]);
 #endif
-        rc = nvme_submit_cmd(soft, &soft->io_queue, &s.cmd);
+        rc = nvme_submit_cmd(soft, &soft->io_queue, &ps->cmd);
         if (rc != 0) {
 #ifdef NVME_DBG
-            cmn_err(CE_WARN, "nvme_scsi_read_write: failed to submit command %u", s.cidx);
+            cmn_err(CE_WARN, "nvme_scsi_rw_start: failed to submit command %u", ps->cidx);
 #endif
-            nvme_set_adapter_status(req, SC_REQUEST, ST_BUSY);
+            nvme_set_busy(soft, req);
             goto error_cleanup_cids;
         }
 #ifdef NVME_DBG_CMD
-        cmn_err(CE_WARN, "nvme_scsi_read_write: command %u/%u submitted to SQ, tail now at %d", s.cidx+1, s.commands, soft->io_queue.sq_tail);
+        cmn_err(CE_WARN, "nvme_scsi_rw_start: command %u/%u submitted to SQ, tail now at %d", ps->cidx+1, ps->commands, soft->io_queue.sq_tail);
 #endif
+        ps->done_blocks += ps->chunk_blocks;
     }
 
 error_cleanup_cids:
     {
         unsigned int j;
         /* Clean up all allocated CIDs */
-        for (j = s.cidx; j < s.commands; j++) {
-            nvme_io_cid_done(soft, s.cids[j], NULL);
+        for (j = ps->cidx; j < ps->commands; j++) {
+            nvme_io_cid_done(soft, ps->cids[j], NULL);
         }
     }
 error_cleanup_alenlist:
     /* Clean up alenlist */
-    nvme_cleanup_alenlist(soft, &s);
+    nvme_cleanup_alenlist(soft, ps);
 
 error:
     /* Atomically decrement refcount by 1 (for the initial +1 at start) */
@@ -758,68 +1683,161 @@ error:
          * Note: sr_ha is already NULL from the atomic decrement, but
          * nvme_complete_request() will set it again for consistency
          */
-        nvme_complete_request(req);
+        nvme_complete_request(soft, req);
     }
 }
 
 /*
- * nvme_scsi_command: Main entry point for SCSI command translation
+ * nvme_scsi_compare_and_write: Handle COMPARE AND WRITE via fused NVMe Compare + Write
+ *
+ * The data-out buffer holds the verify data followed by the write data, one
+ * half per NVMe command. Both commands are placed in consecutive SQ slots by
+ * nvme_submit_cmds() so the controller executes them as one atomic unit. A
+ * miscompare completes the Compare with Compare Failure and aborts the Write,
+ * which the completion path reports as MISCOMPARE. Always completes the request.
  */
 void
-nvme_scsi_command(scsi_request_t *req)
+nvme_scsi_compare_and_write(nvme_soft_t *soft, scsi_request_t *req)
 {
-    nvme_soft_t *soft;
-    vertex_hdl_t scsi_vhdl;
-    scsi_lun_info_t *lun_info;
-    uchar_t opcode;
-    int rc = 0;
+    nvme_ns_t *ns = NVME_REQ_NS(soft, req);
+    uchar_t *cdb = req->sr_command;
+    nvme_rwcmd_state_t s;
+    nvme_command_t cmds[2];
+    int rc;
 
-    /* Get LUN info to find controller */
-    lun_info = scsi_lun_info_get(req->sr_lun_vhdl);
-    if (!lun_info) {
+    /* Initialize refcount atomically to 1 (will be incremented by nvme_io_cid_alloc) */
+    *(volatile int *)&(req->sr_ha) = 1;
+    nvme_set_success(req);
+
+    if (!soft->fuses_compare_write) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_COMMAND, 0);
+        goto error;
+    }
+
+    s.req = req;
+    s.ns = ns;
+    s.buflen = req->sr_buflen;
+    s.flags = NF_WRITE;  /* Both halves are data-out */
+    s.lba = ((__uint64_t)cdb[2] << 56) | ((__uint64_t)cdb[3] << 48) |
+            ((__uint64_t)cdb[4] << 40) | ((__uint64_t)cdb[5] << 32) |
+            ((__uint64_t)cdb[6] << 24) | ((__uint64_t)cdb[7] << 16) |
+            ((__uint64_t)cdb[8] << 8)  | ((__uint64_t)cdb[9]);
+    s.num_blocks = cdb[13];
+    if (cdb[1] & 0x08)  /* FUA bit */
+        s.flags |= NF_FUA;
+
+    /* Zero blocks: nothing to compare or write */
+    if (s.num_blocks == 0)
+        goto error;
+
+    /* Each half must fit into one NVMe command */
+    if (s.num_blocks > (ns->max_transfer_blocks << ns->emul_shift) ||
+        req->sr_buflen != 2 * s.num_blocks * NVME_HOST_BLOCK_SIZE(ns)) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB, 0);
+        goto error;
+    }
+    if (s.lba >= NVME_HOST_BLOCKS(ns) || s.num_blocks > NVME_HOST_BLOCKS(ns) - s.lba) {
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_LBA_OUT_OF_RANGE, 0);
+        goto error;
+    }
+
+    /* 512-byte emulation: the fused pair cannot be read-modify-written, so
+     * only whole namespace blocks are accepted */
+    if (ns->emul_shift) {
+        if ((s.lba | s.num_blocks) & ((1u << ns->emul_shift) - 1)) {
+            nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB, 0);
+            goto error;
+        }
+        s.lba >>= ns->emul_shift;
+        s.num_blocks >>= ns->emul_shift;
+    }
+
+    /* One command per half, the alenlist cursor splits the buffer at num_blocks */
+    s.max_transfer_blocks = s.num_blocks;
+    s.chunk_blocks = s.num_blocks;
+    s.commands = 2;
+    s.cidx = 0;
+
+    rc = nvme_prepare_alenlist(soft, &s);
+    if (rc <= 0) {
+        if (rc == 0)
+            nvme_set_adapter_error(req);
+        goto error;
+    }
+    if (!s.alenlist)
+        goto error;
+
+    if (nvme_io_cid_alloc(soft, req, s.commands, s.cids) != 0) {
 #ifdef NVME_DBG
-        cmn_err(CE_WARN, "nvme_scsi_command: no lun info");
+        cmn_err(CE_WARN, "nvme_scsi_compare_and_write: no free CIDs available");
 #endif
-        nvme_set_adapter_error(req);
-        goto done;
+        nvme_set_busy(soft, req);
+        goto error_cleanup_alenlist;
     }
 
-    /* Only LUN 0 is valid for target 0 (our NVMe device) */
-    if (req->sr_lun != 0 && req->sr_target == 0) {
+    for (s.cidx = 0; s.cidx < s.commands; s.cidx++) {
+        s.done_blocks = s.cidx * s.num_blocks;
+        nvme_io_build_compare_write_command(soft, &s);
+        rc = nvme_build_prps_from_alenlist(soft, &s);
+        if (rc <= 0) {
 #ifdef NVME_DBG
-        cmn_err(CE_NOTE, "!nvme_scsi_command: invalid LUN %d for target 0", req->sr_lun);
+            cmn_err(CE_WARN, "nvme_scsi_compare_and_write: failed to build PRPs for command %u", s.cidx);
 #endif
-        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_LUN, 0);
-        goto done;
+            if (rc == 0)
+                nvme_set_adapter_error(req);
+            s.cidx = 0;  /* Nothing submitted yet, release both CIDs */
+            goto error_cleanup_cids;
+        }
+        cmds[s.cidx] = s.cmd;
     }
 
-    /* Only target 0 is valid - return timeout for non-existent targets */
-    if (req->sr_target != 0) {
+    /* Submit the pair back to back, nothing else may land between them */
+    if (nvme_submit_cmds(soft, &soft->io_queue, cmds, 2) != 0) {
 #ifdef NVME_DBG
-        cmn_err(CE_NOTE, "!nvme_scsi_command: invalid target %d", req->sr_target);
+        cmn_err(CE_WARN, "nvme_scsi_compare_and_write: failed to submit fused pair");
 #endif
-        nvme_set_adapter_status(req, SC_TIMEOUT, ST_CHECK);
-        goto done;
+        nvme_set_busy(soft, req);
+        s.cidx = 0;
     }
 
+error_cleanup_cids:
     {
-        scsi_ctlr_info_t *ctlr_info = SLI_CTLR_INFO(lun_info);
-        if (!ctlr_info) {
-#ifdef NVME_DBG
-            cmn_err(CE_WARN, "nvme_scsi_command: no controller info");
-#endif
-            nvme_set_adapter_error(req);
-            goto done;
+        unsigned int j;
+        /* Release CIDs that were never submitted */
+        for (j = s.cidx; j < s.commands; j++) {
+            nvme_io_cid_done(soft, s.cids[j], NULL);
         }
-        soft = (nvme_soft_t *)SCI_INFO(ctlr_info);
-        if (!soft) {
+    }
+error_cleanup_alenlist:
+    nvme_cleanup_alenlist(soft, &s);
+
+error:
+    /* Drop the initial reference, complete now if both commands already finished */
+    if (atomicAddInt((int *)&req->sr_ha, -1) == 0) {
+        nvme_complete_request(soft, req);
+    }
+}
+
+/*
+ * nvme_scsi_dispatch: Translate and issue one request for nvme_scsi_command()
+ */
+static void
+nvme_scsi_dispatch(nvme_soft_t *soft, scsi_request_t *req)
+{
+    nvme_ns_t *ns;
+    vertex_hdl_t scsi_vhdl;
+    uchar_t opcode;
+    int rc = 0;
+
+    /* Each active namespace is one LUN of target 0 */
+    if (req->sr_lun >= soft->ns_count) {
 #ifdef NVME_DBG
-            cmn_err(CE_WARN, "nvme_scsi_command: no soft state in SCI_INFO");
+        cmn_err(CE_NOTE, "!nvme_scsi_command: invalid LUN %d for target 0", req->sr_lun);
 #endif
-            nvme_set_adapter_error(req);
-            goto done;
-        }
+        nvme_scsi_set_error(req, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_LUN, 0);
+        goto done;
     }
+    ns = NVME_REQ_NS(soft, req);
 
 #ifdef NVME_DBG
     cmn_err(CE_NOTE, "nvme_scsi_command: soft=%p req=%p notify=%p target=%d lun=%d opcode=0x%x sr_status=0x%x",
@@ -828,6 +1846,29 @@ nvme_scsi_command(scsi_request_t *req)
     /* Decode SCSI opcode */
     opcode = req->sr_command[0];
 
+    /* Controller reset in progress (nvme_ctlr_reset), retried once it is back */
+    if (soft->reset_active) {
+        nvme_set_busy(soft, req);
+        goto done;
+    }
+    if (soft->ctlr_failed) {
+        nvme_set_adapter_error(req);
+        goto done;
+    }
+
+    /* Namespace is being reformatted by the NVME_SOP_FORMAT ioctl */
+    if (soft->format_active) {
+        nvme_scsi_set_error(req, SCSI_SENSE_NOT_READY, SCSI_ADSENSE_LUN_NOT_READY, 0x04);
+        goto done;
+    }
+
+    /* Tell the disk driver once that this LUN's block size or capacity moved */
+    if (ns->capacity_changed && opcode != SCSIOP_INQUIRY) {
+        ns->capacity_changed = 0;
+        nvme_scsi_set_error(req, SCSI_SENSE_UNIT_ATTENTION, SCSI_ADSENSE_PARAMETERS_CHANGED, 0x09);
+        goto done;
+    }
+
     switch (opcode) {
     case SCSIOP_TEST_UNIT_READY:
         rc = nvme_scsi_test_unit_ready(soft, req);
@@ -845,6 +1886,10 @@ nvme_scsi_command(scsi_request_t *req)
         rc = nvme_scsi_read_capacity(soft, req);
         break;
 
+    case SCSIOP_SERVICE_ACTION_IN:
+        rc = nvme_scsi_read_capacity_16(soft, req);
+        break;
+
     case SCSIOP_READ_6:
     case SCSIOP_READ_10:
     case SCSIOP_READ_16:
@@ -866,10 +1911,37 @@ nvme_scsi_command(scsi_request_t *req)
         rc = nvme_scsi_mode_sense(soft, req);
         break;
 
+    case SCSIOP_MODE_SELECT_6:
+    case SCSIOP_MODE_SELECT_10:
+        nvme_scsi_mode_select(soft, req);
+        return; // notify always called by nvme_scsi_mode_select
+
+    case SCSIOP_LOG_SENSE:
+        rc = nvme_scsi_log_sense(soft, req);
+        break;
+
     case SCSIOP_SYNC_CACHE:
         rc = nvme_scsi_sync_cache(soft, req);
         break;
 
+    case SCSIOP_UNMAP:
+        nvme_scsi_unmap(soft, req);
+        return; // notify always called by nvme_scsi_unmap
+
+    case SCSIOP_WRITE_SAME_10:
+    case SCSIOP_WRITE_SAME_16:
+        nvme_scsi_write_same(soft, req);
+        return; // notify always called by nvme_scsi_write_same
+
+    case SCSIOP_VERIFY_10:
+    case SCSIOP_VERIFY_16:
+        nvme_scsi_verify(soft, req);
+        return; // notify always called by nvme_scsi_verify
+
+    case SCSIOP_COMPARE_AND_WRITE:
+        nvme_scsi_compare_and_write(soft, req);
+        return; // notify always called by nvme_scsi_compare_and_write
+
     default:
         cmn_err(CE_WARN, "nvme_scsi_command: unsupported opcode 0x%x", opcode);
         nvme_set_adapter_error(req);
@@ -881,6 +1953,7 @@ done:
      * copyout() to return data, not DMA to sr_buffer. No cache invalidation needed.
      * Only READ/WRITE commands (handled by nvme_scsi_read_write) need cache flush.
      */
+    nvme_stats_complete(soft, req);
     if (req->sr_notify) {
         req->sr_ha = NULL;
         (*req->sr_notify)(req);
@@ -888,6 +1961,67 @@ done:
 }
 
 
+/*
+ * nvme_scsi_command: Main entry point for SCSI command translation
+ */
+void
+nvme_scsi_command(scsi_request_t *req)
+{
+    nvme_soft_t *soft;
+    scsi_lun_info_t *lun_info;
+
+    /* Get LUN info to find controller */
+    lun_info = scsi_lun_info_get(req->sr_lun_vhdl);
+    if (!lun_info) {
+#ifdef NVME_DBG
+        cmn_err(CE_WARN, "nvme_scsi_command: no lun info");
+#endif
+        nvme_set_adapter_error(req);
+        goto done;
+    }
+
+    /* Only target 0 is valid - return timeout for non-existent targets */
+    if (req->sr_target != 0) {
+#ifdef NVME_DBG
+        cmn_err(CE_NOTE, "!nvme_scsi_command: invalid target %d", req->sr_target);
+#endif
+        nvme_set_adapter_status(req, SC_TIMEOUT, ST_CHECK);
+        goto done;
+    }
+
+    {
+        scsi_ctlr_info_t *ctlr_info = SLI_CTLR_INFO(lun_info);
+        if (!ctlr_info) {
+#ifdef NVME_DBG
+            cmn_err(CE_WARN, "nvme_scsi_command: no controller info");
+#endif
+            nvme_set_adapter_error(req);
+            goto done;
+        }
+        soft = (nvme_soft_t *)SCI_INFO(ctlr_info);
+        if (!soft) {
+#ifdef NVME_DBG
+            cmn_err(CE_WARN, "nvme_scsi_command: no soft state in SCI_INFO");
+#endif
+            nvme_set_adapter_error(req);
+            goto done;
+        }
+    }
+
+    /* Parked while the controller is quiesced, see nvme_quiesce() */
+    if (!nvme_quiesce_enter(soft, req))
+        return;
+    nvme_scsi_dispatch(soft, req);
+    nvme_quiesce_exit(soft);
+    return;
+
+done:
+    if (req->sr_notify) {
+        req->sr_ha = NULL;
+        (*req->sr_notify)(req);
+    }
+}
+
 /*
  * nvme_scsi_alloc: Allocate SCSI device resources
  */
@@ -912,21 +2046,21 @@ nvme_scsi_free(vertex_hdl_t lun_vhdl, void (*cb)())
 }
 
 /*
- * nvme_init_scsi_target_info: Initialize the SCSI target info structure
+ * nvme_init_scsi_target_info: Initialize a namespace's SCSI target info structure
  * This can be called multiple times to ensure the structure is always valid
  */
 void
-nvme_init_scsi_target_info(nvme_soft_t *soft)
+nvme_init_scsi_target_info(nvme_ns_t *ns)
 {
     /* Set pointers to our persistent buffers */
-    soft->tinfo.si_inq = soft->inq_data;
-    soft->tinfo.si_sense = soft->sense_data;
+    ns->tinfo.si_inq = ns->inq_data;
+    ns->tinfo.si_sense = ns->sense_data;
 
     /* Set capability flags */
-    soft->tinfo.si_ha_status = SRH_TAGQ | SRH_QERR0 | SRH_ALENLIST | SRH_MAPUSER | SRH_WIDE;
-    soft->tinfo.si_maxq = 32;  /* Max queue depth */
-    soft->tinfo.si_qdepth = 0;
-    soft->tinfo.si_qlimit = 0;
+    ns->tinfo.si_ha_status = SRH_TAGQ | SRH_QERR0 | SRH_ALENLIST | SRH_MAPUSER | SRH_WIDE;
+    ns->tinfo.si_maxq = 32;  /* Max queue depth */
+    ns->tinfo.si_qdepth = 0;
+    ns->tinfo.si_qlimit = 0;
 }
 
 /*
@@ -936,6 +2070,7 @@ struct scsi_target_info *
 nvme_scsi_info(vertex_hdl_t lun_vhdl)
 {
     nvme_soft_t *soft;
+    nvme_ns_t *ns;
     scsi_lun_info_t *lun_info;
     vertex_hdl_t ctlr_vhdl;
 
@@ -965,11 +2100,19 @@ nvme_scsi_info(vertex_hdl_t lun_vhdl)
         }
     }
 
+    if (SLI_LUN(lun_info) >= soft->ns_count) {
+#ifdef NVME_DBG
+        cmn_err(CE_WARN, "nvme_scsi_info: no namespace for lun %d", SLI_LUN(lun_info));
+#endif
+        return NULL;
+    }
+    ns = &soft->ns[SLI_LUN(lun_info)];
+
     /* Re-initialize the target info structure every time to work around corruption */
-    nvme_init_scsi_target_info(soft);
+    nvme_init_scsi_target_info(ns);
 
-    /* Return pointer to persistent info structure in soft state */
-    return &soft->tinfo;
+    /* Return pointer to persistent info structure in the namespace state */
+    return &ns->tinfo;
 }
 
 /*
@@ -1040,7 +2183,7 @@ nvme_scsi_ioctl(vertex_hdl_t ctlr_vhdl, unsigned int cmd, struct scsi_ha_op *op)
 #ifdef NVME_DBG
         cmn_err(CE_NOTE, "nvme_scsi_ioctl: SOP_SCAN");
 #endif
-        /* NVMe namespace is already discovered at attach time */
+        /* NVMe namespaces are already discovered at attach time */
         return 0;
 
     case SOP_MAKE_CTL_ALIAS:
@@ -1050,6 +2193,26 @@ nvme_scsi_ioctl(vertex_hdl_t ctlr_vhdl, unsigned int cmd, struct scsi_ha_op *op)
         /* ioconfig uses this to create /dev/scsi/scN aliases */
         return 0;
 
+    case SOP_QUIESCE:
+#ifdef NVME_DBG
+        cmn_err(CE_NOTE, "nvme_scsi_ioctl: SOP_QUIESCE %u ticks", (uint_t)op->sb_arg);
+#endif
+        /* Holds up all I/O on the controller until SOP_UN_QUIESCE; sb_arg is
+         * the wait for the commands in flight in clock ticks, as scsiquiesce
+         * passes it (0 for NVME_QUIESCE_TIMEOUT_MS) */
+        if (!_CAP_ABLE(CAP_DEVICE_MGT))
+            return EPERM;
+        return nvme_quiesce(soft, op->sb_arg ? (uint_t)((__uint64_t)op->sb_arg * 1000 / HZ) :
+                                               NVME_QUIESCE_TIMEOUT_MS);
+
+    case SOP_UN_QUIESCE:
+#ifdef NVME_DBG
+        cmn_err(CE_NOTE, "nvme_scsi_ioctl: SOP_UN_QUIESCE");
+#endif
+        if (!_CAP_ABLE(CAP_DEVICE_MGT))
+            return EPERM;
+        return nvme_resume(soft);
+
     case SOP_QUIESCE_STATE: {
         int state;
 #ifdef NVME_DBG
@@ -1100,6 +2263,54 @@ nvme_scsi_ioctl(vertex_hdl_t ctlr_vhdl, unsigned int cmd, struct scsi_ha_op *op)
         copyout(&sp, (void *)op->sb_addr, sizeof(struct scsi_parms));
         return 0;
     }
+    case NVME_SOP_LBAF_REPORT:
+    {
+        nvme_lbaf_report_t rep;
+#ifdef NVME_DBG
+        cmn_err(CE_NOTE, "nvme_scsi_ioctl: NVME_SOP_LBAF_REPORT");
+#endif
+        if (NVME_SOP_ARG_LUN(op->sb_arg) >= soft->ns_count)
+            return EINVAL;
+        nvme_lbaf_report(soft, &soft->ns[NVME_SOP_ARG_LUN(op->sb_arg)], &rep);
+        if (copyout(&rep, (void *)op->sb_addr, sizeof(rep)))
+            return EFAULT;
+        return 0;
+    }
+    case NVME_SOP_FORMAT:
+#ifdef NVME_DBG
+        cmn_err(CE_NOTE, "nvme_scsi_ioctl: NVME_SOP_FORMAT LUN %u LBAF %u",
+                NVME_SOP_ARG_LUN(op->sb_arg), NVME_SOP_ARG_LBAF(op->sb_arg));
+#endif
+        /* Destroys all data on the namespace behind the LUN */
+        if (!_CAP_ABLE(CAP_DEVICE_MGT))
+            return EPERM;
+        if (NVME_SOP_ARG_LUN(op->sb_arg) >= soft->ns_count)
+            return EINVAL;
+        return nvme_format_namespace(soft, &soft->ns[NVME_SOP_ARG_LUN(op->sb_arg)],
+                                     NVME_SOP_ARG_LBAF(op->sb_arg));
+
+    case NVME_SOP_THERMAL:
+    {
+        nvme_thermal_report_t rep;
+
+        nvme_thermal_report(soft, &rep);
+        if (copyout(&rep, (void *)op->sb_addr, sizeof(rep)))
+            return EFAULT;
+        return 0;
+    }
+
+    case NVME_SOP_STATS:
+    {
+        nvme_stats_t st;
+
+        if (op->sb_arg && !_CAP_ABLE(CAP_DEVICE_MGT))
+            return EPERM;
+        nvme_stats_snapshot(soft, &st, op->sb_arg != 0);
+        if (copyout(&st, (void *)op->sb_addr, sizeof(st)))
+            return EFAULT;
+        return 0;
+    }
+
     default:
         cmn_err(CE_WARN, "nvme_scsi_ioctl: unknown ioctl 0x%x", cmd);
         return EINVAL;
@@ -17,6 +17,11 @@ char *nvme_mversion = M_VERSION;
  */
 int nvme_devflag = D_MP;
 
+/*
+ * Host Memory Buffer size cap in megabytes, 0 disables it (see NVME_HMB_MAX_MB)
+ */
+int nvme_hmb_max_mb = NVME_HMB_MAX_MB;
+
 /* NVMe PCI Class Codes */
 #define PC_CLASS_STORAGE       0x01        /* Mass Storage Controller */
 #define PCI_SUBCLASS_NVM        0x08        /* Non-Volatile Memory */
@@ -133,6 +138,10 @@ int         nvme_detach(vertex_hdl_t conn);
 static pciio_iter_f nvme_reloadme;
 static pciio_iter_f nvme_unloadme;
 
+static int  nvme_attach_controller(nvme_soft_t *soft);
+static void nvme_attach_thread(void *arg);
+static void nvme_attach_wait(void);
+
 /* =====================================================================
  *    Error Handler
  */
@@ -201,6 +210,7 @@ nvme_unload(void)
 {
     cmn_err(CE_NOTE, "nvme_unload: unloading NVMe driver");
 
+    nvme_attach_wait();
     pciio_iterate("nvme_", nvme_unloadme);
 
     return 0;
@@ -229,6 +239,9 @@ nvme_reg(void)
                           "nvme_",
                           0);
 
+    /* Controllers found here come up in parallel, wait for the slowest */
+    nvme_attach_wait();
+
     return 0;
 }
 
@@ -591,9 +604,647 @@ nvme_dump_pci_bridge(vertex_hdl_t conn)
  * ============================================================================
  */
 
+/*
+ * nvme_compute_transfer_geometry: Derive the per-command transfer limits
+ *
+ * Must run after Identify Controller (MDTS) and Identify Namespace (LBADS),
+ * and again whenever an LBA format changes. The byte limit is the smallest of:
+ *   - MDTS, which counts in CAP.MPSMIN pages (0 = no controller limit)
+ *   - v.v_maxdmasz, the largest DMA the kernel hands a driver
+ *   - what one command's PRPs can describe: PRP1 plus NVME_CMD_MAX_PRPS list
+ *     pages from the PRP pool, each giving up its last entry for chaining,
+ *     less one page so an unaligned buffer start still fits
+ * It is then rounded down to whole logical blocks of each namespace and
+ * capped by the 16-bit NLB field. Verify and Write Zeroes move no data and
+ * are bounded by VSL and WZSL instead, in the same units as MDTS.
+ */
+void
+nvme_compute_transfer_geometry(nvme_soft_t *soft)
+{
+    __uint64_t max_bytes;
+    __uint64_t limit;
+    uint_t prp_pages;
+    nvme_ns_t *ns;
+    uint_t i;
+
+    /* PRP capacity of a single command */
+    prp_pages = 1 + NVME_CMD_MAX_PRPS * (soft->nvme_prp_entries - 1);
+    max_bytes = (__uint64_t)(prp_pages - 1) * soft->nvme_page_size;
+
+    /* Kernel DMA limit */
+    limit = (__uint64_t)v.v_maxdmasz * NBPP;
+    if (limit != 0 && limit < max_bytes)
+        max_bytes = limit;
+
+    /* Controller limit, MDTS is a power of two in minimum page size units */
+    if (soft->mdts != 0 && soft->mdts + soft->min_page_size + 12 < 40) {
+        limit = (__uint64_t)1 << (soft->mdts + soft->min_page_size + 12);
+        if (limit < max_bytes)
+            max_bytes = limit;
+    }
+
+    soft->max_transfer_bytes = (uint_t)max_bytes;
+
+    cmn_err(CE_NOTE, "nvme: MDTS=%d, max transfer = %u KB (PRP %u pages, maxdmasz %d pages)",
+            soft->mdts, soft->max_transfer_bytes / 1024, prp_pages, v.v_maxdmasz);
+
+    for (i = 0; i < soft->ns_count; i++) {
+        ns = &soft->ns[i];
+
+        /* 512-byte emulation applies to any namespace block larger than 512 bytes */
+#ifdef NVME_EMULATE_512
+        ns->emul_shift = (ns->lba_shift > NVME_EMUL_HOST_SHIFT) ?
+                         ns->lba_shift - NVME_EMUL_HOST_SHIFT : 0;
+#else
+        ns->emul_shift = 0;
+#endif
+
+        /* Whole logical blocks, no more than one NLB field's worth */
+        ns->max_transfer_blocks = (uint_t)(max_bytes >> ns->lba_shift);
+        if (ns->max_transfer_blocks > NVME_RW_NLB_MASK + 1)
+            ns->max_transfer_blocks = NVME_RW_NLB_MASK + 1;
+        if (ns->max_transfer_blocks == 0)
+            ns->max_transfer_blocks = 1;
+
+        ns->write_zeroes_max_blocks = NVME_WRITE_ZEROES_MAX_BLOCKS;
+        if (soft->wzsl != 0 && soft->wzsl + soft->min_page_size + 12 < 40) {
+            limit = ((__uint64_t)1 << (soft->wzsl + soft->min_page_size + 12)) >> ns->lba_shift;
+            if (limit < ns->write_zeroes_max_blocks)
+                ns->write_zeroes_max_blocks = limit ? (uint_t)limit : 1;
+        }
+
+        ns->verify_max_blocks = NVME_RW_NLB_MASK + 1;
+        if (soft->vsl != 0 && soft->vsl + soft->min_page_size + 12 < 40) {
+            limit = ((__uint64_t)1 << (soft->vsl + soft->min_page_size + 12)) >> ns->lba_shift;
+            if (limit < ns->verify_max_blocks)
+                ns->verify_max_blocks = limit ? (uint_t)limit : 1;
+        }
+
+        cmn_err(CE_NOTE, "nvme: namespace %u (LUN %u) max transfer = %u blocks",
+                ns->nsid, ns->lun, ns->max_transfer_blocks);
+    }
+}
+
+/*
+ * nvme_ns_scan: Find the active namespaces and identify each of them
+ *
+ * Must run after Identify Controller. NVMe 1.1+ controllers report their
+ * active namespaces directly; older ones are probed from NSID 1 to NN,
+ * and namespaces that identify with a zero size are inactive. Each
+ * namespace kept gets the next LUN, up to NVME_MAX_NAMESPACES.
+ *
+ * Returns:
+ *   Number of namespaces found (soft->ns_count), 0 if none or on error
+ */
+int
+nvme_ns_scan(nvme_soft_t *soft)
+{
+    uint_t nsids[NVME_MAX_NAMESPACES];
+    uint_t count = 0;
+    uint_t nsid;
+    uint_t i;
+    nvme_ns_t *ns;
+
+    bzero(soft->ns, sizeof(soft->ns));
+    soft->ns_count = 0;
+
+    if (soft->vs >= NVME_VS_1_1 && nvme_admin_identify_ns_list(soft) &&
+        nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000) == 0) {
+        for (i = 0; i < soft->ns_count; i++)
+            nsids[count++] = soft->ns[i].nsid;
+    } else {
+        for (nsid = 1; nsid <= soft->num_namespaces && count < NVME_MAX_NAMESPACES; nsid++)
+            nsids[count++] = nsid;
+    }
+
+    soft->ns_count = 0;
+    for (i = 0; i < count; i++) {
+        ns = &soft->ns[soft->ns_count];
+        bzero(ns, sizeof(*ns));
+        ns->nsid = nsids[i];
+        ns->lun = soft->ns_count;
+
+        if (!nvme_admin_identify_namespace(soft, ns, nvme_identify_namespace_done) ||
+            nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000) != 0) {
+            cmn_err(CE_WARN, "nvme: Identify Namespace %u failed", nsids[i]);
+            continue;
+        }
+        if (ns->num_blocks == 0)
+            continue;  /* Inactive */
+
+        cmn_err(CE_NOTE, "nvme: namespace %u is LUN %u, %llu blocks of %u bytes",
+                ns->nsid, ns->lun, ns->num_blocks, ns->block_size);
+        soft->ns_count++;
+    }
+
+    return soft->ns_count;
+}
+
+/*
+ * nvme_lbaf_report: Describe the LBA formats of a namespace
+ *
+ * Built from the Identify Namespace data cached at the last identify.
+ * A format is usable when it carries no metadata (we never set up MPTR)
+ * and its block size lies between 512 bytes and one system page. The
+ * best format is the usable one with the lowest Relative Performance
+ * value; ties keep the current format, then favour the larger block.
+ *
+ * Arguments:
+ *   soft - Controller soft state
+ *   ns   - Namespace to describe
+ *   rep  - Report to fill in
+ */
+void
+nvme_lbaf_report(nvme_soft_t *soft, nvme_ns_t *ns, nvme_lbaf_report_t *rep)
+{
+    nvme_lbaf_info_t *f;
+    uint_t i;
+    int best = -1;
+
+    bzero(rep, sizeof(*rep));
+    rep->nsid = ns->nsid;
+    rep->nlbaf = ns->nlbaf;
+    rep->current = ns->flbas;
+    rep->format_supported = soft->oacs_format;
+
+    for (i = 0; i < ns->nlbaf; i++) {
+        f = &rep->lbaf[i];
+        f->lbads = NVME_LBAF_LBADS(ns->lbaf[i]);
+        f->ms = NVME_LBAF_MS(ns->lbaf[i]);
+        f->rp = NVME_LBAF_RP(ns->lbaf[i]);
+        f->usable = (f->ms == 0 && f->lbads >= 9 && f->lbads <= PAGE_SHIFT) ? 1 : 0;
+        if (!f->usable)
+            continue;
+
+        if (best < 0 || f->rp < rep->lbaf[best].rp) {
+            best = i;
+        } else if (f->rp == rep->lbaf[best].rp && best != ns->flbas &&
+                   (i == ns->flbas || f->lbads > rep->lbaf[best].lbads)) {
+            best = i;
+        }
+    }
+
+    rep->best = (best < 0) ? ns->flbas : (uint_t)best;
+}
+
+/*
+ * nvme_format_namespace: Format a namespace to another LBA format
+ *
+ * Admin-driven only, from the NVME_SOP_FORMAT ioctl. New SCSI commands are
+ * refused with NOT READY / FORMAT IN PROGRESS on every LUN while the
+ * outstanding I/O drains and the Format NVM runs, since a controller may
+ * format all namespaces at once (FNA). Afterwards the namespaces are
+ * identified again and the transfer geometry recomputed, so READ CAPACITY
+ * and the Block Limits page show the new block size; the next command to
+ * each LUN that changed gets a CAPACITY DATA HAS CHANGED unit attention so
+ * the disk driver rescans. When the Format NVM outlasts
+ * NVME_FORMAT_TIMEOUT_MS the LUNs stay not ready, nvme_format_done() then
+ * has the namespaces identified again and lets I/O in.
+ *
+ * Arguments:
+ *   soft - Controller soft state
+ *   ns   - Namespace to format
+ *   lbaf - LBA format index, or NVME_LBAF_BEST
+ *
+ * Returns:
+ *   0 on success, errno otherwise
+ */
+int
+nvme_format_namespace(nvme_soft_t *soft, nvme_ns_t *ns, uint_t lbaf)
+{
+    nvme_lbaf_report_t rep;
+    __uint64_t old_blocks[NVME_MAX_NAMESPACES];
+    uint_t old_flbas[NVME_MAX_NAMESPACES];
+    nvme_ns_t *n;
+    int error = 0;
+    int i;
+
+    if (!soft->oacs_format)
+        return ENOTSUP;
+
+    nvme_lbaf_report(soft, ns, &rep);
+    if (lbaf == NVME_LBAF_BEST)
+        lbaf = rep.best;
+    if (lbaf >= rep.nlbaf || !rep.lbaf[lbaf].usable)
+        return EINVAL;
+
+    if (atomicAddInt((int *)&soft->format_active, 1) != 1) {
+        atomicAddInt((int *)&soft->format_active, -1);
+        return EBUSY;
+    }
+
+    /* Let the commands already queued finish before the media goes away,
+     * including read-modify-write work of the 512-byte emulation */
+    for (i = 0; i < 500 && (soft->emul_head || soft->emul_active_hi); i++)
+        delay(drv_usectohz(10000));  /* 10ms */
+    if (soft->emul_head || soft->emul_active_hi ||
+        nvme_wait_for_queue_idle(soft, &soft->io_queue, 5000) != 0) {
+        error = EBUSY;
+        goto out;
+    }
+
+    cmn_err(CE_NOTE, "nvme: formatting namespace %u from LBAF%u to LBAF%u (%u byte blocks, RP=%u)",
+            ns->nsid, ns->flbas, lbaf, 1u << rep.lbaf[lbaf].lbads, rep.lbaf[lbaf].rp);
+
+    if (!nvme_admin_format_nvm(soft, ns, lbaf)) {
+        error = EIO;
+        goto out;
+    }
+    if (nvme_wait_for_queue_idle(soft, &soft->admin_queue, NVME_FORMAT_TIMEOUT_MS) != 0) {
+        /* The media is still changing, so the LUNs stay not ready. Whoever of
+         * us and nvme_format_done() clears format_orphaned finishes the format */
+        soft->format_orphaned = 1;
+        if (soft->format_status == -1 ||
+            !compare_and_swap_int((int *)&soft->format_orphaned, 1, 0)) {
+            cmn_err(CE_WARN, "nvme: Format NVM did not complete in %d seconds, LUNs stay not ready until it does",
+                    NVME_FORMAT_TIMEOUT_MS / 1000);
+            return ETIMEDOUT;
+        }
+    }
+    if (soft->format_status != 0) {
+        cmn_err(CE_WARN, "nvme: Format NVM failed, status 0x%x", soft->format_status);
+        error = EIO;
+        goto out;
+    }
+
+    /* Pick up the new block sizes and everything derived from them */
+    for (i = 0; i < soft->ns_count; i++) {
+        n = &soft->ns[i];
+        old_blocks[i] = n->num_blocks;
+        old_flbas[i] = n->flbas;
+        if (!nvme_admin_identify_namespace(soft, n, nvme_identify_namespace_done) ||
+            nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000) != 0) {
+            error = EIO;
+        }
+    }
+    nvme_compute_transfer_geometry(soft);
+
+    for (i = 0; i < soft->ns_count; i++) {
+        n = &soft->ns[i];
+        if (n == ns || n->num_blocks != old_blocks[i] || n->flbas != old_flbas[i])
+            n->capacity_changed = 1;
+    }
+
+    cmn_err(CE_NOTE, "nvme: namespace %u now %llu blocks of %u bytes",
+            ns->nsid, ns->num_blocks, ns->block_size);
+
+out:
+    atomicAddInt((int *)&soft->format_active, -1);
+    return error;
+}
+
+/*
+ * nvme_quiesce_enter: Admission check at the top of nvme_scsi_command()
+ *
+ * Returns 1 when the request may go on to nvme_scsi_dispatch(), after
+ * which the caller owes nvme_quiesce_exit(). While the controller is
+ * quiesced the request is parked for nvme_resume() instead and 0 is
+ * returned; it is neither failed nor answered busy.
+ */
+int
+nvme_quiesce_enter(nvme_soft_t *soft, scsi_request_t *req)
+{
+    atomicAddInt((int *)&soft->quiesce_entered, 1);
+    if (soft->quiesce_state == NO_QUIESCE_IN_PROGRESS)
+        return 1;
+    atomicAddInt((int *)&soft->quiesce_entered, -1);
+
+    mutex_lock(&soft->quiesce_lock, PZERO);
+    if (soft->quiesce_state == NO_QUIESCE_IN_PROGRESS) {
+        /* Resumed in the meantime, a new quiesce has to wait for us */
+        atomicAddInt((int *)&soft->quiesce_entered, 1);
+        mutex_unlock(&soft->quiesce_lock);
+        return 1;
+    }
+    req->sr_ha = NULL;
+    if (soft->quiesce_tail)
+        soft->quiesce_tail->sr_ha = req;
+    else
+        soft->quiesce_head = req;
+    soft->quiesce_tail = req;
+    soft->quiesce_parked++;
+    mutex_unlock(&soft->quiesce_lock);
+    return 0;
+}
+
+/*
+ * nvme_quiesce_exit: The request admitted by nvme_quiesce_enter() is issued
+ */
+void
+nvme_quiesce_exit(nvme_soft_t *soft)
+{
+    atomicAddInt((int *)&soft->quiesce_entered, -1);
+}
+
+/*
+ * nvme_quiesce_busy: Work a quiesce has to wait for
+ *
+ * Requests still being dispatched, commands on the I/O queue and
+ * read-modify-write jobs of the 512-byte emulation, plus one while a
+ * controller reset holds captured commands for replay.
+ */
+static int
+nvme_quiesce_busy(nvme_soft_t *soft)
+{
+    int busy;
+
+    busy = atomicAddInt((int *)&soft->quiesce_entered, 0);
+    busy += atomicAddInt((int *)&soft->io_queue.outstanding, 0) - soft->io_queue.parked;
+    if (soft->emul_head || soft->emul_active_hi)
+        busy++;
+    if (soft->reset_active)
+        busy++;
+    return busy;
+}
+
+/*
+ * nvme_quiesce: Stop admitting I/O and wait for what is in flight
+ *
+ * New requests are parked by nvme_quiesce_enter() from here on. Completions
+ * are reaped from this thread as well, so a lost interrupt does not stretch
+ * the wait. Progress is logged once a second. The controller stays
+ * quiesced until nvme_resume(), also when the wait times out.
+ *
+ * Returns:
+ *   0 once nothing is in flight (QUIESCE_IS_COMPLETE)
+ *   ETIMEDOUT if commands were still outstanding after timeout_ms
+ *   EAGAIN if nvme_resume() was called while waiting
+ *   EIO if the controller has failed
+ */
+int
+nvme_quiesce(nvme_soft_t *soft, uint_t timeout_ms)
+{
+    uint_t elapsed_ms = 0;
+    int busy;
+
+    if (soft->ctlr_failed)
+        return EIO;
+
+    mutex_lock(&soft->quiesce_lock, PZERO);
+    if (soft->quiesce_state == NO_QUIESCE_IN_PROGRESS)
+        soft->quiesce_state = QUIESCE_IN_PROGRESS;
+    mutex_unlock(&soft->quiesce_lock);
+
+    for (;;) {
+        nvme_process_completions(soft, &soft->io_queue);
+        busy = nvme_quiesce_busy(soft);
+        if (busy <= 0 || soft->quiesce_state == NO_QUIESCE_IN_PROGRESS)
+            break;
+        if (elapsed_ms >= timeout_ms) {
+            cmn_err(CE_WARN, "nvme: adapter %d quiesce timed out after %u ms, %d commands in flight, %u parked",
+                    soft->adap, elapsed_ms, busy, soft->quiesce_parked);
+            return ETIMEDOUT;
+        }
+        if (elapsed_ms && (elapsed_ms % 1000) == 0)
+            cmn_err(CE_NOTE, "nvme: adapter %d quiescing, %d commands in flight, %u parked",
+                    soft->adap, busy, soft->quiesce_parked);
+        delay(drv_usectohz(10000));  /* 10ms */
+        elapsed_ms += 10;
+    }
+
+    mutex_lock(&soft->quiesce_lock, PZERO);
+    if (soft->quiesce_state == NO_QUIESCE_IN_PROGRESS) {
+        mutex_unlock(&soft->quiesce_lock);
+        return EAGAIN;
+    }
+    soft->quiesce_state = QUIESCE_IS_COMPLETE;
+    mutex_unlock(&soft->quiesce_lock);
+
+    cmn_err(CE_NOTE, "nvme: adapter %d quiesced after %u ms, %u requests parked",
+            soft->adap, elapsed_ms, soft->quiesce_parked);
+    return 0;
+}
+
+/*
+ * nvme_quiesce_release: Take the parked requests off the list
+ *
+ * resume - leave the quiesced state and issue them again in arrival
+ *          order, otherwise fail them (shutdown)
+ *
+ * Returns the number of requests released.
+ */
+static int
+nvme_quiesce_release(nvme_soft_t *soft, int resume)
+{
+    scsi_request_t *req, *next;
+    int n = 0;
+
+    mutex_lock(&soft->quiesce_lock, PZERO);
+    req = soft->quiesce_head;
+    soft->quiesce_head = NULL;
+    soft->quiesce_tail = NULL;
+    soft->quiesce_parked = 0;
+    if (resume)
+        soft->quiesce_state = NO_QUIESCE_IN_PROGRESS;
+    mutex_unlock(&soft->quiesce_lock);
+
+    for (; req != NULL; req = next, n++) {
+        next = (scsi_request_t *)req->sr_ha;
+        req->sr_ha = NULL;
+        if (resume) {
+            nvme_scsi_command(req);
+            continue;
+        }
+        nvme_set_adapter_error(req);
+        nvme_stats_complete(soft, req);
+        if (req->sr_notify)
+            (*req->sr_notify)(req);
+    }
+    return n;
+}
+
+/*
+ * nvme_resume: Admit I/O again after nvme_quiesce()
+ *
+ * Returns 0, also when the controller was not quiesced.
+ */
+int
+nvme_resume(nvme_soft_t *soft)
+{
+    int n;
+
+    if (soft->quiesce_state == NO_QUIESCE_IN_PROGRESS)
+        return 0;
+    n = nvme_quiesce_release(soft, 1);
+    cmn_err(CE_NOTE, "nvme: adapter %d resumed, %d parked requests issued", soft->adap, n);
+    return 0;
+}
+
+/*
+ * nvme_stats_snapshot: Copy the statistics for NVME_SOP_STATS
+ *
+ * clear - zero the counters afterwards; increments racing with it may be
+ *         lost, the largest depth seen starts over from the current one
+ */
+void
+nvme_stats_snapshot(nvme_soft_t *soft, nvme_stats_t *st, int clear)
+{
+    *st = soft->stats;
+    st->depth = atomicAddInt((int *)&soft->io_queue.outstanding, 0) - soft->io_queue.parked;
+    st->lbolt = lbolt;
+    st->hz = HZ;
+
+    if (clear) {
+        mutex_lock(&soft->io_queue.lock, PZERO);
+        bzero(&soft->stats, sizeof(soft->stats));
+        soft->stats.depth_max = st->depth;
+        mutex_unlock(&soft->io_queue.lock);
+    }
+}
+
+/*
+ * nvme_hmb_setup: Give a DRAM-less controller its Host Memory Buffer
+ *
+ * Asks for HMPRE capped at nvme_hmb_max_mb, in physically contiguous
+ * chunks of NVME_HMB_CHUNK_BYTES, halving the chunk size whenever
+ * kvpalloc() cannot find one that large, but not below HMMINDS. No more
+ * descriptors than HMMAXD are used. Settles for less than asked as long
+ * as HMMIN is met, otherwise the drive goes without. The memory is only ever touched by the controller.
+ *
+ * Returns:
+ *   1 if the controller accepted the buffer, 0 otherwise (not fatal)
+ */
+int
+nvme_hmb_setup(nvme_soft_t *soft)
+{
+    __uint64_t want, minimum;
+    uint_t chunk, min_chunk, size, pages;
+    uint_t max_chunks;
+    caddr_t p;
+    alenaddr_t phys;
+    nvme_hmb_desc_t *d;
+
+    if (soft->hmpre == 0 || nvme_hmb_max_mb <= 0)
+        return 0;
+
+    want = (__uint64_t)soft->hmpre * 4096;
+    if (want > (__uint64_t)nvme_hmb_max_mb * 1024 * 1024)
+        want = (__uint64_t)nvme_hmb_max_mb * 1024 * 1024;
+    minimum = (__uint64_t)soft->hmmin * 4096;
+    if (want < minimum) {
+        cmn_err(CE_NOTE, "nvme: HMB needs at least %u KB, above the %d MB limit",
+                soft->hmmin * 4, nvme_hmb_max_mb);
+        return 0;
+    }
+
+    soft->hmb_desc = (nvme_hmb_desc_t *)kvpalloc(1, VM_UNCACHED | VM_PHYSCONTIG | VM_DIRECT | VM_NOSLEEP, 0);
+    if (!soft->hmb_desc)
+        return 0;
+    bzero(soft->hmb_desc, NBPP);
+    soft->hmb_desc_phys = pciio_dmatrans_addr(soft->pci_vhdl, 0, kvtophys(soft->hmb_desc), NBPP,
+                                              PCIIO_DMA_CMD | DMATRANS64 | QUEUE_SWAP);
+    if (!soft->hmb_desc_phys)
+        goto fail;
+
+    /* The drive's descriptor limits: entries in the list, and their smallest size */
+    max_chunks = NVME_HMB_MAX_CHUNKS;
+    if (soft->hmmaxd != 0 && soft->hmmaxd < max_chunks)
+        max_chunks = soft->hmmaxd;
+    min_chunk = NBPP;
+    if ((__uint64_t)soft->hmminds * 4096 > min_chunk)
+        min_chunk = (uint_t)ctob(btoc((__uint64_t)soft->hmminds * 4096));
+    chunk = NVME_HMB_CHUNK_BYTES;
+    if (chunk < min_chunk)
+        chunk = min_chunk;
+
+    soft->hmb_bytes = 0;
+    soft->hmb_nchunks = 0;
+    while (soft->hmb_bytes < want && soft->hmb_nchunks < max_chunks) {
+        size = chunk;
+        if (size > want - soft->hmb_bytes)
+            size = (uint_t)(want - soft->hmb_bytes);
+        if (size < min_chunk)
+            size = min_chunk;
+        pages = (uint_t)btoc(size);
+
+        p = kvpalloc(pages, VM_UNCACHED | VM_PHYSCONTIG | VM_DIRECT | VM_NOSLEEP, 0);
+        if (!p) {
+            if (chunk <= min_chunk)
+                break;      /* Nothing the drive would take is left */
+            chunk >>= 1;
+            if (chunk < min_chunk)
+                chunk = min_chunk;
+            continue;
+        }
+        phys = pciio_dmatrans_addr(soft->pci_vhdl, 0, kvtophys(p), ctob(pages),
+                                   PCIIO_DMA_DATA | DMATRANS64);
+        if (!phys) {
+            kvpfree(p, pages);
+            break;
+        }
+
+        d = &soft->hmb_desc[soft->hmb_nchunks];
+        NVME_MEMWR(&d->badd_lo, PHYS64_LO(phys));
+        NVME_MEMWR(&d->badd_hi, PHYS64_HI(phys));
+        NVME_MEMWR(&d->bsize, ctob(pages) / soft->nvme_page_size);
+        NVME_MEMWR(&d->reserved, 0);
+
+        soft->hmb_chunk[soft->hmb_nchunks] = p;
+        soft->hmb_chunk_pages[soft->hmb_nchunks] = pages;
+        soft->hmb_nchunks++;
+        soft->hmb_bytes += ctob(pages);
+    }
+
+    if (soft->hmb_bytes == 0 || soft->hmb_bytes < minimum) {
+        cmn_err(CE_WARN, "nvme: could only allocate %u KB of the %u KB HMB minimum",
+                soft->hmb_bytes / 1024, soft->hmmin * 4);
+        goto fail;
+    }
+
+    if (!nvme_admin_set_hmb(soft, 1))
+        goto fail;
+#ifndef NVME_COMPLETION_MANUAL
+    if (nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000) != 0) {
+        /* A late completion may still hand it over, it is freed once the controller is disabled */
+        cmn_err(CE_WARN, "nvme: Host Memory Buffer Set Features timed out, buffer kept until detach");
+        return 0;
+    }
+#endif
+    if (!soft->hmb_enabled) {
+        cmn_err(CE_WARN, "nvme: controller refused the Host Memory Buffer");
+        goto fail;
+    }
+
+    cmn_err(CE_NOTE, "nvme: Host Memory Buffer enabled, %u KB in %u chunks (preferred %u KB)",
+            soft->hmb_bytes / 1024, soft->hmb_nchunks, soft->hmpre * 4);
+    return 1;
+
+fail:
+    nvme_hmb_free(soft);
+    return 0;
+}
+
+/*
+ * nvme_hmb_free: Release the Host Memory Buffer
+ *
+ * Only once the controller no longer uses it: after Set Features cleared
+ * EHM, or with the controller disabled.
+ */
+void
+nvme_hmb_free(nvme_soft_t *soft)
+{
+    uint_t i;
+
+    for (i = 0; i < soft->hmb_nchunks; i++)
+        kvpfree(soft->hmb_chunk[i], soft->hmb_chunk_pages[i]);
+    soft->hmb_nchunks = 0;
+    soft->hmb_bytes = 0;
+
+    if (soft->hmb_desc) {
+        kvpfree(soft->hmb_desc, 1);
+        soft->hmb_desc = NULL;
+        soft->hmb_desc_phys = 0;
+    }
+}
+
 /*
  * nvme_wait_for_ready: Wait for controller ready status
  *
+ * CSTS.RDY is polled every NVME_READY_POLL_US for the first
+ * NVME_READY_SPIN_MS, which covers most controllers; slower ones are then
+ * checked once a clock tick, sleeping in between, so the bring-up threads
+ * of other controllers get the CPU.
+ *
  * Arguments:
  *   soft       - Controller state
  *   ready      - TRUE to wait for ready, FALSE to wait for not ready
@@ -605,11 +1256,11 @@ nvme_dump_pci_bridge(vertex_hdl_t conn)
 static int
 nvme_wait_for_ready(nvme_soft_t *soft, int ready, uint_t timeout_ms)
 {
+    clock_t deadline = lbolt + drv_usectohz(timeout_ms * 1000);
+    uint_t spins = 0;
     uint_t csts;
-    uint_t iterations = timeout_ms;  /* Check every 1ms */
-    uint_t i;
 
-    for (i = 0; i < iterations; i++) {
+    for (;;) {
         csts = NVME_RD(soft, NVME_REG_CSTS);
 
         if (ready) {
@@ -620,15 +1271,23 @@ nvme_wait_for_ready(nvme_soft_t *soft, int ready, uint_t timeout_ms)
                 return 0;  /* Controller is not ready */
         }
 
-        /* Check for fatal status */
-        if (csts & NVME_CSTS_CFS) {
+        /* A fatal controller never becomes ready, but still stops when disabled */
+        if (ready && (csts & NVME_CSTS_CFS)) {
 #ifdef NVME_DBG
             cmn_err(CE_WARN, "nvme: controller fatal status detected");
 #endif
             return -1;
         }
 
-        us_delay(1000);  /* Delay 1ms */
+        if (lbolt - deadline >= 0)
+            break;
+
+        if (spins < NVME_READY_SPIN_MS * 1000 / NVME_READY_POLL_US) {
+            us_delay(NVME_READY_POLL_US);
+            spins++;
+        } else {
+            delay(1);
+        }
     }
 
 #ifdef NVME_DBG
@@ -754,11 +1413,36 @@ nvme_sanitize(nvme_soft_t *soft)
     return 0;
 }
 
+/*
+ * nvme_coalescing_setup: Configure interrupt coalescing if supported
+ *
+ * Coalesce after 10 completions OR 500 microseconds (whichever comes first)
+ * Time calculation: 10 × 4KB reads over 33MHz PCI ≈ 400us, use 500us for margin
+ * CDW11 format: Threshold (7:0), Time (31:8) in 100us units
+ */
+static void
+nvme_coalescing_setup(nvme_soft_t *soft)
+{
+    uint_t coalesce_value = 10 | (5 << 8);  /* 10 completions, 500us (5 × 100us) */
+
+    if (!soft->features[NVME_FEAT_INTERRUPT_COALESCING])
+        return;
+
+    if (nvme_admin_set_features(soft, NVME_FEAT_INTERRUPT_COALESCING, coalesce_value)) {
+#ifndef NVME_COMPLETION_MANUAL
+        nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000);
+#endif
+        cmn_err(CE_NOTE, "nvme: Interrupt coalescing configured (10 completions, 500us)");
+    } else {
+        cmn_err(CE_WARN, "nvme: Failed to configure interrupt coalescing");
+    }
+}
+
 /*
  * nvme_initialize: Initialize NVMe controller
  *
  * This function:
- * - Allocates admin queue and utility buffer
+ * - Allocates admin queue and admin command buffers
  * - Enables the controller
  * - Queries controller and namespace information (polling mode, no interrupts)
  *
@@ -938,6 +1622,7 @@ nvme_initialize(nvme_soft_t *soft)
     soft->admin_queue.cq_doorbell = 0x1000 + ((2 * 0 + 1) * soft->doorbell_stride);
     soft->admin_queue.cpl_handler = nvme_handle_admin_completion;
     soft->admin_queue.outstanding = 0;
+    soft->admin_queue.parked = 0;
     soft->admin_queue.watchdog_id = 0;
     soft->admin_queue.watchdog_active = 0;
 
@@ -1004,6 +1689,7 @@ nvme_initialize(nvme_soft_t *soft)
     soft->io_queue.vector = 0;
     soft->io_queue.cpl_handler = nvme_handle_io_completion;
     soft->io_queue.outstanding = 0;
+    soft->io_queue.parked = 0;
     soft->io_queue.watchdog_id = 0;
     soft->io_queue.watchdog_active = 0;
 
@@ -1061,31 +1747,17 @@ nvme_initialize(nvme_soft_t *soft)
     cmn_err(CE_NOTE, "nvme: initialized aborted command FIFO");
 #endif
     /*
-     * Allocate utility buffer (1 page for admin commands during init)
-     * This will be used for Identify commands
+     * Admin command slots and their DMA buffers (Identify, Get Log Page)
      */
-    soft->utility_buffer = kvpalloc(1, VM_UNCACHED | VM_PHYSCONTIG | VM_DIRECT | VM_NOSLEEP, 0);
-    if (!soft->utility_buffer) {
+    if (nvme_admin_pool_init(soft) != 0) {
 #ifdef NVME_DBG
-        cmn_err(CE_WARN, "nvme: failed to allocate utility buffer");
+        cmn_err(CE_WARN, "nvme: failed to allocate admin buffers");
 #endif
         goto err_free_alenlist;
     }
-#ifdef NVME_UTILBUF_USEDMAP
-    soft->utility_buffer_dmamap = pciio_dmamap_alloc(soft->pci_vhdl, NULL,
-                                                     NBPP,
-                                                     UTILBUF_DMA_TYPE);
-    soft->utility_buffer_phys = pciio_dmamap_addr(soft->utility_buffer_dmamap,
-                                                  kvtophys(soft->utility_buffer),
-                                                  NBPP);
 
-#else    
-    /* Get physical address for utility buffer - use pciio_dmatrans_addr for proper PCI DMA mapping */
-    soft->utility_buffer_phys = pciio_dmatrans_addr(soft->pci_vhdl, 0,
-                                                     kvtophys(soft->utility_buffer),
-                                                     NBPP,  /* 1 page */
-                                                     UTILBUF_DMA_TYPE | DMATRANS64);
-#endif
+    /* SMART / Health cache, refreshed in the background for LOG SENSE */
+    init_mutex(&soft->smart_lock, MUTEX_DEFAULT, "nvme_smart", 0);
 #ifdef NVME_DBG
     cmn_err(CE_NOTE, "nvme: allocated admin queue (size=%u, shift=%u) at phys SQ=%llx CQ=%llx",
             soft->admin_queue.size, soft->admin_queue.size_shift,
@@ -1155,7 +1827,7 @@ nvme_initialize(nvme_soft_t *soft)
     /*  Wait for controller to become ready (timeout from CAP.TO) */
     if (nvme_wait_for_ready(soft, 1, 60000) != 0) {
         cmn_err(CE_WARN, "nvme: controller failed to become ready");
-        goto err_free_utility_buffer;
+        goto err_free_admin_pool;
     }
 
 #ifdef NVME_DBG
@@ -1172,7 +1844,7 @@ nvme_initialize(nvme_soft_t *soft)
 #endif /* NVME_DBG_EXTRA */
 
     if (!nvme_admin_identify_controller(soft)) {
-        goto err_free_utility_buffer;
+        goto err_free_admin_pool;
     }
 
 #ifdef NVME_DBG_EXTRA
@@ -1182,22 +1854,35 @@ nvme_initialize(nvme_soft_t *soft)
 #ifndef NVME_COMPLETION_MANUAL
     nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000);
 #endif
-    if (!nvme_admin_identify_namespace(soft)) {
-        goto err_free_utility_buffer;
-    }
+
+    /* Verify and Write Zeroes size limits, NVMe 2.0 */
+    soft->vsl = 0;
+    soft->wzsl = 0;
+    if ((soft->oncs_verify || soft->oncs_write_zeroes) && soft->vs >= NVME_VS_2_0 &&
+        nvme_admin_identify_ctrl_nvm(soft)) {
 #ifndef NVME_COMPLETION_MANUAL
-    nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000);
+        nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000);
 #endif
+    }
+
+    /* Every active namespace becomes a LUN */
+    if (nvme_ns_scan(soft) == 0) {
+        cmn_err(CE_WARN, "nvme: no active namespaces");
+        goto err_free_admin_pool;
+    }
+    /* MDTS and LBADS are both known now */
+    nvme_compute_transfer_geometry(soft);
+
     if (!nvme_admin_create_cq(soft, soft->io_queue.qid, soft->io_queue.size,
                               soft->io_queue.cq_phys, soft->io_queue.vector)) {
-        goto err_free_utility_buffer;
+        goto err_free_admin_pool;
     }
 #ifndef NVME_COMPLETION_MANUAL
     nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000);
 #endif
     if (!nvme_admin_create_sq(soft, soft->io_queue.qid, soft->io_queue.size,
                               soft->io_queue.sq_phys, soft->io_queue.qid)) {
-        goto err_free_utility_buffer;
+        goto err_free_admin_pool;
     }
 #ifndef NVME_COMPLETION_MANUAL
     nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000);
@@ -1209,23 +1894,40 @@ nvme_initialize(nvme_soft_t *soft)
         /* Non-fatal - continue initialization even if feature query fails */
     }
 
-    /* Configure interrupt coalescing if supported
-     * Coalesce after 10 completions OR 500 microseconds (whichever comes first)
-     * Time calculation: 10 × 4KB reads over 33MHz PCI ≈ 400us, use 500us for margin
-     * CDW11 format: Threshold (7:0), Time (31:8) in 100us units */
-    if (soft->features[NVME_FEAT_INTERRUPT_COALESCING]) {
-        uint_t coalesce_value = 10 | (5 << 8);  /* 10 completions, 500us (5 × 100us) */
-
-        if (nvme_admin_set_features(soft, NVME_FEAT_INTERRUPT_COALESCING, coalesce_value)) {
+    /* Read the write cache state reported in the caching mode page */
+    if (soft->vwc_present) {
+        if (nvme_admin_get_vwc(soft)) {
 #ifndef NVME_COMPLETION_MANUAL
             nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000);
 #endif
-            cmn_err(CE_NOTE, "nvme: Interrupt coalescing configured (10 completions, 500us)");
+            cmn_err(CE_NOTE, "nvme: volatile write cache %s",
+                    soft->vwc_enabled ? "enabled" : "disabled");
         } else {
-            cmn_err(CE_WARN, "nvme: Failed to configure interrupt coalescing");
+            cmn_err(CE_WARN, "nvme: failed to read the volatile write cache setting");
         }
     }
 
+    nvme_coalescing_setup(soft);
+
+    /* DRAM-less drives keep their mapping tables in host memory */
+    nvme_hmb_setup(soft);
+
+    /* Pick the thermal pacing point */
+    nvme_thermal_init(soft);
+
+    /* Prime the SMART cache, the timeout watchdog keeps it fresh from here on */
+    if (nvme_admin_get_log_page_smart(soft)) {
+#ifndef NVME_COMPLETION_MANUAL
+        nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000);
+#endif
+    }
+
+    /* From here on health changes arrive as events */
+    nvme_aer_start(soft);
+
+    /* Timeouts and fatal status from here on end in a reset, not a reload */
+    nvme_start_reset_thread(soft);
+
     /* Start timeout watchdog for checking hung commands */
     nvme_timeout_watchdog_start(soft);
 
@@ -1236,11 +1938,9 @@ nvme_initialize(nvme_soft_t *soft)
     return 0;
 
     /* Error cleanup path - free resources in reverse order of allocation */
-err_free_utility_buffer:
-    if (soft->utility_buffer) {
-        kvpfree(soft->utility_buffer, 1);
-        soft->utility_buffer = NULL;
-    }
+err_free_admin_pool:
+    mutex_destroy(&soft->smart_lock);
+    nvme_admin_pool_done(soft);
 
 err_free_alenlist:
     if (soft->alenlist) {
@@ -1285,20 +1985,92 @@ err_out:
 }
 
 /*
- * nvme_wait_for_queue_idle: Wait for queue to drain all outstanding commands
+ * nvme_admin_sleep: Wait for the admin commands in flight without polling
  *
- * Polls the completion queue until all outstanding commands complete or timeout.
- * Returns 0 on success (queue idle), -1 on timeout.
+ * See nvme_admin_waiter_t. Idle means no admin slot is held apart from the
+ * parked AERs; slots are released after their done callback, so whatever
+ * the callbacks stored is visible once this returns 0.
+ *
+ * Returns 0 once idle, -1 on timeout.
  */
-int
-nvme_wait_for_queue_idle(nvme_soft_t *soft, nvme_queue_t *q, uint_t timeout_ms)
+static int
+nvme_admin_sleep(nvme_soft_t *soft, uint_t timeout_ms)
 {
-    int elapsed_ms = 0;
+    nvme_queue_t *q = &soft->admin_queue;
+    nvme_admin_waiter_t w, **wp;
+    clock_t deadline = lbolt + drv_usectohz(timeout_ms * 1000);
+    int busy;
+
+    initnsema(&w.sema, 0, "nvme_admin_wait");
+    mutex_lock(&soft->admin_lock, PZERO);
+    w.next = soft->admin_waiters;
+    soft->admin_waiters = &w;
+    mutex_unlock(&soft->admin_lock);
+
+    for (;;) {
+        busy = (int)soft->admin_busy - q->parked;
+        if (busy <= 0 || lbolt - deadline >= 0)
+            break;
+        psema(&w.sema, PZERO);
+
+        /* A watchdog tick also lands here: reap what a lost interrupt left */
+        nvme_process_completions(soft, q);
+    }
+
+    mutex_lock(&soft->admin_lock, PZERO);
+    for (wp = &soft->admin_waiters; *wp != &w; wp = &(*wp)->next)
+        ;
+    *wp = w.next;
+    mutex_unlock(&soft->admin_lock);
+    freesema(&w.sema);
+
+#ifdef NVME_DBG
+    if (busy > 0)
+        cmn_err(CE_WARN, "nvme_admin_sleep: timeout with %d admin commands in flight", busy);
+#endif
+    return busy > 0 ? -1 : 0;
+}
+
+/*
+ * nvme_admin_wakeup: Post every thread sleeping in nvme_admin_sleep()
+ *
+ * Called after each admin completion and on each timeout watchdog tick.
+ */
+void
+nvme_admin_wakeup(nvme_soft_t *soft)
+{
+    nvme_admin_waiter_t *w;
+
+    if (soft->admin_waiters == NULL)
+        return;
+
+    mutex_lock(&soft->admin_lock, PZERO);
+    for (w = soft->admin_waiters; w != NULL; w = w->next)
+        vsema(&w->sema);
+    mutex_unlock(&soft->admin_lock);
+}
+
+/*
+ * nvme_wait_for_queue_idle: Wait for queue to drain all outstanding commands
+ *
+ * Admin waits sleep in nvme_admin_sleep() once completions are reaped for
+ * us (soft->admin_sleep). Otherwise, during attach and shutdown, this polls
+ * the completion queue every 100us until all outstanding commands complete
+ * or timeout. Parked commands (Asynchronous Event Requests) do not count.
+ * Returns 0 on success (queue idle), -1 on timeout.
+ */
+int
+nvme_wait_for_queue_idle(nvme_soft_t *soft, nvme_queue_t *q, uint_t timeout_ms)
+{
+    uint_t elapsed_us = 0;
     int processed;
     int outstanding;
 
+    if (q == &soft->admin_queue && soft->admin_sleep)
+        return nvme_admin_sleep(soft, timeout_ms);
+
     /* Read outstanding counter atomically */
-    outstanding = atomicAddInt((int *)&q->outstanding, 0);
+    outstanding = atomicAddInt((int *)&q->outstanding, 0) - q->parked;
 
 #ifdef NVME_DBG
     cmn_err(CE_NOTE, "nvme_wait_for_queue_idle: waiting for queue %d (outstanding=%d, timeout=%dms)",
@@ -1306,7 +2078,7 @@ nvme_wait_for_queue_idle(nvme_soft_t *soft, nvme_queue_t *q, uint_t timeout_ms)
 #endif
 
     /* Poll completions until queue is idle or timeout */
-    while (outstanding > 0 && elapsed_ms < timeout_ms) {
+    while (outstanding > 0 && elapsed_us < timeout_ms * 1000) {
         processed = nvme_process_completions(soft, q);
 
 #ifdef NVME_DBG_EXTRA
@@ -1317,15 +2089,15 @@ nvme_wait_for_queue_idle(nvme_soft_t *soft, nvme_queue_t *q, uint_t timeout_ms)
 #endif
 
         /* Re-read outstanding counter atomically */
-        outstanding = atomicAddInt((int *)&q->outstanding, 0);
+        outstanding = atomicAddInt((int *)&q->outstanding, 0) - q->parked;
 
         if (outstanding == 0) {
             break;
         }
 
-        /* Sleep 1ms between polls */
-        us_delay(1000);
-        elapsed_ms++;
+        /* Spin 100us between polls, a millisecond adds up over attach */
+        us_delay(100);
+        elapsed_us += 100;
     }
 
     if (outstanding > 0) {
@@ -1337,7 +2109,7 @@ nvme_wait_for_queue_idle(nvme_soft_t *soft, nvme_queue_t *q, uint_t timeout_ms)
     }
 
 #ifdef NVME_DBG
-    cmn_err(CE_NOTE, "nvme_wait_for_queue_idle: queue %d is idle (took %dms)", q->qid, elapsed_ms);
+    cmn_err(CE_NOTE, "nvme_wait_for_queue_idle: queue %d is idle (took %dus)", q->qid, elapsed_us);
 #endif
     return 0;
 }
@@ -1356,19 +2128,38 @@ nvme_shutdown(nvme_soft_t *soft)
     cmn_err(CE_NOTE, "nvme: shutting down controller");
 #endif
 
+    /* Let a reset in progress finish, it restarts the watchdog */
+    nvme_stop_reset_thread(soft);
+
     /* Stop timeout watchdog - no more commands should time out */
     nvme_timeout_watchdog_stop(soft);
 
-    /* Wait for any in-flight I/O commands to complete (5 second timeout) */
+    /* Nothing bounds a sleeping admin wait without the watchdog, poll from here */
+    soft->admin_sleep = 0;
+
+    /* AERs stay parked on the controller until it is disabled; an event
+     * arriving now is handled but not asked for again */
+    soft->aer_stop = 1;
+
+    /* Park new requests and let the ones in flight complete, nvme_quiesce()
+     * reports progress; whatever is parked is failed once the queues are gone */
 #ifdef NVME_DBG
     cmn_err(CE_NOTE, "nvme: waiting for I/O queue to drain");
 #endif
-    nvme_wait_for_queue_idle(soft, &soft->io_queue, 5000);
+    nvme_quiesce(soft, NVME_QUIESCE_TIMEOUT_MS);
 
     /* Stop completion watchdog timers */
     nvme_watchdog_stop(&soft->io_queue);
     nvme_watchdog_stop(&soft->admin_queue);
 
+    /* Take the Host Memory Buffer back while the controller can still flush its tables */
+    if (soft->hmb_enabled) {
+        if (nvme_admin_set_hmb(soft, 0))
+            nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000);
+        if (soft->hmb_enabled)
+            cmn_err(CE_WARN, "nvme: failed to disable the Host Memory Buffer");
+    }
+
     /*
      * Delete I/O queues using admin commands (must happen BEFORE disabling controller)
      * This is the proper NVMe shutdown sequence:
@@ -1437,10 +2228,17 @@ nvme_shutdown(nvme_soft_t *soft)
     /* Wait for controller to become not ready */
     nvme_wait_for_ready(soft, 0, 5000);
 
-    /* Free utility buffer */
-    if (soft->utility_buffer) {
-        kvpfree(soft->utility_buffer, 1);
-        soft->utility_buffer = NULL;
+    /* The controller is disabled, its Host Memory Buffer can go */
+    nvme_hmb_free(soft);
+
+    /* Requests parked since nvme_quiesce() will not be issued again */
+    if (soft->quiesce_head && nvme_quiesce_release(soft, 0))
+        cmn_err(CE_NOTE, "nvme: failed requests parked at shutdown");
+
+    /* Free admin slots and buffers */
+    if (soft->admin_bufs) {
+        mutex_destroy(&soft->smart_lock);
+        nvme_admin_pool_done(soft);
     }
 
     /* Free alenlist */
@@ -1458,9 +2256,7 @@ nvme_shutdown(nvme_soft_t *soft)
 
     /* Destroy aborted command tracking lock */
     mutex_destroy(&soft->aborted_lock);
-#ifdef NVME_UTILBUF_USEDMAP
-    pciio_dmamap_free(soft->utility_buffer_dmamap);
-#endif
+    mutex_destroy(&soft->quiesce_lock);
 
     /* Free I/O queue */
     if (soft->io_queue.sq) {
@@ -1650,6 +2446,8 @@ nvme_disable_interrupts(nvme_soft_t *soft)
 
 static vertex_hdl_t nvme_pcie_bridge_conn = 0;
 static unsigned int nvme_dev_counter = 0;
+static int nvme_adap_next = 0;                  /* Lowest adapter number not yet reserved */
+static volatile int nvme_attach_pending = 0;    /* Bring-up threads still running */
 
 /*
  * nvme_attach: called by pciio infrastructure for each PCI device
@@ -1668,7 +2466,6 @@ nvme_attach(vertex_hdl_t conn)
     pciio_info_t        pciioinfo;
     size_t              bar0_size;
     int                 rc;
-    graph_error_t       rv;
 
     if (!conn) {
         cmn_err(CE_WARN, "nvme_attach: PCI device #%d conn is 0");    
@@ -1883,6 +2680,53 @@ nvme_attach(vertex_hdl_t conn)
 #endif
     }
 
+    /*
+     * Reserve the adapter number now, in PCI order; the inventory scan
+     * cannot see controllers whose bring-up is still running
+     */
+    soft->adap = nvme_get_next_adapter_num();
+    if (soft->adap < nvme_adap_next)
+        soft->adap = nvme_adap_next;
+    nvme_adap_next = soft->adap + 1;
+
+    /*
+     * Sanitize, initialize and register in a thread of this controller's
+     * own, so several controllers come up side by side
+     */
+    atomicAddInt(&nvme_attach_pending, 1);
+    sthread_create("nvme_attach",
+                    NULL, 2 * KTHREAD_DEF_STACKSZ, /* stack/stack size */
+                    0, /* flags */
+                    scsi_intr_pri, /* some priority */
+                    KT_PS, /* scheduling flags PS - priority scheduled */
+                    nvme_attach_thread,
+                    (void *)soft, /* arg0 */
+                    0, 0, 0); /* rest of args */
+
+#ifdef NVME_DBG
+    cmn_err(CE_NOTE, "nvme_attach: bring-up of adapter %d started", soft->adap);
+#endif
+    return 0;
+}
+
+/*
+ * nvme_attach_controller: Bring up a controller mapped by nvme_attach()
+ *
+ * Runs in nvme_attach_thread(). Sanitizes and initializes the controller,
+ * turns on completion delivery, then registers the SCSI controller and one
+ * LUN per namespace. On failure everything including soft is released.
+ *
+ * Returns:
+ *   0 on success, -1 on failure
+ */
+static int
+nvme_attach_controller(nvme_soft_t *soft)
+{
+    vertex_hdl_t        conn = soft->pci_vhdl;
+    pciio_piomap_t      bar0_map = soft->bar0_map;
+    pciio_info_t        pciioinfo = pciio_info_get(conn);
+    graph_error_t       rv;
+
     /*
      * Sanitize and initialize controller
      */
@@ -1910,6 +2754,7 @@ nvme_attach(vertex_hdl_t conn)
         we want to set 3 to match expansion slot
 */
     /* Initialize quiesce state - not quiesced by default */
+    init_mutex(&soft->quiesce_lock, MUTEX_DEFAULT, "nvme_quiesce", 0);
     soft->quiesce_state = NO_QUIESCE_IN_PROGRESS;
 
     /*
@@ -1929,6 +2774,15 @@ nvme_attach(vertex_hdl_t conn)
         DEL(soft);
         return -1;
     }
+    /* Admin waits sleep from here on, see nvme_admin_sleep() */
+    soft->admin_sleep = soft->interrupts_enabled;
+#endif
+#ifdef NVME_COMPLETION_THREAD
+    soft->admin_sleep = 1;
+#endif
+#ifdef NVME_EMULATE_512
+    /* Read-modify-write engine for 512-byte blocks on larger namespace blocks */
+    nvme_emul_start(soft);
 #endif
 
 #ifdef NVME_TEST
@@ -1950,11 +2804,7 @@ nvme_attach(vertex_hdl_t conn)
         /* Get PCI slot number for logging */
         slot = pciio_info_slot_get(pciioinfo);
 
-        /* Find next available adapter number by scanning inventory 
-           FIXME - let ioconfig do it for us and use ioctl?
-        */
-        soft->adap = nvme_get_next_adapter_num();
-
+        /* Adapter number was reserved by nvme_attach() */
         cmn_err(CE_NOTE, "nvme_attach: PCI slot=%d, assigned adapter=%d", slot, soft->adap);
 
         /* Create SCSI controller vertex under the PCI connection */
@@ -2064,70 +2914,80 @@ nvme_attach(vertex_hdl_t conn)
                 soft->adap);
 
         /*
-         * Probe target and LUN during attach
-         * We present namespace 1 as target 0, LUN 0
+         * Probe target and LUNs during attach
+         * We present each active namespace as a LUN of target 0
          * The SCSI upper layer will call SOP_SCAN, but we'll just return success
          * since we're doing the actual probing here.
          */
         {
             vertex_hdl_t lun_vhdl;
             uint_t targ = 0;
-            uint_t lun = 0;
+            uint_t lun;
+            nvme_ns_t *ns;
+
+            for (lun = 0; lun < soft->ns_count; lun++) {
+                ns = &soft->ns[lun];
 
-            /* Create target and LUN vertices */
-            lun_vhdl = scsi_device_add(ctlr_vhdl, targ, lun);
-            if (lun_vhdl == GRAPH_VERTEX_NONE) {
+                /* Create target and LUN vertices */
+                lun_vhdl = scsi_device_add(ctlr_vhdl, targ, lun);
+                if (lun_vhdl == GRAPH_VERTEX_NONE) {
 #ifdef NVME_DBG
-                cmn_err(CE_WARN, "nvme_attach: unable to create device vertices");
+                    cmn_err(CE_WARN, "nvme_attach: unable to create device vertices for lun %d", lun);
 #endif
-                hwgraph_vertex_destroy(ctlr_vhdl);
-                nvme_shutdown(soft);
-                pciio_piomap_free(bar0_map);
-                DEL(soft);
-                return -1;
-            }
-
-            /*
-             * Add inventory for the disk device
-             */
-            device_inventory_add(lun_vhdl,
-                                INV_DISK,      /* class: disk */
-                                INV_SCSIDRIVE, /* type: SCSI drive */
-                                soft->adap,    /* controller number */
-                                targ,          /* unit (target ID) */
-                                0);            /* state */
-
-            /*
-             * Initialize SCSI target info structure
-             * Note: We zero the data buffers but NOT tinfo itself since
-             * nvme_init_scsi_target_info will set all fields
-             */
-            bzero(soft->inq_data, sizeof(soft->inq_data));
-            bzero(soft->sense_data, sizeof(soft->sense_data));
-
-            /* Build INQUIRY data from NVMe controller info */
-            nvme_build_inquiry_data(soft, soft->inq_data);
+                    if (lun > 0) {
+                        /* Keep the LUNs already presented */
+                        soft->ns_count = lun;
+                        break;
+                    }
+                    hwgraph_vertex_destroy(ctlr_vhdl);
+                    nvme_shutdown(soft);
+                    pciio_piomap_free(bar0_map);
+                    DEL(soft);
+                    return -1;
+                }
 
-            /* Initialize SCSI target info structure */
-            nvme_init_scsi_target_info(soft);
+                /*
+                 * Add inventory for the disk device
+                 */
+                device_inventory_add(lun_vhdl,
+                                    INV_DISK,      /* class: disk */
+                                    INV_SCSIDRIVE, /* type: SCSI drive */
+                                    soft->adap,    /* controller number */
+                                    targ,          /* unit (target ID) */
+                                    0);            /* state */
+
+                /*
+                 * Initialize SCSI target info structure
+                 * Note: We zero the data buffers but NOT tinfo itself since
+                 * nvme_init_scsi_target_info will set all fields
+                 */
+                bzero(ns->inq_data, sizeof(ns->inq_data));
+                bzero(ns->sense_data, sizeof(ns->sense_data));
+
+                /* Build INQUIRY data from NVMe controller info */
+                nvme_build_inquiry_data(soft, ns->inq_data);
+
+                /* Initialize SCSI target info structure */
+                nvme_init_scsi_target_info(ns);
 
 #ifdef NVME_DBG
-            cmn_err(CE_NOTE, "nvme_attach: AFTER INIT soft=%p inq_data=%p sense_data=%p",
-                    soft, soft->inq_data, soft->sense_data);
+                cmn_err(CE_NOTE, "nvme_attach: AFTER INIT soft=%p inq_data=%p sense_data=%p",
+                        soft, ns->inq_data, ns->sense_data);
 #endif
-            /*
-             * Notify SCSI layer about the device by providing INQUIRY data
-             * This triggers dksc (disk driver) to attach and create disk/volume vertices
-             */
-            scsi_device_update(soft->inq_data, lun_vhdl);
+                /*
+                 * Notify SCSI layer about the device by providing INQUIRY data
+                 * This triggers dksc (disk driver) to attach and create disk/volume vertices
+                 */
+                scsi_device_update(ns->inq_data, lun_vhdl);
 
 #ifdef NVME_DBG
-            cmn_err(CE_NOTE, "nvme_attach: created SCSI target %d lun %d for namespace %d",
-                    targ, lun, soft->nsid);
-            cmn_err(CE_NOTE, "nvme_attach: added disk inventory: class=INV_DISK, type=INV_SCSIDRIVE, ctlr=%d, unit=%d",
-                    soft->adap, targ);
-            cmn_err(CE_NOTE, "nvme_attach: called scsi_device_update to create disk vertices");
+                cmn_err(CE_NOTE, "nvme_attach: created SCSI target %d lun %d for namespace %d",
+                        targ, lun, ns->nsid);
+                cmn_err(CE_NOTE, "nvme_attach: added disk inventory: class=INV_DISK, type=INV_SCSIDRIVE, ctlr=%d, unit=%d",
+                        soft->adap, targ);
+                cmn_err(CE_NOTE, "nvme_attach: called scsi_device_update to create disk vertices");
 #endif
+            }
         }
     }
 
@@ -2147,28 +3007,60 @@ nvme_attach(vertex_hdl_t conn)
     return 0;
 }
 
+/*
+ * nvme_attach_thread: Per-controller bring-up thread started by nvme_attach()
+ */
+static void
+nvme_attach_thread(void *arg)
+{
+    nvme_soft_t *soft = (nvme_soft_t *)arg;
+    int adap = soft->adap;
+
+    if (nvme_attach_controller(soft) != 0)
+        cmn_err(CE_WARN, "nvme_attach: adapter %d did not come up", adap);
+
+    atomicAddInt(&nvme_attach_pending, -1);
+}
+
+/*
+ * nvme_attach_wait: Wait until every started bring-up thread has finished
+ */
+static void
+nvme_attach_wait(void)
+{
+    while (atomicAddInt(&nvme_attach_pending, 0) > 0)
+        delay(drv_usectohz(10000));  /* 10ms */
+}
+
 /*
  * nvme_remove_disk_aliases: Remove disk device aliases from /hw/disk or /hw/rdisk
+ *
+ * LUN 0 is dks<c>d<t>, other LUNs are dks<c>d<t>l<lun>.
  */
 static void
-nvme_remove_disk_aliases(char *disk_label, uint_t adap, uint_t targ)
+nvme_remove_disk_aliases(char *disk_label, uint_t adap, uint_t targ, uint_t lun)
 {
     vertex_hdl_t disk_vhdl;
+    char dks_base[24];
     char dks_name[32];
     int part;
 
+    if (lun == 0)
+        sprintf(dks_base, "dks%dd%d", SCSI_EXT_CTLR(adap), targ);
+    else
+        sprintf(dks_base, "dks%dd%dl%d", SCSI_EXT_CTLR(adap), targ, lun);
+
     if (hwgraph_traverse(hwgraph_root, disk_label, &disk_vhdl) == GRAPH_SUCCESS) {
         /* Remove whole disk entry */
-        sprintf(dks_name, "dks%dd%d", SCSI_EXT_CTLR(adap), targ);
-        hwgraph_edge_remove(disk_vhdl, dks_name, NULL);
+        hwgraph_edge_remove(disk_vhdl, dks_base, NULL);
 
         /* Remove partition entries (vh, vol, s0-s15) */
-        sprintf(dks_name, "dks%dd%dvh", SCSI_EXT_CTLR(adap), targ);
+        sprintf(dks_name, "%svh", dks_base);
         hwgraph_edge_remove(disk_vhdl, dks_name, NULL);
-        sprintf(dks_name, "dks%dd%dvol", SCSI_EXT_CTLR(adap), targ);
+        sprintf(dks_name, "%svol", dks_base);
         hwgraph_edge_remove(disk_vhdl, dks_name, NULL);
         for (part = 0; part < 16; part++) {
-            sprintf(dks_name, "dks%dd%ds%d", SCSI_EXT_CTLR(adap), targ, part);
+            sprintf(dks_name, "%ss%d", dks_base, part);
             hwgraph_edge_remove(disk_vhdl, dks_name, NULL);
         }
     }
@@ -2183,7 +3075,7 @@ nvme_detach(vertex_hdl_t conn)
     nvme_soft_t        *soft;
     vertex_hdl_t        ctlr_vhdl;
     uint_t              targ = 0;
-    uint_t              lun = 0;
+    uint_t              lun;
     uint_t              class_code;
     pciio_info_t        pciioinfo;
 
@@ -2214,6 +3106,9 @@ nvme_detach(vertex_hdl_t conn)
         return -1;
     }
 
+    /* A controller still coming up has no SCSI vertex yet */
+    nvme_attach_wait();
+
     /* Get SCSI controller vertex from the "scsi" edge on the PCI connection */
     if (hwgraph_edge_get(conn, EDGE_LBL_SCSI, &ctlr_vhdl) != GRAPH_SUCCESS) {
 #ifdef NVME_DBG
@@ -2242,18 +3137,19 @@ nvme_detach(vertex_hdl_t conn)
     }
 
     /* Remove inventory entries BEFORE removing vertices */
-    {
+    for (lun = 0; lun < soft->ns_count; lun++) {
         vertex_hdl_t lun_vhdl = scsi_lun_vhdl_get(ctlr_vhdl, targ, lun);
         if (lun_vhdl != GRAPH_VERTEX_NONE) {
             /* Remove disk inventory (-1 matches any value) */
             hwgraph_inventory_remove(lun_vhdl, -1, -1, -1, -1, -1);
         }
-        /* Remove controller inventory (-1 matches any value) */
-        hwgraph_inventory_remove(ctlr_vhdl, -1, -1, -1, -1, -1);
     }
+    /* Remove controller inventory (-1 matches any value) */
+    hwgraph_inventory_remove(ctlr_vhdl, -1, -1, -1, -1, -1);
 
-    /* Remove SCSI device (LUN and target vertices) */
-    scsi_device_remove(ctlr_vhdl, targ, lun);
+    /* Remove SCSI devices (LUN and target vertices) */
+    for (lun = 0; lun < soft->ns_count; lun++)
+        scsi_device_remove(ctlr_vhdl, targ, lun);
 
     /* Remove /hw/scsi_ctlr/%d link */
     {
@@ -2266,9 +3162,15 @@ nvme_detach(vertex_hdl_t conn)
     }
 
     /* Remove disk device aliases (dks entries in /hw/disk and /hw/rdisk) */
-    nvme_remove_disk_aliases(EDGE_LBL_DISK, soft->adap, targ);
-    nvme_remove_disk_aliases(EDGE_LBL_RDISK, soft->adap, targ);
+    for (lun = 0; lun < soft->ns_count; lun++) {
+        nvme_remove_disk_aliases(EDGE_LBL_DISK, soft->adap, targ, lun);
+        nvme_remove_disk_aliases(EDGE_LBL_RDISK, soft->adap, targ, lun);
+    }
 
+#ifdef NVME_EMULATE_512
+    /* Fail queued read-modify-write work while completions still arrive */
+    nvme_emul_stop(soft);
+#endif
 #ifdef NVME_COMPLETION_INTERRUPT
     /* Disable interrupts */
     nvme_disable_interrupts(soft);
@@ -2437,6 +3339,471 @@ nvme_stop_poll_thread(nvme_soft_t *soft)
 #endif
 }
 
+/* =====================================================================
+ *    Controller Reset and Replay
+ * =====================================================================
+ */
+
+/*
+ * nvme_queue_restart: Empty a queue the controller no longer uses
+ *
+ * Called with q->lock held, after the controller was disabled or the queue
+ * deleted; the next command goes to entry 0 of a queue created again.
+ */
+static void
+nvme_queue_restart(nvme_queue_t *q)
+{
+    q->sq_head = 0;
+    q->sq_tail = 0;
+    q->cq_head = q->size;  /* Start with phase = 1 */
+    q->outstanding = 0;
+    bzero(q->cq, q->size * NVME_CQ_ENTRY_SIZE);
+}
+
+/*
+ * nvme_reset_thread: Kernel thread that runs I/O queue recreations and
+ * controller resets
+ *
+ * Sleeps on reset_sema until nvme_reset_request() posts it; recovery waits
+ * on the controller and on admin commands, which the timeout watchdog
+ * that usually asks for it cannot do. A queue recreation that fails turns
+ * into a controller reset.
+ */
+void
+nvme_reset_thread(void *arg)
+{
+    nvme_soft_t *soft = (nvme_soft_t *)arg;
+
+    while (!soft->reset_shutdown) {
+        psema(&soft->reset_sema, PZERO);
+
+        if (soft->reset_shutdown) {
+            break;
+        }
+
+        if (soft->reset_active == NVME_RESET_QUEUE && nvme_queue_recreate(soft) == 0)
+            continue;
+        nvme_ctlr_reset(soft);
+    }
+
+    soft->reset_thread_running = 0;
+}
+
+/*
+ * nvme_start_reset_thread: Start the controller reset thread
+ *
+ * Called at the end of controller initialization.
+ */
+void
+nvme_start_reset_thread(nvme_soft_t *soft)
+{
+    initnsema(&soft->reset_sema, 0, "nvme_reset");
+
+    soft->reset_shutdown = 0;
+    soft->reset_active = 0;
+    soft->ctlr_failed = 0;
+    soft->reset_thread_running = 1;
+
+    sthread_create("nvme_reset",
+                    NULL, 2 * KTHREAD_DEF_STACKSZ, /* stack/stack size */
+                    0, /* flags */
+                    scsi_intr_pri, /* some priority */
+                    KT_PS, /* scheduling flags PS - priority scheduled */
+                    nvme_reset_thread,
+                    (void *)soft, /* arg0 */
+                    0, 0, 0); /* rest of args */
+}
+
+/*
+ * nvme_stop_reset_thread: Stop the controller reset thread
+ *
+ * Called during driver shutdown. A reset in progress is finished first,
+ * a requested one that has not started is dropped.
+ */
+void
+nvme_stop_reset_thread(nvme_soft_t *soft)
+{
+    if (!soft->reset_thread_running) {
+        return;
+    }
+
+    soft->reset_shutdown = 1;
+    vsema(&soft->reset_sema);
+
+    while (soft->reset_thread_running) {
+        delay(drv_usectohz(10000));  /* 10ms */
+    }
+
+    freesema(&soft->reset_sema);
+}
+
+/*
+ * nvme_reset_request: Ask the reset thread for recovery
+ *
+ * Never sleeps, callable from the timeout watchdog. A pending or running
+ * queue recreation is raised to a controller reset. From here until the
+ * recovery is done nvme_scsi_command() answers busy.
+ *
+ * Arguments:
+ *   soft  - Controller state
+ *   level - NVME_RESET_QUEUE or NVME_RESET_CTLR
+ *   why   - For the console
+ *
+ * Returns:
+ *   1 if recovery is pending or running now, 0 if there is no reset thread
+ */
+int
+nvme_reset_request(nvme_soft_t *soft, int level, char *why)
+{
+    int cur;
+
+    if (!soft->reset_thread_running || soft->reset_shutdown)
+        return 0;
+
+    cur = soft->reset_active;
+    if (cur >= level || !compare_and_swap_int((int *)&soft->reset_active, cur, level))
+        return 1;   /* Already on its way */
+
+    cmn_err(CE_WARN, "nvme: %s, %s", why,
+            level == NVME_RESET_CTLR ? "resetting the controller" : "recreating the I/O queue pair");
+    if (cur == 0)
+        vsema(&soft->reset_sema);
+    return 1;
+}
+
+/*
+ * nvme_reset_capture: Collect the I/O commands the controller no longer holds
+ *
+ * Called once the controller is disabled or the I/O submission queue is
+ * deleted. Completions already posted are reaped first; whatever is still
+ * on the I/O queue after that never completed. Those CIDs go to cids in
+ * submission order, so fused pairs stay adjacent, and the I/O queue is
+ * emptied. The CIDs, their requests and PRP lists stay allocated.
+ *
+ * Returns the number of CIDs.
+ */
+static uint_t
+nvme_reset_capture(nvme_soft_t *soft, ushort_t *cids)
+{
+    nvme_queue_t *q = &soft->io_queue;
+    nvme_cmd_info_t *ci;
+    uint_t cid, i, n = 0;
+
+    nvme_process_completions(soft, &soft->admin_queue);
+    nvme_process_completions(soft, q);
+
+    mutex_lock(&soft->io_requests_lock, PZERO);
+    mutex_lock(&q->lock, PZERO);
+    for (cid = 0; cid < NVME_IO_QUEUE_SIZE; cid++) {
+        ci = &soft->io_requests[cid];
+        if (!(soft->io_cid_bitmap[cid >> 5u] & (1u << (cid & 0x1F))) || !ci->submitted)
+            continue;
+        for (i = n; i > 0 && (int)(soft->io_requests[cids[i - 1]].seq - ci->seq) > 0; i--)
+            cids[i] = cids[i - 1];
+        cids[i] = (ushort_t)cid;
+        n++;
+    }
+    nvme_queue_restart(q);
+    mutex_unlock(&q->lock);
+    mutex_unlock(&soft->io_requests_lock);
+
+    return n;
+}
+
+/*
+ * nvme_reset_replay: Submit captured commands again on the new I/O queue
+ *
+ * In batches the queue can hold without splitting a fused pair. Escalated
+ * commands (NVME_RECOV_ESCALATED) are not sent again: they fail as timed
+ * out, which frees their CIDs.
+ *
+ * Returns:
+ *   The number failed that way, -1 if the queue stopped taking commands
+ */
+static int
+nvme_reset_replay(nvme_soft_t *soft, ushort_t *cids, nvme_command_t *cmds, uint_t ncids)
+{
+    nvme_queue_t *q = &soft->io_queue;
+    nvme_completion_t cpl;
+    nvme_cmd_info_t *ci;
+    clock_t deadline;
+    uint_t i, n, nsend = 0;
+    int nfail = 0;
+
+    for (i = 0; i < ncids; i++) {
+        ci = &soft->io_requests[cids[i]];
+        if (ci->recov == NVME_RECOV_ESCALATED) {
+            bzero(&cpl, sizeof(cpl));
+            cpl.dw3 = cids[i] | (NVME_SC_ABORT_REQ << 17);
+            nvme_handle_io_completion(soft, q, &cpl);
+            nfail++;
+            continue;
+        }
+        ci->start_time = lbolt;
+        ci->recov = NVME_RECOV_NONE;
+        cmds[nsend++] = ci->cmd;
+    }
+
+    deadline = lbolt + drv_usectohz(NVME_RESET_READY_MS * 1000);
+    for (i = 0; i < nsend; i += n) {
+        n = nsend - i;
+        if (n > q->size - 1) {
+            n = q->size - 1;
+            if (cmds[i + n - 1].cdw0 & NVME_CMD_FUSE_FIRST)
+                n--;
+        }
+        while (nvme_submit_cmds(soft, q, &cmds[i], n) != 0) {
+            if (lbolt - deadline >= 0) {
+                cmn_err(CE_WARN, "nvme: I/O queue stuck while replaying commands");
+                return -1;
+            }
+            nvme_process_completions(soft, q);
+            delay(1);
+        }
+    }
+    return nfail;
+}
+
+/*
+ * nvme_reset_fail_admin: Complete every admin command in flight as aborted
+ *
+ * The done callbacks see Command Aborted due to SQ Deletion, so waiters
+ * return and the parked AERs are dropped; nvme_aer_start() posts new ones.
+ */
+static void
+nvme_reset_fail_admin(nvme_soft_t *soft)
+{
+    nvme_completion_t cpl;
+    int slot;
+
+    for (slot = 0; slot < NVME_ADMIN_SLOTS; slot++) {
+        if (!(soft->admin_slot_bitmap & (1u << slot)))
+            continue;
+        bzero(&cpl, sizeof(cpl));
+        cpl.dw3 = NVME_ADMIN_CID(slot) | (NVME_SC_ABORT_QUEUE << 17);
+        nvme_handle_admin_completion(soft, &soft->admin_queue, &cpl);
+    }
+    soft->admin_queue.parked = 0;
+}
+
+/*
+ * nvme_queue_cmd_wait: Wait for a Create / Delete I/O queue command
+ *
+ * Returns 0 if it was submitted and completed successfully, -1 otherwise.
+ */
+static int
+nvme_queue_cmd_wait(nvme_soft_t *soft, int submitted)
+{
+    if (!submitted)
+        return -1;
+    nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000);
+    return soft->queue_status == 0 ? 0 : -1;
+}
+
+/*
+ * nvme_queue_recreate: Delete and create the I/O queue pair, replaying its I/O
+ *
+ * The first recovery for commands stuck after their abort. Deleting the
+ * submission queue makes the controller give up everything on it; those
+ * completions (Command Aborted due to SQ Deletion) are held back by
+ * nvme_handle_io_completion() and the commands replayed on the new queue
+ * pair, except the escalated ones, which fail as timed out.
+ *
+ * Returns:
+ *   0 on success, -1 if a controller reset has to take over
+ */
+int
+nvme_queue_recreate(nvme_soft_t *soft)
+{
+    nvme_queue_t *q = &soft->io_queue;
+    nvme_command_t *cmds;
+    ushort_t *cids;
+    uint_t ncids;
+    int admin_sleep = soft->admin_sleep;
+    int nfail = -1;
+
+    cids = kmem_alloc(NVME_IO_QUEUE_SIZE * sizeof(ushort_t), KM_SLEEP);
+    cmds = kmem_alloc(NVME_IO_QUEUE_SIZE * sizeof(nvme_command_t), KM_SLEEP);
+
+    /* See nvme_ctlr_reset() */
+    nvme_timeout_watchdog_stop(soft);
+    nvme_watchdog_stop(q);
+    soft->admin_sleep = 0;
+
+    if (nvme_queue_cmd_wait(soft, nvme_admin_delete_sq(soft, q->qid)) != 0) {
+        cmn_err(CE_WARN, "nvme: could not delete the I/O submission queue");
+        goto out;
+    }
+    /* Everything the controller still posts for it is in the CQ now */
+    nvme_process_completions(soft, q);
+    if (nvme_queue_cmd_wait(soft, nvme_admin_delete_cq(soft, q->qid)) != 0) {
+        cmn_err(CE_WARN, "nvme: could not delete the I/O completion queue");
+        goto out;
+    }
+
+    ncids = nvme_reset_capture(soft, cids);
+
+    if (nvme_queue_cmd_wait(soft, nvme_admin_create_cq(soft, q->qid, q->size, q->cq_phys, q->vector)) != 0 ||
+        nvme_queue_cmd_wait(soft, nvme_admin_create_sq(soft, q->qid, q->size, q->sq_phys, q->qid)) != 0) {
+        cmn_err(CE_WARN, "nvme: could not create the I/O queue pair again");
+        goto out;
+    }
+
+    nfail = nvme_reset_replay(soft, cids, cmds, ncids);
+    if (nfail >= 0) {
+        soft->recreates++;
+        soft->recreate_time = lbolt;
+        cmn_err(CE_NOTE, "nvme: I/O queue pair recreated, %d commands replayed, %d timed out",
+                (int)ncids - nfail, nfail);
+    }
+
+out:
+    soft->admin_sleep = admin_sleep;
+    kmem_free(cmds, NVME_IO_QUEUE_SIZE * sizeof(nvme_command_t));
+    kmem_free(cids, NVME_IO_QUEUE_SIZE * sizeof(ushort_t));
+
+    /* A controller reset asked for meanwhile still runs */
+    if (nfail < 0 || !compare_and_swap_int((int *)&soft->reset_active, NVME_RESET_QUEUE, 0))
+        return -1;
+    nvme_timeout_watchdog_start(soft);
+    return 0;
+}
+
+/*
+ * nvme_ctlr_reset: Reset the controller and replay the I/O it held
+ *
+ * Runs in the reset thread with soft->reset_active set. The controller is
+ * disabled, which stops its DMA even in fatal state, then restarted on the
+ * queues, PRP lists and CIDs it had: the I/O queue pair is created again
+ * and every I/O command that had not completed is submitted again in its
+ * original order, with its original CID (escalated ones fail as timed out
+ * instead). Admin commands in flight are failed. Features a reset clears
+ * (coalescing, write cache, HMB, asynchronous events) are set again at the end.
+ *
+ * If the controller does not come back it is left disabled, the held I/O
+ * is failed and so is everything after it (soft->ctlr_failed).
+ *
+ * Returns:
+ *   0 on success, -1 on failure
+ */
+int
+nvme_ctlr_reset(nvme_soft_t *soft)
+{
+    nvme_queue_t *q = &soft->io_queue;
+    nvme_completion_t cpl;
+    nvme_command_t *cmds;
+    ushort_t *cids;
+    uint_t cc, i, ncids;
+    int admin_sleep = soft->admin_sleep;
+    int nfail;
+
+    cids = kmem_alloc(NVME_IO_QUEUE_SIZE * sizeof(ushort_t), KM_SLEEP);
+    cmds = kmem_alloc(NVME_IO_QUEUE_SIZE * sizeof(nvme_command_t), KM_SLEEP);
+
+    /* No timeout checks, no AERs posted again, and admin waits poll:
+     * without the watchdog nothing would post a sleeping waiter */
+    nvme_timeout_watchdog_stop(soft);
+    nvme_watchdog_stop(q);
+    nvme_watchdog_stop(&soft->admin_queue);
+    soft->admin_sleep = 0;
+    soft->aer_stop = 1;
+
+    cc = NVME_RD(soft, NVME_REG_CC) & ~(NVME_CC_ENABLE | NVME_CC_SHN_MASK);
+    NVME_WR(soft, NVME_REG_CC, cc);
+    if (nvme_wait_for_ready(soft, 0, NVME_RESET_READY_MS) != 0) {
+        cmn_err(CE_WARN, "nvme: controller did not stop for the reset");
+        goto fail;
+    }
+
+    ncids = nvme_reset_capture(soft, cids);
+    mutex_lock(&soft->admin_queue.lock, PZERO);
+    nvme_queue_restart(&soft->admin_queue);
+    mutex_unlock(&soft->admin_queue.lock);
+    nvme_reset_fail_admin(soft);
+
+    /* Same admin queue, same controller configuration */
+    NVME_WR(soft, NVME_REG_AQA, ((soft->admin_queue.size - 1) << 16) | (soft->admin_queue.size - 1));
+    NVME_WR(soft, NVME_REG_ASQ, PHYS64_LO(soft->admin_queue.sq_phys));
+    NVME_WR(soft, NVME_REG_ASQ + 4, PHYS64_HI(soft->admin_queue.sq_phys));
+    NVME_WR(soft, NVME_REG_ACQ, PHYS64_LO(soft->admin_queue.cq_phys));
+    NVME_WR(soft, NVME_REG_ACQ + 4, PHYS64_HI(soft->admin_queue.cq_phys));
+    NVME_WR(soft, NVME_REG_CC, cc | NVME_CC_ENABLE);
+    if (nvme_wait_for_ready(soft, 1, NVME_RESET_READY_MS) != 0) {
+        cmn_err(CE_WARN, "nvme: controller did not become ready after the reset");
+        goto fail;
+    }
+
+    /* The reset unmasked every interrupt */
+    if (!soft->interrupts_enabled)
+        NVME_WR(soft, NVME_REG_INTMS, 0xFFFFFFFF);
+
+    if (nvme_queue_cmd_wait(soft, nvme_admin_create_cq(soft, q->qid, q->size, q->cq_phys, q->vector)) != 0 ||
+        nvme_queue_cmd_wait(soft, nvme_admin_create_sq(soft, q->qid, q->size, q->sq_phys, q->qid)) != 0) {
+        cmn_err(CE_WARN, "nvme: could not create the I/O queue again after the reset");
+        goto fail;
+    }
+
+    nfail = nvme_reset_replay(soft, cids, cmds, ncids);
+    if (nfail < 0)
+        goto fail;
+
+    nvme_coalescing_setup(soft);
+    if (soft->vwc_present &&
+        nvme_admin_set_features(soft, NVME_FEAT_VOLATILE_WRITE_CACHE,
+                                soft->vwc_enabled ? NVME_FEAT_VWC_WCE : 0))
+        nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000);
+
+    /* The buffer is still allocated, the controller just has to take it again */
+    if (soft->hmb_nchunks) {
+        soft->hmb_enabled = 0;
+        if (nvme_admin_set_hmb(soft, 1) &&
+            nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000) != 0) {
+            cmn_err(CE_WARN, "nvme: Host Memory Buffer Set Features timed out after the reset, buffer kept");
+        } else if (!soft->hmb_enabled) {
+            cmn_err(CE_WARN, "nvme: controller refused the Host Memory Buffer after the reset");
+            nvme_hmb_free(soft);
+        }
+    }
+
+    nvme_thermal_init(soft);
+    nvme_aer_start(soft);
+
+    soft->resets++;
+    soft->admin_sleep = admin_sleep;
+    nvme_timeout_watchdog_start(soft);
+    soft->reset_active = 0;
+
+    cmn_err(CE_NOTE, "nvme: controller reset done, %d I/O commands replayed, %d timed out",
+            (int)ncids - nfail, nfail);
+    kmem_free(cmds, NVME_IO_QUEUE_SIZE * sizeof(nvme_command_t));
+    kmem_free(cids, NVME_IO_QUEUE_SIZE * sizeof(ushort_t));
+    return 0;
+
+fail:
+    /* Leave it disabled and fail whatever it still held, replayed or not */
+    soft->ctlr_failed = 1;
+    NVME_WR(soft, NVME_REG_CC, NVME_RD(soft, NVME_REG_CC) & ~NVME_CC_ENABLE);
+    nvme_wait_for_ready(soft, 0, NVME_RESET_READY_MS);
+
+    ncids = nvme_reset_capture(soft, cids);
+    mutex_lock(&soft->admin_queue.lock, PZERO);
+    nvme_queue_restart(&soft->admin_queue);
+    mutex_unlock(&soft->admin_queue.lock);
+    nvme_reset_fail_admin(soft);
+    for (i = 0; i < ncids; i++) {
+        bzero(&cpl, sizeof(cpl));
+        cpl.dw3 = cids[i] | (NVME_SC_ABORT_QUEUE << 17);
+        nvme_handle_io_completion(soft, q, &cpl);
+    }
+    soft->reset_active = 0;
+
+    cmn_err(CE_WARN, "nvme: controller reset failed, %u I/O commands failed, controller is offline",
+            ncids);
+    kmem_free(cmds, NVME_IO_QUEUE_SIZE * sizeof(nvme_command_t));
+    kmem_free(cids, NVME_IO_QUEUE_SIZE * sizeof(ushort_t));
+    return -1;
+}
+
 /*
  * nvme_watchdog_timeout: Watchdog timer callback for missed interrupts
  *
@@ -2475,6 +3842,8 @@ nvme_watchdog_timeout(nvme_soft_t *soft)
         if (outstanding > 0) {
             /* Process any pending completions */
             num_completions = nvme_process_completions(soft, q);
+            if (num_completions > 0)
+                atomicAddInt((int *)&soft->stats.wd_recovered, num_completions);
 
 #ifdef NVME_DBG
             if (num_completions > 0) {
@@ -2552,8 +3921,11 @@ nvme_watchdog_stop(nvme_queue_t *q)
  * Iterates through all CIDs in the I/O queue and checks if any have exceeded
  * their timeout value (from sr_timeout field in scsi_request_t).
  *
- * For timed-out commands, issues an NVMe Abort command and updates the
- * start_time to current lbolt to prevent re-aborting on subsequent checks.
+ * Timed-out commands go through the NVME_RECOV_* states: an NVMe Abort is
+ * sent once (at most NVME_TIMEOUT_ABORTS per check), and a command that is
+ * still out NVME_ABORT_WAIT_MS after it escalates to an I/O queue
+ * recreation, or to a controller reset when a recreation just failed to
+ * help. The reset thread fails escalated commands and frees their CIDs.
  *
  * Called from timeout watchdog handler (nvme_timeout_watchdog_handler).
  */
@@ -2566,6 +3938,9 @@ nvme_check_timeouts(nvme_soft_t *soft)
     scsi_request_t *req;
     time_t elapsed;
     nvme_aborted_cmd_t *entry;
+    nvme_cmd_info_t *ci;
+    ushort_t abort_cids[NVME_TIMEOUT_ABORTS];
+    int naborts = 0, escalate = 0;
 
     /* Age out stale aborted command entries (older than 1 second) */
     mutex_lock(&soft->aborted_lock, PZERO);
@@ -2623,33 +3998,57 @@ nvme_check_timeouts(nvme_soft_t *soft)
             continue;
         }
 
-        req = soft->io_requests[cid].req;
+        ci = &soft->io_requests[cid];
+        req = ci->req;
 
-        /* Check if command has timed out */
-        elapsed = now - soft->io_requests[cid].start_time;
-
-        if (elapsed > req->sr_timeout) {
-            /* Command has timed out */
-            cmn_err(CE_WARN,
-                    "nvme: CID %d timeout after %d seconds (limit %d seconds)",
-                    cid, (int)(elapsed / HZ), (int)(req->sr_timeout / HZ));
+        switch (ci->recov) {
+        case NVME_RECOV_NONE:
+            /* Check if command has timed out, the rest wait for a free abort */
+            elapsed = now - ci->start_time;
+            if (elapsed <= req->sr_timeout || naborts == NVME_TIMEOUT_ABORTS)
+                break;
             cmn_err(CE_WARN,
                     "nvme: CID %d timeout after %d seconds (limit %d seconds)",
                     cid, (int)(elapsed / HZ), (int)(req->sr_timeout / HZ));
 
             /* Store in aborted FIFO for retry detection */
             nvme_aborted_fifo_add(soft, req);
+            NVME_STAT_INC(soft, timeouts);
 
-            /* Update start_time to prevent re-aborting this command */
-            soft->io_requests[cid].start_time = now;
+            ci->recov = NVME_RECOV_ABORT_SENT;
+            ci->recov_time = now;
+            abort_cids[naborts++] = (ushort_t)cid;
+            break;
 
-            nvme_admin_abort_command(soft, (ushort_t)cid);
+        case NVME_RECOV_ABORT_SENT:
+        case NVME_RECOV_ABORT_DONE:
+            if (now - ci->recov_time <= drv_usectohz(NVME_ABORT_WAIT_MS * 1000))
+                break;
+            cmn_err(CE_WARN, "nvme: CID %d %s %d ms later, escalating", cid,
+                    ci->recov == NVME_RECOV_ABORT_SENT ? "abort not completed" :
+                    "still not back after its abort", NVME_ABORT_WAIT_MS);
+            ci->recov = NVME_RECOV_ESCALATED;
+            escalate = 1;
+            break;
         }
 
         cid++;
     }
 
     mutex_unlock(&soft->io_requests_lock);
+
+    /* Outside the lock, nvme_abort_done() takes it */
+    for (i = 0; i < naborts; i++)
+        nvme_admin_abort_command(soft, abort_cids[i]);
+
+    /* A queue recreation that did not help does not get another try */
+    if (escalate) {
+        if (soft->recreates &&
+            lbolt - soft->recreate_time < drv_usectohz(NVME_RECREATE_WINDOW_MS * 1000))
+            nvme_reset_request(soft, NVME_RESET_CTLR, "command stuck again after an I/O queue recreation");
+        else
+            nvme_reset_request(soft, NVME_RESET_QUEUE, "command stuck after its abort");
+    }
 }
 
 /*
@@ -2662,6 +4061,7 @@ void
 nvme_timeout_watchdog_handler(nvme_soft_t *soft)
 {
     nvme_queue_t *q = &soft->io_queue;
+    uint_t csts;
 
     /* Clear the active flag atomically */
     if (!compare_and_swap_int((int *)&soft->timeout_watchdog_active, 1, 0)) {
@@ -2669,12 +4069,183 @@ nvme_timeout_watchdog_handler(nvme_soft_t *soft)
         return;
     }
 
+    /* The reset thread starts the watchdog again when it is done */
+    if (soft->reset_active)
+        return;
+
+    /* A fatal controller only comes back through a reset (all ones: it is gone) */
+    csts = NVME_RD(soft, NVME_REG_CSTS);
+    if ((csts & NVME_CSTS_CFS) && csts != 0xFFFFFFFF && !soft->ctlr_failed &&
+        nvme_reset_request(soft, NVME_RESET_CTLR, "controller fatal status"))
+        return;
+
     /* Check for timeouts */
     nvme_check_timeouts(soft);
 
+    /* Let sleeping admin waiters look at their deadline and the queue */
+    nvme_admin_wakeup(soft);
+
+    /* Keep the SMART cache for LOG SENSE fresh, and track a warm drive closely.
+     * No event marks the pacing point, only polling finds it */
+    if (++soft->smart_ticks >= (soft->thermal_level ||
+                                soft->smart.temperature + NVME_THERMAL_STEP_K >= soft->thermal_pace_temp ?
+                                NVME_THERMAL_REFRESH_MS : NVME_SMART_REFRESH_MS) / NVME_TIMEOUT_CHECK_INTERVAL_MS) {
+        soft->smart_ticks = 0;
+        nvme_smart_refresh(soft);
+    }
+
+    /* A namespace rescan that found no free admin buffer */
+    if (soft->rescan_wanted)
+        nvme_ns_rescan_start(soft);
+
     nvme_timeout_watchdog_start(soft);
 }
 
+/*
+ * nvme_smart_refresh: Start a background refresh of the SMART cache
+ *
+ * Called from the timeout watchdog every NVME_SMART_REFRESH_MS. Only one
+ * Get Log Page is in flight at a time; one that never completed is given
+ * up after another refresh interval so the cache does not freeze.
+ */
+void
+nvme_smart_refresh(nvme_soft_t *soft)
+{
+    if (!compare_and_swap_int((int *)&soft->smart_busy, 0, 1)) {
+        if (lbolt - soft->smart_issued < drv_usectohz(NVME_SMART_REFRESH_MS * 1000))
+            return;
+        cmn_err(CE_WARN, "nvme: SMART log refresh did not complete, retrying");
+    }
+
+    soft->smart_issued = lbolt;
+    if (!nvme_admin_get_log_page_smart(soft))
+        soft->smart_busy = 0;
+}
+
+/*
+ * nvme_thermal_init: Choose the thermal pacing point
+ *
+ * Pacing starts NVME_THERMAL_MARGIN_K below the drive's warning temperature
+ * and follows the polled composite temperature. The drive's own Temperature
+ * Threshold is left alone, lowering it would raise SMART critical warning
+ * bit 1 (logged, reported in LOG SENSE and by AER) whenever pacing starts.
+ */
+void
+nvme_thermal_init(nvme_soft_t *soft)
+{
+    soft->thermal_pace_temp = (soft->wctemp > NVME_THERMAL_MARGIN_K ?
+                               soft->wctemp : NVME_THERMAL_DEFAULT_K) - NVME_THERMAL_MARGIN_K;
+    soft->thermal_level = 0;
+    soft->io_depth_limit = NVME_THERMAL_DEPTH(0);
+
+    cmn_err(CE_NOTE, "nvme: thermal pacing from %d C", (int)soft->thermal_pace_temp - 273);
+}
+
+/*
+ * nvme_aer_start: Enable asynchronous events and post the requests for them
+ *
+ * Every SMART critical warning is reported, namespace attribute changes too
+ * when the controller supports them (OAES bit 8). Without AERs nothing is
+ * lost, the periodic SMART refresh just finds it later. Not available with
+ * NVME_COMPLETION_MANUAL, where every submission waits for its completion.
+ */
+void
+nvme_aer_start(nvme_soft_t *soft)
+{
+#ifndef NVME_COMPLETION_MANUAL
+    uint_t aec = NVME_FEAT_AEC_SMART;
+    uint_t want, i;
+
+    if (soft->oaes & NVME_OAES_NS_ATTR)
+        aec |= NVME_FEAT_AEC_NS_ATTR;
+    if (nvme_admin_set_features(soft, NVME_FEAT_ASYNC_EVENT_CONFIG, aec))
+        nvme_wait_for_queue_idle(soft, &soft->admin_queue, 5000);
+    else
+        cmn_err(CE_WARN, "nvme: failed to configure asynchronous events");
+
+    soft->aer_stop = 0;
+    want = soft->aer_limit < NVME_AER_MAX ? soft->aer_limit : NVME_AER_MAX;
+    for (i = 0; i < want; i++) {
+        atomicAddInt(&soft->aer_active, 1);
+        if (!nvme_admin_async_event(soft)) {
+            atomicAddInt(&soft->aer_active, -1);
+            break;
+        }
+    }
+
+    cmn_err(CE_NOTE, "nvme: %d asynchronous event requests posted (AERL %u)%s",
+            soft->aer_active, soft->aer_limit - 1,
+            (aec & NVME_FEAT_AEC_NS_ATTR) ? ", namespace notices on" : "");
+#endif
+}
+
+/*
+ * nvme_thermal_update: Move the pacing level to follow a new temperature
+ *
+ * Called with every SMART refresh. Each level above the pacing point is
+ * NVME_THERMAL_STEP_K wide; going up is immediate, coming down waits until
+ * the drive is NVME_THERMAL_HYST_K below the level's entry point.
+ */
+void
+nvme_thermal_update(nvme_soft_t *soft, uint_t temperature)
+{
+    int level, up, down;
+
+    if (temperature == 0 || soft->thermal_pace_temp == 0)
+        return;     /* Not reported, or pacing not set up yet */
+
+    up = temperature < soft->thermal_pace_temp ? 0 :
+         1 + (temperature - soft->thermal_pace_temp) / NVME_THERMAL_STEP_K;
+    down = temperature + NVME_THERMAL_HYST_K < soft->thermal_pace_temp ? 0 :
+           1 + (temperature + NVME_THERMAL_HYST_K - soft->thermal_pace_temp) / NVME_THERMAL_STEP_K;
+    if (up > NVME_THERMAL_LEVELS - 1)
+        up = NVME_THERMAL_LEVELS - 1;
+    if (down > NVME_THERMAL_LEVELS - 1)
+        down = NVME_THERMAL_LEVELS - 1;
+
+    level = soft->thermal_level;
+    if (up > level)
+        level = up;
+    else if (down < level)
+        level = down;
+    if (level == soft->thermal_level)
+        return;
+
+    if (soft->thermal_level == 0)
+        soft->thermal_events++;
+    soft->io_depth_limit = NVME_THERMAL_DEPTH(level);
+    soft->thermal_level = level;
+
+    if (level)
+        cmn_err(CE_NOTE, "nvme: %d C, pacing I/O to %u commands in flight",
+                (int)temperature - 273, NVME_THERMAL_DEPTH(level));
+    else
+        cmn_err(CE_NOTE, "nvme: %d C, I/O pacing off", (int)temperature - 273);
+}
+
+/*
+ * nvme_thermal_report: Fill in the NVME_SOP_THERMAL report
+ */
+void
+nvme_thermal_report(nvme_soft_t *soft, nvme_thermal_report_t *rep)
+{
+    bzero(rep, sizeof(*rep));
+
+    mutex_lock(&soft->smart_lock, PZERO);
+    if (soft->smart.valid) {
+        rep->temperature = soft->smart.temperature;
+        rep->crit_warning = soft->smart.crit_warning;
+        rep->drive_throttles = soft->smart.throttle_count;
+    }
+    mutex_unlock(&soft->smart_lock);
+
+    rep->pace_temp = soft->thermal_pace_temp;
+    rep->wctemp = soft->wctemp;
+    rep->level = soft->thermal_level;
+    rep->depth_limit = soft->io_depth_limit;
+    rep->pace_events = soft->thermal_events;
+}
+
 /*
  * nvme_timeout_watchdog_start: Start the timeout watchdog timer
  *
@@ -9,6 +9,7 @@
 #define noNVME_COMPLETION_MANUAL
 #define noNVME_COMPLETION_INTERRUPT
 #define noNVME_FORCE_4K
+#define noNVME_EMULATE_512
 #define noNVME_TEST
 
 /* IP32 can mix and match swapping regions because it is all address based
@@ -85,6 +86,7 @@ extern void hwgraph_link_add(   char *dest_path,
 #include <sys/mload.h>
 
 #include <sys/var.h>
+#include <sys/capability.h>     /* CAP_DEVICE_MGT for the format ioctl */
 #include <sys/atomic_ops.h>
 
 /* NVMe specification definitions */
@@ -127,20 +129,48 @@ void bp_heart_invalidate_war(struct buf *bp);
 #define NVME_IO_QUEUE_SIZE      512     /* I/O queue depth */
 #define NVME_WATCHDOG_TIMEOUT_US 2000   /* Watchdog timeout in microseconds (2ms) */
 #define NVME_TIMEOUT_CHECK_INTERVAL_MS 100  /* Check for timeouts every 100ms (10 Hz) */
+#define NVME_READY_POLL_US      100     /* CSTS.RDY poll interval while spinning */
+#define NVME_READY_SPIN_MS      50      /* Spin this long on CSTS.RDY, then poll once a tick */
+#define NVME_RESET_READY_MS     30000   /* CSTS.RDY wait of a controller reset, either edge */
+
+/*
+ * Host Memory Buffer for DRAM-less drives. The size given to the drive is
+ * its preferred size (HMPRE) capped at nvme_hmb_max_mb megabytes, which
+ * defaults to NVME_HMB_MAX_MB; 0 turns the HMB off. It is built from
+ * physically contiguous chunks of up to NVME_HMB_CHUNK_BYTES, smaller ones
+ * when memory is fragmented (never below HMMINDS), at most
+ * NVME_HMB_MAX_CHUNKS of them, or HMMAXD when the drive allows fewer.
+ */
+#define NVME_HMB_MAX_MB         64
+#define NVME_HMB_CHUNK_BYTES    (1024 * 1024)
+#define NVME_HMB_MAX_CHUNKS     64
 
 /* SCSI CDB Operation Codes we handle */
 #define SCSIOP_TEST_UNIT_READY    0x00
 #define SCSIOP_INQUIRY            0x12
 #define SCSIOP_SEND_DIAGNOSTIC    0x1D
 #define SCSIOP_MODE_SENSE_6       0x1A
+#define SCSIOP_MODE_SELECT_6      0x15
+#define SCSIOP_MODE_SELECT_10     0x55
 #define SCSIOP_READ_CAPACITY_10   0x25
+#define SCSIOP_VERIFY_10          0x2F
+#define SCSIOP_VERIFY_16          0x8F
 #define SCSIOP_READ_6             0x08
 #define SCSIOP_READ_10            0x28
 #define SCSIOP_READ_16            0x88
+#define SCSIOP_COMPARE_AND_WRITE  0x89
 #define SCSIOP_WRITE_6            0x0A
 #define SCSIOP_WRITE_10           0x2A
 #define SCSIOP_WRITE_16           0x8A
 #define SCSIOP_SYNC_CACHE         0x35
+#define SCSIOP_SERVICE_ACTION_IN  0x9E
+#define SCSIOP_LOG_SENSE          0x4D
+
+/* SERVICE ACTION IN(16) service actions */
+#define SCSI_SAI_READ_CAPACITY_16 0x10
+#define SCSIOP_WRITE_SAME_10      0x41
+#define SCSIOP_UNMAP              0x42
+#define SCSIOP_WRITE_SAME_16      0x93
 
 /* MODE SENSE page codes */
 #define MODE_SENSE_RETURN_ALL           0x3F
@@ -157,9 +187,167 @@ void bp_heart_invalidate_war(struct buf *bp);
 #define MODE_SENSE_DEFAULT_VALUES       0x02
 #define MODE_SENSE_SAVED_VALUES         0x03
 
+/* Caching mode page (08h) byte 2 bits */
+#define MODE_CACHING_WCE                0x04    /* Write cache enable */
+#define MODE_CACHING_PAGE_LEN           0x12    /* Page length byte, 20-byte page */
+
+/* LOG SENSE page codes */
+#define LOG_PAGE_SUPPORTED              0x00
+#define LOG_PAGE_READ_ERRORS            0x03
+#define LOG_PAGE_TEMPERATURE            0x0D
+#define LOG_PAGE_SELF_TEST              0x10
+#define LOG_PAGE_SOLID_STATE_MEDIA      0x11
+#define LOG_PAGE_INFO_EXCEPTIONS        0x2F
+
+/* MODE SELECT CDB byte 1 bits */
+#define MODE_SELECT_PF                  0x10    /* Page format */
+#define MODE_SELECT_SP                  0x01    /* Save pages */
+
+/* MODE SENSE header device-specific parameter bits (direct-access devices) */
+#define MODE_DSP_DPOFUA                 0x10    /* DPO and FUA bits supported */
+
 /* NVMe internal command flags (for passing through the call stack) */
 #define NF_WRITE    0x01    /* Command is a write operation */
 #define NF_RETRY    0x02    /* Command is a retry of an aborted command */
+#define NF_FUA      0x04    /* Force Unit Access requested by the CDB */
+#define NF_DEALLOC  0x08    /* Deallocate hint (WRITE SAME with UNMAP) */
+
+/*
+ * Driver-private host adapter ioctls, issued on the scsi_ctlr bus vertex
+ * through struct scsi_ha_op like the SOP_* requests.
+ *
+ * The first two act on the namespace behind LUN NVME_SOP_ARG_LUN(sb_arg) of
+ * target 0. NVME_SOP_LBAF_REPORT copies an nvme_lbaf_report_t out to sb_addr.
+ * NVME_SOP_FORMAT formats the namespace to LBA format NVME_SOP_ARG_LBAF(sb_arg),
+ * or to the best-performing format when that is NVME_LBAF_BEST. All data on
+ * the namespace is lost; the driver never does this on its own.
+ * NVME_SOP_THERMAL copies the controller's nvme_thermal_report_t to sb_addr.
+ * NVME_SOP_STATS copies the controller's nvme_stats_t to sb_addr and, when
+ * sb_arg is non-zero, clears the counters afterwards.
+ */
+#define NVME_SOP_BASE           ('N' << 8)
+#define NVME_SOP_LBAF_REPORT    (NVME_SOP_BASE | 1)
+#define NVME_SOP_FORMAT         (NVME_SOP_BASE | 2)
+#define NVME_SOP_THERMAL        (NVME_SOP_BASE | 3)
+#define NVME_SOP_STATS          (NVME_SOP_BASE | 6)
+
+#define NVME_SOP_ARG(lun, lbaf) (((lun) << 8) | (lbaf))
+#define NVME_SOP_ARG_LUN(arg)   (((arg) >> 8) & 0xFF)
+#define NVME_SOP_ARG_LBAF(arg)  ((arg) & 0xFF)
+
+#define NVME_MAX_LBAF           16
+#define NVME_LBAF_BEST          0xFF
+#define NVME_FORMAT_TIMEOUT_MS  600000  /* Format NVM may take minutes on large media */
+#define NVME_QUIESCE_TIMEOUT_MS 30000   /* Default drain wait, also used by shutdown */
+
+/*
+ * 512-byte logical block emulation (NVME_EMULATE_512, nvme_emul.c)
+ *
+ * SCSI sees 512-byte blocks while the namespace uses 1 << emul_shift times
+ * larger ones. emul_shift is per namespace and 0 when emulation is off or not
+ * needed, which makes the macros below plain namespace values.
+ */
+#define NVME_EMUL_HOST_SHIFT    9               /* log2 of the emulated block size */
+#define NVME_EMUL_BOUNCE_BYTES  (128 * 1024)    /* RMW window, whole namespace blocks */
+
+#define NVME_HOST_BLOCKS(ns)        ((ns)->num_blocks << (ns)->emul_shift)
+#define NVME_HOST_BLOCK_SIZE(ns)    ((ns)->block_size >> (ns)->emul_shift)
+
+typedef struct nvme_emul_job {
+    struct nvme_emul_job *next;
+    scsi_request_t     *req;            /* Initiator request */
+    struct nvme_ns_s   *ns;             /* Namespace of the request */
+    __uint64_t          lba;            /* First 512-byte block */
+    uint_t              num_blocks;     /* 512-byte blocks */
+    uint_t              flags;          /* NF_WRITE, NF_FUA */
+    __uint64_t          dev_lo;         /* First namespace block touched */
+    __uint64_t          dev_hi;         /* One past the last namespace block touched */
+    caddr_t             kaddr;          /* Kernel address of the data */
+    int                 mapped;         /* kaddr came from bp_mapin() */
+    int                 wait;           /* Issuer sleeps on done, kaddr is its staging buffer */
+    sema_t              done;
+} nvme_emul_job_t;
+
+typedef struct nvme_lbaf_info {
+    uint_t      lbads;          /* log2 of the logical block size */
+    uint_t      ms;             /* Metadata bytes per block */
+    uint_t      rp;             /* Relative performance, 0 = best .. 3 = degraded */
+    uint_t      usable;         /* 1 if the driver can run with this format */
+} nvme_lbaf_info_t;
+
+typedef struct nvme_lbaf_report {
+    uint_t      nsid;           /* Namespace the report describes */
+    uint_t      nlbaf;          /* Number of formats (NLBAF + 1) */
+    uint_t      current;        /* Format in use (FLBAS) */
+    uint_t      best;           /* Format NVME_LBAF_BEST would select */
+    uint_t      format_supported; /* OACS bit 1 */
+    nvme_lbaf_info_t lbaf[NVME_MAX_LBAF];
+} nvme_lbaf_report_t;
+
+/*
+ * Thermal pacing
+ *
+ * Passively cooled drives throttle themselves hard once they pass their
+ * warning temperature. NVME_THERMAL_MARGIN_K below that point (WCTEMP, or
+ * NVME_THERMAL_DEFAULT_K when not reported) the driver limits the I/O
+ * commands in flight to 64, and to a quarter of that for every further
+ * NVME_THERMAL_STEP_K, so the drive sheds heat at a steady, lower rate
+ * instead of collapsing.
+ * A level is left only NVME_THERMAL_HYST_K below where it was entered.
+ * The drive's Temperature Threshold is not changed. The SMART cache is
+ * refreshed every NVME_THERMAL_REFRESH_MS once the temperature is close.
+ */
+#define NVME_THERMAL_DEFAULT_K  353     /* 80 C when WCTEMP is not reported */
+#define NVME_THERMAL_MARGIN_K   5
+#define NVME_THERMAL_STEP_K     3
+#define NVME_THERMAL_HYST_K     2
+#define NVME_THERMAL_LEVELS     4       /* Level 0 (no pacing) to 3 */
+#define NVME_THERMAL_REFRESH_MS 1000
+
+/* Commands in flight allowed at each pacing level */
+#define NVME_THERMAL_DEPTH(level)   ((level) == 0 ? NVME_IO_QUEUE_SIZE : (64u >> (2 * ((level) - 1))))
+
+typedef struct nvme_thermal_report {
+    uint_t      temperature;    /* Composite temperature, Kelvin (0 = unknown) */
+    uint_t      pace_temp;      /* Pacing starts here, Kelvin */
+    uint_t      wctemp;         /* Warning composite temperature threshold, Kelvin (0 = not reported) */
+    uint_t      level;          /* Pacing level, 0 = off */
+    uint_t      depth_limit;    /* I/O commands allowed in flight */
+    uint_t      crit_warning;   /* SMART critical warning bits */
+    uint_t      pace_events;    /* Times pacing was switched on */
+    uint_t      drive_throttles; /* Drive's own throttle entries (TMT1 + TMT2), NVMe 1.2+ */
+} nvme_thermal_report_t;
+
+/*
+ * Per-controller statistics, kept in soft->stats and copied out by
+ * NVME_SOP_STATS. Counters are bumped with atomic adds where they happen
+ * and wrap, so readers work with differences between two samples. Request
+ * counts are by data direction, taken when the last NVMe command of a
+ * request completes; the busy causes are a breakdown of busy.
+ */
+typedef struct nvme_stats {
+    __uint64_t  read_bytes;     /* Data moved by completed READs and WRITEs */
+    __uint64_t  write_bytes;
+    __uint64_t  depth_sum;      /* I/O queue depth summed over submissions */
+    uint_t      reads;          /* READ(6/10/16) requests completed */
+    uint_t      writes;         /* WRITE(6/10/16) requests completed */
+    uint_t      others;         /* All other requests completed */
+    uint_t      errors;         /* Requests completed with an error */
+    uint_t      submits;        /* NVMe commands submitted to the I/O queue */
+    uint_t      depth;          /* I/O commands outstanding when copied out */
+    uint_t      depth_max;      /* Most I/O commands ever outstanding */
+    uint_t      busy;           /* Requests answered busy */
+    uint_t      cid_exhausted;  /* No free CIDs */
+    uint_t      cid_paced;      /* CIDs held back by thermal pacing */
+    uint_t      prp_exhausted;  /* PRP list pool empty */
+    uint_t      sq_full;        /* Submission queue full */
+    uint_t      wd_recovered;   /* Completions reaped by the missed interrupt watchdog */
+    uint_t      timeouts;       /* Commands that timed out */
+    uint_t      lbolt;          /* lbolt when copied out */
+    uint_t      hz;             /* Ticks per second */
+} nvme_stats_t;
+
+#define NVME_STAT_INC(soft, field)  atomicAddInt((int *)&(soft)->stats.field, 1)
 
 /* Sense codes */
 #define SCSI_SENSE_NO_SENSE         0x00
@@ -180,7 +368,42 @@ void bp_heart_invalidate_war(struct buf *bp);
 #define SCSI_SENSE_RESERVED         0x0F
 
 
+#define SCSI_ADSENSE_LUN_NOT_READY     0x04  /* ASCQ 0x04: format in progress */
+#define SCSI_ADSENSE_MISCOMPARE        0x1D  /* Miscompare during verify operation */
+#define SCSI_ADSENSE_INVALID_COMMAND   0x20
+#define SCSI_ADSENSE_LBA_OUT_OF_RANGE  0x21
+#define SCSI_ADSENSE_INVALID_CDB       0x24
 #define SCSI_ADSENSE_INVALID_LUN    0x25
+#define SCSI_ADSENSE_INVALID_PARAMETER 0x26
+#define SCSI_ADSENSE_PARAMETERS_CHANGED 0x2A  /* ASCQ 0x09: capacity data has changed */
+
+/*
+ * UNMAP translation limits
+ * Each DSM command carries up to NVME_DSM_MAX_RANGES ranges in one PRP pool page,
+ * a single UNMAP may fan out into NVME_UNMAP_MAX_COMMANDS DSM commands.
+ */
+#define NVME_UNMAP_MAX_COMMANDS     4
+#define NVME_UNMAP_MAX_DESCRIPTORS  (NVME_DSM_MAX_RANGES * NVME_UNMAP_MAX_COMMANDS)
+#define NVME_UNMAP_DESC_SIZE        16      /* SBC UNMAP block descriptor size */
+
+/*
+ * WRITE SAME translation limits
+ * Write Zeroes NLB is 16 bits, so each command covers at most 64K blocks,
+ * fewer when the controller sets WZSL (ns->write_zeroes_max_blocks).
+ * Larger requests are split, up to NVME_WRITE_SAME_MAX_COMMANDS per request.
+ */
+#define NVME_WRITE_ZEROES_MAX_BLOCKS   (NVME_RW_NLB_MASK + 1)
+#define NVME_WRITE_SAME_MAX_COMMANDS   128
+#define NVME_WRITE_SAME_MAX_BLOCKS     (NVME_WRITE_ZEROES_MAX_BLOCKS * NVME_WRITE_SAME_MAX_COMMANDS)
+
+/*
+ * VERIFY translation limits
+ * Verify moves no data, so MDTS does not bound it; each NVMe Verify covers
+ * up to the 16-bit NLB limit, or less under the controller's VSL
+ * (ns->verify_max_blocks). A VERIFY fans out into at most
+ * NVME_VERIFY_MAX_COMMANDS, 16M blocks without a VSL.
+ */
+#define NVME_VERIFY_MAX_COMMANDS       256
 
 /*
  * NVMe Queue Structures
@@ -222,6 +445,8 @@ typedef struct nvme_queue_s {
 
     /* Outstanding command tracking */
     volatile int        outstanding;    /* Atomic counter of commands in flight */
+    volatile int        parked;         /* Of those, held by the controller until an event (AERs) */
+    uint_t              sq_seq;         /* Commands submitted, orders the replay after a reset */
 
     /* Watchdog timer for missed interrupts */
     toid_t              watchdog_id;    /* Timeout ID for watchdog timer */
@@ -234,6 +459,67 @@ typedef struct nvme_queue_s {
  */
 #define NVME_PRP_POOL_SIZE      64      /* Number of PRP list pages (64 * 4KB = 256KB) */
 
+/*
+ * Admin command slots
+ *
+ * Every admin command takes a slot from soft->admin_cmds[] for as long as
+ * it is on the controller; the slot index gives the CID. Commands that move
+ * data also take one page from a small DMA buffer pool. The completion
+ * handler hands the completion to the slot's done callback, then releases
+ * slot and page, so any number of admin commands up to NVME_ADMIN_SLOTS
+ * can be in flight without knowing about each other.
+ */
+#define NVME_ADMIN_SLOTS        16      /* Admin commands in flight */
+#define NVME_ADMIN_BUFS         4       /* One page DMA buffers for admin data */
+#define NVME_ADMIN_CID_BASE     0x1000  /* CID of slot 0, kept clear of I/O CIDs in logs */
+#define NVME_ADMIN_CID(slot)            (NVME_ADMIN_CID_BASE + (slot))
+#define NVME_ADMIN_CID_IS_SLOT(cid)     ((cid) >= NVME_ADMIN_CID_BASE && \
+                                         (cid) < NVME_ADMIN_CID_BASE + NVME_ADMIN_SLOTS)
+
+/*
+ * Sleeping admin waits
+ *
+ * Once something other than the waiter reaps admin completions (interrupts
+ * or the completion thread, soft->admin_sleep), nvme_wait_for_queue_idle()
+ * on the admin queue sleeps on a semaphore of its own instead of polling.
+ * nvme_handle_admin_completion() posts every waiter. The timeout watchdog
+ * does too on each tick, which bounds a missed interrupt and lets waiters
+ * notice their deadline.
+ */
+typedef struct nvme_admin_waiter_s {
+    sema_t                      sema;
+    struct nvme_admin_waiter_s *next;
+} nvme_admin_waiter_t;
+
+/*
+ * Asynchronous Event Requests
+ *
+ * Up to NVME_AER_MAX (capped by the controller's AERL + 1) admin slots are
+ * parked on the controller with an Asynchronous Event Request. Each event
+ * completes one; nvme_aer_done() reads the log page the event names, which
+ * is also what re-arms that event type, and posts the request again.
+ */
+#define NVME_AER_MAX            4
+
+/* Completion status as (SCT << 8) | SC, 0 on success */
+#define NVME_CPL_STATUS(cpl)    (((((cpl)->dw3 >> 25) & 0x7) << 8) | (((cpl)->dw3 >> 17) & 0x7F))
+
+struct nvme_admin_cmd_s;
+
+typedef void (*nvme_admin_done_t)(struct nvme_soft_s *soft, struct nvme_admin_cmd_s *ac,
+                                  nvme_completion_t *cpl);
+
+typedef struct nvme_admin_cmd_s {
+    ushort_t            cid;            /* NVME_ADMIN_CID(slot) */
+    uchar_t             opcode;         /* For the failure message */
+    short               bufidx;         /* Page of the admin buffer pool, -1 if none */
+    void               *buf;            /* That page, zeroed at allocation */
+    alenaddr_t          buf_phys;
+    nvme_admin_done_t   done;           /* Called on completion, may be NULL */
+    void               *arg;            /* Caller context for done */
+    uint_t              argv;
+} nvme_admin_cmd_t;
+
 /*
  * Command Tracking Structure
  */
@@ -243,6 +529,11 @@ typedef struct nvme_cmd_info {
     time_t              start_time;    /* lbolt when command was issued */
     int                 prpidx[NVME_CMD_MAX_PRPS]; /* Index into PRP pool (0-63, -1 if none) */
     int                 last;
+    int                 submitted;     /* cmd is on the I/O queue */
+    int                 recov;         /* NVME_RECOV_*, timeout recovery state */
+    time_t              recov_time;    /* lbolt of the last recov change */
+    uint_t              seq;           /* io_queue.sq_seq when cmd was submitted */
+    nvme_command_t      cmd;           /* As submitted, replayed after a controller reset */
 } nvme_cmd_info_t;
 
 /*
@@ -251,6 +542,26 @@ typedef struct nvme_cmd_info {
  */
 #define NVME_ABORT_FIFO_SIZE 16  /* Track last 16 aborted commands */
 #define NVME_ABORT_TIMEOUT_TICKS (1 * HZ)  /* 1 second - age out stale aborted entries */
+
+/*
+ * Timed out command recovery, see nvme_check_timeouts(). A command past its
+ * sr_timeout is aborted. If neither the Abort nor the command itself is back
+ * NVME_ABORT_WAIT_MS later, the I/O queue pair is deleted and created again;
+ * a second escalation within NVME_RECREATE_WINDOW_MS resets the controller.
+ * Either way the stuck command fails as timed out, its CID is free again and
+ * the other commands are replayed.
+ */
+#define NVME_RECOV_NONE         0       /* Within its timeout */
+#define NVME_RECOV_ABORT_SENT   1       /* Abort submitted (or no admin slot for it) */
+#define NVME_RECOV_ABORT_DONE   2       /* Abort completed, command still out */
+#define NVME_RECOV_ESCALATED    3       /* Failed by the next queue recreation or reset */
+#define NVME_ABORT_WAIT_MS      5000
+#define NVME_TIMEOUT_ABORTS     4       /* Aborts sent per timeout check, the rest wait */
+#define NVME_RECREATE_WINDOW_MS 60000
+
+/* soft->reset_active, the recovery the reset thread is asked for */
+#define NVME_RESET_QUEUE        1       /* Delete and create the I/O queue pair */
+#define NVME_RESET_CTLR         2       /* Disable and enable the controller */
 #define SCSI_MAX_CDB_LEN 16      /* Maximum CDB length */
 
 typedef struct nvme_aborted_cmd {
@@ -262,6 +573,70 @@ typedef struct nvme_aborted_cmd {
     time_t              abort_time;     /* lbolt when command was aborted (for aging) */
 } nvme_aborted_cmd_t;
 
+/*
+ * Namespaces
+ *
+ * Every active namespace is presented as one LUN of SCSI target 0, in
+ * ascending NSID order, so LUN n is ns[n]. NVME_MAX_NAMESPACES is the
+ * number of LUNs a SCSI-2 target can address; further namespaces are
+ * ignored. All namespaces share the controller's I/O queue pair.
+ */
+#define NVME_MAX_NAMESPACES     8
+
+/*
+ * SMART / Health cache
+ *
+ * LOG SENSE is answered from this copy of the SMART / Health log, which the
+ * timeout watchdog refreshes every NVME_SMART_REFRESH_MS with one Get Log
+ * Page into a buffer of its own. Monitoring never waits on the admin queue.
+ */
+#define NVME_SMART_REFRESH_MS   10000
+
+typedef struct nvme_smart_s {
+    int                 valid;              /* At least one log page was read */
+    clock_t             updated;            /* lbolt of the last refresh */
+    uchar_t             crit_warning;       /* NVME_SMART_CW_* */
+    uchar_t             avail_spare;        /* Percent */
+    uchar_t             spare_thresh;       /* Percent */
+    uchar_t             percent_used;       /* Percent, may exceed 100 */
+    ushort_t            temperature;        /* Composite temperature, Kelvin */
+    __uint64_t          data_units_read;    /* Thousands of 512-byte units */
+    __uint64_t          data_units_written;
+    __uint64_t          power_on_hours;
+    __uint64_t          unsafe_shutdowns;
+    __uint64_t          media_errors;
+    __uint64_t          error_log_entries;
+    uint_t              throttle_count;     /* TMT1 + TMT2 transition counts */
+} nvme_smart_t;
+
+#define NVME_REQ_NS(soft, req)  (&(soft)->ns[(req)->sr_lun])
+
+typedef struct nvme_ns_s {
+    uint_t              nsid;           /* Namespace ID */
+    uint_t              lun;            /* SCSI LUN, index into soft->ns */
+    __uint64_t          num_blocks;     /* Total blocks */
+    uint_t              block_size;     /* Block size in bytes */
+    uint_t              lba_shift;      /* log2(block_size) */
+    uint_t              phys_block_exp; /* log2(physical / logical block), from NPWG */
+    uint_t              pref_write_gran; /* Preferred write granularity in blocks (NPWG+1), 0 if not reported */
+    uint_t              opt_write_size; /* Optimal write size in blocks (NOWS+1), 0 if not reported */
+    uint_t              noiob;          /* Optimal I/O boundary in blocks (NVMe 1.3+), 0 if none */
+    uint_t              emul_shift;     /* log2(namespace block / 512) under 512-byte emulation, else 0 */
+    uint_t              max_transfer_blocks; /* Maximum logical blocks per command (nvme_compute_transfer_geometry) */
+    uint_t              write_zeroes_max_blocks; /* Maximum logical blocks per Write Zeroes, WZSL and NLB (ditto) */
+    uint_t              verify_max_blocks; /* Maximum logical blocks per Verify, VSL and NLB (ditto) */
+    uint_t              nlbaf;          /* Number of LBA formats (NLBAF + 1) */
+    uint_t              flbas;          /* LBA format in use */
+    __uint32_t          lbaf[NVME_MAX_LBAF]; /* Raw LBA format descriptors (MS, LBADS, RP) */
+    volatile int        capacity_changed; /* Report CAPACITY DATA HAS CHANGED on the next command */
+    volatile int        rescan_pending; /* Identify again, see nvme_ns_rescan_next() */
+
+    /* SCSI emulation */
+    scsi_target_info_t  tinfo;          /* SCSI target info for this LUN */
+    u_char              inq_data[SCSI_INQUIRY_LEN];  /* INQUIRY data buffer */
+    u_char              sense_data[SCSI_SENSE_LEN];  /* Sense data buffer */
+} nvme_ns_t;
+
 typedef struct nvme_soft_s {
     /* Hardware graph vertices */
     vertex_hdl_t        pci_vhdl;         /* PCI connection vertex */
@@ -281,7 +656,7 @@ typedef struct nvme_soft_s {
     uint_t              max_page_size;
     uint_t              nvme_page_size; /* size used for transfers, ideally matching NBPP */
     uint_t              nvme_page_shift;
-    u_int8_t            nvme_prp_entries; /* number of prp entries in nvme page */
+    uint_t              nvme_prp_entries; /* number of prp entries in nvme page */
     uint_t              doorbell_stride; /* Doorbell stride */
 
     /* Queues */
@@ -297,15 +672,77 @@ typedef struct nvme_soft_s {
     volatile int        poll_shutdown;        /* Set to 1 to shutdown polling thread */
     int                 poll_thread_running;  /* 1 if thread is running */
 
-    /* Quiesce state for SOP_QUIESCE_STATE ioctl */
-    int                 quiesce_state;        /* QUIESCE_* state flags */
-
-    /* Utility buffer for admin commands during init */
-    void               *utility_buffer;      /* Virtual address */
-    alenaddr_t          utility_buffer_phys; /* Physical address */
+    /* 512-byte emulation read-modify-write engine (nvme_emul.c) */
+    mutex_t             emul_lock;      /* Protects the job queue and active window */
+    sema_t              emul_sema;      /* Wakes the RMW thread, posted per job */
+    sema_t              emul_io_sema;   /* Posted when the internal request completes */
+    nvme_emul_job_t    *emul_head;      /* Jobs in arrival order */
+    nvme_emul_job_t    *emul_tail;
+    nvme_ns_t          *emul_active_ns; /* Namespace being worked on */
+    __uint64_t          emul_active_lo; /* Namespace blocks being worked on */
+    __uint64_t          emul_active_hi;
+    caddr_t             emul_bounce;    /* NVME_EMUL_BOUNCE_BYTES bounce buffer */
+    struct nvme_rwcmd_state_s *emul_ps; /* Read/write state for the internal request */
+    scsi_request_t      emul_ireq;      /* Internal request for namespace I/O */
+    u_char              emul_cdb[16];
+    u_char              emul_sense[SCSI_SENSE_LEN];
+    volatile int        emul_shutdown;  /* Set to 1 to stop the RMW thread */
+    volatile int        emul_running;   /* 1 while the RMW thread runs */
+
+    /* Quiesce and resume, see nvme_quiesce() */
+    mutex_t             quiesce_lock;         /* Protects the parked list and quiesce_state changes */
+    volatile int        quiesce_state;        /* QUIESCE_* state, reported by SOP_QUIESCE_STATE */
+    volatile int        quiesce_entered;      /* Requests admitted to nvme_scsi_dispatch() */
+    scsi_request_t     *quiesce_head;         /* Parked requests in arrival order, linked through sr_ha */
+    scsi_request_t     *quiesce_tail;
+    uint_t              quiesce_parked;       /* Requests on the list */
+
+    /* Admin command slots and their buffer pool, see nvme_admin_alloc() */
+    nvme_admin_cmd_t    admin_cmds[NVME_ADMIN_SLOTS];
+    __uint32_t          admin_slot_bitmap;   /* Bit set = slot in use */
+    volatile uint_t     admin_busy;          /* Slots in use, parked AERs included */
+    void               *admin_bufs;          /* NVME_ADMIN_BUFS pages */
+    alenaddr_t          admin_bufs_phys;
 #ifdef NVME_UTILBUF_USEDMAP
-    pciio_dmamap_t      utility_buffer_dmamap; /* DMA map for utility buffer */
+    pciio_dmamap_t      admin_bufs_dmamap;
 #endif
+    __uint32_t          admin_buf_bitmap;    /* Bit set = page in use */
+    mutex_t             admin_lock;          /* Protects both bitmaps and admin_waiters */
+    nvme_admin_waiter_t *admin_waiters;      /* Threads sleeping in nvme_wait_for_queue_idle() */
+    volatile int        admin_sleep;         /* Admin completions are reaped for us, waiters sleep */
+
+    /* SMART / Health cache, see nvme_smart_refresh() */
+    mutex_t             smart_lock;          /* Protects smart */
+    nvme_smart_t        smart;               /* Last decoded log page */
+    volatile int        smart_busy;          /* Get Log Page SMART in flight */
+    clock_t             smart_issued;        /* lbolt when it was submitted */
+    uint_t              smart_ticks;         /* Watchdog ticks since the last refresh */
+    ushort_t            wctemp;              /* Warning composite temperature threshold, Kelvin */
+
+    /* Thermal pacing, see nvme_thermal_update() */
+    ushort_t            thermal_pace_temp;   /* Pacing starts here, Kelvin */
+    volatile int        thermal_level;       /* 0 = no pacing .. NVME_THERMAL_LEVELS - 1 */
+    volatile uint_t     io_depth_limit;      /* I/O CIDs allowed in use, NVME_THERMAL_DEPTH(level) */
+    uint_t              thermal_events;      /* Times pacing was switched on */
+
+    /* Asynchronous events, see nvme_aer_start() */
+    uint_t              aer_limit;           /* AERL + 1 from Identify Controller */
+    uint_t              oaes;                /* Optional Asynchronous Events Supported */
+    volatile int        aer_active;          /* AERs posted */
+    volatile int        aer_stop;            /* Shutting down, completed AERs are not posted again */
+    uint_t              aer_events;          /* Events received */
+
+    /* Controller reset and replay, see nvme_ctlr_reset() */
+    sema_t              reset_sema;          /* Posted by nvme_reset_request() */
+    volatile int        reset_shutdown;      /* Set to 1 to stop the reset thread */
+    int                 reset_thread_running; /* 1 if thread is running */
+    volatile int        reset_active;        /* NVME_RESET_* requested or running, I/O is refused as busy */
+    volatile int        ctlr_failed;         /* A reset did not bring the controller back */
+    volatile int        queue_status;        /* Last Create / Delete I/O queue, -1 pending */
+    uint_t              resets;              /* Resets done */
+    uint_t              recreates;           /* I/O queue recreations done */
+    clock_t             recreate_time;       /* lbolt of the last one */
+
     /* PRP list pool for I/O operations (64 nvme_page_size pages, nvme_prp_entries PRP entries per page) */
     void               *prp_pool;            /* Virtual address of PRP list pool (64 pages) */
     alenaddr_t          prp_pool_phys;       /* Physical address of PRP list pool */
@@ -325,20 +762,23 @@ typedef struct nvme_soft_s {
 
     /* Controller limits */
     uchar_t             mdts;           /* Maximum Data Transfer Size (2^n pages, 0=unlimited) */
-    uint_t              max_transfer_blocks; /* Maximum transfer in blocks (calculated from MDTS) */
-
-    /* Namespace information - we and everyone in the world only use ns 1 */
-    __uint64_t          num_blocks;     /* Total blocks */
-    uint_t              block_size;     /* Block size in bytes */
-    uint_t              lba_shift;      /* log2(block_size) */
-    uint_t              nsid;           /* Namespace ID (always 1) */
-    uint_t              num_namespaces; /* Number of namespaces */
+    uchar_t             wzsl;           /* Write Zeroes Size Limit, same units (0=unlimited) */
+    uchar_t             vsl;            /* Verify Size Limit, same units (0=unlimited) */
+    uint_t              max_transfer_bytes;  /* Maximum bytes per command (nvme_compute_transfer_geometry) */
+
+    /* Namespaces, one per LUN of target 0 */
+    nvme_ns_t           ns[NVME_MAX_NAMESPACES];
+    uint_t              ns_count;       /* Active namespaces in use */
+    uint_t              num_namespaces; /* Number of namespaces (NN) */
+    volatile int        format_active;  /* Format NVM in progress, I/O is refused */
+    volatile int        format_status;  /* Format NVM completion, (SCT << 8) | SC, -1 pending */
+    volatile int        format_orphaned; /* The ioctl timed out, nvme_format_done() ends the format */
+    volatile int        format_rescan;  /* Drop format_active once the namespace rescan is through */
+    volatile int        rescan_busy;    /* Namespace rescan Identify in flight */
+    volatile int        rescan_wanted;  /* A namespace was marked while the rescan could not run */
 
     /* SCSI emulation */
     int                 adap;           /* SCSI adapter number */
-    scsi_target_info_t  tinfo;          /* SCSI target info for LUN 0 */
-    u_char              inq_data[SCSI_INQUIRY_LEN];  /* INQUIRY data buffer */
-    u_char              sense_data[SCSI_SENSE_LEN];  /* Sense data buffer */
 
     /* State */
     int                 initialized;
@@ -368,41 +808,42 @@ typedef struct nvme_soft_s {
     /* Optional NVMe Command Support (ONCS) from Identify Controller */
     uchar_t             oncs_compare;               /* Bit 0: Compare command supported */
     uchar_t             oncs_dataset_mgmt;          /* Bit 2: Dataset Management (TRIM) supported */
+    uchar_t             oncs_write_zeroes;          /* Bit 3: Write Zeroes supported */
     uchar_t             oncs_verify;                /* Bit 5: Verify command supported */
+    uchar_t             fuses_compare_write;        /* FUSES bit 0: fused Compare and Write supported */
+    uchar_t             oacs_format;                /* OACS bit 1: Format NVM supported */
+
+    /* Volatile write cache, the caching mode page's WCE bit */
+    uchar_t             vwc_present;                /* VWC bit 0: volatile write cache present */
+    volatile int        vwc_enabled;                /* WCE as last read or set through Features */
+    volatile int        vwc_busy;                   /* Set Features VWC in flight for vwc_req */
+    scsi_request_t     *vwc_req;                    /* MODE SELECT waiting on Set Features VWC */
+    int                 vwc_wanted;                 /* WCE value requested by vwc_req */
+
+    /* Host Memory Buffer, see nvme_hmb_setup() */
+    uint_t              hmpre;                      /* Preferred size, 4 KiB units (0 = no HMB support) */
+    uint_t              hmmin;                      /* Minimum size, 4 KiB units */
+    uint_t              hmminds;                    /* Minimum descriptor size, 4 KiB units (0 = none) */
+    uint_t              hmmaxd;                     /* Maximum descriptors (0 = no limit) */
+    caddr_t             hmb_chunk[NVME_HMB_MAX_CHUNKS];
+    uint_t              hmb_chunk_pages[NVME_HMB_MAX_CHUNKS]; /* Size of each chunk in NBPP pages */
+    uint_t              hmb_nchunks;
+    uint_t              hmb_bytes;                  /* Total given to the controller */
+    nvme_hmb_desc_t    *hmb_desc;                   /* Descriptor list, one page */
+    alenaddr_t          hmb_desc_phys;
+    volatile int        hmb_enabled;                /* Set Features HMB accepted */
+
+    /* Statistics for NVME_SOP_STATS */
+    nvme_stats_t        stats;
 
 #ifdef NVME_TEST
     volatile unsigned int test_cid;
 #endif
 } nvme_soft_t;
 
-#define NVME_ADMIN_CID_DONT_CARE             0
-#define NVME_ADMIN_CID_IDENTIFY_CONTROLLER   1
-#define NVME_ADMIN_CID_IDENTIFY_NAMESPACE    2
-#define NVME_ADMIN_CID_CREATE_CQ             3
-#define NVME_ADMIN_CID_CREATE_SQ             4
-#define NVME_ADMIN_CID_DELETE_SQ             5
-#define NVME_ADMIN_CID_DELETE_CQ             6
-#define NVME_ADMIN_CID_GET_LOG_PAGE_ERROR    7
-#define NVME_ADMIN_CID_SET_FEATURES          8
-
-/* Get Features CIDs: Reserve CIDs 16-31 for Get Features (16 slots)
- * CID = 16 + FID, so we can extract FID from CID in completion handler */
-#define NVME_ADMIN_CID_GET_FEATURES_BASE     16
-#define NVME_ADMIN_CID_GET_FEATURES_END      31
-#define NVME_ADMIN_CID_GET_FEATURES(fid)     (NVME_ADMIN_CID_GET_FEATURES_BASE + (fid))
-#define NVME_ADMIN_CID_IS_GET_FEATURES(cid)  ((cid) >= NVME_ADMIN_CID_GET_FEATURES_BASE && (cid) <= NVME_ADMIN_CID_GET_FEATURES_END)
-#define NVME_ADMIN_CID_EXTRACT_FID(cid)      ((cid) - NVME_ADMIN_CID_GET_FEATURES_BASE)
-
 /* Special CIDs for ordered I/O commands not associated with scsi_request */
 #define NVME_IO_CID_FLUSH                    0x8000
 
-/* Special CID encoding for abort commands in admin queue */
-#define NVME_ADMIN_CID_ABORT_MASK            0x8000  /* Bit 15 set = abort command */
-#define NVME_ADMIN_CID_ABORT_CID_MASK        0x7FFF
-#define NVME_ADMIN_CID_MAKE_ABORT(cid)       (NVME_ADMIN_CID_ABORT_MASK | ((cid) & NVME_ADMIN_CID_ABORT_CID_MASK))
-#define NVME_ADMIN_CID_IS_ABORT(cid)         (((cid) & NVME_ADMIN_CID_ABORT_MASK) != 0)
-#define NVME_ADMIN_CID_GET_ABORTED_CID(cid)  ((cid) & NVME_ADMIN_CID_ABORT_CID_MASK)
-
 /*
  * Function Prototypes - nvme_cmd.c
  */
@@ -417,6 +858,7 @@ typedef struct nvme_soft_s {
 
 typedef struct nvme_rwcmd_state_s {
     scsi_request_t *req;
+    nvme_ns_t *ns;
     alenlist_t alenlist;
     int alenlist_type;  /* NVME_ALENLIST_* - tracks cleanup method */
     __uint64_t lba;
@@ -426,13 +868,23 @@ typedef struct nvme_rwcmd_state_s {
     uint_t max_transfer_blocks;
     uint_t commands;
     uint_t cidx;
+    uint_t done_blocks;     /* Blocks covered by commands already built */
+    uint_t chunk_blocks;    /* Blocks carried by the command being built */
     unsigned int cids[NVME_IO_QUEUE_SIZE];
     nvme_command_t cmd;
 } nvme_rwcmd_state_t;
 
 
+int nvme_admin_pool_init(nvme_soft_t *soft);
+void nvme_admin_pool_done(nvme_soft_t *soft);
+nvme_admin_cmd_t *nvme_admin_alloc(nvme_soft_t *soft, int want_buf, nvme_admin_done_t done, void *arg);
+void nvme_admin_free(nvme_soft_t *soft, nvme_admin_cmd_t *ac);
+int nvme_admin_submit(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_command_t *cmd);
+
 int nvme_admin_identify_controller(nvme_soft_t *soft);
-int nvme_admin_identify_namespace(nvme_soft_t *soft);
+int nvme_admin_identify_namespace(nvme_soft_t *soft, nvme_ns_t *ns, nvme_admin_done_t done);
+int nvme_admin_identify_ns_list(nvme_soft_t *soft);
+int nvme_admin_identify_ctrl_nvm(nvme_soft_t *soft);
 int nvme_admin_get_log_page_error(nvme_soft_t *soft);
 int nvme_admin_create_cq(nvme_soft_t *soft, ushort_t qid, ushort_t qsize,
                          alenaddr_t phys_addr, ushort_t vector);
@@ -443,9 +895,17 @@ int nvme_admin_delete_cq(nvme_soft_t *soft, ushort_t qid);
 int nvme_admin_abort_command(nvme_soft_t *soft, ushort_t cid);
 int nvme_admin_get_features(nvme_soft_t *soft, uchar_t fid, uchar_t sel);
 int nvme_admin_set_features(nvme_soft_t *soft, uchar_t fid, uint_t value);
+int nvme_admin_get_vwc(nvme_soft_t *soft);
+int nvme_admin_get_log_page_smart(nvme_soft_t *soft);
+int nvme_admin_get_log_page(nvme_soft_t *soft, uchar_t lid, nvme_admin_done_t done);
+int nvme_admin_async_event(nvme_soft_t *soft);
+int nvme_admin_set_vwc(nvme_soft_t *soft, int enable);
 int nvme_admin_query_features(nvme_soft_t *soft);
+int nvme_admin_format_nvm(nvme_soft_t *soft, nvme_ns_t *ns, uint_t lbaf);
+int nvme_admin_set_hmb(nvme_soft_t *soft, int enable);
 
 int nvme_submit_cmd(nvme_soft_t *soft, nvme_queue_t *q, nvme_command_t *cmd);
+int nvme_submit_cmds(nvme_soft_t *soft, nvme_queue_t *q, nvme_command_t *cmds, uint_t count);
 int nvme_wait_for_completion(nvme_queue_t *q, ushort_t cid, uint_t timeout_ms);
 
 
@@ -458,7 +918,9 @@ int nvme_get_translated_addr(nvme_soft_t *soft,
 
 int nvme_prepare_alenlist(nvme_soft_t *soft, nvme_rwcmd_state_t *ps);
 
+uint_t nvme_io_next_chunk(nvme_soft_t *soft, nvme_rwcmd_state_t *ps, uint_t done);
 int nvme_io_build_rw_command(nvme_soft_t *soft, nvme_rwcmd_state_t *ps);
+int nvme_io_build_compare_write_command(nvme_soft_t *soft, nvme_rwcmd_state_t *ps);
 int nvme_build_prps_from_alenlist(nvme_soft_t *soft, nvme_rwcmd_state_t *ps);
 void nvme_cleanup_alenlist(nvme_soft_t *soft, nvme_rwcmd_state_t *ps);
 
@@ -471,7 +933,14 @@ int nvme_io_cid_alloc(nvme_soft_t *soft, scsi_request_t *req, unsigned int comma
 scsi_request_t *nvme_io_cid_done(nvme_soft_t *soft, unsigned int cid, int *last);
 int nvme_io_cid_store_prp(nvme_soft_t *soft, unsigned int cid, int prpidx);
 
-int nvme_cmd_special_flush(nvme_soft_t *soft);
+int nvme_cmd_special_flush(nvme_soft_t *soft, nvme_ns_t *ns);
+int nvme_io_build_write_zeroes_command(nvme_soft_t *soft, nvme_ns_t *ns, unsigned int cid,
+                                       __uint64_t lba, uint_t num_blocks, uint_t flags,
+                                       nvme_command_t *cmd);
+int nvme_io_build_verify_command(nvme_soft_t *soft, nvme_ns_t *ns, unsigned int cid,
+                                 __uint64_t lba, uint_t num_blocks, nvme_command_t *cmd);
+int nvme_io_build_dsm_command(nvme_soft_t *soft, nvme_ns_t *ns, unsigned int cid, uchar_t *desc,
+                              uint_t num_desc, uint_t *consumed, nvme_command_t *cmd);
 
 /*
  * Function Prototypes - nvme_cpl.c
@@ -481,14 +950,38 @@ int nvme_process_completions(nvme_soft_t *soft, nvme_queue_t *q);
 void nvme_handle_admin_completion(nvme_soft_t *soft, nvme_queue_t *q, nvme_completion_t *cpl);
 void nvme_handle_io_completion(nvme_soft_t *soft, nvme_queue_t *q, nvme_completion_t *cpl);
 
+/* Admin done callbacks, see nvme_admin_alloc() */
+void nvme_identify_controller_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl);
+void nvme_identify_ns_list_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl);
+void nvme_identify_ctrl_nvm_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl);
+void nvme_identify_namespace_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl);
+void nvme_error_log_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl);
+void nvme_smart_log_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl);
+void nvme_feature_query_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl);
+void nvme_set_features_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl);
+void nvme_get_vwc_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl);
+void nvme_set_vwc_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl);
+void nvme_format_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl);
+void nvme_abort_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl);
+void nvme_queue_cmd_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl);
+void nvme_set_hmb_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl);
+void nvme_aer_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl);
+void nvme_changed_ns_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl);
+void nvme_ns_rescan_done(nvme_soft_t *soft, nvme_admin_cmd_t *ac, nvme_completion_t *cpl);
+void nvme_ns_rescan_start(nvme_soft_t *soft);
+void nvme_ns_rescan_next(nvme_soft_t *soft);
+void nvme_smart_update(nvme_soft_t *soft, uchar_t *log);
+
 /* SCSI status helpers */
 void nvme_set_adapter_status(scsi_request_t *req, uint_t sr_status, u_char sr_scsi_status);
 void nvme_set_adapter_error(scsi_request_t *req);
 void nvme_set_success(scsi_request_t *req);
+void nvme_set_busy(nvme_soft_t *soft, scsi_request_t *req);
 void nvme_scsi_set_error(scsi_request_t *req, u_char sense_key, u_char asc, u_char ascq);
 
 /* Request completion with R10K+ cache invalidation workaround */
-void nvme_complete_request(scsi_request_t *req);
+void nvme_complete_request(nvme_soft_t *soft, scsi_request_t *req);
+void nvme_stats_complete(nvme_soft_t *soft, scsi_request_t *req);
 /*
  * Function Prototypes - nvme_scsi.c
  */
@@ -500,18 +993,35 @@ int nvme_scsi_dump(vertex_hdl_t ctlr_vhdl);
 int nvme_scsi_abort(scsi_request_t *req);
 int nvme_scsi_ioctl(vertex_hdl_t ctlr_vhdl, unsigned int cmd, struct scsi_ha_op *op);
 void nvme_build_inquiry_data(nvme_soft_t *soft, u_char *inq_data);
-void nvme_init_scsi_target_info(nvme_soft_t *soft);
+void nvme_init_scsi_target_info(nvme_ns_t *ns);
 
 /* Aborted command FIFO management */
 void nvme_aborted_fifo_add(nvme_soft_t *soft, scsi_request_t *req);
 int nvme_aborted_fifo_find_and_remove(nvme_soft_t *soft, nvme_rwcmd_state_t *ps);
 
 void nvme_scsi_read_write(nvme_soft_t *soft, scsi_request_t *req);
+void nvme_scsi_rw_start(nvme_soft_t *soft, nvme_rwcmd_state_t *ps);
 int nvme_scsi_inquiry(nvme_soft_t *soft, scsi_request_t *req);
 int nvme_scsi_read_capacity(nvme_soft_t *soft, scsi_request_t *req);
+int nvme_scsi_read_capacity_16(nvme_soft_t *soft, scsi_request_t *req);
 int nvme_scsi_test_unit_ready(nvme_soft_t *soft, scsi_request_t *req);
 int nvme_scsi_send_diagnostic(nvme_soft_t *soft, scsi_request_t *req);
 int nvme_scsi_sync_cache(nvme_soft_t *soft, scsi_request_t *req);
+void nvme_scsi_unmap(nvme_soft_t *soft, scsi_request_t *req);
+void nvme_scsi_write_same(nvme_soft_t *soft, scsi_request_t *req);
+void nvme_scsi_verify(nvme_soft_t *soft, scsi_request_t *req);
+void nvme_scsi_compare_and_write(nvme_soft_t *soft, scsi_request_t *req);
+void nvme_scsi_mode_select(nvme_soft_t *soft, scsi_request_t *req);
+void nvme_scsi_mode_select_done(nvme_soft_t *soft, int ok);
+int nvme_scsi_log_sense(nvme_soft_t *soft, scsi_request_t *req);
+
+/*
+ * Function Prototypes - nvme_emul.c
+ */
+void nvme_emul_start(nvme_soft_t *soft);
+void nvme_emul_stop(nvme_soft_t *soft);
+int nvme_emul_divert(nvme_soft_t *soft, nvme_rwcmd_state_t *ps);
+void nvme_emul_queue(nvme_soft_t *soft, nvme_rwcmd_state_t *ps);
 
 /*
  * Function Prototypes - nvmedrv.c (controller management)
@@ -522,9 +1032,19 @@ int nvme_ctlr_reset(nvme_soft_t *soft);
 int nvme_ctlr_init(nvme_soft_t *soft);
 int nvme_ctlr_shutdown(nvme_soft_t *soft);
 void nvme_dump_controller_state(nvme_soft_t *soft, const char *context);
+void nvme_compute_transfer_geometry(nvme_soft_t *soft);
+int nvme_ns_scan(nvme_soft_t *soft);
+void nvme_lbaf_report(nvme_soft_t *soft, nvme_ns_t *ns, nvme_lbaf_report_t *rep);
+int nvme_format_namespace(nvme_soft_t *soft, nvme_ns_t *ns, uint_t lbaf);
+int nvme_quiesce_enter(nvme_soft_t *soft, scsi_request_t *req);
+void nvme_quiesce_exit(nvme_soft_t *soft);
+int nvme_quiesce(nvme_soft_t *soft, uint_t timeout_ms);
+int nvme_resume(nvme_soft_t *soft);
+void nvme_stats_snapshot(nvme_soft_t *soft, nvme_stats_t *st, int clear);
 
 /* Helper to wait for queue to drain completions */
 int nvme_wait_for_queue_idle(nvme_soft_t *soft, nvme_queue_t *q, uint_t timeout_ms);
+void nvme_admin_wakeup(nvme_soft_t *soft);
 void nvme_dump_sq_entry(nvme_command_t *cmd, const char *context);
 void nvme_dump_memory(void *addr, size_t len, const char *context);
 void nvme_dump_pci_bridge(vertex_hdl_t conn);
@@ -532,6 +1052,11 @@ void nvme_dump_pci_bridge(vertex_hdl_t conn);
 /* Completion processing thread for interrupt fallback */
 void nvme_start_poll_thread(nvme_soft_t *soft);
 void nvme_stop_poll_thread(nvme_soft_t *soft);
+void nvme_start_reset_thread(nvme_soft_t *soft);
+void nvme_stop_reset_thread(nvme_soft_t *soft);
+int nvme_reset_request(nvme_soft_t *soft, int level, char *why);
+int nvme_queue_recreate(nvme_soft_t *soft);
+void nvme_reset_thread(void *arg);
 void nvme_kick_poll_thread(nvme_soft_t *soft);
 void nvme_poll_thread(void *arg);
 
@@ -545,6 +1070,13 @@ void nvme_check_timeouts(nvme_soft_t *soft);
 void nvme_timeout_watchdog_start(nvme_soft_t *soft);
 void nvme_timeout_watchdog_stop(nvme_soft_t *soft);
 void nvme_timeout_watchdog_handler(nvme_soft_t *soft);
+void nvme_smart_refresh(nvme_soft_t *soft);
+void nvme_thermal_init(nvme_soft_t *soft);
+void nvme_aer_start(nvme_soft_t *soft);
+int nvme_hmb_setup(nvme_soft_t *soft);
+void nvme_hmb_free(nvme_soft_t *soft);
+void nvme_thermal_update(nvme_soft_t *soft, uint_t temperature);
+void nvme_thermal_report(nvme_soft_t *soft, nvme_thermal_report_t *rep);
 
 /*
  * Utility Macros - NVMe BAR MMIO Access
@@ -621,6 +1153,7 @@ void nvme_timeout_watchdog_handler(nvme_soft_t *soft);
 #endif
 
 extern volatile int nvme_intcount;
+extern int nvme_hmb_max_mb;
 
 #pragma set woff 3201
 #pragma set woff 1174
@@ -20,6 +20,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/dkio.h>
+#include <sys/scsi.h>
 #include <dslib.h>
 
 /* IRIX hardware graph path for controller 2, target 0, lun 0, find some way to find it! */
@@ -30,6 +31,38 @@
 #endif
 #define BLOCK_SIZE 512
 
+/* Host adapter ioctls go to the controller's bus vertex */
+#ifdef IP35
+#define DEFAULT_BUS_PATH "/hw/scsi_ctlr/5/bus"
+#else
+#define DEFAULT_BUS_PATH "/hw/scsi_ctlr/2/bus"
+#endif
+
+/* Driver statistics, must match NVME_SOP_STATS and nvme_stats_t in nvmedrv.h */
+#define NVME_SOP_STATS (('N' << 8) | 6)
+
+typedef struct nvme_stats {
+    __uint64_t  read_bytes;
+    __uint64_t  write_bytes;
+    __uint64_t  depth_sum;
+    uint_t      reads;
+    uint_t      writes;
+    uint_t      others;
+    uint_t      errors;
+    uint_t      submits;
+    uint_t      depth;
+    uint_t      depth_max;
+    uint_t      busy;
+    uint_t      cid_exhausted;
+    uint_t      cid_paced;
+    uint_t      prp_exhausted;
+    uint_t      sq_full;
+    uint_t      wd_recovered;
+    uint_t      timeouts;
+    uint_t      lbolt;
+    uint_t      hz;
+} nvme_stats_t;
+
 /* Test functions */
 void test_inquiry(int fd);
 void test_read_capacity(int fd);
@@ -40,6 +73,7 @@ void test_write_sequential(int fd, unsigned int start_lba, unsigned int num_bloc
 void test_write_read(int fd, unsigned int lba);
 void test_random_write_read(int fd, unsigned int max_lba, unsigned int num_iterations);
 void dump_hex(unsigned char *data, size_t len, size_t offset);
+void nvmestat(const char *bus_path, unsigned int interval, int clear);
 
 /* Random number generator state (simple LCG) */
 static unsigned int rng_seed = 0;
@@ -57,12 +91,16 @@ void usage(const char *progname)
     fprintf(stderr, "  -S LBA COUNT   Write COUNT blocks starting at LBA\n");
     fprintf(stderr, "  -w LBA         Write/Read test at LBA\n");
     fprintf(stderr, "  -R ITERATIONS  Random write/read stress test (default: 100 iterations)\n");
+    fprintf(stderr, "  -T SECONDS     nvmestat: print driver statistics every SECONDS\n");
+    fprintf(stderr, "  -b PATH        Bus path for -T (default: %s)\n", DEFAULT_BUS_PATH);
+    fprintf(stderr, "  -z             Clear the statistics first (with -T)\n");
     fprintf(stderr, "  -a             Run all tests\n");
     fprintf(stderr, "  -h             Show this help\n");
     fprintf(stderr, "\nExamples:\n");
     fprintf(stderr, "  %s -a                           # Run all basic tests\n", progname);
     fprintf(stderr, "  %s -s 0 8192                    # Large read (4MB, tests PRP chaining)\n", progname);
     fprintf(stderr, "  %s -R 1000                      # Random write/read stress test\n", progname);
+    fprintf(stderr, "  %s -T 1                         # Driver statistics every second\n", progname);
     fprintf(stderr, "  %s -d /hw/scsi_ctlr/1/... -i   # Test different controller\n", progname);
     exit(1);
 }
@@ -86,7 +124,10 @@ int main(int argc, char *argv[])
     unsigned int count = 1;
     unsigned int count_write = 1;
     unsigned int random_iterations = 100;
+    unsigned int stat_interval = 0;
+    int stat_clear = 0;
     const char *device_path = DEFAULT_SCSI_PATH;
+    const char *bus_path = DEFAULT_BUS_PATH;
 
     if (argc < 2) {
         usage(argv[0]);
@@ -96,7 +137,7 @@ int main(int argc, char *argv[])
     rng_seed = (unsigned int)time(NULL);
 
     /* Parse options */
-    while ((opt = getopt(argc, argv, "d:icr:s:W:S:w:R:ah")) != -1) {
+    while ((opt = getopt(argc, argv, "d:icr:s:W:S:w:R:T:b:zah")) != -1) {
         switch (opt) {
         case 'd':
             device_path = optarg;
@@ -140,6 +181,16 @@ int main(int argc, char *argv[])
             random_iterations = strtoul(optarg, NULL, 0);
             if (random_iterations == 0) random_iterations = 100;
             break;
+        case 'T':
+            stat_interval = strtoul(optarg, NULL, 0);
+            if (stat_interval == 0) stat_interval = 1;
+            break;
+        case 'b':
+            bus_path = optarg;
+            break;
+        case 'z':
+            stat_clear = 1;
+            break;
         case 'a':
             test_all = 1;
             break;
@@ -149,6 +200,12 @@ int main(int argc, char *argv[])
         }
     }
 
+    /* nvmestat talks to the controller, not to a LUN */
+    if (stat_interval) {
+        nvmestat(bus_path, stat_interval, stat_clear);
+        return 0;
+    }
+
     /* Open SCSI device */
     printf("Opening %s...\n", device_path);
     fd = open(device_path, O_RDWR);
@@ -1027,3 +1084,83 @@ void test_random_write_read(int fd, unsigned int max_lba, unsigned int num_itera
     }
     printf("\n");
 }
+
+/* Fetch the controller's statistics, clearing them after the copy if asked */
+static int get_stats(int fd, nvme_stats_t *st, int clear)
+{
+    struct scsi_ha_op op;
+
+    bzero(&op, sizeof(op));
+    op.sb_arg = clear;
+    op.sb_addr = (uintptr_t)st;
+    if (ioctl(fd, NVME_SOP_STATS, &op) < 0) {
+        perror("NVME_SOP_STATS");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * nvmestat: Print the driver's statistics every interval seconds
+ *
+ * Rates are worked out from the difference between two samples and the
+ * driver's own tick count, so a late wakeup does not skew them.
+ */
+void nvmestat(const char *bus_path, unsigned int interval, int clear)
+{
+    nvme_stats_t prev, cur;
+    double secs, mb;
+    unsigned int submits;
+    int fd;
+    int line = 0;
+
+    fd = open(bus_path, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        fprintf(stderr, "Failed to open %s\n", bus_path);
+        exit(1);
+    }
+
+    /* A clearing read returns the totals from before the clear, so the
+     * baseline is taken by a second read that leaves the counters alone */
+    if (get_stats(fd, &prev, clear) < 0 ||
+        (clear && get_stats(fd, &prev, 0) < 0))
+        exit(1);
+
+    for (;;) {
+        sleep(interval);
+        if (get_stats(fd, &cur, 0) < 0)
+            exit(1);
+
+        if (line++ % 20 == 0)
+            printf("%8s %8s %8s %8s %8s %5s %5s %6s %5s %5s %5s %5s %6s %4s\n",
+                   "r/s", "w/s", "rMB/s", "wMB/s", "o/s", "qd", "qmax",
+                   "busy", "cid", "pace", "prp", "sqf", "wdrec", "tmo");
+
+        secs = (double)(cur.lbolt - prev.lbolt) / (cur.hz ? cur.hz : 100);
+        if (secs <= 0)
+            secs = interval;
+        mb = 1024.0 * 1024.0 * secs;
+        submits = cur.submits - prev.submits;
+
+        printf("%8.0f %8.0f %8.2f %8.2f %8.0f %5.1f %5u %6u %5u %5u %5u %5u %6u %4u\n",
+               (cur.reads - prev.reads) / secs,
+               (cur.writes - prev.writes) / secs,
+               (double)(cur.read_bytes - prev.read_bytes) / mb,
+               (double)(cur.write_bytes - prev.write_bytes) / mb,
+               (cur.others - prev.others) / secs,
+               submits ? (double)(cur.depth_sum - prev.depth_sum) / submits : (double)cur.depth,
+               cur.depth_max,
+               cur.busy - prev.busy,
+               cur.cid_exhausted - prev.cid_exhausted,
+               cur.cid_paced - prev.cid_paced,
+               cur.prp_exhausted - prev.prp_exhausted,
+               cur.sq_full - prev.sq_full,
+               cur.wd_recovered - prev.wd_recovered,
+               cur.timeouts - prev.timeouts);
+        if (cur.errors != prev.errors)
+            printf("    %u requests completed with errors\n", cur.errors - prev.errors);
+        fflush(stdout);
+        prev = cur;
+    }
+}